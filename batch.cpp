@@ -0,0 +1,604 @@
+/**
+ * Native batch tool: runs a chain of the editor's operations over image files.
+ *
+ *   ./batch [options] --op NAME[:PARAMS] ... INPUT OUTPUT
+ *
+ * INPUT and OUTPUT are two files, or two directories: then every .ppm, .pam
+ * and .rgba file in INPUT is written to OUTPUT under the same name (see
+ * image_file.h for the formats). The operations are the engine's own
+ * (batch_run_commands), so results are identical to the editor's.
+ *
+ * Files flow through three stages at once: a reader thread decodes them in
+ * order, a pool of workers each filter one image at a time, and a writer
+ * thread encodes the results. The reader only starts an image once the
+ * decoded images between it and the writer fit the in-flight budget
+ * (--max-inflight-mb), so memory stays bounded however many files there are.
+ * Each stage's throughput is reported at the end, to size batch hosts: the
+ * busiest stage is the one to add threads (or disks) to.
+ *
+ * Build with `make batch`, or see `./batch --help`.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image_processor.h"
+#include "image_file.h"
+#include "command_buffer.h"
+
+namespace {
+
+namespace fs = std::filesystem;
+
+/**
+ * Operations, by the name of their exported function. Each becomes one
+ * command (command_buffer.h); `fixed` params come first, then the ones given
+ * on the command line, then the defaults of those left out (NaN: required).
+ */
+struct OperationInfo {
+    const char* name;
+    int op;
+    std::vector<double> fixed;
+    std::vector<double> defaults;
+    const char* params;
+};
+
+const double REQUIRED = std::numeric_limits<double>::quiet_NaN();
+
+const OperationInfo OPERATIONS[] = {
+    {"monochrome_average", 0, {}, {}, ""},
+    {"monochrome_luminosity", 1, {}, {}, ""},
+    {"monochrome_lightness", 2, {}, {}, ""},
+    {"monochrome_itu", 3, {}, {}, ""},
+    {"gaussian_blur", 4, {}, {REQUIRED, 0}, "sigma[,kernel size]"},
+    {"edge_sobel", 5, {}, {}, ""},
+    {"laplacian_filter", 6, {}, {}, ""},
+    {"edge_laplacian_of_gaussian", 7, {}, {REQUIRED, 0}, "sigma[,kernel size]"},
+    {"bucket_fill", 8, {}, {REQUIRED, REQUIRED, REQUIRED, REQUIRED, REQUIRED, 255, 0}, "x,y,r,g,b[,a,threshold]"},
+    {"quad_compression", 9, {}, {REQUIRED, REQUIRED}, "width,height"},
+    {"resize", 12, {}, {REQUIRED, REQUIRED, 0}, "width,height[,filter: 0 area, 1 Lanczos-3]"},
+    {"sharpen", 13, {}, {1.0}, "[amount]"},
+    {"emboss", 14, {}, {}, ""},
+    {"levels", 15, {4}, {0, 255, 1, 0, 255}, "[in black,in white,gamma,out black,out white]"},
+    {"curves", 15, {5}, {REQUIRED, REQUIRED, -1, -1, -1, -1}, "x0,y0[,x1,y1,x2,y2] (0 - 255)"},
+    {"gamma", 15, {6}, {REQUIRED}, "gamma"},
+    {"invert", 15, {7}, {}, ""},
+    {"threshold", 15, {8}, {128}, "[level]"},
+};
+
+// Kernel size for a blur given only sigma: +-3 sigma
+double default_kernel_size(double sigma) {
+    return 2 * std::ceil(3 * sigma) + 1;
+}
+
+/**
+ * Append the command for "NAME[:P1,P2,...]" to `commands`. Returns false
+ * (with a message) if the name is unknown or a required param is missing.
+ */
+bool parse_operation(const std::string& spec, std::vector<double>& commands) {
+    const size_t colon = spec.find(':');
+    const std::string name = spec.substr(0, colon);
+    const OperationInfo* info = nullptr;
+    for (const OperationInfo& candidate : OPERATIONS) {
+        if (name == candidate.name) info = &candidate;
+    }
+    if (!info) {
+        std::fprintf(stderr, "Unknown operation: %s\n", name.c_str());
+        return false;
+    }
+
+    std::vector<double> given;
+    if (colon != std::string::npos) {
+        const char* p = spec.c_str() + colon + 1;
+        while (*p) {
+            char* end = nullptr;
+            given.push_back(std::strtod(p, &end));
+            if (end == p || (*end && *end != ',')) {
+                std::fprintf(stderr, "Invalid params for %s: %s\n", name.c_str(), spec.c_str() + colon + 1);
+                return false;
+            }
+            p = *end ? end + 1 : end;
+        }
+    }
+    if (given.size() > info->defaults.size()) {
+        std::fprintf(stderr, "%s takes %s\n", name.c_str(), *info->params ? info->params : "no params");
+        return false;
+    }
+
+    double command[COMMAND_SIZE] = {static_cast<double>(info->op), 0};
+    double* params = command + 2;
+    std::copy(info->fixed.begin(), info->fixed.end(), params);
+    for (size_t i = 0; i < info->defaults.size(); ++i) {
+        const double value = i < given.size() ? given[i] : info->defaults[i];
+        if (std::isnan(value)) {
+            std::fprintf(stderr, "%s takes %s\n", name.c_str(), info->params);
+            return false;
+        }
+        params[info->fixed.size() + i] = value;
+    }
+    if ((info->op == 4 || info->op == 7) && params[1] <= 0) params[1] = default_kernel_size(params[0]);
+
+    commands.insert(commands.end(), command, command + COMMAND_SIZE);
+    return true;
+}
+
+/**
+ * A queue between two stages, holding at most `capacity` items. pop returns
+ * false once the queue is closed and empty.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // No more items will be pushed
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    bool closed = false;
+};
+
+/**
+ * Bytes of decoded images in flight. `acquire` waits until the bytes fit the
+ * budget, or nothing else is in flight (an image larger than the budget still
+ * runs, alone).
+ */
+class MemoryBudget {
+public:
+    explicit MemoryBudget(size_t budget) : budget(budget) {}
+
+    void acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return used == 0 || used + bytes <= budget; });
+        charge(bytes);
+    }
+
+    // An image already in flight changed size (resize, quad tree compression)
+    void resize(size_t from, size_t to) {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= from;
+        charge(to);
+        if (to < from) released.notify_all();
+    }
+
+    void release(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= bytes;
+        released.notify_all();
+    }
+
+    size_t peak_bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak;
+    }
+
+private:
+    const size_t budget;
+    std::mutex mutex;
+    std::condition_variable released;
+    size_t used = 0;
+    size_t peak = 0;
+
+    void charge(size_t bytes) {
+        used += bytes;
+        peak = std::max(peak, used);
+    }
+};
+
+double now_seconds() {
+    using namespace std::chrono;
+    return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Work done by one stage, summed over its threads: time spent on images
+ * (busy) and waiting for input or for room downstream (idle).
+ */
+struct StageStats {
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> pixels{0};
+    std::atomic<uint64_t> bytes{0};         // file bytes read or written
+    std::atomic<uint64_t> busyNs{0};
+    std::atomic<uint64_t> idleNs{0};
+
+    void add_time(std::atomic<uint64_t>& counter, double seconds) {
+        counter.fetch_add(static_cast<uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+    }
+};
+
+// One file on its way through the stages
+struct Job {
+    std::string input;
+    std::string output;
+    ImageFormat outputFormat = ImageFormat::Unknown;
+    uint8_t* pixels = nullptr;          // tightly packed RGBA, released with free()
+    int width = 0;
+    int height = 0;
+    size_t charged = 0;                 // bytes charged to the in-flight budget
+
+    size_t size_bytes() const { return static_cast<size_t>(width) * height * 4; }
+};
+
+struct Options {
+    std::string input;
+    std::string output;
+    std::vector<double> commands;
+    ImageFormat format = ImageFormat::Unknown;     // of the outputs; Unknown = as the input
+    int rawWidth = 0;                               // size of raw inputs whose names have none
+    int rawHeight = 0;
+    int workers = 0;                                // 0 = one per hardware thread
+    int threads = 1;                                // kernel threads (thread_pool.h)
+    size_t maxInflightMB = 1024;
+    int flags = 0;
+    bool stats = false;
+};
+
+class BatchRun {
+public:
+    explicit BatchRun(const Options& options)
+        : options(options), budget(options.maxInflightMB << 20),
+          workerCount(options.workers > 0 ? options.workers
+                                          : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))),
+          toWorkers(2 * workerCount), toWriter(2 * workerCount) {}
+
+    // Filter every job; returns the number of files that failed
+    int run(std::vector<Job> jobs) {
+        const double start = now_seconds();
+
+        std::thread reader([&] { read_all(jobs); });
+        std::vector<std::thread> workers;
+        for (int i = 0; i < workerCount; ++i) workers.emplace_back([&] { filter_all(); });
+        std::thread writer([&] { write_all(); });
+
+        reader.join();
+        toWorkers.close();
+        for (std::thread& worker : workers) worker.join();
+        toWriter.close();
+        writer.join();
+
+        wallSeconds = now_seconds() - start;
+        return failures.load();
+    }
+
+    void report() {
+        const double wall = std::max(wallSeconds, 1e-9);
+        std::fprintf(stderr, "\n%-8s %7s %7s %10s %10s %9s %9s %6s %14s\n", "stage", "threads", "images", "MP",
+                     "MB", "busy s", "idle s", "util", "MP/s/thread");
+        const struct {
+            const char* name;
+            int threads;
+            StageStats& stats;
+        } stages[] = {{"read", 1, readStats}, {"filter", workerCount, filterStats}, {"write", 1, writeStats}};
+        for (const auto& stage : stages) {
+            const double busy = stage.stats.busyNs.load() / 1e9;
+            const double mp = stage.stats.pixels.load() / 1e6;
+            std::fprintf(stderr, "%-8s %7d %7llu %10.1f %10.1f %9.2f %9.2f %5.0f%% %14.1f\n", stage.name,
+                         stage.threads, static_cast<unsigned long long>(stage.stats.images.load()), mp,
+                         stage.stats.bytes.load() / 1e6, busy, stage.stats.idleNs.load() / 1e9,
+                         100.0 * busy / (wall * stage.threads), busy > 0 ? mp / busy : 0.0);
+        }
+
+        const double images = static_cast<double>(writeStats.images.load());
+        std::fprintf(stderr, "\n%.0f images (%d failed) in %.2f s: %.1f images/s, %.1f MP/s, peak in flight %.1f MB\n",
+                     images, failures.load(), wallSeconds, images / wall, readStats.pixels.load() / 1e6 / wall,
+                     budget.peak_bytes() / 1e6);
+    }
+
+private:
+    const Options& options;
+    MemoryBudget budget;
+    const int workerCount;
+    BoundedQueue<Job> toWorkers;
+    BoundedQueue<Job> toWriter;
+    StageStats readStats, filterStats, writeStats;
+    std::atomic<int> failures{0};
+    std::mutex logMutex;
+    double wallSeconds = 0;
+
+    void fail(const Job& job, const std::string& message) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::fprintf(stderr, "%s: %s\n", job.input.c_str(), message.c_str());
+        ++failures;
+    }
+
+    void read_all(std::vector<Job>& jobs) {
+        for (Job& job : jobs) {
+            double t = now_seconds();
+            FILE* file = std::fopen(job.input.c_str(), "rb");
+            if (!file) {
+                fail(job, "cannot open");
+                continue;
+            }
+
+            ImageHeader header;
+            std::string error;
+            if (image_format_of(job.input) == ImageFormat::Raw &&
+                !raw_image_size(job.input, header.width, header.height)) {
+                header.width = options.rawWidth;
+                header.height = options.rawHeight;
+            }
+            if (!read_image_header(file, image_format_of(job.input), header, error)) {
+                std::fclose(file);
+                fail(job, error);
+                continue;
+            }
+            job.width = header.width;
+            job.height = header.height;
+            if (job.outputFormat == ImageFormat::Unknown) job.outputFormat = header.format;
+
+            // Wait for room before decoding; that wait is idle time
+            readStats.add_time(readStats.busyNs, now_seconds() - t);
+            t = now_seconds();
+            job.charged = job.size_bytes();
+            budget.acquire(job.charged);
+            readStats.add_time(readStats.idleNs, now_seconds() - t);
+            t = now_seconds();
+
+            job.pixels = alloc_layer_buffer(job.width, job.height);
+            const bool ok = job.pixels && read_image_pixels(file, header, job.pixels);
+            const long fileBytes = std::ftell(file);
+            std::fclose(file);
+            if (!ok) {
+                fail(job, job.pixels ? "file ends early" : "out of memory");
+                std::free(job.pixels);
+                budget.release(job.charged);
+                continue;
+            }
+
+            readStats.images.fetch_add(1);
+            readStats.pixels.fetch_add(static_cast<uint64_t>(job.width) * job.height);
+            readStats.bytes.fetch_add(static_cast<uint64_t>(std::max(0L, fileBytes)));
+            readStats.add_time(readStats.busyNs, now_seconds() - t);
+
+            t = now_seconds();
+            toWorkers.push(std::move(job));
+            readStats.add_time(readStats.idleNs, now_seconds() - t);
+        }
+    }
+
+    void filter_all() {
+        for (;;) {
+            double t = now_seconds();
+            Job job;
+            const bool more = toWorkers.pop(job);
+            filterStats.add_time(filterStats.idleNs, now_seconds() - t);
+            if (!more) return;
+
+            t = now_seconds();
+            const uint64_t pixels = static_cast<uint64_t>(job.width) * job.height;
+            int size[2] = {0, 0};
+            job.pixels = batch_run_commands(job.pixels, job.width, job.height, const_cast<double*>(options.commands.data()),
+                                            static_cast<int>(options.commands.size() / COMMAND_SIZE), options.flags,
+                                            size);
+            job.width = size[0];
+            job.height = size[1];
+            budget.resize(job.charged, job.size_bytes());
+            job.charged = job.size_bytes();
+            filterStats.images.fetch_add(1);
+            filterStats.pixels.fetch_add(pixels);
+            filterStats.add_time(filterStats.busyNs, now_seconds() - t);
+
+            t = now_seconds();
+            toWriter.push(std::move(job));
+            filterStats.add_time(filterStats.idleNs, now_seconds() - t);
+        }
+    }
+
+    void write_all() {
+        for (;;) {
+            double t = now_seconds();
+            Job job;
+            const bool more = toWriter.pop(job);
+            writeStats.add_time(writeStats.idleNs, now_seconds() - t);
+            if (!more) return;
+
+            t = now_seconds();
+            const std::string path = image_output_path(job.output, job.outputFormat, job.width, job.height);
+            FILE* file = job.pixels ? std::fopen(path.c_str(), "wb") : nullptr;
+            bool ok = file && write_image(file, job.outputFormat, job.pixels, job.width, job.height);
+            const long fileBytes = file ? std::ftell(file) : 0;
+            if (file && std::fclose(file) != 0) ok = false;
+            std::free(job.pixels);
+            budget.release(job.charged);
+            if (!ok) {
+                fail(job, "cannot write " + path);
+                continue;
+            }
+
+            writeStats.images.fetch_add(1);
+            writeStats.pixels.fetch_add(static_cast<uint64_t>(job.width) * job.height);
+            writeStats.bytes.fetch_add(static_cast<uint64_t>(std::max(0L, fileBytes)));
+            writeStats.add_time(writeStats.busyNs, now_seconds() - t);
+        }
+    }
+};
+
+/**
+ * The files to filter: INPUT itself, or every image file in the directory
+ * INPUT (sorted by name), with OUTPUT created as a directory for them.
+ */
+bool collect_jobs(const Options& options, std::vector<Job>& jobs) {
+    std::error_code error;
+    if (!fs::is_directory(options.input, error)) {
+        if (image_format_of(options.input) == ImageFormat::Unknown) {
+            std::fprintf(stderr, "%s: not a .ppm, .pam or .rgba file\n", options.input.c_str());
+            return false;
+        }
+        Job job;
+        job.input = options.input;
+        job.output = options.output;
+        job.outputFormat = options.format != ImageFormat::Unknown ? options.format : image_format_of(options.output);
+        if (job.outputFormat == ImageFormat::Unknown) {
+            std::fprintf(stderr, "%s: not a .ppm, .pam or .rgba file\n", options.output.c_str());
+            return false;
+        }
+        jobs.push_back(job);
+        return true;
+    }
+
+    fs::create_directories(options.output, error);
+    if (!fs::is_directory(options.output, error)) {
+        std::fprintf(stderr, "Cannot create %s\n", options.output.c_str());
+        return false;
+    }
+    for (const fs::directory_entry& entry : fs::directory_iterator(options.input, error)) {
+        const std::string name = entry.path().filename().string();
+        if (!entry.is_regular_file(error) || image_format_of(name) == ImageFormat::Unknown) continue;
+        Job job;
+        job.input = entry.path().string();
+        job.output = (fs::path(options.output) / name).string();
+        job.outputFormat = options.format;
+        jobs.push_back(job);
+    }
+    std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.input < b.input; });
+    return true;
+}
+
+// Engine statistics (engine_stats.h) of the run, as printed by the benchmark
+void write_engine_stats() {
+    const int fields = 5;
+    std::vector<double> stats(static_cast<size_t>(get_engine_stats(nullptr, 0)) * fields);
+    const int count = get_engine_stats(stats.data(), static_cast<int>(stats.size()));
+    if (count == 0) {
+        std::fprintf(stderr, "engine statistics are compiled out (ENGINE_STATS=0)\n");
+        return;
+    }
+
+    std::fprintf(stderr, "\n%-28s %10s %12s %12s %14s %14s\n", "probe", "calls", "total ms", "longest ms",
+                 "pixels", "bytes");
+    for (int i = 0; i < count; ++i) {
+        const double* s = stats.data() + static_cast<size_t>(i) * fields;
+        if (s[0] == 0) continue;
+        std::fprintf(stderr, "%-28s %10.0f %12.3f %12.3f %14.0f %14.0f\n", get_engine_stat_name(i), s[0], s[1], s[2],
+                     s[3], s[4]);
+    }
+}
+
+void print_usage() {
+    std::printf(
+        "usage: batch [options] INPUT OUTPUT\n"
+        "  INPUT and OUTPUT are image files, or directories: every .ppm, .pam and .rgba\n"
+        "  file of INPUT is written to OUTPUT under the same name.\n"
+        "\n"
+        "  --op NAME[:P1,P2,...]  run an operation; repeat for a chain, run in order\n"
+        "  --format F             output format: ppm, pam or rgba (default: as OUTPUT, or\n"
+        "                         in a directory as each input)\n"
+        "  --raw-size WxH         size of .rgba inputs not named NAME.WxH.rgba\n"
+        "  --workers N            images filtered at once (default: one per core)\n"
+        "  --threads N            threads each operation may use, shared by the workers\n"
+        "                         (default: 1; raise it for a few very large images)\n"
+        "  --max-inflight-mb N    decoded images held at once (default: 1024)\n"
+        "  --coalesce             run consecutive filters as one fused pipeline\n"
+        "  --stats                also print the engine statistics of the run\n"
+        "\n"
+        "operations:\n");
+    for (const OperationInfo& info : OPERATIONS) {
+        std::printf("  %-28s %s\n", info.name, info.params);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--help" || arg == "-h") {
+            print_usage();
+            return 0;
+        } else if (arg == "--op" && hasValue) {
+            if (!parse_operation(argv[++i], options.commands)) return 1;
+        } else if (arg == "--format" && hasValue) {
+            options.format = image_format_named(argv[++i]);
+            if (options.format == ImageFormat::Unknown) {
+                std::fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--raw-size" && hasValue) {
+            if (std::sscanf(argv[++i], "%dx%d", &options.rawWidth, &options.rawHeight) != 2 ||
+                options.rawWidth <= 0 || options.rawHeight <= 0) {
+                std::fprintf(stderr, "Invalid size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (arg == "--workers" && hasValue) {
+            options.workers = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--max-inflight-mb" && hasValue) {
+            options.maxInflightMB = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--coalesce") {
+            options.flags |= COMMANDS_COALESCE;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (!arg.empty() && arg[0] != '-') {
+            paths.push_back(arg);
+        } else {
+            std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (paths.size() != 2) {
+        print_usage();
+        return 1;
+    }
+    options.input = paths[0];
+    options.output = paths[1];
+
+    std::vector<Job> jobs;
+    if (!collect_jobs(options, jobs)) return 1;
+
+    set_thread_count(options.threads);
+    reset_engine_stats();
+
+    BatchRun run(options);
+    const int failures = run.run(std::move(jobs));
+    run.report();
+    if (options.stats) write_engine_stats();
+
+    return failures == 0 ? 0 : 1;
+}
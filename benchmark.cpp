@@ -0,0 +1,686 @@
+/**
+ * Native benchmark suite for the exported image_processor.cpp entry points.
+ *
+ * Runs every exported operation on synthetic images, from the 730x946 README
+ * image up to 8K, across layer counts and kernel sizes, and reports the median
+ * time per call as ns/pixel and MP/s. Unlike `timeOperation` in script.js, only
+ * the C++ call is timed: layers are re-ingested (untimed) before every run so
+ * destructive operations always see the same input.
+ *
+ * Build and run with `make bench`, or see `./benchmark --help`.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "image_processor.h"
+#include "blend.h"
+#include "command_buffer.h"
+
+namespace {
+
+struct Size {
+    int width;
+    int height;
+    const char* name;
+};
+
+const Size DEFAULT_SIZES[] = {
+    {730, 946, "readme"},
+    {1920, 1080, "1080p"},
+    {3840, 2160, "4k"},
+    {7680, 4320, "8k"},
+};
+
+struct Options {
+    std::vector<Size> sizes;
+    std::vector<int> layerCounts = {1, 4, 16, 32};
+    std::vector<int> kernelSizes = {3, 5, 9, 15, 31};
+    std::vector<std::string> ops;     // empty = all
+    int reps = 5;
+    size_t maxMemoryMB = 2048;
+    int threads = 0;                  // 0 = one per hardware thread
+    std::string format = "table";     // table | csv | json
+    std::string outputPath;           // empty = stdout
+    bool stats = false;               // print the engine statistics at the end
+};
+
+struct Result {
+    std::string op;
+    int width;
+    int height;
+    int layers;
+    int kernel;                       // 0 when not applicable
+    int reps;
+    double medianNs;
+    double minNs;
+    double pixels;                    // pixels processed per call
+};
+
+/**
+ * Deterministic synthetic image: smooth gradients, flat blocks (so bucket fill
+ * and quad tree have regions to work with) and sparse noise. Layers above the
+ * bottom one get partial alpha so compositing does real blending.
+ */
+std::vector<uint8_t> make_image(int width, int height, int seed, bool opaque) {
+    std::vector<uint8_t> data(static_cast<size_t>(width) * height * 4);
+    uint32_t state = 0x9e3779b9u * (seed + 1);
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t* p = &data[(static_cast<size_t>(y) * width + x) * 4];
+            int block = ((x / 64) + (y / 64) + seed) % 6;
+
+            state = state * 1664525u + 1013904223u;
+            bool noisy = (state >> 24) < 4;
+
+            p[0] = noisy ? static_cast<uint8_t>(state >> 8) : static_cast<uint8_t>(block * 42);
+            p[1] = static_cast<uint8_t>(x * 255 / std::max(1, width - 1));
+            p[2] = static_cast<uint8_t>(y * 255 / std::max(1, height - 1));
+            p[3] = opaque ? 255 : static_cast<uint8_t>(block == 0 ? 0 : 96 + block * 30);
+        }
+    }
+
+    return data;
+}
+
+double now_ns() {
+    using namespace std::chrono;
+    return static_cast<double>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+/**
+ * Time `run` `reps` times, calling `setup` (untimed) before each run.
+ */
+void measure(const std::function<void()>& setup, const std::function<void()>& run, int reps,
+             double& medianNs, double& minNs) {
+    std::vector<double> samples;
+    samples.reserve(reps);
+
+    for (int i = 0; i < reps; ++i) {
+        setup();
+        double start = now_ns();
+        run();
+        samples.push_back(now_ns() - start);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    medianNs = samples[samples.size() / 2];
+    minNs = samples.front();
+}
+
+bool wants(const Options& options, const std::string& op) {
+    if (options.ops.empty()) return true;
+    return std::find(options.ops.begin(), options.ops.end(), op) != options.ops.end();
+}
+
+class Suite {
+public:
+    explicit Suite(const Options& options) : options(options) {}
+
+    void run() {
+        for (const Size& size : options.sizes) {
+            run_size(size);
+        }
+    }
+
+    const std::vector<Result>& results() const { return results_; }
+
+private:
+    const Options& options;
+    std::vector<Result> results_;
+
+    void record(const std::string& op, const Size& size, int layers, int kernel,
+                double medianNs, double minNs, double pixels) {
+        Result r{op, size.width, size.height, layers, kernel, options.reps, medianNs, minNs, pixels};
+        results_.push_back(r);
+        std::fprintf(stderr, "  %-28s %5dx%-5d layers=%-3d kernel=%-3d %10.3f ms\n",
+                     op.c_str(), size.width, size.height, layers, kernel, medianNs / 1e6);
+    }
+
+    void run_size(const Size& size) {
+        const int width = size.width;
+        const int height = size.height;
+        const double pixels = static_cast<double>(width) * height;
+        const size_t layerBytes = static_cast<size_t>(width) * height * 4;
+
+        std::fprintf(stderr, "%s (%dx%d)\n", size.name, width, height);
+
+        std::vector<uint8_t> base = make_image(width, height, 0, true);
+        std::vector<uint8_t> overlay = make_image(width, height, 1, false);
+        std::vector<uint8_t> output(layerBytes);
+
+        int order[1] = {0};
+        auto ingest = [&]() { data_to_layer(base.data(), width, height, 0); };
+
+        // Layer ingest
+        if (wants(options, "data_to_layer")) {
+            double med, mn;
+            measure([]() {}, [&]() { data_to_layer(base.data(), width, height, 0); }, options.reps, med, mn);
+            record("data_to_layer", size, 1, 0, med, mn, pixels);
+        }
+
+        if (wants(options, "adopt_layer")) {
+            double med, mn;
+            uint8_t* buffer = nullptr;
+            measure([&]() { buffer = alloc_layer_buffer(width, height); },
+                    [&]() {
+                        std::memcpy(buffer, base.data(), layerBytes);
+                        adopt_layer(buffer, width, height, 0);
+                    },
+                    options.reps, med, mn);
+            record("adopt_layer", size, 1, 0, med, mn, pixels);
+        }
+
+        // Compositing across layer counts
+        if (wants(options, "merge_layers")) {
+            for (int layerCount : options.layerCounts) {
+                if (layerBytes * (layerCount + 1) > options.maxMemoryMB * 1024 * 1024) {
+                    std::fprintf(stderr, "  merge_layers layers=%d skipped (exceeds --max-memory-mb)\n", layerCount);
+                    continue;
+                }
+
+                std::vector<int> mergeOrder(layerCount);
+                for (int i = 0; i < layerCount; ++i) {
+                    mergeOrder[i] = i;
+                    data_to_layer(i == 0 ? base.data() : overlay.data(), width, height, i);
+                }
+
+                double med, mn;
+                measure([]() {},
+                        [&]() { merge_layers(output.data(), width, height, mergeOrder.data(), layerCount); },
+                        options.reps, med, mn);
+                record("merge_layers", size, layerCount, 0, med, mn, pixels * layerCount);
+
+                // Stack of full-canvas opaque photos: everything below the top layer is occluded
+                for (int i = 0; i < layerCount; ++i) {
+                    data_to_layer(base.data(), width, height, i);
+                }
+                measure([]() {},
+                        [&]() { merge_layers(output.data(), width, height, mergeOrder.data(), layerCount); },
+                        options.reps, med, mn);
+                record("merge_layers.opaque", size, layerCount, 0, med, mn, pixels * layerCount);
+
+                for (int i = 1; i < layerCount; ++i) {
+                    data_to_layer(overlay.data(), width, height, i);
+                }
+
+                // Small edit on the top layer: only its dirty tiles are recomposited.
+                // Alternating colours keeps the filled region identical between runs.
+                int rep = 0;
+                measure([]() {},
+                        [&]() {
+                            uint8_t shade = (rep++ % 2) ? 255 : 0;
+                            bucket_fill(output.data(), width, height, mergeOrder.data(), layerCount,
+                                        layerCount - 1, 32, 32, shade, 0, 0, 255, 0.0f);
+                        },
+                        options.reps, med, mn);
+                record("bucket_fill.small_edit", size, layerCount, 0, med, mn, pixels);
+            }
+            ingest();
+        }
+
+        // Single-layer operations. Each exported call includes its merge_layers.
+        struct PointOp {
+            const char* name;
+            void (*fn)(uint8_t*, int, int, int*, int, int);
+        };
+        const PointOp pointOps[] = {
+            {"monochrome_average", monochrome_average},
+            {"monochrome_luminosity", monochrome_luminosity},
+            {"monochrome_lightness", monochrome_lightness},
+            {"monochrome_itu", monochrome_itu},
+            {"edge_sobel", edge_sobel},
+            {"laplacian_filter", laplacian_filter},
+            {"emboss", emboss},
+        };
+
+        for (const PointOp& op : pointOps) {
+            if (!wants(options, op.name)) continue;
+            double med, mn;
+            measure(ingest, [&]() { op.fn(output.data(), width, height, order, 1, 0); }, options.reps, med, mn);
+            record(op.name, size, 1, 0, med, mn, pixels);
+        }
+
+        // Sobel again after an undo only rescales the cached magnitudes
+        if (wants(options, "edge_sobel.after_undo")) {
+            double med, mn;
+            ingest();
+            edge_sobel(output.data(), width, height, order, 1, 0);
+            measure([&]() { undo(output.data(), width, height, order, 1); },
+                    [&]() { edge_sobel(output.data(), width, height, order, 1, 0); }, options.reps, med, mn);
+            record("edge_sobel.after_undo", size, 1, 0, med, mn, pixels);
+        }
+
+        if (wants(options, "sharpen")) {
+            double med, mn;
+            measure(ingest, [&]() { sharpen(output.data(), width, height, order, 1, 0, 1.0); }, options.reps, med, mn);
+            record("sharpen", size, 1, 3, med, mn, pixels);
+        }
+
+        // A grading preset of 5 adjustments (levels, curves, channel mix,
+        // gamma, invert), compiled into one pass: compare with one monochrome
+        if (wants(options, "adjust_colors")) {
+            double preset[5][13] = {
+                {4, 12, 240, 1.1, 0, 255},
+                {5, 0, 0, 64, 52, 192, 208, 255, 255, -1},
+                {9, 1.05, 0.05, 0, 0, 1, 0, 0, -0.05, 0.95, 4, 0, -4},
+                {6, 1.2},
+                {7},
+            };
+            double med, mn;
+            measure(ingest, [&]() { adjust_colors(output.data(), width, height, order, 1, 0, &preset[0][0], 5); },
+                    options.reps, med, mn);
+            record("adjust_colors", size, 1, 5, med, mn, pixels);
+        }
+
+        for (int kernel : options.kernelSizes) {
+            double sigma = kernel / 3.0;
+
+            // A user kernel of the same size (a box blur), up to the largest the engine takes
+            if (kernel <= CONVOLUTION_MAX_SIZE && wants(options, "apply_kernel")) {
+                std::vector<float> weights(static_cast<size_t>(kernel) * kernel, 1.0f / (kernel * kernel));
+                double med, mn;
+                measure(ingest, [&]() { apply_kernel(output.data(), width, height, order, 1, 0, weights.data(), kernel, 0.0); },
+                        options.reps, med, mn);
+                record("apply_kernel", size, 1, kernel, med, mn, pixels);
+            }
+
+            if (wants(options, "gaussian_blur")) {
+                double med, mn;
+                measure(ingest, [&]() { gaussian_blur(output.data(), width, height, order, 1, 0, sigma, kernel); },
+                        options.reps, med, mn);
+                record("gaussian_blur", size, 1, kernel, med, mn, pixels);
+            }
+
+            if (wants(options, "edge_laplacian_of_gaussian")) {
+                double med, mn;
+                measure(ingest, [&]() { edge_laplacian_of_gaussian(output.data(), width, height, order, 1, 0, sigma, kernel); },
+                        options.reps, med, mn);
+                record("edge_laplacian_of_gaussian", size, 1, kernel, med, mn, pixels);
+            }
+        }
+
+        // Background-softening blurs: large sigma with a kernel spanning +-2 sigma,
+        // which takes the stacked box blur path
+        if (wants(options, "gaussian_blur.large_sigma")) {
+            for (double sigma : {20.0, 50.0}) {
+                int kernel = static_cast<int>(4 * sigma) + 1;
+                double med, mn;
+                measure(ingest, [&]() { gaussian_blur(output.data(), width, height, order, 1, 0, sigma, kernel); },
+                        options.reps, med, mn);
+                record("gaussian_blur.large_sigma", size, 1, kernel, med, mn, pixels);
+            }
+        }
+
+        // Slider tick in preview mode, on a display a quarter of the canvas size:
+        // the blur runs on pyramid level 2 and the layer itself is untouched
+        if (wants(options, "preview_pipeline")) {
+            ingest();
+            set_preview_size(width / 4, height / 4);
+            int previewSize[3];
+            get_preview_size(width, height, previewSize);
+            std::vector<uint8_t> preview(static_cast<size_t>(previewSize[0]) * previewSize[1] * 4);
+            merge_layers_preview(preview.data(), width, height, order, 1);
+
+            for (double sigma : {2.0, 20.0}) {
+                int kernel = static_cast<int>(4 * sigma) + 1;
+                double steps[3] = {4, sigma, static_cast<double>(kernel)};  // op 4: Gaussian blur
+                double med, mn;
+                measure([]() {},
+                        [&]() { preview_pipeline(preview.data(), width, height, order, 1, 0, steps, 1); },
+                        options.reps, med, mn);
+                record("preview_pipeline", size, 1, kernel, med, mn, pixels);
+            }
+            set_preview_size(0, 0);
+        }
+
+        // Bucket fill: a small region (one flat block) and the whole image
+        if (wants(options, "bucket_fill")) {
+            double med, mn;
+            measure(ingest, [&]() { bucket_fill(output.data(), width, height, order, 1, 0, 32, 32, 255, 0, 0, 255, 1.0f); },
+                    options.reps, med, mn);
+            record("bucket_fill.block", size, 1, 0, med, mn, pixels);
+
+            measure(ingest, [&]() { bucket_fill(output.data(), width, height, order, 1, 0, 32, 32, 255, 0, 0, 128, 100.0f); },
+                    options.reps, med, mn);
+            record("bucket_fill.full", size, 1, 0, med, mn, pixels);
+
+            // Trying colours on the region just filled reuses the cached region
+            int rep = 0;
+            ingest();
+            bucket_fill(output.data(), width, height, order, 1, 0, 32, 32, 0, 0, 255, 255, 1.0f);
+            measure([]() {},
+                    [&]() {
+                        uint8_t shade = (rep++ % 2) ? 255 : 0;
+                        bucket_fill(output.data(), width, height, order, 1, 0, 32, 32, shade, 0, 255, 255, 1.0f);
+                    },
+                    options.reps, med, mn);
+            record("bucket_fill.recolor", size, 1, 0, med, mn, pixels);
+        }
+
+        // Replaying a log of 32 small fills on the top of two layers: one call
+        // (and composite) per fill, against a single run_commands batch
+        if (wants(options, "run_commands")) {
+            const int fills = 32;
+            int stack[2] = {0, 1};
+            data_to_layer(overlay.data(), width, height, 1);
+            std::vector<double> commands;
+            for (int i = 0; i < fills; ++i) {
+                double command[COMMAND_SIZE] = {8, 1, 32.0 + (i % 8) * 64, 32.0 + (i / 8) * 64, 255, 0, 0, 255, 0};
+                commands.insert(commands.end(), command, command + COMMAND_SIZE);  // op 8: bucket fill
+            }
+            auto reset = [&]() {
+                ingest();
+                data_to_layer(overlay.data(), width, height, 1);
+                merge_layers(output.data(), width, height, stack, 2);
+            };
+
+            double med, mn;
+            measure(reset,
+                    [&]() {
+                        for (int i = 0; i < fills; ++i) {
+                            const double* c = commands.data() + i * COMMAND_SIZE;
+                            bucket_fill(output.data(), width, height, stack, 2, 1, static_cast<int>(c[2]),
+                                        static_cast<int>(c[3]), 255, 0, 0, 255, 0.0f);
+                        }
+                    },
+                    options.reps, med, mn);
+            record("run_commands.separate", size, 2, fills, med, mn, pixels);
+
+            measure(reset, [&]() { run_commands(output.data(), width, height, stack, 2, commands.data(), fills, 0); },
+                    options.reps, med, mn);
+            record("run_commands", size, 2, fills, med, mn, pixels);
+            ingest();
+        }
+
+        // Snapshot of the layer in 1 MB chunks, and restoring it from them
+        if (wants(options, "snapshot")) {
+            ingest();
+            std::vector<uint8_t> stream;
+            double med, mn;
+            measure([&]() { stream.clear(); },
+                    [&]() {
+                        snapshot_begin(order, 1);
+                        int chunkSize[1];
+                        while (uint8_t* chunk = snapshot_next(1 << 20, chunkSize)) {
+                            if (chunkSize[0] <= 0) break;
+                            stream.insert(stream.end(), chunk, chunk + chunkSize[0]);
+                        }
+                        snapshot_end();
+                    },
+                    options.reps, med, mn);
+            record("snapshot", size, 1, 0, med, mn, pixels);
+
+            measure([]() {},
+                    [&]() {
+                        restore_begin();
+                        for (size_t at = 0; at < stream.size(); at += 1 << 20) {
+                            restore_feed(stream.data() + at, static_cast<int>(std::min<size_t>(1 << 20, stream.size() - at)));
+                        }
+                    },
+                    options.reps, med, mn);
+            record("snapshot.restore", size, 1, 0, med, mn, pixels);
+            ingest();
+        }
+
+        // Tile digests of a freshly ingested layer (every tile hashed), and
+        // after a small fill (only its tiles rehashed)
+        if (wants(options, "tile_digests")) {
+            std::vector<uint32_t> digests;
+            auto digest_all = [&]() {
+                const int tiles = get_tile_digests(0, nullptr, 0);
+                digests.resize(2 * static_cast<size_t>(tiles));
+                get_tile_digests(0, digests.data(), tiles);
+            };
+            double med, mn;
+            measure(ingest, digest_all, options.reps, med, mn);
+            record("tile_digests", size, 1, 0, med, mn, pixels);
+
+            int rep = 0;
+            ingest();
+            digest_all();
+            measure([&]() {
+                        uint8_t shade = (rep++ % 2) ? 255 : 0;
+                        bucket_fill(output.data(), width, height, order, 1, 0, 32, 32, shade, 0, 0, 255, 1.0f);
+                    },
+                    digest_all, options.reps, med, mn);
+            record("tile_digests.after_fill", size, 1, 0, med, mn, pixels);
+        }
+
+        // Integer kernels, for peers that must stay bit-identical
+        if (wants(options, "gaussian_blur.integer")) {
+            set_integer_kernels(1);
+            double med, mn;
+            measure(ingest, [&]() { gaussian_blur(output.data(), width, height, order, 1, 0, 3.0, 9); },
+                    options.reps, med, mn);
+            record("gaussian_blur.integer", size, 1, 9, med, mn, pixels);
+            set_integer_kernels(0);
+        }
+
+        // The same blur on an out-of-core copy of the layer, in bands
+        if (wants(options, "tiled_pipeline")) {
+            const int image = tiled_image_create(width, height);
+            double steps[3] = {4, 3.0, 9};  // op 4: Gaussian blur
+            double med, mn;
+            measure([&]() { tiled_image_write(image, base.data(), 0, height); },
+                    [&]() { tiled_run_pipeline(image, steps, 1); }, options.reps, med, mn);
+            record("tiled_pipeline", size, 1, 9, med, mn, pixels);
+            tiled_image_destroy(image);
+        }
+
+        if (wants(options, "quad_compression")) {
+            double med, mn;
+            measure(ingest, [&]() { quad_compression(output.data(), width, height, order, 1, 0, width / 2, height / 2); },
+                    options.reps, med, mn);
+            record("quad_compression", size, 1, 0, med, mn, pixels);
+
+            // Compressing again after an undo reuses the cached quad tree
+            ingest();
+            quad_compression(output.data(), width, height, order, 1, 0, width / 2, height / 2);
+            measure([&]() { undo(output.data(), width, height, order, 1); },
+                    [&]() { quad_compression(output.data(), width, height, order, 1, 0, width / 3, height / 3); },
+                    options.reps, med, mn);
+            record("quad_compression.after_undo", size, 1, 0, med, mn, pixels);
+        }
+
+        // Halving the layer, and a 256 pixel wide thumbnail of the image
+        const char* filterNames[] = {"resize_layer.area", "resize_layer.lanczos3"};
+        for (int filter = 0; filter < 2; ++filter) {
+            if (!wants(options, filterNames[filter])) continue;
+            double med, mn;
+            measure(ingest, [&]() { resize_layer(output.data(), width, height, order, 1, 0, width / 2, height / 2, filter); },
+                    options.reps, med, mn);
+            record(filterNames[filter], size, 1, 0, med, mn, pixels);
+        }
+        if (wants(options, "resample_image.thumbnail")) {
+            const int thumbWidth = 256, thumbHeight = std::max(1, height * 256 / width);
+            std::vector<uint8_t> thumbnail(static_cast<size_t>(thumbWidth) * thumbHeight * 4);
+            double med, mn;
+            measure([]() {}, [&]() { resample_image(base.data(), width, height, thumbnail.data(), thumbWidth, thumbHeight, 1); },
+                    options.reps, med, mn);
+            record("resample_image.thumbnail", size, 1, 0, med, mn, pixels);
+        }
+    }
+};
+
+void write_results(const Options& options, const std::vector<Result>& results) {
+    FILE* out = stdout;
+    if (!options.outputPath.empty()) {
+        out = std::fopen(options.outputPath.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "Cannot open %s\n", options.outputPath.c_str());
+            std::exit(1);
+        }
+    }
+
+    if (options.format == "json") {
+        std::fprintf(out, "{\n  \"reps\": %d,\n  \"threads\": %d,\n  \"blend_kernel\": \"%s\",\n  \"results\": [\n",
+                     options.reps, get_thread_count(), blend_kernel().name);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result& r = results[i];
+            std::fprintf(out,
+                         "    {\"op\": \"%s\", \"width\": %d, \"height\": %d, \"layers\": %d, \"kernel\": %d, "
+                         "\"median_ns\": %.0f, \"min_ns\": %.0f, \"ns_per_pixel\": %.4f, \"mpix_per_s\": %.2f}%s\n",
+                         r.op.c_str(), r.width, r.height, r.layers, r.kernel, r.medianNs, r.minNs,
+                         r.medianNs / r.pixels, r.pixels / r.medianNs * 1e3, i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+    } else if (options.format == "csv") {
+        std::fprintf(out, "op,width,height,layers,kernel,median_ns,min_ns,ns_per_pixel,mpix_per_s\n");
+        for (const Result& r : results) {
+            std::fprintf(out, "%s,%d,%d,%d,%d,%.0f,%.0f,%.4f,%.2f\n",
+                         r.op.c_str(), r.width, r.height, r.layers, r.kernel, r.medianNs, r.minNs,
+                         r.medianNs / r.pixels, r.pixels / r.medianNs * 1e3);
+        }
+    } else {
+        std::fprintf(out, "%-28s %11s %6s %6s %12s %10s %10s\n",
+                     "op", "size", "layers", "kernel", "median ms", "ns/pixel", "MP/s");
+        for (const Result& r : results) {
+            char size[32];
+            std::snprintf(size, sizeof(size), "%dx%d", r.width, r.height);
+            std::fprintf(out, "%-28s %11s %6d %6d %12.3f %10.3f %10.1f\n",
+                         r.op.c_str(), size, r.layers, r.kernel, r.medianNs / 1e6,
+                         r.medianNs / r.pixels, r.pixels / r.medianNs * 1e3);
+        }
+    }
+
+    if (out != stdout) std::fclose(out);
+}
+
+std::vector<int> parse_int_list(const char* arg) {
+    std::vector<int> values;
+    for (const char* p = arg; *p;) {
+        values.push_back(std::atoi(p));
+        while (*p && *p != ',') ++p;
+        if (*p == ',') ++p;
+    }
+    return values;
+}
+
+std::vector<std::string> parse_string_list(const char* arg) {
+    std::vector<std::string> values;
+    std::string current;
+    for (const char* p = arg; ; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (!current.empty()) values.push_back(current);
+            current.clear();
+            if (*p == '\0') break;
+        } else {
+            current += *p;
+        }
+    }
+    return values;
+}
+
+// Engine statistics (engine_stats.h) of the whole run, untimed ingests included
+void write_engine_stats() {
+    const int fields = 5;
+    std::vector<double> stats(static_cast<size_t>(get_engine_stats(nullptr, 0)) * fields);
+    const int count = get_engine_stats(stats.data(), static_cast<int>(stats.size()));
+    if (count == 0) {
+        std::fprintf(stderr, "engine statistics are compiled out (ENGINE_STATS=0)\n");
+        return;
+    }
+
+    std::fprintf(stderr, "\n%-28s %10s %12s %12s %14s %14s\n", "probe", "calls", "total ms", "longest ms",
+                 "pixels", "bytes");
+    for (int i = 0; i < count; ++i) {
+        const double* s = stats.data() + static_cast<size_t>(i) * fields;
+        if (s[0] == 0) continue;
+        std::fprintf(stderr, "%-28s %10.0f %12.3f %12.3f %14.0f %14.0f\n", get_engine_stat_name(i), s[0], s[1], s[2],
+                     s[3], s[4]);
+    }
+}
+
+void print_usage() {
+    std::printf(
+        "usage: benchmark [options]\n"
+        "  --sizes WxH,...      image sizes (default: 730x946,1920x1080,3840x2160,7680x4320)\n"
+        "  --layers N,...       layer counts for merge_layers (default: 1,4,16,32)\n"
+        "  --kernels N,...      kernel sizes for gaussian_blur / LoG (default: 3,5,9,15,31)\n"
+        "  --ops name,...       only run these operations (default: all)\n"
+        "  --reps N             runs per measurement, median is reported (default: 5)\n"
+        "  --max-memory-mb N    skip merge configurations above this size (default: 2048)\n"
+        "  --threads N          threads used by the kernels, 1 = serial (default: all cores)\n"
+        "  --quick              730x946 and 1080p only, 3 reps\n"
+        "  --format F           table, csv or json (default: table)\n"
+        "  --output PATH        write results to PATH instead of stdout\n"
+        "  --stats              print the engine statistics of the run to stderr\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    bool quick = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--help" || arg == "-h") {
+            print_usage();
+            return 0;
+        } else if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--sizes" && hasValue) {
+            for (const std::string& s : parse_string_list(argv[++i])) {
+                int w = 0, h = 0;
+                if (std::sscanf(s.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+                    std::fprintf(stderr, "Invalid size: %s\n", s.c_str());
+                    return 1;
+                }
+                options.sizes.push_back({w, h, "custom"});
+            }
+        } else if (arg == "--layers" && hasValue) {
+            options.layerCounts = parse_int_list(argv[++i]);
+        } else if (arg == "--kernels" && hasValue) {
+            options.kernelSizes = parse_int_list(argv[++i]);
+        } else if (arg == "--ops" && hasValue) {
+            options.ops = parse_string_list(argv[++i]);
+        } else if (arg == "--reps" && hasValue) {
+            options.reps = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--max-memory-mb" && hasValue) {
+            options.maxMemoryMB = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--format" && hasValue) {
+            options.format = argv[++i];
+        } else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        } else {
+            std::fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (options.sizes.empty()) {
+        for (const Size& size : DEFAULT_SIZES) {
+            if (quick && size.width > 1920) continue;
+            options.sizes.push_back(size);
+        }
+    }
+    if (quick) options.reps = std::min(options.reps, 3);
+
+    set_thread_count(options.threads);
+    std::fprintf(stderr, "blend kernel: %s, threads: %d\n", blend_kernel().name, get_thread_count());
+
+    Suite suite(options);
+    reset_engine_stats();
+    suite.run();
+    write_results(options, suite.results());
+    if (options.stats) write_engine_stats();
+
+    return 0;
+}
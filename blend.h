@@ -0,0 +1,278 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "layer.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define BLEND_X86_DISPATCH 1
+#endif
+
+/**
+ * "Under" blending
+ *
+ * The compositor works on one tile of straight 8-bit RGBA at a time, layers
+ * top to bottom, and blends each layer pixel (the source) under the pixel
+ * composited so far (the destination). With alphas a and colours c in
+ * 0 - 255, the coverage of the result is
+ *
+ *   A = 255 * dstA + srcA * (255 - dstA)
+ *
+ * in units of 1 / 65025, and the result is
+ *
+ *   outA = A / 255
+ *   outC = (dstC * dstA * 255 + srcC * srcA * (255 - dstA)) / A
+ *
+ * rounded down: both colours premultiplied in fixed point, summed, and
+ * divided back by the coverage. Every kernel computes exactly this (the
+ * vector ones in floats, where the products and sums are whole numbers below
+ * 2^24 and so exact), so all of them, native and WASM, give the same results,
+ * and a transparent source leaves the destination as it is.
+ *
+ * merge_layers used to evaluate the same formula in normalized floats,
+ * truncating after every layer. The float result falls just below a whole
+ * number now and then, so one blend differs from it by at most one level,
+ * always upwards, and a stack of n layers by at most n levels, as the float
+ * result drifts down with depth (4 at worst over random stacks of up to 32
+ * semi-transparent layers; `make check` checks both bounds).
+ *
+ * There is no divide per pixel: the vector kernels blend 4 pixels per 128
+ * bits (8 with AVX2), a pixel per lane, and multiply by an approximate
+ * reciprocal of the coverage, then correct the quotient to the exact one by
+ * its remainder.
+ */
+
+/**
+ * Scalar kernel: blend `count` pixels of `src` under `dst`. Returns the
+ * minimum alpha of those pixels afterwards. The division is a multiply by a
+ * 40-bit reciprocal of A, which is exact here since the dividend is below
+ * 2^24 and A at least 255.
+ */
+inline uint8_t blend_under_integer(uint8_t* dst, const Pixel* src, int count) {
+    uint8_t minAlpha = 255;
+    for (int i = 0; i < count; ++i) {
+        const Pixel& p = src[i];
+        uint8_t* o = dst + i * 4;
+
+        const uint32_t dstA = o[3], srcA = p.a;
+        const uint32_t coverage = 255 * dstA + srcA * (255 - dstA);
+        if (dstA != 255 && coverage != 0) {
+            const uint64_t reciprocal = (uint64_t(1) << 40) / coverage + 1;
+            const uint32_t dstWeight = dstA * 255, srcWeight = srcA * (255 - dstA);
+            o[0] = static_cast<uint8_t>(((o[0] * dstWeight + p.r * srcWeight) * reciprocal) >> 40);
+            o[1] = static_cast<uint8_t>(((o[1] * dstWeight + p.g * srcWeight) * reciprocal) >> 40);
+            o[2] = static_cast<uint8_t>(((o[2] * dstWeight + p.b * srcWeight) * reciprocal) >> 40);
+            o[3] = static_cast<uint8_t>(coverage / 255);
+        }
+        minAlpha = std::min(minAlpha, o[3]);
+    }
+    return minAlpha;
+}
+
+/*
+ * The vector kernels divide without a divide. Each colour quotient is
+ * floor(n * r + 0.5), with r a float reciprocal of the coverage A within
+ * 1 / 1000 of 1 / A, so n * r is within 0.26 of the quotient (at most 255)
+ * and the result is the exact quotient or one above it. The remainder
+ * n - q * A, exact in floats as every term is a whole number below 2^24,
+ * tells which. The alpha is (A + 0.5) / 255, truncated, which is exact for
+ * every A.
+ */
+
+#if defined(__wasm_simd128__)
+
+// Initial guess for a float reciprocal, from the bits of its argument
+constexpr int32_t BLEND_RECIPROCAL_MAGIC = 0x7EF311C3;
+
+/**
+ * WASM SIMD128 kernel: 4 pixels per 128-bit vector, one per lane. There is no
+ * reciprocal instruction, so r is refined from a guess with two Newton steps.
+ */
+inline uint8_t blend_under_simd128(uint8_t* dst, const Pixel* src, int count) {
+    const v128_t c255 = wasm_f32x4_splat(255.0f);
+    const v128_t half = wasm_f32x4_splat(0.5f);
+    const v128_t two = wasm_f32x4_splat(2.0f);
+    const v128_t inv255 = wasm_f32x4_splat(1.0f / 255.0f);
+    const v128_t magic = wasm_i32x4_splat(BLEND_RECIPROCAL_MAGIC);
+    // Byte c of each pixel into its own lane; out-of-range indices give 0
+    const v128_t lanes[3] = {wasm_i8x16_make(0, 16, 16, 16, 4, 16, 16, 16, 8, 16, 16, 16, 12, 16, 16, 16),
+                             wasm_i8x16_make(1, 16, 16, 16, 5, 16, 16, 16, 9, 16, 16, 16, 13, 16, 16, 16),
+                             wasm_i8x16_make(2, 16, 16, 16, 6, 16, 16, 16, 10, 16, 16, 16, 14, 16, 16, 16)};
+    v128_t minv = wasm_i32x4_splat(255);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint8_t* o = dst + i * 4;
+        const v128_t d = wasm_v128_load(o);
+        const v128_t s = wasm_v128_load(src + i);
+
+        const v128_t dstA = wasm_f32x4_convert_i32x4(wasm_u32x4_shr(d, 24));
+        const v128_t srcA = wasm_f32x4_convert_i32x4(wasm_u32x4_shr(s, 24));
+        const v128_t dstWeight = wasm_f32x4_mul(dstA, c255);
+        const v128_t srcWeight = wasm_f32x4_mul(srcA, wasm_f32x4_sub(c255, dstA));
+        const v128_t coverage = wasm_f32x4_add(dstWeight, srcWeight);
+        v128_t r = wasm_i32x4_sub(magic, coverage);
+        r = wasm_f32x4_mul(r, wasm_f32x4_sub(two, wasm_f32x4_mul(coverage, r)));
+        r = wasm_f32x4_mul(r, wasm_f32x4_sub(two, wasm_f32x4_mul(coverage, r)));
+
+        v128_t out = wasm_i32x4_shl(wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_mul(wasm_f32x4_add(coverage, half), inv255)), 24);
+        for (int c = 0; c < 3; ++c) {
+            const v128_t n = wasm_f32x4_add(wasm_f32x4_mul(wasm_f32x4_convert_i32x4(wasm_i8x16_swizzle(d, lanes[c])), dstWeight),
+                                            wasm_f32x4_mul(wasm_f32x4_convert_i32x4(wasm_i8x16_swizzle(s, lanes[c])), srcWeight));
+            const v128_t q = wasm_f32x4_floor(wasm_f32x4_add(wasm_f32x4_mul(n, r), half));
+            const v128_t over = wasm_f32x4_lt(wasm_f32x4_sub(n, wasm_f32x4_mul(q, coverage)), wasm_f32x4_splat(0.0f));
+            out = wasm_v128_or(out, wasm_i32x4_shl(wasm_i32x4_add(wasm_i32x4_trunc_sat_f32x4(q), over), c * 8));
+        }
+        // Where the coverage is 0 the pixel is left as it is
+        out = wasm_v128_bitselect(d, out, wasm_f32x4_eq(coverage, wasm_f32x4_splat(0.0f)));
+        wasm_v128_store(o, out);
+        minv = wasm_u32x4_min(minv, wasm_u32x4_shr(out, 24));
+    }
+
+    minv = wasm_u32x4_min(minv, wasm_i32x4_shuffle(minv, minv, 2, 3, 0, 1));
+    minv = wasm_u32x4_min(minv, wasm_i32x4_shuffle(minv, minv, 1, 0, 3, 2));
+    uint8_t minAlpha = static_cast<uint8_t>(wasm_i32x4_extract_lane(minv, 0));
+    if (i < count) minAlpha = std::min(minAlpha, blend_under_integer(dst + i * 4, src + i, count - i));
+    return minAlpha;
+}
+
+#endif
+
+#if defined(BLEND_X86_DISPATCH)
+
+/**
+ * SSE4.1 kernel: 4 pixels per 128-bit register, one per lane. r is the
+ * hardware reciprocal estimate, good to 1.5 * 2^-12 on every CPU.
+ */
+__attribute__((target("sse4.1")))
+inline uint8_t blend_under_sse41(uint8_t* dst, const Pixel* src, int count) {
+    const __m128 c255 = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 inv255 = _mm_set1_ps(1.0f / 255.0f);
+    // Byte c of each pixel into its own lane; -1 gives 0
+    const __m128i lanes[3] = {_mm_setr_epi8(0, -1, -1, -1, 4, -1, -1, -1, 8, -1, -1, -1, 12, -1, -1, -1),
+                              _mm_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1, 9, -1, -1, -1, 13, -1, -1, -1),
+                              _mm_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1)};
+    __m128i minv = _mm_set1_epi32(255);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint8_t* o = dst + i * 4;
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(o));
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+
+        const __m128 dstA = _mm_cvtepi32_ps(_mm_srli_epi32(d, 24));
+        const __m128 srcA = _mm_cvtepi32_ps(_mm_srli_epi32(s, 24));
+        const __m128 dstWeight = _mm_mul_ps(dstA, c255);
+        const __m128 srcWeight = _mm_mul_ps(srcA, _mm_sub_ps(c255, dstA));
+        const __m128 coverage = _mm_add_ps(dstWeight, srcWeight);
+        const __m128 r = _mm_rcp_ps(coverage);
+
+        __m128i out = _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(coverage, half), inv255)), 24);
+        for (int c = 0; c < 3; ++c) {
+            const __m128 n = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_shuffle_epi8(d, lanes[c])), dstWeight),
+                                        _mm_mul_ps(_mm_cvtepi32_ps(_mm_shuffle_epi8(s, lanes[c])), srcWeight));
+            const __m128 q = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(n, r), half));
+            const __m128 over = _mm_cmplt_ps(_mm_sub_ps(n, _mm_mul_ps(q, coverage)), _mm_setzero_ps());
+            out = _mm_or_si128(out, _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(q), _mm_castps_si128(over)), c * 8));
+        }
+        // Where the coverage is 0 the pixel is left as it is
+        out = _mm_blendv_epi8(out, d, _mm_castps_si128(_mm_cmpeq_ps(coverage, _mm_setzero_ps())));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), out);
+        minv = _mm_min_epu32(minv, _mm_srli_epi32(out, 24));
+    }
+
+    minv = _mm_min_epu32(minv, _mm_shuffle_epi32(minv, 0x4E));
+    minv = _mm_min_epu32(minv, _mm_shuffle_epi32(minv, 0xB1));
+    uint8_t minAlpha = static_cast<uint8_t>(_mm_cvtsi128_si32(minv));
+    if (i < count) minAlpha = std::min(minAlpha, blend_under_integer(dst + i * 4, src + i, count - i));
+    return minAlpha;
+}
+
+/**
+ * AVX2 kernel: 8 pixels per 256-bit register, one per lane, as the SSE4.1 one.
+ */
+__attribute__((target("avx2")))
+inline uint8_t blend_under_avx2(uint8_t* dst, const Pixel* src, int count) {
+    const __m256 c255 = _mm256_set1_ps(255.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 inv255 = _mm256_set1_ps(1.0f / 255.0f);
+    // Byte c of each pixel into its own lane (shuffles stay within 128-bit halves); -1 gives 0
+    const __m256i lanes[3] = {
+        _mm256_setr_epi8(0, -1, -1, -1, 4, -1, -1, -1, 8, -1, -1, -1, 12, -1, -1, -1,
+                         0, -1, -1, -1, 4, -1, -1, -1, 8, -1, -1, -1, 12, -1, -1, -1),
+        _mm256_setr_epi8(1, -1, -1, -1, 5, -1, -1, -1, 9, -1, -1, -1, 13, -1, -1, -1,
+                         1, -1, -1, -1, 5, -1, -1, -1, 9, -1, -1, -1, 13, -1, -1, -1),
+        _mm256_setr_epi8(2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1,
+                         2, -1, -1, -1, 6, -1, -1, -1, 10, -1, -1, -1, 14, -1, -1, -1)};
+    __m256i minv = _mm256_set1_epi32(255);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint8_t* o = dst + i * 4;
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(o));
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+
+        const __m256 dstA = _mm256_cvtepi32_ps(_mm256_srli_epi32(d, 24));
+        const __m256 srcA = _mm256_cvtepi32_ps(_mm256_srli_epi32(s, 24));
+        const __m256 dstWeight = _mm256_mul_ps(dstA, c255);
+        const __m256 srcWeight = _mm256_mul_ps(srcA, _mm256_sub_ps(c255, dstA));
+        const __m256 coverage = _mm256_add_ps(dstWeight, srcWeight);
+        const __m256 r = _mm256_rcp_ps(coverage);
+
+        __m256i out = _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(coverage, half), inv255)), 24);
+        for (int c = 0; c < 3; ++c) {
+            const __m256 n = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(d, lanes[c])), dstWeight),
+                                           _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi8(s, lanes[c])), srcWeight));
+            const __m256 q = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(n, r), half));
+            const __m256 over = _mm256_cmp_ps(_mm256_sub_ps(n, _mm256_mul_ps(q, coverage)), _mm256_setzero_ps(), _CMP_LT_OQ);
+            out = _mm256_or_si256(out, _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(q), _mm256_castps_si256(over)), c * 8));
+        }
+        // Where the coverage is 0 the pixel is left as it is
+        out = _mm256_blendv_epi8(out, d, _mm256_castps_si256(_mm256_cmp_ps(coverage, _mm256_setzero_ps(), _CMP_EQ_OQ)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), out);
+        minv = _mm256_min_epu32(minv, _mm256_srli_epi32(out, 24));
+    }
+
+    __m128i m = _mm_min_epu32(_mm256_castsi256_si128(minv), _mm256_extracti128_si256(minv, 1));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, 0x4E));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, 0xB1));
+    uint8_t minAlpha = static_cast<uint8_t>(_mm_cvtsi128_si32(m));
+    if (i < count) minAlpha = std::min(minAlpha, blend_under_integer(dst + i * 4, src + i, count - i));
+    return minAlpha;
+}
+
+#endif
+
+using BlendUnderFn = uint8_t (*)(uint8_t*, const Pixel*, int);
+
+struct BlendKernel {
+    BlendUnderFn fn;
+    const char* name;
+};
+
+/**
+ * Pick the widest kernel available: WASM SIMD128 when built with -msimd128,
+ * otherwise AVX2 or SSE4.1 if the CPU supports them (checked once at run
+ * time), otherwise scalar. They all give the same results, in either kernel
+ * mode (integer_kernels.h).
+ */
+inline const BlendKernel& blend_kernel() {
+    static const BlendKernel kernel = []() -> BlendKernel {
+#if defined(__wasm_simd128__)
+        return {blend_under_simd128, "simd128"};
+#elif defined(BLEND_X86_DISPATCH)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return {blend_under_avx2, "avx2"};
+        if (__builtin_cpu_supports("sse4.1")) return {blend_under_sse41, "sse4.1"};
+        return {blend_under_integer, "scalar"};
+#else
+        return {blend_under_integer, "scalar"};
+#endif
+    }();
+    return kernel;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+#include "integer_kernels.h"
+#include "engine_stats.h"
+#include "scratch_arena.h"
+
+/**
+ * Stacked box blur
+ *
+ * Approximates a Gaussian blur with three successive box blurs, whose widths
+ * are chosen so that together they have the same variance as the Gaussian
+ * kernel being approximated. Each box pass keeps a running sum along the line,
+ * so the cost per pixel is the same for any sigma.
+ *
+ * Rows are blurred one at a time. The vertical pass works on strips of
+ * BOX_BLUR_STRIP_WIDTH columns: each strip is copied into a small buffer (one
+ * cache line of pixels per row), blurred down its length, and copied back, so
+ * every memory access is to consecutive bytes. Values are kept with 8
+ * fractional bits between the three passes of a direction, and rounded to
+ * 8-bit once per direction, like the direct blur.
+ *
+ * Edges are clamped (the edge pixel is repeated), as in the direct blur. Each
+ * line is extended by the combined radius of all passes before blurring, so
+ * the edge is repeated once for the whole stack rather than once per pass.
+ */
+
+constexpr int BOX_BLUR_PASSES = 3;
+
+// Columns per vertical strip: 16 RGBA pixels = one 64-byte cache line
+constexpr int BOX_BLUR_STRIP_WIDTH = 16;
+
+/**
+ * Radii of the BOX_BLUR_PASSES boxes whose combined variance best matches
+ * `variance`. Box widths are odd, and differ by at most 2.
+ */
+inline std::array<int, BOX_BLUR_PASSES> box_blur_radii(double variance) {
+    const int n = BOX_BLUR_PASSES;
+
+    // Variance of a box of width w is (w^2 - 1) / 12
+    double idealWidth = std::sqrt(12.0 * variance / n + 1.0);
+    int lower = static_cast<int>(std::floor(idealWidth));
+    if (lower % 2 == 0) --lower;
+    lower = std::max(1, lower);
+    int upper = lower + 2;
+
+    // Number of boxes that use the lower width
+    double m = (12.0 * variance - n * lower * lower - 4.0 * n * lower - 3.0 * n) / (-4.0 * lower - 4.0);
+    int lowerCount = std::min(n, std::max(0, static_cast<int>(std::lround(m))));
+
+    std::array<int, BOX_BLUR_PASSES> radii;
+    for (int i = 0; i < n; ++i) {
+        radii[i] = ((i < lowerCount ? lower : upper) - 1) / 2;
+    }
+    return radii;
+}
+
+/**
+ * One box pass along a line of `count` positions with `lanes` interleaved
+ * values each (4 for a row of RGBA pixels, 4 * strip width for a strip of
+ * columns). `sum` is scratch for `lanes` values.
+ */
+inline void box_blur_pass(const int32_t* in, int32_t* out, int count, int lanes,
+                          int radius, int32_t* sum) {
+    const int width = 2 * radius + 1;
+    const float inv = 1.0f / width;
+    const bool integer = integer_kernels();
+    const int last = count - 1;
+
+    std::fill(sum, sum + lanes, 0);
+    for (int j = -radius; j <= radius; ++j) {
+        const int32_t* src = in + static_cast<size_t>(std::min(std::max(j, 0), last)) * lanes;
+        for (int l = 0; l < lanes; ++l) sum[l] += src[l];
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int32_t* dst = out + static_cast<size_t>(i) * lanes;
+        if (integer) {
+            // Sums are never negative, so this rounds half up like the float mode
+            for (int l = 0; l < lanes; ++l) {
+                dst[l] = static_cast<int32_t>((2 * static_cast<int64_t>(sum[l]) + width) / (2 * width));
+            }
+        } else {
+            for (int l = 0; l < lanes; ++l) dst[l] = static_cast<int32_t>(sum[l] * inv + 0.5f);
+        }
+
+        // Slide the window: add the sample entering at the front, drop the one leaving
+        const int32_t* add = in + static_cast<size_t>(std::min(i + radius + 1, last)) * lanes;
+        const int32_t* sub = in + static_cast<size_t>(std::max(i - radius, 0)) * lanes;
+        for (int l = 0; l < lanes; ++l) sum[l] += add[l] - sub[l];
+    }
+}
+
+/**
+ * Run all passes on `a`, which holds a line of `count` positions extended by
+ * `pad` positions on both sides, using `b` as the second buffer. Returns a
+ * pointer to the first of the `count` results (in `a` or `b`).
+ */
+inline int32_t* box_blur_line(int32_t* a, int32_t* b, int count, int pad, int lanes,
+                              const std::array<int, BOX_BLUR_PASSES>& radii, int32_t* sum) {
+    for (int radius : radii) {
+        box_blur_pass(a, b, count + 2 * pad, lanes, radius, sum);
+        std::swap(a, b);
+    }
+    return a + static_cast<size_t>(pad) * lanes;
+}
+
+// Combined radius of all passes, i.e. how far the edge must be repeated
+inline int box_blur_padding(const std::array<int, BOX_BLUR_PASSES>& radii) {
+    int pad = 0;
+    for (int radius : radii) pad += radius;
+    return pad;
+}
+
+inline int32_t box_blur_load(uint8_t value) { return value << 8; }
+
+inline uint8_t box_blur_store(int32_t value) {
+    return static_cast<uint8_t>(std::min(255, std::max(0, (value + 128) >> 8)));
+}
+
+/**
+ * Horizontal passes over rows [y0, y1) of `pixels`, in place. Rows are
+ * independent, so any set of rows can be blurred in any order.
+ */
+inline void box_blur_rows(PixelBuffer& pixels, const std::array<int, BOX_BLUR_PASSES>& radii, int y0, int y1) {
+    const int width = pixels.width;
+    const int pad = box_blur_padding(radii);
+    const int lanes = 4;
+    const size_t lineSize = static_cast<size_t>(width + 2 * pad) * lanes;
+    ScratchScope scratch;
+    int32_t* a = scratch.allocate<int32_t>(lineSize);
+    int32_t* b = scratch.allocate<int32_t>(lineSize);
+    int32_t* sum = scratch.allocate<int32_t>(lanes);
+
+    for (int y = y0; y < y1; ++y) {
+        const Pixel* src = pixels.row(y);
+        for (int i = 0; i < width + 2 * pad; ++i) {
+            const Pixel& p = src[std::min(std::max(i - pad, 0), width - 1)];
+            int32_t* dst = a + static_cast<size_t>(i) * lanes;
+            dst[0] = box_blur_load(p.r);
+            dst[1] = box_blur_load(p.g);
+            dst[2] = box_blur_load(p.b);
+            dst[3] = box_blur_load(p.a);
+        }
+
+        const int32_t* result = box_blur_line(a, b, width, pad, lanes, radii, sum);
+
+        uint8_t* row = reinterpret_cast<uint8_t*>(pixels.row(y));
+        for (int i = 0; i < width * lanes; ++i) row[i] = box_blur_store(result[i]);
+    }
+}
+
+// Number of BOX_BLUR_STRIP_WIDTH column strips the vertical pass works on
+inline int box_blur_strip_count(int width) {
+    return (width + BOX_BLUR_STRIP_WIDTH - 1) / BOX_BLUR_STRIP_WIDTH;
+}
+
+/**
+ * Vertical passes over column strips [s0, s1) of `pixels`, in place. Like
+ * rows, strips are independent.
+ */
+inline void box_blur_strips(PixelBuffer& pixels, const std::array<int, BOX_BLUR_PASSES>& radii, int s0, int s1) {
+    const int width = pixels.width;
+    const int height = pixels.height;
+    const int pad = box_blur_padding(radii);
+    const int maxLanes = BOX_BLUR_STRIP_WIDTH * 4;
+    const size_t lineSize = static_cast<size_t>(height + 2 * pad) * maxLanes;
+    ScratchScope scratch;
+    int32_t* a = scratch.allocate<int32_t>(lineSize);
+    int32_t* b = scratch.allocate<int32_t>(lineSize);
+    int32_t* sum = scratch.allocate<int32_t>(maxLanes);
+
+    for (int s = s0; s < s1; ++s) {
+        const int x0 = s * BOX_BLUR_STRIP_WIDTH;
+        const int lanes = std::min(BOX_BLUR_STRIP_WIDTH, width - x0) * 4;
+
+        for (int i = 0; i < height + 2 * pad; ++i) {
+            int y = std::min(std::max(i - pad, 0), height - 1);
+            const uint8_t* src = reinterpret_cast<const uint8_t*>(pixels.row(y) + x0);
+            int32_t* dst = a + static_cast<size_t>(i) * lanes;
+            for (int l = 0; l < lanes; ++l) dst[l] = box_blur_load(src[l]);
+        }
+
+        const int32_t* result = box_blur_line(a, b, height, pad, lanes, radii, sum);
+
+        for (int y = 0; y < height; ++y) {
+            uint8_t* dst = reinterpret_cast<uint8_t*>(pixels.row(y) + x0);
+            const int32_t* src = result + static_cast<size_t>(y) * lanes;
+            for (int l = 0; l < lanes; ++l) dst[l] = box_blur_store(src[l]);
+        }
+    }
+}
+
+/**
+ * Blur `layer` in place with stacked box blurs matching a Gaussian of the
+ * given variance. The caller marks the layer dirty.
+ */
+inline void box_blur_layer(Layer& layer, double variance) {
+    if (layer.empty()) return;
+
+    const std::array<int, BOX_BLUR_PASSES> radii = box_blur_radii(variance);
+    ThreadPool& pool = ThreadPool::shared();
+
+    const uint64_t pixels = static_cast<uint64_t>(layer.width()) * layer.height();
+
+    // === HORIZONTAL PASS ===
+    {
+        ENGINE_STAT(stat, "box_blur.horizontal");
+        stat.add(pixels);
+        pool.parallel_for(0, layer.height(), row_grain(layer.width()), [&](int y0, int y1) {
+            box_blur_rows(layer.pixels, radii, y0, y1);
+        });
+    }
+
+    // === VERTICAL PASS ===
+    ENGINE_STAT(stat, "box_blur.vertical");
+    stat.add(pixels);
+    pool.parallel_for(0, box_blur_strip_count(layer.width()), 1, [&](int s0, int s1) {
+        box_blur_strips(layer.pixels, radii, s0, s1);
+    });
+}
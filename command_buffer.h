@@ -0,0 +1,175 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+#include "pipeline.h"
+
+/**
+ * Command buffers
+ *
+ * A batch of operations packed into one array of doubles, run by a single
+ * call to run_commands and composited once at the end. Each command is
+ * COMMAND_SIZE doubles: [op, layer id, up to COMMAND_PARAM_COUNT params].
+ *
+ *   op 0 - 6   the filter with that PipelineOp code, params as in run_pipeline
+ *   op 7       Laplacian of Gaussian (as edge_laplacian_of_gaussian): sigma,
+ *              kernel size
+ *   op 8       bucket fill: x, y, r, g, b, a, error threshold
+ *   op 9       quad tree compression: width, height
+ *   op 10, 11  undo, redo (the layer id is ignored)
+ *   op 12      resize: width, height, ResampleFilter code (resample.h)
+ *   op 13      sharpen: amount
+ *   op 14      emboss
+ *   op 15      colour adjustment: PointOpKind code (point_ops.h), then its
+ *              first 6 params (channel mixing needs adjust_colors)
+ *
+ * By default every command is its own undoable step, exactly as if each had
+ * been called on its own, so peers replaying the same log keep the same
+ * history. Two optional flags trade that for speed:
+ *
+ *   COMMANDS_COALESCE   consecutive filters on the same layer run as one
+ *                       pipeline (pipeline.h), sharing sweeps over the layer,
+ *                       and become one undoable step; so do consecutive
+ *                       colour adjustments, compiled into one table pass
+ *   COMMANDS_REORDER    between undo / redo commands, the commands of each
+ *                       layer run together, in the order the layers first
+ *                       appear. Commands on different layers commute, so the
+ *                       layers end up the same, but more filters become
+ *                       consecutive and compressed layers (layer_store.h) are
+ *                       decompressed once.
+ */
+
+// Operation codes of commands. The values are part of the JS API.
+enum class CommandOp : int {
+    // 0 - 6: PipelineOp
+    LaplacianOfGaussian = 7,    // sigma, kernel size
+    BucketFill = 8,             // x, y, r, g, b, a, error threshold
+    QuadCompression = 9,        // width, height
+    Undo = 10,
+    Redo = 11,
+    Resize = 12,                // width, height, filter
+    Sharpen = 13,               // amount
+    Emboss = 14,
+    Adjust = 15,                // PointOpKind, up to 6 params
+};
+
+constexpr int COMMAND_PARAM_COUNT = 7;
+
+// Doubles per command in the packed array passed to run_commands
+constexpr int COMMAND_SIZE = 2 + COMMAND_PARAM_COUNT;
+
+// Flags of run_commands
+constexpr int COMMANDS_COALESCE = 1;
+constexpr int COMMANDS_REORDER = 2;
+
+struct Command {
+    CommandOp op;
+    int layerId = -1;
+    double params[COMMAND_PARAM_COUNT] = {};
+};
+
+inline bool command_op_valid(int op) {
+    return pipeline_op_valid(op) ||
+           (op >= static_cast<int>(CommandOp::LaplacianOfGaussian) && op <= static_cast<int>(CommandOp::Adjust));
+}
+
+// Whether the command is a filter, which can share a pipeline with others
+inline bool command_is_filter(const Command& command) {
+    return pipeline_op_valid(static_cast<int>(command.op)) || command.op == CommandOp::LaplacianOfGaussian;
+}
+
+// Whether the command is a colour adjustment, which can share a program with others
+inline bool command_is_adjustment(const Command& command) {
+    return command.op == CommandOp::Adjust;
+}
+
+// The point operation of a colour adjustment command. The params it has no
+// room for are -1, which ends a curve's points.
+inline PointOp command_point_op(const Command& command) {
+    PointOp op{static_cast<PointOpKind>(static_cast<int>(command.params[0]))};
+    std::fill(op.params, op.params + POINT_OP_PARAM_COUNT, -1.0);
+    std::copy(command.params + 1, command.params + COMMAND_PARAM_COUNT, op.params);
+    return op;
+}
+
+// Undo and redo act on whichever layer the history says, so nothing is
+// reordered across them
+inline bool command_is_barrier(const Command& command) {
+    return command.op == CommandOp::Undo || command.op == CommandOp::Redo;
+}
+
+// Append the pipeline steps of a filter command to `steps`
+inline void add_command_steps(const Command& command, std::vector<PipelineStep>& steps) {
+    if (command.op == CommandOp::LaplacianOfGaussian) {
+        steps.push_back(PipelineStep{PipelineOp::MonochromeItu});
+        steps.push_back(PipelineStep{PipelineOp::GaussianBlur, command.params[0], command.params[1]});
+        steps.push_back(PipelineStep{PipelineOp::LaplacianFilter});
+    } else {
+        steps.push_back(PipelineStep{static_cast<PipelineOp>(command.op), command.params[0], command.params[1]});
+    }
+}
+
+// Commands packed as in run_commands. Unknown codes are skipped.
+inline std::vector<Command> unpack_commands(const double* commands, int commandCount) {
+    std::vector<Command> unpacked;
+    unpacked.reserve(std::max(0, commandCount));
+    for (int i = 0; i < commandCount; ++i) {
+        const double* packed = commands + static_cast<size_t>(i) * COMMAND_SIZE;
+        const int op = static_cast<int>(packed[0]);
+        if (!command_op_valid(op)) continue;
+
+        Command command;
+        command.op = static_cast<CommandOp>(op);
+        command.layerId = static_cast<int>(packed[1]);
+        std::copy(packed + 2, packed + COMMAND_SIZE, command.params);
+        unpacked.push_back(command);
+    }
+    return unpacked;
+}
+
+/**
+ * Between barriers, move the commands of each layer together, keeping their
+ * order within the layer and ordering layers by first appearance.
+ */
+inline std::vector<Command> reorder_commands(const std::vector<Command>& commands) {
+    std::vector<Command> reordered;
+    reordered.reserve(commands.size());
+
+    size_t begin = 0;
+    while (begin < commands.size()) {
+        size_t end = begin;
+        while (end < commands.size() && !command_is_barrier(commands[end])) ++end;
+
+        // Stable sort of the segment by the rank of each layer's first command
+        std::unordered_map<int, size_t> rank;
+        std::vector<std::pair<size_t, size_t>> keys;
+        for (size_t i = begin; i < end; ++i) {
+            auto inserted = rank.emplace(commands[i].layerId, rank.size());
+            keys.emplace_back(inserted.first->second, i);
+        }
+        std::sort(keys.begin(), keys.end());
+        for (const auto& key : keys) reordered.push_back(commands[key.second]);
+
+        if (end < commands.size()) reordered.push_back(commands[end++]);
+        begin = end;
+    }
+    return reordered;
+}
+
+/**
+ * Split commands into the runs executed as one operation each: a single
+ * command, or with `coalesce`, consecutive filters or consecutive colour
+ * adjustments on the same layer. Run i is commands[runs[i] .. runs[i + 1]).
+ */
+inline std::vector<size_t> command_runs(const std::vector<Command>& commands, bool coalesce) {
+    std::vector<size_t> runs{0};
+    for (size_t i = 1; i <= commands.size(); ++i) {
+        const bool joins = coalesce && i < commands.size() && commands[i].layerId == commands[i - 1].layerId &&
+                           ((command_is_filter(commands[i]) && command_is_filter(commands[i - 1])) ||
+                            (command_is_adjustment(commands[i]) && command_is_adjustment(commands[i - 1])));
+        if (!joins) runs.push_back(i);
+    }
+    return runs;
+}
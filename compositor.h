@@ -0,0 +1,279 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "layer.h"
+#include "blend.h"
+#include "thread_pool.h"
+#include "engine_stats.h"
+
+/**
+ * Axis-aligned rectangle in canvas pixels. An empty rect (width or height 0)
+ * means nothing changed.
+ */
+struct Rect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+
+    bool empty() const { return width <= 0 || height <= 0; }
+};
+
+/**
+ * Counters from the most recent composite, in tiles.
+ */
+struct CompositeStats {
+    int tiles = 0;               // canvas tiles recomposited
+    int layerTilesBlended = 0;   // layer tiles actually blended
+    int layerTilesSkipped = 0;   // fully transparent layer tiles skipped
+    int layerTilesOccluded = 0;  // layer tiles skipped below fully opaque output
+};
+
+/**
+ * Incremental, tiled compositor.
+ *
+ * Caches the last composited output together with the identity (uid) and
+ * version of every layer in the stack. On the next call, only the canvas tiles
+ * that some layer has marked dirty since then are cleared and re-blended. Any
+ * change to the output buffer, canvas size, layer order, or a layer's
+ * dimensions falls back to a full recomposite.
+ *
+ * Each canvas tile is composited on its own, layers top to bottom, blending
+ * each layer under the output tile (see blend.h), which stays in cache across
+ * all layers. A fully transparent layer tile is skipped, and once the output
+ * tile is fully opaque the layers below it are not visited at all; neither
+ * would change a pixel. Dirty tiles are split into bands and composited in
+ * parallel on the shared thread pool.
+ */
+class Compositor {
+public:
+    static constexpr int TILE_SIZE = Layer::TILE_SIZE;
+
+    /**
+     * Composite `stack` (bottom to top, entries may be null) into `output`,
+     * which is width * height RGBA. Returns the canvas region that changed.
+     */
+    Rect composite(uint8_t* output, int width, int height,
+                   const std::vector<Layer*>& stack, bool forceFull = false) {
+        if (!output || width <= 0 || height <= 0) return Rect();
+        ENGINE_STAT(stat, "compositor.composite");
+
+        const int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        const int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+        bool full = forceFull || !cache_matches(output, width, height, stack);
+        dirty.assign(static_cast<size_t>(tilesX) * tilesY, full ? 1 : 0);
+
+        if (!full) {
+            for (size_t i = 0; i < stack.size(); ++i) {
+                const Layer* layer = stack[i];
+                if (!layer || layer->empty()) continue;
+                uint32_t seen = cached[i].version;
+                if (layer->version == seen) continue;
+
+                int maxTy = std::min(layer->tiles_y, tilesY);
+                int maxTx = std::min(layer->tiles_x, tilesX);
+                for (int ty = 0; ty < maxTy; ++ty) {
+                    for (int tx = 0; tx < maxTx; ++tx) {
+                        if (layer->tile_versions[ty * layer->tiles_x + tx] > seen) {
+                            dirty[ty * tilesX + tx] = 1;
+                        }
+                    }
+                }
+            }
+        }
+
+        dirtyTiles.clear();
+        for (int t = 0; t < tilesX * tilesY; ++t) {
+            if (dirty[t]) dirtyTiles.push_back(t);
+        }
+
+        // Tiles are independent, so bands of dirty tiles are composited in
+        // parallel, each with its own counters and bounding box
+        BandResult total = ThreadPool::shared().parallel_reduce(
+            0, static_cast<int>(dirtyTiles.size()), TILES_PER_BAND, BandResult(width, height),
+            [&](int begin, int end) {
+                BandResult band(width, height);
+                for (int i = begin; i < end; ++i) {
+                    int tx = dirtyTiles[i] % tilesX, ty = dirtyTiles[i] / tilesX;
+                    int x0 = tx * TILE_SIZE, x1 = std::min(width, x0 + TILE_SIZE);
+                    int y0 = ty * TILE_SIZE, y1 = std::min(height, y0 + TILE_SIZE);
+                    composite_tile(output, width, stack, tx, ty, x0, y0, x1, y1, band.stats);
+                    band.include(x0, y0, x1, y1);
+                }
+                return band;
+            },
+            [](BandResult a, const BandResult& b) {
+                a.merge(b);
+                return a;
+            });
+
+        stats = total.stats;
+        for (int t : dirtyTiles) {
+            const int tx = t % tilesX, ty = t / tilesX;
+            stat.add(static_cast<uint64_t>(std::min(TILE_SIZE, width - tx * TILE_SIZE)) *
+                     std::min(TILE_SIZE, height - ty * TILE_SIZE));
+        }
+
+        remember(output, width, height, stack);
+
+        if (stats.tiles == 0) return Rect();
+        return Rect{total.minX, total.minY, total.maxX - total.minX, total.maxY - total.minY};
+    }
+
+    // Forget the cached composite; the next call recomposites everything
+    void invalidate() { valid = false; }
+
+    // Counters from the most recent composite
+    const CompositeStats& last_stats() const { return stats; }
+
+private:
+    struct Entry {
+        uint64_t uid;
+        uint32_t version;
+        int width;
+        int height;
+    };
+
+    bool valid = false;
+    uint8_t* cachedOutput = nullptr;
+    int cachedWidth = 0;
+    int cachedHeight = 0;
+    std::vector<Entry> cached;
+
+    // Scratch reused between calls
+    std::vector<uint8_t> dirty;
+    std::vector<int> dirtyTiles;
+
+    CompositeStats stats;
+
+    // Minimum number of dirty tiles worth handing to another thread
+    static constexpr int TILES_PER_BAND = 4;
+
+    // Counters and bounding box of the tiles composited by one band
+    struct BandResult {
+        CompositeStats stats;
+        int minX, minY, maxX = 0, maxY = 0;
+
+        BandResult(int width, int height) : minX(width), minY(height) {}
+
+        void include(int x0, int y0, int x1, int y1) {
+            minX = std::min(minX, x0);
+            minY = std::min(minY, y0);
+            maxX = std::max(maxX, x1);
+            maxY = std::max(maxY, y1);
+        }
+
+        void merge(const BandResult& other) {
+            stats.tiles += other.stats.tiles;
+            stats.layerTilesBlended += other.stats.layerTilesBlended;
+            stats.layerTilesSkipped += other.stats.layerTilesSkipped;
+            stats.layerTilesOccluded += other.stats.layerTilesOccluded;
+            include(other.minX, other.minY, other.maxX, other.maxY);
+        }
+    };
+
+    /**
+     * Composite canvas tile (tx, ty), covering [x0, x1) x [y0, y1), blending the
+     * stack from the top layer down. Safe to call for different tiles at once:
+     * it only touches this tile of the output and of each layer's coverage cache.
+     */
+    static void composite_tile(uint8_t* output, int width, const std::vector<Layer*>& stack,
+                               int tx, int ty, int x0, int y0, int x1, int y1, CompositeStats& stats) {
+        ++stats.tiles;
+
+        const BlendUnderFn blend = blend_kernel().fn;
+        for (int y = y0; y < y1; ++y) {
+            std::memset(output + (static_cast<size_t>(y) * width + x0) * 4, 0, static_cast<size_t>(x1 - x0) * 4);
+        }
+
+        // Lower bound on the output alpha over the whole tile
+        uint8_t coverage = 0;
+        bool blendedAny = false;
+
+        // Iterate from top layer down to bottom layer
+        for (int i = static_cast<int>(stack.size()) - 1; i >= 0; --i) {
+            Layer* layer = stack[i];
+            if (!layer || layer->empty()) continue;
+            if (tx >= layer->tiles_x || ty >= layer->tiles_y) continue;
+
+            if (coverage == 255) {
+                ++stats.layerTilesOccluded;
+                continue;
+            }
+
+            const Layer::TileCoverage& layerCoverage = layer->tile_coverage(tx, ty);
+            if (layerCoverage.maxAlpha == 0) {
+                ++stats.layerTilesSkipped;
+                continue;
+            }
+            ++stats.layerTilesBlended;
+
+            bool coversTile = layer->width() >= x1 && layer->height() >= y1;
+
+            // An opaque layer tile on top of nothing is simply copied
+            if (!blendedAny && coversTile && layerCoverage.minAlpha == 255) {
+                for (int y = y0; y < y1; ++y) {
+                    std::memcpy(output + (static_cast<size_t>(y) * width + x0) * 4,
+                                layer->pixels.row(y) + x0, static_cast<size_t>(x1 - x0) * 4);
+                }
+                stats.layerTilesOccluded += count_below(stack, i, tx, ty);
+                return;
+            }
+
+            int bx1 = std::min(x1, layer->width());
+            int by1 = std::min(y1, layer->height());
+            uint8_t blendedMin = 255;
+            for (int y = y0; y < by1; ++y) {
+                uint8_t rowMin = blend(output + (static_cast<size_t>(y) * width + x0) * 4, layer->pixels.row(y) + x0, bx1 - x0);
+                blendedMin = std::min(blendedMin, rowMin);
+            }
+            blendedAny = true;
+
+            // Alpha never decreases as layers are added underneath, so the minimum
+            // over the blended region is the tile's minimum only if the layer
+            // covers the whole tile
+            if (coversTile) coverage = std::max(coverage, blendedMin);
+        }
+    }
+
+    // Number of non-empty layers below index i that overlap tile (tx, ty)
+    static int count_below(const std::vector<Layer*>& stack, int i, int tx, int ty) {
+        int count = 0;
+        for (int j = i - 1; j >= 0; --j) {
+            const Layer* layer = stack[j];
+            if (layer && !layer->empty() && tx < layer->tiles_x && ty < layer->tiles_y) ++count;
+        }
+        return count;
+    }
+
+    static Entry entry_for(const Layer* layer) {
+        if (!layer) return Entry{0, 0, 0, 0};
+        return Entry{layer->uid, layer->version, layer->width(), layer->height()};
+    }
+
+    bool cache_matches(uint8_t* output, int width, int height, const std::vector<Layer*>& stack) const {
+        if (!valid || output != cachedOutput || width != cachedWidth || height != cachedHeight) return false;
+        if (stack.size() != cached.size()) return false;
+
+        for (size_t i = 0; i < stack.size(); ++i) {
+            Entry e = entry_for(stack[i]);
+            if (e.uid != cached[i].uid || e.width != cached[i].width || e.height != cached[i].height) return false;
+            // Versions only move forward; anything else means the layer was swapped out
+            if (e.version < cached[i].version) return false;
+        }
+        return true;
+    }
+
+    void remember(uint8_t* output, int width, int height, const std::vector<Layer*>& stack) {
+        valid = true;
+        cachedOutput = output;
+        cachedWidth = width;
+        cachedHeight = height;
+        cached.clear();
+        for (const Layer* layer : stack) cached.push_back(entry_for(layer));
+    }
+};
@@ -0,0 +1,573 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+#include "layer.h"
+#include "thread_pool.h"
+#include "scratch_arena.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Convolution engine
+ *
+ * NxN integer kernels (N odd, up to CONVOLUTION_MAX_SIZE) over 8-bit images,
+ * either the average grayscale of each pixel (1 lane per pixel, as the edge
+ * filters use) or its four channels (4 lanes). Float kernels are quantized to
+ * 16-bit weights with up to CONVOLUTION_MAX_SHIFT fractional bits.
+ *
+ * Rows are read through a ConvolutionWindow: a rolling buffer of the
+ * 2 * radius + 1 rows around the current one, converted to int16 lanes and
+ * padded by repeating the edge pixels. Filters therefore never hold a
+ * full-size intermediate, only a few rows per band.
+ *
+ * The sums are SIMD multiply-adds of two taps at a time into 32-bit lanes
+ * (`wasm_i32x4_dot_i16x8` / `_mm_madd_epi16`), over 8 lanes per step. Kernels
+ * whose sums cannot leave 16 bits, like Sobel and the Laplacian, can instead
+ * be summed in int16 lanes. Rank-1 kernels (Sobel, box and Gaussian kernels)
+ * are detected and run as a vertical then a horizontal pass, when their
+ * vertical sums fit 16 bits. All of it is integer arithmetic, so every path
+ * gives the same results.
+ */
+
+constexpr int CONVOLUTION_MAX_SIZE = 9;
+
+// Most fractional bits of a quantized float kernel
+constexpr int CONVOLUTION_MAX_SHIFT = 12;
+
+/**
+ * out[i] = sum of weights[t] * inputs[t][i] over the `taps` inputs, for `lanes`
+ * lanes. Taps are taken two at a time; `pairs` has (taps + 1) / 2 entries,
+ * the weights of taps 2j (low 16 bits) and 2j + 1.
+ */
+inline void convolution_taps(const int16_t* const* inputs, const int32_t* pairs, int taps, int32_t* out, int lanes) {
+    int i = 0;
+#if defined(__wasm_simd128__)
+    for (; i + 8 <= lanes; i += 8) {
+        v128_t lo = wasm_i32x4_splat(0), hi = lo;
+        for (int t = 0; t < taps; t += 2) {
+            const v128_t a = wasm_v128_load(inputs[t] + i);
+            const v128_t b = t + 1 < taps ? wasm_v128_load(inputs[t + 1] + i) : wasm_i16x8_splat(0);
+            const v128_t w = wasm_i32x4_splat(pairs[t / 2]);
+            lo = wasm_i32x4_add(lo, wasm_i32x4_dot_i16x8(wasm_i16x8_shuffle(a, b, 0, 8, 1, 9, 2, 10, 3, 11), w));
+            hi = wasm_i32x4_add(hi, wasm_i32x4_dot_i16x8(wasm_i16x8_shuffle(a, b, 4, 12, 5, 13, 6, 14, 7, 15), w));
+        }
+        wasm_v128_store(out + i, lo);
+        wasm_v128_store(out + i + 4, hi);
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= lanes; i += 8) {
+        __m128i lo = _mm_setzero_si128(), hi = lo;
+        for (int t = 0; t < taps; t += 2) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[t] + i));
+            const __m128i b = t + 1 < taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[t + 1] + i))
+                                           : _mm_setzero_si128();
+            const __m128i w = _mm_set1_epi32(pairs[t / 2]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), hi);
+    }
+#endif
+    for (; i < lanes; ++i) {
+        int32_t sum = 0;
+        for (int t = 0; t < taps; ++t) {
+            const int32_t pair = pairs[t / 2];
+            const int32_t weight = t % 2 == 0 ? static_cast<int16_t>(pair & 0xFFFF)
+                                              : static_cast<int16_t>(static_cast<uint32_t>(pair) >> 16);
+            sum += weight * inputs[t][i];
+        }
+        out[i] = sum;
+    }
+}
+
+/**
+ * out[i] = sum of weights[t] * inputs[t][i] over the `taps` inputs, in 16
+ * bits: the caller guarantees that no partial sum leaves the int16 range.
+ */
+inline void convolution_taps_narrow(const int16_t* const* inputs, const int16_t* weights, int taps, int16_t* out,
+                                    int lanes) {
+    int i = 0;
+#if defined(__wasm_simd128__)
+    for (; i + 8 <= lanes; i += 8) {
+        v128_t sum = wasm_i16x8_splat(0);
+        for (int t = 0; t < taps; ++t) {
+            sum = wasm_i16x8_add(sum, wasm_i16x8_mul(wasm_v128_load(inputs[t] + i), wasm_i16x8_splat(weights[t])));
+        }
+        wasm_v128_store(out + i, sum);
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= lanes; i += 8) {
+        __m128i sum = _mm_setzero_si128();
+        for (int t = 0; t < taps; ++t) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[t] + i));
+            sum = _mm_add_epi16(sum, _mm_mullo_epi16(v, _mm_set1_epi16(weights[t])));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), sum);
+    }
+#endif
+    for (; i < lanes; ++i) {
+        int32_t sum = 0;
+        for (int t = 0; t < taps; ++t) sum += weights[t] * inputs[t][i];
+        out[i] = static_cast<int16_t>(sum);
+    }
+}
+
+/**
+ * Kernel weights, prepared for the engine: the non-zero taps of the full
+ * kernel, and its factors if it is separable.
+ */
+class ConvolutionKernel {
+public:
+    ConvolutionKernel() = default;
+
+    /**
+     * size x size weights, row-major, each within the int16 range. Sums are
+     * divided by 2^shift (rounded) by `scale`. Invalid (see valid) if the size
+     * is not odd and at most CONVOLUTION_MAX_SIZE, or a weight is out of range.
+     */
+    ConvolutionKernel(int size, const int32_t* weights, int shift = 0) {
+        if (size < 1 || size > CONVOLUTION_MAX_SIZE || size % 2 == 0 || shift < 0 || shift > 30) return;
+        for (int i = 0; i < size * size; ++i) {
+            if (weights[i] < INT16_MIN || weights[i] > INT16_MAX) return;
+        }
+        n = size;
+        shiftBits = shift;
+
+        for (int k = 0; k < n; ++k) {
+            for (int j = 0; j < n; ++j) {
+                if (weights[k * n + j] != 0) taps[tapCount++] = Tap{k, j, static_cast<int16_t>(weights[k * n + j])};
+            }
+        }
+        pack(taps, tapCount, pairs, tapWeights);
+
+        int32_t magnitude = 0;
+        for (int t = 0; t < tapCount; ++t) magnitude += std::abs(taps[t].weight);
+        narrowSums = magnitude * 255 <= INT16_MAX;
+        factor(weights);
+    }
+
+    /**
+     * Float weights, quantized with as many fractional bits (up to
+     * CONVOLUTION_MAX_SHIFT) as the largest weight leaves room for. Integer
+     * weights are kept exact. The rounding error of the sum goes to the
+     * largest weight, so a kernel that sums to 1 keeps flat areas flat.
+     */
+    static ConvolutionKernel from_float(int size, const float* weights) {
+        if (size < 1 || size > CONVOLUTION_MAX_SIZE || size % 2 == 0) return ConvolutionKernel();
+
+        const int count = size * size;
+        double largest = 0.0;
+        double total = 0.0;
+        bool integers = true;
+        int largestIndex = 0;
+        for (int i = 0; i < count; ++i) {
+            if (!std::isfinite(weights[i])) return ConvolutionKernel();
+            if (std::fabs(weights[i]) > largest) {
+                largest = std::fabs(weights[i]);
+                largestIndex = i;
+            }
+            total += weights[i];
+            integers = integers && weights[i] == std::floor(weights[i]);
+        }
+
+        int shift = 0;
+        if (!integers) {
+            while (shift < CONVOLUTION_MAX_SHIFT && largest * (1 << (shift + 1)) <= INT16_MAX) ++shift;
+        }
+        if (largest * (1 << shift) > INT16_MAX) return ConvolutionKernel();
+
+        int32_t quantized[MAX_TAPS];
+        int64_t sum = 0;
+        for (int i = 0; i < count; ++i) {
+            quantized[i] = static_cast<int32_t>(std::lround(weights[i] * (1 << shift)));
+            sum += quantized[i];
+        }
+        const int64_t corrected = quantized[largestIndex] + std::llround(total * (1 << shift)) - sum;
+        if (corrected >= INT16_MIN && corrected <= INT16_MAX) quantized[largestIndex] = static_cast<int32_t>(corrected);
+        return ConvolutionKernel(size, quantized, shift);
+    }
+
+    bool valid() const { return n > 0; }
+    int size() const { return n; }
+    int radius() const { return n / 2; }
+    bool separable() const { return rowTapCount > 0; }
+
+    // Whether every sum of 8-bit values fits 16 bits, for ConvolutionWindow's int16 output
+    bool narrow() const { return narrowSums; }
+
+    // A sum of the kernel, divided by 2^shift and rounded
+    int32_t scale(int32_t sum) const {
+        return shiftBits == 0 ? sum : (sum + (1 << (shiftBits - 1))) >> shiftBits;
+    }
+
+private:
+    friend class ConvolutionWindow;
+
+    // Weight of row k, column j
+    struct Tap {
+        int row;
+        int column;
+        int16_t weight;
+    };
+
+    static constexpr int MAX_TAPS = CONVOLUTION_MAX_SIZE * CONVOLUTION_MAX_SIZE;
+
+    // Fixed capacity, so kernels built for one call (sharpen, apply_kernel)
+    // allocate nothing
+    int n = 0;
+    int shiftBits = 0;
+    bool narrowSums = false;
+    int tapCount = 0;
+    Tap taps[MAX_TAPS] = {};
+    int32_t pairs[(MAX_TAPS + 1) / 2] = {};
+    int16_t tapWeights[MAX_TAPS] = {};
+
+    // Separable kernels: weights[k][j] = column[k] * row[j]. The horizontal
+    // pass only runs the non-zero taps of `row`.
+    int16_t column[CONVOLUTION_MAX_SIZE] = {};
+    int rowTapCount = 0;
+    Tap rowTaps[CONVOLUTION_MAX_SIZE] = {};
+    int32_t rowPairs[(CONVOLUTION_MAX_SIZE + 1) / 2] = {};
+    int16_t rowWeights[CONVOLUTION_MAX_SIZE] = {};
+
+    // The weights of `count` taps, as pairs (see convolution_taps) and one by one
+    static void pack(const Tap* taps, int count, int32_t* pairs, int16_t* weights) {
+        std::fill(pairs, pairs + (count + 1) / 2, 0);
+        for (int t = 0; t < count; ++t) {
+            const uint32_t weight = static_cast<uint16_t>(taps[t].weight);
+            pairs[t / 2] |= static_cast<int32_t>(t % 2 == 0 ? weight : weight << 16);
+            weights[t] = taps[t].weight;
+        }
+    }
+
+    // Split rank-1 kernels into a column and a row factor
+    void factor(const int32_t* weights) {
+        if (n == 1 || tapCount == 0) return;
+
+        // Row factor: the first non-zero row, divided by the gcd of its weights
+        const int pivotRow = taps[0].row;
+        const int pivotColumn = taps[0].column;
+        int32_t divisor = 0;
+        for (int j = 0; j < n; ++j) divisor = gcd(divisor, std::abs(weights[pivotRow * n + j]));
+
+        int32_t row[CONVOLUTION_MAX_SIZE], col[CONVOLUTION_MAX_SIZE];
+        for (int j = 0; j < n; ++j) row[j] = weights[pivotRow * n + j] / divisor;
+        for (int k = 0; k < n; ++k) {
+            if (weights[k * n + pivotColumn] % row[pivotColumn] != 0) return;
+            col[k] = weights[k * n + pivotColumn] / row[pivotColumn];
+        }
+
+        // Every weight must be the product, and the vertical sums of 8-bit
+        // values must fit 16 bits
+        int32_t columnMagnitude = 0;
+        for (int k = 0; k < n; ++k) {
+            for (int j = 0; j < n; ++j) {
+                if (col[k] * row[j] != weights[k * n + j]) return;
+            }
+            columnMagnitude += std::abs(col[k]);
+        }
+        if (columnMagnitude * 255 > INT16_MAX) return;
+
+        for (int k = 0; k < n; ++k) column[k] = static_cast<int16_t>(col[k]);
+        for (int j = 0; j < n; ++j) {
+            if (row[j] != 0) rowTaps[rowTapCount++] = Tap{0, j, static_cast<int16_t>(row[j])};
+        }
+        pack(rowTaps, rowTapCount, rowPairs, rowWeights);
+    }
+
+    static int32_t gcd(int32_t a, int32_t b) {
+        while (b != 0) {
+            const int32_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+};
+
+/**
+ * Rolling window of the rows around one row of an image, as int16 lanes:
+ * 1 lane per pixel, the average grayscale (r + g + b) / 3, or 4, the
+ * channels. Rows outside the image repeat its first or last row, pixels
+ * outside it the first or last pixel.
+ */
+class ConvolutionWindow {
+public:
+    // Rows and buffers come from `memory`, which must outlive the window
+    ConvolutionWindow(ScratchScope& memory, int width, int height, int channels, int radius)
+        : width(width), height(height), channels(channels), radius(radius),
+          lanes(width * channels), stride((width + 2 * radius) * channels),
+          ring(memory.allocate<int16_t>(static_cast<size_t>(2 * radius + 1) * stride)),
+          tags(memory.allocate<int>(2 * radius + 1)), scratch(memory.allocate<int16_t>(stride)),
+          inputs(memory.allocate<const int16_t*>(CONVOLUTION_MAX_SIZE * CONVOLUTION_MAX_SIZE)) {
+        std::fill(tags, tags + 2 * radius + 1, -1);
+    }
+
+    /**
+     * Centre the window on row y, loading the rows it is missing from
+     * source(row), which returns a pointer to `width` pixels. Rows must be
+     * visited in increasing order for each to be loaded once.
+     */
+    template <typename Source>
+    void center(int y, Source&& source) {
+        centerRow = y;
+        for (int k = -radius; k <= radius; ++k) {
+            const int sourceRow = clamp_row(y + k);
+            const int slot = sourceRow % (2 * radius + 1);
+            if (tags[slot] != sourceRow) {
+                load(source(sourceRow), ring + static_cast<size_t>(slot) * stride);
+                tags[slot] = sourceRow;
+            }
+        }
+    }
+
+    // Lanes of the row at offset k (|k| <= radius) from the centre, from its first pixel
+    const int16_t* row(int k) const {
+        const int slot = clamp_row(centerRow + k) % (2 * radius + 1);
+        return ring + static_cast<size_t>(slot) * stride + radius * channels;
+    }
+
+    // Unscaled sums of `kernel` (radius at most the window's) at every lane of the centre row
+    void convolve(const ConvolutionKernel& kernel, int32_t* out) {
+        const int count = prepare(kernel);
+        convolution_taps(inputs, kernel.separable() ? kernel.rowPairs : kernel.pairs, count, out,
+                         lanes);
+    }
+
+    // The same in 16 bits, twice as many lanes per step, for kernels that are narrow()
+    void convolve(const ConvolutionKernel& kernel, int16_t* out) {
+        const int count = prepare(kernel);
+        convolution_taps_narrow(inputs, kernel.separable() ? kernel.rowWeights : kernel.tapWeights,
+                                count, out, lanes);
+    }
+
+private:
+    const int width;
+    const int height;
+    const int channels;
+    const int radius;
+    const int lanes;
+    const int stride;
+    int16_t* const ring;
+    int* const tags;
+    int16_t* const scratch;
+    const int16_t** const inputs;
+    int centerRow = 0;
+
+    int clamp_row(int y) const { return std::min(std::max(y, 0), height - 1); }
+
+    /**
+     * Point `inputs` at the lanes of the taps of `kernel`, and return how many
+     * there are. Separable kernels first run their vertical pass, over the
+     * lanes the horizontal taps read, into `scratch`.
+     */
+    int prepare(const ConvolutionKernel& kernel) {
+        const int r = kernel.radius();
+        if (kernel.separable()) {
+            const int reach = r * channels;
+            for (int k = 0; k < kernel.n; ++k) inputs[k] = row(k - r) - reach;
+            convolution_taps_narrow(inputs, kernel.column, kernel.n, scratch, lanes + 2 * reach);
+
+            const int count = kernel.rowTapCount;
+            for (int t = 0; t < count; ++t) inputs[t] = scratch + kernel.rowTaps[t].column * channels;
+            return count;
+        }
+
+        const int count = kernel.tapCount;
+        for (int t = 0; t < count; ++t) {
+            const ConvolutionKernel::Tap& tap = kernel.taps[t];
+            inputs[t] = row(tap.row - r) + (tap.column - r) * channels;
+        }
+        return count;
+    }
+
+    void load(const Pixel* pixels, int16_t* out) const {
+        int16_t* lane = out + radius * channels;
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels);
+        if (channels == 1) {
+            // s * 21846 >> 16 is s / 3 for every s up to 765, and vectorizes
+            for (int x = 0; x < width; ++x) {
+                const int sum = bytes[4 * x] + bytes[4 * x + 1] + bytes[4 * x + 2];
+                lane[x] = static_cast<int16_t>((sum * 21846) >> 16);
+            }
+        } else {
+            for (int i = 0; i < lanes; ++i) lane[i] = bytes[i];
+        }
+
+        // Repeat the edge pixels into the padding
+        for (int p = 0; p < radius; ++p) {
+            std::memcpy(out + p * channels, lane, channels * sizeof(int16_t));
+            std::memcpy(lane + lanes + p * channels, lane + lanes - channels, channels * sizeof(int16_t));
+        }
+    }
+};
+
+/**
+ * Layer sweeps
+ */
+
+// Bands a sweep of `rows` rows of a `width` wide image splits into
+inline int convolution_band_count(int width, int rows) {
+    return ThreadPool::shared().band_count(rows, row_grain(width));
+}
+
+/**
+ * Sweep rows [y0, y1) of `layer` in `bands` parallel bands (see
+ * convolution_band_count), each with its own window of `radius` rows and
+ * `channels` lanes per pixel. process(band, y, window) is called for every
+ * row of a band, in order, with the window centred on it.
+ *
+ * With `inPlace`, process may overwrite row y of the layer. Rows of the sweep
+ * that belong to other bands, which may already have been overwritten, are
+ * then read from copies taken before it starts, as the fused pipeline does.
+ */
+template <typename Process>
+void convolution_sweep(const Layer& layer, int channels, int radius, int y0, int y1, int bands, bool inPlace,
+                       Process&& process) {
+    const int width = layer.width();
+    const int height = layer.height();
+    if (layer.empty() || y0 >= y1) return;
+
+    // Halo rows of every band
+    ScratchScope scratch;
+    Pixel** above = scratch.allocate<Pixel*>(bands);
+    Pixel** below = scratch.allocate<Pixel*>(bands);
+    if (inPlace) {
+        for (int band = 0; band < bands; ++band) {
+            const std::pair<int, int> range = ThreadPool::band_range(y0, y1, bands, band);
+            const int top = std::max(y0, range.first - radius);
+            const int bottom = std::min(y1, range.second + radius);
+            const size_t rowBytes = static_cast<size_t>(width) * sizeof(Pixel);
+
+            above[band] = scratch.allocate<Pixel>(static_cast<size_t>(range.first - top) * width);
+            for (int y = top; y < range.first; ++y) {
+                std::memcpy(static_cast<void*>(above[band] + static_cast<size_t>(y - top) * width),
+                            layer.pixels.row(y), rowBytes);
+            }
+            below[band] = scratch.allocate<Pixel>(static_cast<size_t>(bottom - range.second) * width);
+            for (int y = range.second; y < bottom; ++y) {
+                std::memcpy(static_cast<void*>(below[band] + static_cast<size_t>(y - range.second) * width),
+                            layer.pixels.row(y), rowBytes);
+            }
+        }
+    }
+
+    ThreadPool::shared().parallel_for(0, bands, 1, [&](int firstBand, int lastBand) {
+        for (int band = firstBand; band < lastBand; ++band) {
+            const std::pair<int, int> range = ThreadPool::band_range(y0, y1, bands, band);
+            const int top = std::max(y0, range.first - radius);
+            auto source = [&](int y) -> const Pixel* {
+                if (inPlace && y >= y0 && y < range.first) return above[band] + static_cast<size_t>(y - top) * width;
+                if (inPlace && y >= range.second && y < y1) {
+                    return below[band] + static_cast<size_t>(y - range.second) * width;
+                }
+                return layer.pixels.row(y);
+            };
+
+            ScratchScope bandScratch;
+            ConvolutionWindow window(bandScratch, width, height, channels, radius);
+            for (int y = range.first; y < range.second; ++y) {
+                window.center(y, source);
+                process(band, y, window);
+            }
+        }
+    });
+}
+
+/**
+ * Kernels
+ */
+
+// Sobel gradients: Gx = [-1 0 1; -2 0 2; -1 0 1], Gy = [1 2 1; 0 0 0; -1 -2 -1]
+inline const ConvolutionKernel& sobel_x_kernel() {
+    static const int32_t weights[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    static const ConvolutionKernel kernel(3, weights);
+    return kernel;
+}
+
+inline const ConvolutionKernel& sobel_y_kernel() {
+    static const int32_t weights[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+    static const ConvolutionKernel kernel(3, weights);
+    return kernel;
+}
+
+inline const ConvolutionKernel& laplacian_kernel() {
+    static const int32_t weights[9] = {-1, -1, -1, -1, 8, -1, -1, -1, -1};
+    static const ConvolutionKernel kernel(3, weights);
+    return kernel;
+}
+
+// Unsharp 3x3 kernel: the pixel plus `amount` times its difference from its 4 neighbours
+inline ConvolutionKernel sharpen_kernel(float amount) {
+    const float weights[9] = {0, -amount, 0, -amount, 1 + 4 * amount, -amount, 0, -amount, 0};
+    return ConvolutionKernel::from_float(3, weights);
+}
+
+// Emboss lit from the top left; sums to 1, so flat areas keep their colour
+inline const ConvolutionKernel& emboss_kernel() {
+    static const int32_t weights[9] = {-2, -1, 0, -1, 1, 1, 0, 1, 2};
+    static const ConvolutionKernel kernel(3, weights);
+    return kernel;
+}
+
+/**
+ * Writes |gx| + |gy| of the Sobel gradients at each pixel of the row the
+ * (grayscale) window is centred on into magnitudes[0 .. width - 1], using
+ * `gy` (width values) as scratch, and returns the largest inside the 1 pixel
+ * border (at least 1).
+ */
+inline int sobel_magnitude_row(ConvolutionWindow& window, int16_t* magnitudes, int16_t* gy, int width) {
+    window.convolve(sobel_x_kernel(), magnitudes);
+    window.convolve(sobel_y_kernel(), gy);
+
+    // At most 2 * 4 * 255 each
+    for (int x = 0; x < width; ++x) {
+        magnitudes[x] = static_cast<int16_t>(std::abs(magnitudes[x]) + std::abs(gy[x]));
+    }
+
+    int16_t rowMax = 1;
+    for (int x = 1; x < width - 1; ++x) rowMax = std::max(rowMax, magnitudes[x]);
+    return rowMax;
+}
+
+/**
+ * Writes the amplified Laplacian of the row the (grayscale) window is
+ * centred on into the interior pixels (1 .. width - 2) of `row`, using `sums`
+ * (width values) as scratch. Border pixels and alpha are left unchanged.
+ */
+inline void laplacian_row(ConvolutionWindow& window, Pixel* row, int16_t* sums, int width) {
+    window.convolve(laplacian_kernel(), sums);
+    for (int x = 1; x < width - 1; ++x) {
+        // Amplify by 3 and clamp
+        const uint8_t edge = static_cast<uint8_t>(std::min(255, std::max(0, sums[x] * 3)));
+        row[x].r = row[x].g = row[x].b = edge;
+    }
+}
+
+/**
+ * Writes the colour channels of the row the (4 lane) window is centred on,
+ * filtered with `kernel` plus `bias`, to `row`; alpha is left unchanged.
+ * `sums` is scratch of 4 * width values.
+ */
+inline void kernel_row(ConvolutionWindow& window, const ConvolutionKernel& kernel, int bias, Pixel* row,
+                       int32_t* sums, int width) {
+    window.convolve(kernel, sums);
+    auto channel = [&](int32_t sum) {
+        return static_cast<uint8_t>(std::min(255, std::max(0, kernel.scale(sum) + bias)));
+    };
+    for (int x = 0; x < width; ++x) {
+        row[x].r = channel(sums[4 * x]);
+        row[x].g = channel(sums[4 * x + 1]);
+        row[x].b = channel(sums[4 * x + 2]);
+    }
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+/**
+ * Engine statistics
+ *
+ * Counters for the hot paths of the engine, to tell whether a slow operation
+ * is spent in a kernel, in compositing or in copying data in and out. Each
+ * probe is a named scope, either a whole exported operation, named after it
+ * ("gaussian_blur", "data_to_layer"), or a phase shared by several, named
+ * area.phase ("gaussian.horizontal", "sobel.gradient",
+ * "compositor.composite"), and accumulates:
+ *
+ *   calls     times the scope ran
+ *   time      wall time inside it, total and longest
+ *   pixels    pixels it processed
+ *   bytes     bytes it allocated or copied
+ *
+ * Phases are timed on the calling thread around their parallel loops, never
+ * per row or tile, so a probe costs two clock reads and a few relaxed atomic
+ * adds per operation. Phases nest inside their operation, so their times add
+ * up to less than (not on top of) the operation's.
+ *
+ * Building with ENGINE_STATS=0 (make STATS=0) compiles every probe out;
+ * get_engine_stats then reports no probes.
+ */
+
+#ifndef ENGINE_STATS
+#define ENGINE_STATS 1
+#endif
+
+class EngineStats {
+public:
+    static constexpr int MAX_PROBES = 64;
+
+    // Values per probe in a snapshot: calls, total ms, longest ms, pixels, bytes
+    static constexpr int FIELDS = 5;
+
+    static EngineStats& shared() {
+        static EngineStats stats;
+        return stats;
+    }
+
+    // Index of the probe called `name` (a string literal), registered on first use; -1 if full
+    int probe(const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const int count = probeCount.load(std::memory_order_relaxed);
+        for (int i = 0; i < count; ++i) {
+            if (std::strcmp(probes[i].name, name) == 0) return i;
+        }
+        if (count == MAX_PROBES) return -1;
+        probes[count].name = name;
+        probeCount.store(count + 1, std::memory_order_release);
+        return count;
+    }
+
+    void record(int index, uint64_t nanoseconds, uint64_t pixels, uint64_t bytes) {
+        if (index < 0) return;
+        Probe& p = probes[index];
+        p.calls.fetch_add(1, std::memory_order_relaxed);
+        p.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        p.pixels.fetch_add(pixels, std::memory_order_relaxed);
+        p.bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        uint64_t longest = p.longest.load(std::memory_order_relaxed);
+        while (nanoseconds > longest &&
+               !p.longest.compare_exchange_weak(longest, nanoseconds, std::memory_order_relaxed)) {
+        }
+    }
+
+    int size() const { return probeCount.load(std::memory_order_acquire); }
+
+    const char* name(int index) const { return index >= 0 && index < size() ? probes[index].name : ""; }
+
+    // FIELDS values of probe `index` into `out`
+    void snapshot(int index, double* out) const {
+        const Probe& p = probes[index];
+        out[0] = static_cast<double>(p.calls.load(std::memory_order_relaxed));
+        out[1] = static_cast<double>(p.nanoseconds.load(std::memory_order_relaxed)) / 1e6;
+        out[2] = static_cast<double>(p.longest.load(std::memory_order_relaxed)) / 1e6;
+        out[3] = static_cast<double>(p.pixels.load(std::memory_order_relaxed));
+        out[4] = static_cast<double>(p.bytes.load(std::memory_order_relaxed));
+    }
+
+    // Zero every counter; probes keep their indices
+    void reset() {
+        for (int i = 0; i < size(); ++i) {
+            Probe& p = probes[i];
+            p.calls.store(0, std::memory_order_relaxed);
+            p.nanoseconds.store(0, std::memory_order_relaxed);
+            p.longest.store(0, std::memory_order_relaxed);
+            p.pixels.store(0, std::memory_order_relaxed);
+            p.bytes.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Probe {
+        const char* name = "";
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> nanoseconds{0};
+        std::atomic<uint64_t> longest{0};
+        std::atomic<uint64_t> pixels{0};
+        std::atomic<uint64_t> bytes{0};
+    };
+
+    std::mutex mutex;
+    std::atomic<int> probeCount{0};
+    Probe probes[MAX_PROBES];
+};
+
+#if ENGINE_STATS
+
+/**
+ * Times its own lifetime into one probe, with the pixels and bytes passed to
+ * `add` while it lives.
+ */
+class ScopedStat {
+public:
+    explicit ScopedStat(int probe) : probe(probe), start(std::chrono::steady_clock::now()) {}
+
+    ScopedStat(const ScopedStat&) = delete;
+    ScopedStat& operator=(const ScopedStat&) = delete;
+
+    ~ScopedStat() {
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        EngineStats::shared().record(
+            probe, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+            pixels, bytes);
+    }
+
+    void add(uint64_t morePixels, uint64_t moreBytes = 0) {
+        pixels += morePixels;
+        bytes += moreBytes;
+    }
+
+private:
+    int probe;
+    std::chrono::steady_clock::time_point start;
+    uint64_t pixels = 0;
+    uint64_t bytes = 0;
+};
+
+// Declare ScopedStat `var` timing the rest of the enclosing scope as probe `name`
+#define ENGINE_STAT(var, name)                                                  \
+    static const int var##_probe = EngineStats::shared().probe(name);           \
+    ScopedStat var(var##_probe)
+
+#else
+
+class ScopedStat {
+public:
+    ScopedStat() {}
+    void add(uint64_t, uint64_t = 0) {}
+};
+
+#define ENGINE_STAT(var, name) ScopedStat var
+
+#endif
@@ -0,0 +1,440 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include "layer.h"
+#include "integer_kernels.h"
+#include "scratch_arena.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Row-level filter primitives
+ *
+ * The per-row building blocks of the layer filters. The whole-layer kernels in
+ * image_processor.cpp and the fused pipeline (pipeline.h) are both built from
+ * these, so a filter gives bit-identical results however it is run.
+ */
+
+/**
+ * Monochrome functions
+ *
+ * Various methods to convert RGB pixels to grayscale, all in integers. These
+ * define the methods; layers are converted by the compiled tables of
+ * point_ops.h, which give the same results.
+ */
+
+using GrayscaleFn = uint8_t (*)(uint8_t, uint8_t, uint8_t);
+
+inline uint8_t grayscale_average(uint8_t r, uint8_t g, uint8_t b) {
+    return static_cast<uint8_t>((r + g + b) / 3);
+}
+
+inline uint8_t grayscale_luminosity(uint8_t r, uint8_t g, uint8_t b) {
+    return static_cast<uint8_t>((299 * r + 587 * g + 114 * b) / 1000);
+}
+
+inline uint8_t grayscale_lightness(uint8_t r, uint8_t g, uint8_t b) {
+    return static_cast<uint8_t>((std::max({r, g, b}) + std::min({r, g, b})) / 2);
+}
+
+inline uint8_t grayscale_itu(uint8_t r, uint8_t g, uint8_t b) {
+    return static_cast<uint8_t>((2126 * r + 7152 * g + 722 * b) / 10000);
+}
+
+/**
+ * Gaussian blur
+ */
+
+// Blurs with sigma >= BOX_BLUR_MIN_SIGMA whose kernel reaches at least
+// BOX_BLUR_MIN_SPREAD sigmas on each side use the stacked box blur (box_blur.h)
+constexpr double BOX_BLUR_MIN_SIGMA = 5.0;
+constexpr double BOX_BLUR_MIN_SPREAD = 2.0;
+
+// Kernel sizes are always odd; even sizes are rounded up
+inline int gaussian_kernel_size(int kernelSize) {
+    return kernelSize % 2 == 0 ? kernelSize + 1 : kernelSize;
+}
+
+inline bool use_box_blur(double sigma, int kernelSize) {
+    int halfKernel = gaussian_kernel_size(kernelSize) / 2;
+    return sigma >= BOX_BLUR_MIN_SIGMA && halfKernel >= BOX_BLUR_MIN_SPREAD * sigma;
+}
+
+// Normalized 1D Gaussian kernel of the given (odd) size, into kernel[0 .. kernelSize - 1]
+inline void gaussian_kernel(double sigma, int kernelSize, float* kernel) {
+    int halfKernel = kernelSize / 2;
+    float denom = 2.0f * sigma * sigma;
+    float sum = 0.0f;
+
+    for (int i = 0; i < kernelSize; ++i) {
+        int x = i - halfKernel;
+        kernel[i] = std::exp(-(x * x) / denom);
+        sum += kernel[i];
+    }
+    for (int i = 0; i < kernelSize; ++i) kernel[i] /= sum;
+}
+
+inline double gaussian_kernel_variance(const float* kernel, int kernelSize) {
+    int halfKernel = kernelSize / 2;
+    double variance = 0.0;
+    for (int i = 0; i < kernelSize; ++i) {
+        int x = i - halfKernel;
+        variance += kernel[i] * x * x;
+    }
+    return variance;
+}
+
+/**
+ * Fixed-point kernel for the integer mode (see integer_kernels.h): weights
+ * with GAUSSIAN_FIXED_BITS fractional bits that sum to exactly
+ * GAUSSIAN_FIXED_ONE, so a flat area stays flat.
+ */
+constexpr int GAUSSIAN_FIXED_BITS = 16;
+constexpr int32_t GAUSSIAN_FIXED_ONE = 1 << GAUSSIAN_FIXED_BITS;
+
+/**
+ * e^x for x <= 0, from + * / only, whose results IEEE 754 fixes exactly, so
+ * every engine computes the same weights. Taylor series of e^(x / 1024),
+ * squared 10 times.
+ */
+inline double reproducible_exp(double x) {
+    if (!(x > -700.0)) return 0.0;
+
+    const double y = x / 1024.0;
+    double term = 1.0;
+    double sum = 1.0;
+    for (int n = 1; n < 18; ++n) {
+        term = term * y / n;
+        sum = sum + term;
+    }
+    for (int i = 0; i < 10; ++i) sum = sum * sum;
+    return sum;
+}
+
+// The fixed-point kernel of the given (odd) size, into kernel[0 .. kernelSize - 1]
+inline void gaussian_kernel_fixed(double sigma, int kernelSize, int32_t* kernel) {
+    const int halfKernel = kernelSize / 2;
+    const double denom = 2.0 * sigma * sigma;
+    if (!(denom > 0.0)) {
+        std::fill(kernel, kernel + kernelSize, 0);
+        kernel[halfKernel] = GAUSSIAN_FIXED_ONE;
+        return;
+    }
+
+    // The exps are recomputed when rounding rather than kept; they are exact
+    double sum = 0.0;
+    for (int i = 0; i < kernelSize; ++i) {
+        const int x = i - halfKernel;
+        sum += reproducible_exp(-(x * x) / denom);
+    }
+
+    // Round each weight, and give the rounding error to the centre tap
+    int32_t total = 0;
+    for (int i = 0; i < kernelSize; ++i) {
+        const int x = i - halfKernel;
+        kernel[i] = static_cast<int32_t>(std::lround(reproducible_exp(-(x * x) / denom) * GAUSSIAN_FIXED_ONE / sum));
+        total += kernel[i];
+    }
+    kernel[halfKernel] += GAUSSIAN_FIXED_ONE - total;
+}
+
+inline double gaussian_kernel_variance(const int32_t* kernel, int kernelSize) {
+    const int halfKernel = kernelSize / 2;
+    int64_t moment = 0;
+    for (int i = 0; i < kernelSize; ++i) {
+        const int64_t x = i - halfKernel;
+        moment += kernel[i] * x * x;
+    }
+    return static_cast<double>(moment) / GAUSSIAN_FIXED_ONE;
+}
+
+// Variance of the Gaussian kernel the current kernel mode blurs with
+inline double gaussian_variance(double sigma, int kernelSize) {
+    kernelSize = gaussian_kernel_size(kernelSize);
+    ScratchScope scratch;
+    if (integer_kernels()) {
+        int32_t* kernel = scratch.allocate<int32_t>(kernelSize);
+        gaussian_kernel_fixed(sigma, kernelSize, kernel);
+        return gaussian_kernel_variance(kernel, kernelSize);
+    }
+    float* kernel = scratch.allocate<float>(kernelSize);
+    gaussian_kernel(sigma, kernelSize, kernel);
+    return gaussian_kernel_variance(kernel, kernelSize);
+}
+
+inline uint8_t gaussian_fixed_store(int32_t sum) {
+    return static_cast<uint8_t>(std::min(255, std::max(0, (sum + GAUSSIAN_FIXED_ONE / 2) >> GAUSSIAN_FIXED_BITS)));
+}
+
+// Horizontal pass of the fixed-point kernel over one row, repeating the edge pixels
+inline void gaussian_fixed_row_horizontal(const Pixel* in, Pixel* out, int width,
+                                          const int32_t* kernel, int halfKernel) {
+    const int taps = 2 * halfKernel + 1;
+    for (int x = 0; x < width; ++x) {
+        int32_t r = 0, g = 0, b = 0, a = 0;
+        if (x >= halfKernel && x + halfKernel < width) {
+            const Pixel* window = in + x - halfKernel;
+            for (int k = 0; k < taps; ++k) {
+                const int32_t coeff = kernel[k];
+                r += window[k].r * coeff;
+                g += window[k].g * coeff;
+                b += window[k].b * coeff;
+                a += window[k].a * coeff;
+            }
+        } else {
+            for (int k = -halfKernel; k <= halfKernel; ++k) {
+                const Pixel& p = in[std::min(std::max(x + k, 0), width - 1)];
+                const int32_t coeff = kernel[k + halfKernel];
+                r += p.r * coeff;
+                g += p.g * coeff;
+                b += p.b * coeff;
+                a += p.a * coeff;
+            }
+        }
+        out[x] = Pixel(gaussian_fixed_store(r), gaussian_fixed_store(g), gaussian_fixed_store(b),
+                       gaussian_fixed_store(a));
+    }
+}
+
+// Vertical pass of the fixed-point kernel; rows[k] is the input row at offset k - halfKernel
+inline void gaussian_fixed_row_vertical(const Pixel* const* rows, Pixel* out, int width,
+                                        const int32_t* kernel, int halfKernel) {
+    const int taps = 2 * halfKernel + 1;
+    for (int x = 0; x < width; ++x) {
+        int32_t r = 0, g = 0, b = 0, a = 0;
+        for (int k = 0; k < taps; ++k) {
+            const Pixel& p = rows[k][x];
+            const int32_t coeff = kernel[k];
+            r += p.r * coeff;
+            g += p.g * coeff;
+            b += p.b * coeff;
+            a += p.a * coeff;
+        }
+        out[x] = Pixel(gaussian_fixed_store(r), gaussian_fixed_store(g), gaussian_fixed_store(b),
+                       gaussian_fixed_store(a));
+    }
+}
+
+inline uint8_t gaussian_clamp(float value) {
+    return static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, value)));
+}
+
+/**
+ * Horizontal pass over pixels [x0, x1) of one row, repeating the edge pixels.
+ * `kernel` has 2 * halfKernel + 1 taps.
+ */
+inline void gaussian_blur_span_horizontal(const Pixel* in, Pixel* out, int width,
+                                          const float* kernel, int halfKernel, int x0, int x1) {
+    for (int x = x0; x < x1; ++x) {
+        float r = 0, g = 0, b = 0, a = 0;
+
+        for (int k = -halfKernel; k <= halfKernel; ++k) {
+            int sampleX = x + k;
+            if (sampleX < 0) sampleX = 0;
+            else if (sampleX >= width) sampleX = width - 1;
+
+            float coeff = kernel[k + halfKernel];
+            const Pixel& p = in[sampleX];
+            r += p.r * coeff;
+            g += p.g * coeff;
+            b += p.b * coeff;
+            a += p.a * coeff;
+        }
+
+        out[x] = Pixel(gaussian_clamp(r), gaussian_clamp(g), gaussian_clamp(b), gaussian_clamp(a));
+    }
+}
+
+// Horizontal pass over a whole row
+inline void gaussian_blur_row_horizontal(const Pixel* in, Pixel* out, int width,
+                                         const float* kernel, int halfKernel) {
+    gaussian_blur_span_horizontal(in, out, width, kernel, halfKernel, 0, width);
+}
+
+/**
+ * Vertical pass producing one row. rows[k] is the input row at offset
+ * k - halfKernel from the output row, already clamped to the image.
+ */
+inline void gaussian_blur_row_vertical(const Pixel* const* rows, Pixel* out, int width,
+                                       const float* kernel, int halfKernel) {
+    for (int x = 0; x < width; ++x) {
+        float r = 0, g = 0, b = 0, a = 0;
+
+        for (int k = -halfKernel; k <= halfKernel; ++k) {
+            float coeff = kernel[k + halfKernel];
+            const Pixel& p = rows[k + halfKernel][x];
+
+            r += p.r * coeff;
+            g += p.g * coeff;
+            b += p.b * coeff;
+            a += p.a * coeff;
+        }
+
+        out[x] = Pixel(gaussian_clamp(r), gaussian_clamp(g), gaussian_clamp(b), gaussian_clamp(a));
+    }
+}
+
+/**
+ * Unrolled Gaussian passes
+ *
+ * The common kernel sizes get fixed-size versions of both passes, with the
+ * taps unrolled at compile time and the weights (which depend on sigma) held
+ * in locals for the whole row. Taps are summed in the same order as in the
+ * generic loops, so the results are bit-identical.
+ */
+
+using GaussianRowHorizontalFn = void (*)(const Pixel*, Pixel*, int, const float*, int);
+using GaussianRowVerticalFn = void (*)(const Pixel* const*, Pixel*, int, const float*, int);
+
+struct GaussianRowKernels {
+    GaussianRowHorizontalFn horizontal;
+    GaussianRowVerticalFn vertical;
+};
+
+/**
+ * Running weighted sum of the four channels of a pixel. The SIMD versions keep
+ * the channels in one float vector; lane by lane they do the same multiplies
+ * and adds as the scalar version.
+ */
+#if defined(__wasm_simd128__)
+
+struct GaussianSum {
+    v128_t sum = wasm_f32x4_splat(0.0f);
+
+    void add(const Pixel& p, float coeff) {
+        v128_t v = wasm_v128_load32_zero(&p);
+        v = wasm_f32x4_convert_i32x4(wasm_u32x4_extend_low_u16x8(wasm_u16x8_extend_low_u8x16(v)));
+        sum = wasm_f32x4_add(sum, wasm_f32x4_mul(v, wasm_f32x4_splat(coeff)));
+    }
+
+    Pixel pixel() const {
+        v128_t v = wasm_f32x4_min(wasm_f32x4_splat(255.0f), wasm_f32x4_max(wasm_f32x4_splat(0.0f), sum));
+        v = wasm_i32x4_trunc_sat_f32x4(v);
+        v = wasm_u8x16_narrow_i16x8(wasm_i16x8_narrow_i32x4(v, v), v);
+        Pixel p;
+        wasm_v128_store32_lane(&p, v, 0);
+        return p;
+    }
+};
+
+#elif defined(__SSE2__)
+
+struct GaussianSum {
+    __m128 sum = _mm_setzero_ps();
+
+    void add(const Pixel& p, float coeff) {
+        int32_t packed;
+        std::memcpy(&packed, &p, sizeof(packed));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(coeff)));
+    }
+
+    Pixel pixel() const {
+        __m128i v = _mm_cvttps_epi32(_mm_min_ps(_mm_set1_ps(255.0f), _mm_max_ps(_mm_setzero_ps(), sum)));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        int32_t packed = _mm_cvtsi128_si32(v);
+        Pixel p;
+        std::memcpy(static_cast<void*>(&p), &packed, sizeof(p));
+        return p;
+    }
+};
+
+#else
+
+struct GaussianSum {
+    float r = 0, g = 0, b = 0, a = 0;
+
+    void add(const Pixel& p, float coeff) {
+        r += p.r * coeff;
+        g += p.g * coeff;
+        b += p.b * coeff;
+        a += p.a * coeff;
+    }
+
+    Pixel pixel() const {
+        return Pixel(gaussian_clamp(r), gaussian_clamp(g), gaussian_clamp(b), gaussian_clamp(a));
+    }
+};
+
+#endif
+
+// Taps in[0 .. N-1], weighted by w
+template <std::size_t... K>
+inline Pixel gaussian_taps(const Pixel* in, const float* w, std::index_sequence<K...>) {
+    GaussianSum sum;
+    (sum.add(in[K], w[K]), ...);
+    return sum.pixel();
+}
+
+// Taps rows[0 .. N-1][x], weighted by w
+template <std::size_t... K>
+inline Pixel gaussian_taps(const Pixel* const* rows, int x, const float* w, std::index_sequence<K...>) {
+    GaussianSum sum;
+    (sum.add(rows[K][x], w[K]), ...);
+    return sum.pixel();
+}
+
+template <int HALF>
+void gaussian_blur_row_horizontal_fixed(const Pixel* in, Pixel* out, int width,
+                                        const float* kernel, int /*halfKernel*/) {
+    constexpr int SIZE = 2 * HALF + 1;
+    float w[SIZE];
+    std::copy(kernel, kernel + SIZE, w);
+
+    // Only pixels within HALF of an edge need clamped samples
+    const int interiorBegin = std::min(HALF, width);
+    const int interiorEnd = std::max(interiorBegin, width - HALF);
+
+    gaussian_blur_span_horizontal(in, out, width, kernel, HALF, 0, interiorBegin);
+    for (int x = interiorBegin; x < interiorEnd; ++x) {
+        out[x] = gaussian_taps(in + x - HALF, w, std::make_index_sequence<SIZE>());
+    }
+    gaussian_blur_span_horizontal(in, out, width, kernel, HALF, interiorEnd, width);
+}
+
+template <int HALF>
+void gaussian_blur_row_vertical_fixed(const Pixel* const* rows, Pixel* out, int width,
+                                      const float* kernel, int /*halfKernel*/) {
+    constexpr int SIZE = 2 * HALF + 1;
+    float w[SIZE];
+    const Pixel* taps[SIZE];
+    std::copy(kernel, kernel + SIZE, w);
+    std::copy(rows, rows + SIZE, taps);
+
+    for (int x = 0; x < width; ++x) {
+        out[x] = gaussian_taps(taps, x, w, std::make_index_sequence<SIZE>());
+    }
+}
+
+/**
+ * Row passes for a kernel of 2 * halfKernel + 1 taps: the unrolled versions
+ * for sizes 3 to 15, the generic loops for any other size.
+ */
+inline GaussianRowKernels gaussian_row_kernels(int halfKernel) {
+    static const GaussianRowKernels generic = {gaussian_blur_row_horizontal, gaussian_blur_row_vertical};
+
+    // Indexed by halfKernel
+    static const GaussianRowKernels table[] = {
+        generic,
+        {gaussian_blur_row_horizontal_fixed<1>, gaussian_blur_row_vertical_fixed<1>},
+        {gaussian_blur_row_horizontal_fixed<2>, gaussian_blur_row_vertical_fixed<2>},
+        {gaussian_blur_row_horizontal_fixed<3>, gaussian_blur_row_vertical_fixed<3>},
+        {gaussian_blur_row_horizontal_fixed<4>, gaussian_blur_row_vertical_fixed<4>},
+        {gaussian_blur_row_horizontal_fixed<5>, gaussian_blur_row_vertical_fixed<5>},
+        {gaussian_blur_row_horizontal_fixed<6>, gaussian_blur_row_vertical_fixed<6>},
+        {gaussian_blur_row_horizontal_fixed<7>, gaussian_blur_row_vertical_fixed<7>},
+    };
+    constexpr int tableSize = sizeof(table) / sizeof(table[0]);
+
+    if (halfKernel < 0 || halfKernel >= tableSize) return generic;
+    return table[halfKernel];
+}
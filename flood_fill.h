@@ -0,0 +1,411 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <list>
+#include <utility>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+#include "integer_kernels.h"
+#include "scratch_arena.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Scanline flood fill
+ *
+ * The region filled by the bucket tool is the 4-connected set of pixels
+ * around the seed whose colour is within the threshold of the seed pixel. It
+ * is found one horizontal span at a time: a seed pixel is extended left and
+ * right as far as the colour matches, and the rows above and below the span
+ * are scanned for matching pixels that become the seeds of new spans. The
+ * stack holds one entry per span rather than one per pixel, and visited pixels
+ * are tracked in a bitset (one bit per pixel, rows padded to whole words).
+ *
+ * The region is kept as a list of runs, sorted by row, which is then blended
+ * span by span. Regions are also cached (see FillCache), so clicking again on
+ * a region that was just filled, e.g. to try another colour, skips the search.
+ */
+
+// Pixels x0 .. x1 - 1 of row y
+struct FillRun {
+    int y;
+    int x0;
+    int x1;
+};
+
+struct FillRegion {
+    // Sorted by row, then by x0. Runs on the same row never touch.
+    std::vector<FillRun> runs;
+
+    // runs[rowStart[y - minY] .. rowStart[y - minY + 1]) are the runs of row y
+    std::vector<uint32_t> rowStart;
+
+    // Bounding box, inclusive
+    int minX = 0, minY = 0, maxX = -1, maxY = -1;
+
+    bool empty() const { return runs.empty(); }
+
+    size_t pixel_count() const {
+        size_t count = 0;
+        for (const FillRun& run : runs) count += static_cast<size_t>(run.x1 - run.x0);
+        return count;
+    }
+
+    std::pair<const FillRun*, const FillRun*> row_runs(int y) const {
+        if (y < minY || y > maxY) return {nullptr, nullptr};
+        const FillRun* base = runs.data();
+        return {base + rowStart[y - minY], base + rowStart[y - minY + 1]};
+    }
+
+    bool contains(int x, int y) const {
+        std::pair<const FillRun*, const FillRun*> row = row_runs(y);
+        const FillRun* run = std::upper_bound(row.first, row.second, x,
+                                              [](int value, const FillRun& r) { return value < r.x0; });
+        return run != row.first && x < (run - 1)->x1;
+    }
+
+    // Sort the runs and build the row index
+    void finish() {
+        std::sort(runs.begin(), runs.end(), [](const FillRun& a, const FillRun& b) {
+            return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+        });
+
+        rowStart.assign(static_cast<size_t>(maxY - minY + 2), 0);
+        for (const FillRun& run : runs) ++rowStart[run.y - minY + 1];
+        for (size_t i = 1; i < rowStart.size(); ++i) rowStart[i] += rowStart[i - 1];
+    }
+};
+
+// Helper function - check if within error threshold
+inline bool pixel_within_threshold_fast(const Pixel& p1, const Pixel& p2, float threshold_sq) {
+    int dr = p1.r - p2.r;
+    int dg = p1.g - p2.g;
+    int db = p1.b - p2.b;
+    int da = p1.a - p2.a;
+
+    int dist_sq = dr * dr + dg * dg + db * db + da * da;
+    return dist_sq <= threshold_sq;
+}
+
+// Normalize threshold: scale [0,100] to [0, 255^2*4]
+inline float fill_threshold_sq(float error_threshold) {
+    int max_channel_distance = 255;
+    float max_possible_sq = 4.0f * max_channel_distance * max_channel_distance;
+    return (error_threshold / 100.0f) * max_possible_sq;
+}
+
+// One bit per pixel, all clear, in memory from `scratch`
+class FillBitset {
+public:
+    FillBitset(ScratchScope& scratch, int width, int height)
+        : wordsPerRow((width + 63) / 64), bits(scratch.allocate<uint64_t>(static_cast<size_t>(wordsPerRow) * height)) {
+        std::memset(bits, 0, static_cast<size_t>(wordsPerRow) * height * sizeof(uint64_t));
+    }
+
+    bool test(int x, int y) const {
+        return (word(y, x) >> (x & 63)) & 1;
+    }
+
+    // Set bits x0 .. x1 - 1 of row y
+    void set_span(int y, int x0, int x1) {
+        for (int w = x0 >> 6; w <= (x1 - 1) >> 6; ++w) {
+            int lo = std::max(x0, w * 64) - w * 64;
+            int hi = std::min(x1, w * 64 + 64) - w * 64;
+            uint64_t mask = (hi == 64 ? ~uint64_t(0) : (uint64_t(1) << hi) - 1) & ~((uint64_t(1) << lo) - 1);
+            bits[static_cast<size_t>(y) * wordsPerRow + w] |= mask;
+        }
+    }
+
+private:
+    int wordsPerRow;
+    uint64_t* bits;
+
+    uint64_t word(int y, int x) const { return bits[static_cast<size_t>(y) * wordsPerRow + (x >> 6)]; }
+};
+
+/**
+ * Region filled by a click at (x, y): the pixels connected to it whose colour
+ * is within `threshold_sq` of its colour. Empty if even the seed pixel does
+ * not qualify (a negative threshold).
+ */
+inline FillRegion fill_region(const Layer& layer, int x, int y, float threshold_sq) {
+    FillRegion region;
+    const int width = layer.width();
+    const int height = layer.height();
+    const Pixel ref = layer.pixels.at(x, y);
+
+    auto matches = [&](const Pixel& p) { return pixel_within_threshold_fast(p, ref, threshold_sq); };
+    if (!matches(ref)) return region;
+
+    // The search runs in scratch memory; only the region itself is allocated
+    ScratchScope scratch;
+    FillBitset visited(scratch, width, height);
+    ScratchStack<std::pair<int, int>> seeds(scratch);
+    ScratchStack<FillRun> runs(scratch);
+    seeds.push({x, y});
+    region.minX = region.maxX = x;
+    region.minY = region.maxY = y;
+
+    while (!seeds.empty()) {
+        auto [sx, sy] = seeds.pop();
+        if (visited.test(sx, sy)) continue;
+
+        // Extend the span as far as the colour matches. Its neighbours on this
+        // row cannot have been visited, or the span would already be filled.
+        const Pixel* row = layer.pixels.row(sy);
+        int x0 = sx, x1 = sx + 1;
+        while (x0 > 0 && matches(row[x0 - 1])) --x0;
+        while (x1 < width && matches(row[x1])) ++x1;
+
+        visited.set_span(sy, x0, x1);
+        runs.push({sy, x0, x1});
+        region.minX = std::min(region.minX, x0);
+        region.maxX = std::max(region.maxX, x1 - 1);
+        region.minY = std::min(region.minY, sy);
+        region.maxY = std::max(region.maxY, sy);
+
+        // One seed per stretch of matching, unvisited pixels above and below
+        for (int ny : {sy - 1, sy + 1}) {
+            if (ny < 0 || ny >= height) continue;
+            const Pixel* next = layer.pixels.row(ny);
+            for (int nx = x0; nx < x1; ++nx) {
+                if (visited.test(nx, ny) || !matches(next[nx])) continue;
+                seeds.push({nx, ny});
+                while (nx + 1 < x1 && !visited.test(nx + 1, ny) && matches(next[nx + 1])) ++nx;
+            }
+        }
+    }
+
+    region.runs.assign(runs.begin(), runs.end());
+    region.finish();
+    return region;
+}
+
+/**
+ * Blend `color` over one pixel with the "over" operator, in float (the
+ * original bucket fill arithmetic).
+ */
+inline void fill_blend_pixel(Pixel& cur_pixel, const Pixel& color) {
+    float src_a = color.a / 255.0f;
+    float dst_a = cur_pixel.a / 255.0f;
+    float out_a = src_a + dst_a * (1.0f - src_a);
+
+    if (out_a > 0.0f) {
+        cur_pixel.r = static_cast<uint8_t>((color.r * src_a + cur_pixel.r * dst_a * (1.0f - src_a)) / out_a);
+        cur_pixel.g = static_cast<uint8_t>((color.g * src_a + cur_pixel.g * dst_a * (1.0f - src_a)) / out_a);
+        cur_pixel.b = static_cast<uint8_t>((color.b * src_a + cur_pixel.b * dst_a * (1.0f - src_a)) / out_a);
+        cur_pixel.a = static_cast<uint8_t>(out_a * 255.0f);
+    }
+}
+
+/**
+ * The same blend in integers, for the integer mode (integer_kernels.h): the
+ * float formula with every term scaled by 255^2, truncated the same way.
+ */
+inline void fill_blend_pixel_integer(Pixel& cur_pixel, const Pixel& color) {
+    const uint32_t src_a = color.a * 255u;
+    const uint32_t dst_a = cur_pixel.a * (255u - color.a);
+    const uint32_t out_a = src_a + dst_a;
+
+    if (out_a > 0) {
+        cur_pixel.r = static_cast<uint8_t>((color.r * src_a + cur_pixel.r * dst_a) / out_a);
+        cur_pixel.g = static_cast<uint8_t>((color.g * src_a + cur_pixel.g * dst_a) / out_a);
+        cur_pixel.b = static_cast<uint8_t>((color.b * src_a + cur_pixel.b * dst_a) / out_a);
+        cur_pixel.a = static_cast<uint8_t>(out_a / 255u);
+    }
+}
+
+/**
+ * Blend `color` over a span of pixels. An opaque colour simply replaces them.
+ * Otherwise the SIMD versions blend one pixel per vector, doing the same float
+ * operations as fill_blend_pixel in each lane, so the results are identical.
+ */
+inline void fill_blend_span(Pixel* pixels, int count, const Pixel& color) {
+    if (color.a == 255) {
+        std::fill(pixels, pixels + count, color);
+        return;
+    }
+    if (integer_kernels()) {
+        for (int i = 0; i < count; ++i) fill_blend_pixel_integer(pixels[i], color);
+        return;
+    }
+
+#if defined(__wasm_simd128__)
+    const float src_a = color.a / 255.0f;
+    const v128_t srcA = wasm_f32x4_splat(src_a);
+    const v128_t inv = wasm_f32x4_splat(1.0f - src_a);
+    const v128_t src = wasm_f32x4_mul(wasm_f32x4_make(color.r, color.g, color.b, 0.0f), srcA);
+    const v128_t scale = wasm_f32x4_splat(255.0f);
+
+    for (int i = 0; i < count; ++i) {
+        v128_t c = wasm_v128_load32_zero(pixels + i);
+        c = wasm_f32x4_convert_i32x4(wasm_u32x4_extend_low_u16x8(wasm_u16x8_extend_low_u8x16(c)));
+        v128_t dstA = wasm_f32x4_div(wasm_i32x4_shuffle(c, c, 3, 3, 3, 3), scale);
+        v128_t outA = wasm_f32x4_add(srcA, wasm_f32x4_mul(dstA, inv));
+        if (!(wasm_f32x4_extract_lane(outA, 0) > 0.0f)) continue;
+
+        v128_t color4 = wasm_f32x4_div(wasm_f32x4_add(src, wasm_f32x4_mul(wasm_f32x4_mul(c, dstA), inv)), outA);
+        v128_t v = wasm_i32x4_shuffle(color4, wasm_f32x4_mul(outA, scale), 0, 1, 2, 7);
+        v = wasm_i32x4_trunc_sat_f32x4(v);
+        v = wasm_u8x16_narrow_i16x8(wasm_i16x8_narrow_i32x4(v, v), v);
+        wasm_v128_store32_lane(pixels + i, v, 0);
+    }
+#elif defined(__SSE2__)
+    const float src_a = color.a / 255.0f;
+    const __m128 srcA = _mm_set1_ps(src_a);
+    const __m128 inv = _mm_set1_ps(1.0f - src_a);
+    const __m128 src = _mm_mul_ps(_mm_setr_ps(color.r, color.g, color.b, 0.0f), srcA);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 colorMask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int i = 0; i < count; ++i) {
+        int32_t packed;
+        std::memcpy(&packed, pixels + i, sizeof(packed));
+        __m128 c = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero));
+        __m128 dstA = _mm_div_ps(_mm_shuffle_ps(c, c, 0xFF), scale);
+        __m128 outA = _mm_add_ps(srcA, _mm_mul_ps(dstA, inv));
+        if (!(_mm_cvtss_f32(outA) > 0.0f)) continue;
+
+        __m128 color4 = _mm_div_ps(_mm_add_ps(src, _mm_mul_ps(_mm_mul_ps(c, dstA), inv)), outA);
+        __m128 v = _mm_or_ps(_mm_and_ps(colorMask, color4), _mm_andnot_ps(colorMask, _mm_mul_ps(outA, scale)));
+        __m128i out = _mm_cvttps_epi32(v);
+        out = _mm_packus_epi16(_mm_packs_epi32(out, out), out);
+        packed = _mm_cvtsi128_si32(out);
+        std::memcpy(static_cast<void*>(pixels + i), &packed, sizeof(packed));
+    }
+#else
+    for (int i = 0; i < count; ++i) fill_blend_pixel(pixels[i], color);
+#endif
+}
+
+// Blend `color` over every pixel of `region`, rows in parallel
+inline void fill_region_blend(Layer& layer, const FillRegion& region, const Pixel& color) {
+    if (region.empty()) return;
+
+    ThreadPool::shared().parallel_for(region.minY, region.maxY + 1, row_grain(region.maxX - region.minX + 1),
+                                      [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            Pixel* row = layer.pixels.row(y);
+            std::pair<const FillRun*, const FillRun*> runs = region.row_runs(y);
+            for (const FillRun* run = runs.first; run != runs.second; ++run) {
+                fill_blend_span(row + run->x0, run->x1 - run->x0, color);
+            }
+        }
+    });
+}
+
+/**
+ * Recently filled regions
+ *
+ * After an opaque fill, every pixel of the region has the fill colour, and the
+ * layer has changed nowhere else. A later click inside the region, at the same
+ * threshold, fills the same region again unless some pixel bordering it is
+ * within the threshold of the new colour (then the region grows), which only
+ * takes a walk around the border to rule out. Entries are keyed on the layer
+ * (uid and version, so any other edit invalidates them) and the threshold.
+ *
+ * Regions left by a translucent fill are not uniform, so they are not kept.
+ */
+class FillCache {
+public:
+    static constexpr size_t MAX_ENTRIES = 4;
+
+    // Regions with more runs than this are not kept (12 bytes per run)
+    static constexpr size_t MAX_RUNS = 1 << 20;
+
+    static FillCache& shared() {
+        static FillCache cache;
+        return cache;
+    }
+
+    /**
+     * If a cached region is exactly what a click at (x, y) would fill, move it
+     * into `region` and return true.
+     */
+    bool take(const Layer& layer, int x, int y, float threshold_sq, FillRegion& region) {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->uid != layer.uid || it->threshold_sq != threshold_sq) continue;
+            if (it->version != layer.version || !it->region.contains(x, y)) continue;
+
+            bool exact = border_excluded(layer, it->region, it->color, threshold_sq);
+            if (exact) region = std::move(it->region);
+            entries.erase(it);
+            return exact;
+        }
+        return false;
+    }
+
+    // Remember `region`, just filled with the opaque `color`
+    void store(const Layer& layer, float threshold_sq, const Pixel& color, FillRegion&& region) {
+        if (color.a != 255 || region.empty() || region.runs.size() > MAX_RUNS) return;
+
+        entries.remove_if([&](const Entry& e) { return e.uid == layer.uid; });
+        entries.push_front({layer.uid, layer.version, threshold_sq, color, std::move(region)});
+        if (entries.size() > MAX_ENTRIES) entries.pop_back();
+    }
+
+    void clear() { entries.clear(); }
+
+private:
+    struct Entry {
+        uint64_t uid;
+        uint32_t version;
+        float threshold_sq;
+        Pixel color;
+        FillRegion region;
+    };
+
+    // Most recent first
+    std::list<Entry> entries;
+
+    /**
+     * True if no pixel 4-adjacent to the region (and outside it) is within the
+     * threshold of `color`.
+     */
+    static bool border_excluded(const Layer& layer, const FillRegion& region, const Pixel& color,
+                                float threshold_sq) {
+        const int width = layer.width();
+        const int height = layer.height();
+        auto outside_ok = [&](int x, int y) {
+            return !pixel_within_threshold_fast(layer.pixels.at(x, y), color, threshold_sq);
+        };
+
+        for (int y = region.minY; y <= region.maxY; ++y) {
+            std::pair<const FillRun*, const FillRun*> runs = region.row_runs(y);
+
+            for (const FillRun* run = runs.first; run != runs.second; ++run) {
+                // Runs are maximal, so the pixels either side are outside the region
+                if (run->x0 > 0 && !outside_ok(run->x0 - 1, y)) return false;
+                if (run->x1 < width && !outside_ok(run->x1, y)) return false;
+            }
+
+            // Pixels above and below the row's runs that the neighbouring row's runs do not cover
+            for (int ny : {y - 1, y + 1}) {
+                if (ny < 0 || ny >= height) continue;
+                std::pair<const FillRun*, const FillRun*> other = region.row_runs(ny);
+                const FillRun* o = other.first;
+
+                for (const FillRun* run = runs.first; run != runs.second; ++run) {
+                    int x = run->x0;
+                    while (x < run->x1) {
+                        while (o != other.second && o->x1 <= x) ++o;
+                        int end = (o != other.second) ? std::min(run->x1, o->x0) : run->x1;
+                        for (; x < end; ++x) {
+                            if (!outside_ok(x, ny)) return false;
+                        }
+                        if (o != other.second && x >= o->x0) x = o->x1;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+};
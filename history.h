@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+#include "engine_stats.h"
+#include "plane_cache.h"
+
+/**
+ * Undo / redo history
+ *
+ * Every destructive operation on a layer is recorded as one entry, holding
+ * only the Layer::TILE_SIZE tiles the operation actually changed, as they
+ * were before it. Undoing an entry swaps those tiles with the layer's current
+ * ones, so the entry then holds what redo needs to put back. Both cost
+ * O(changed tiles), and tiles that never change are never copied.
+ *
+ * An operation is bracketed by `begin` and `commit`. In between, before it
+ * writes to a region, it calls `capture` for that region: tiles are copied on
+ * their first capture only (copy on write). Operations that replace the
+ * layer's buffer instead hand the old buffer to `keep_previous`. `commit`
+ * drops every captured tile whose pixels came out unchanged, e.g. the
+ * transparent tiles of a layer turned to grayscale.
+ *
+ * Entries are kept under a byte budget: once the history is over it, the
+ * oldest entries are forgotten.
+ */
+class History {
+public:
+    static constexpr size_t DEFAULT_BUDGET_BYTES = size_t(256) << 20;
+
+    struct Stats {
+        size_t undoEntries = 0;
+        size_t redoEntries = 0;
+        size_t bytes = 0;
+        size_t budget = 0;
+    };
+
+    void set_budget(size_t bytes) {
+        budget = bytes;
+        trim();
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.undoEntries = undoStack.size();
+        s.redoEntries = redoStack.size();
+        s.bytes = totalBytes;
+        s.budget = budget;
+        return s;
+    }
+
+    // Start recording an operation on `layer`
+    void begin(const Layer& layer) {
+        pending = Entry();
+        pending.layerId = layer.id;
+        pending.layerUid = layer.uid;
+        pending.version = layer.version;
+        captured.assign(layer.tile_versions.size(), 0);
+        recording = true;
+    }
+
+    /**
+     * Copy the tiles overlapping [x, y, w, h] that have not been captured yet,
+     * before the operation writes to them.
+     */
+    void capture(const Layer& layer, int x, int y, int w, int h) {
+        if (!recording || layer.empty()) return;
+
+        int x0 = std::max(0, x), y0 = std::max(0, y);
+        int x1 = std::min(layer.width(), x + w), y1 = std::min(layer.height(), y + h);
+        if (x0 >= x1 || y0 >= y1) return;
+        ENGINE_STAT(stat, "history.capture");
+
+        const size_t first = pending.tiles.size();
+        const size_t firstPixel = pending.offsets.back();
+        for (int ty = y0 / Layer::TILE_SIZE; ty <= (y1 - 1) / Layer::TILE_SIZE; ++ty) {
+            for (int tx = x0 / Layer::TILE_SIZE; tx <= (x1 - 1) / Layer::TILE_SIZE; ++tx) {
+                int t = ty * layer.tiles_x + tx;
+                if (captured[t]) continue;
+                captured[t] = 1;
+                pending.add_tile(layer, t);
+            }
+        }
+
+        pending.pixels.resize(pending.offsets.back());
+        stat.add(pending.offsets.back() - firstPixel, (pending.offsets.back() - firstPixel) * sizeof(Pixel));
+        ThreadPool::shared().parallel_for(static_cast<int>(first), static_cast<int>(pending.tiles.size()), 16,
+                                          [&](int i0, int i1) {
+            for (int i = i0; i < i1; ++i) pending.copy_tile(layer, i);
+        });
+    }
+
+    // Capture the whole layer
+    void capture(const Layer& layer) { capture(layer, 0, 0, layer.width(), layer.height()); }
+
+    /**
+     * The operation replaced the layer's buffer: keep the one it replaced.
+     * Takes the place of capturing; tiles captured before are discarded.
+     */
+    void keep_previous(PixelBuffer&& previous) {
+        if (!recording) return;
+        pending.tiles.clear();
+        pending.offsets.assign(1, 0);
+        pending.pixels.clear();
+        pending.buffer = std::move(previous);
+    }
+
+    /**
+     * Finish recording. Unchanged tiles are dropped, and an operation that
+     * changed nothing leaves no entry. Clears the redo history otherwise.
+     */
+    void commit(const Layer& layer) {
+        if (!recording) return;
+        recording = false;
+        if (layer.uid != pending.layerUid) return;
+
+        if (!pending.buffer.empty() && pending.buffer.width == layer.width() &&
+            pending.buffer.height == layer.height()) {
+            // Same size: keep only the tiles of the old buffer that differ
+            PixelBuffer previous = std::move(pending.buffer);
+            for (int t = 0; t < static_cast<int>(layer.tile_versions.size()); ++t) {
+                if (layer.tile_versions[t] > pending.version) pending.add_tile(layer, t);
+            }
+            pending.pixels.resize(pending.offsets.back());
+            ThreadPool::shared().parallel_for(0, static_cast<int>(pending.tiles.size()), 16, [&](int i0, int i1) {
+                for (int i = i0; i < i1; ++i) pending.copy_buffer_tile(previous, layer.tiles_x, i);
+            });
+        }
+
+        if (pending.buffer.empty()) drop_unchanged(layer);
+        if (pending.tiles.empty() && pending.buffer.empty()) return;
+
+        pending.width = layer.width();
+        pending.height = layer.height();
+
+        clear_stack(redoStack);
+        totalBytes += pending.bytes();
+        undoStack.push_back(std::move(pending));
+        pending = Entry();
+        trim();
+    }
+
+    /**
+     * Undo the most recent operation. `find(id)` returns the layer with the
+     * given id, or nullptr. Returns the id of the layer it changed, or -1 when
+     * there is nothing to undo.
+     */
+    template <typename Find>
+    int undo(Find&& find) { return step(find, undoStack, redoStack); }
+
+    // Redo the most recently undone operation, like `undo`
+    template <typename Find>
+    int redo(Find&& find) { return step(find, redoStack, undoStack); }
+
+    // Forget every entry of layer `id`, e.g. when the layer is replaced
+    void forget(int id) {
+        auto remove = [&](std::deque<Entry>& stack) {
+            for (auto it = stack.begin(); it != stack.end();) {
+                if (it->layerId == id) {
+                    totalBytes -= it->bytes();
+                    it = stack.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        };
+        remove(undoStack);
+        remove(redoStack);
+    }
+
+    void clear() {
+        clear_stack(undoStack);
+        clear_stack(redoStack);
+    }
+
+private:
+    struct Entry {
+        int layerId = -1;
+        uint64_t layerUid = 0;
+        // Layer version before the operation; once recorded, the version
+        // whose pixels stepping the entry puts back
+        uint32_t version = 0;
+
+        // Layer size after the operation, which undo and redo start from
+        int width = 0;
+        int height = 0;
+
+        // Changed tiles (row-major indices), and their pixels one after
+        // another: tile i is offsets[i] .. offsets[i + 1], row by row
+        std::vector<int> tiles;
+        std::vector<size_t> offsets{0};
+        std::vector<Pixel> pixels;
+
+        // The whole previous buffer, when the operation resized the layer
+        PixelBuffer buffer;
+
+        size_t bytes() const { return pixels.size() * sizeof(Pixel) + buffer.size_bytes(); }
+
+        void add_tile(const Layer& layer, int t) {
+            int x, y, w, h;
+            layer.tile_rect(t, x, y, w, h);
+            tiles.push_back(t);
+            offsets.push_back(offsets.back() + static_cast<size_t>(w) * h);
+        }
+
+        // Copy tile i from the layer into the entry
+        void copy_tile(const Layer& layer, int i) {
+            int x, y, w, h;
+            layer.tile_rect(tiles[i], x, y, w, h);
+            Pixel* stored = pixels.data() + offsets[i];
+            for (int row = 0; row < h; ++row, stored += w) {
+                std::memcpy(static_cast<void*>(stored), layer.pixels.row(y + row) + x, static_cast<size_t>(w) * sizeof(Pixel));
+            }
+        }
+
+        // Copy tile i of a buffer the size of the layer into the entry
+        void copy_buffer_tile(const PixelBuffer& source, int tilesX, int i) {
+            const int x = (tiles[i] % tilesX) * Layer::TILE_SIZE;
+            const int y = (tiles[i] / tilesX) * Layer::TILE_SIZE;
+            const int w = std::min(Layer::TILE_SIZE, source.width - x);
+            const int h = std::min(Layer::TILE_SIZE, source.height - y);
+            Pixel* stored = pixels.data() + offsets[i];
+            for (int row = 0; row < h; ++row, stored += w) {
+                std::memcpy(static_cast<void*>(stored), source.row(y + row) + x, static_cast<size_t>(w) * sizeof(Pixel));
+            }
+        }
+
+        // Swap tile i of the entry with the layer's pixels
+        void swap_tile(Layer& layer, int i) {
+            int x, y, w, h;
+            layer.tile_rect(tiles[i], x, y, w, h);
+            Pixel* stored = pixels.data() + offsets[i];
+            for (int row = 0; row < h; ++row, stored += w) {
+                std::swap_ranges(stored, stored + w, layer.pixels.row(y + row) + x);
+            }
+        }
+
+        // Whether tile i of the entry matches the layer
+        bool tile_matches(const Layer& layer, int i) const {
+            int x, y, w, h;
+            layer.tile_rect(tiles[i], x, y, w, h);
+            const Pixel* stored = pixels.data() + offsets[i];
+            for (int row = 0; row < h; ++row, stored += w) {
+                if (std::memcmp(stored, layer.pixels.row(y + row) + x, static_cast<size_t>(w) * sizeof(Pixel)) != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    std::deque<Entry> undoStack;
+    std::deque<Entry> redoStack;
+    size_t totalBytes = 0;
+    size_t budget = DEFAULT_BUDGET_BYTES;
+
+    Entry pending;
+    std::vector<uint8_t> captured;
+    bool recording = false;
+
+    // Remove captured tiles the operation did not change, compacting the rest
+    void drop_unchanged(const Layer& layer) {
+        const int count = static_cast<int>(pending.tiles.size());
+        std::vector<uint8_t> keep(count);
+        ThreadPool::shared().parallel_for(0, count, 16, [&](int i0, int i1) {
+            for (int i = i0; i < i1; ++i) {
+                int t = pending.tiles[i];
+                keep[i] = layer.tile_versions[t] > pending.version && !pending.tile_matches(layer, i);
+            }
+        });
+
+        size_t write = 0;
+        std::vector<int> tiles;
+        std::vector<size_t> offsets{0};
+        for (int i = 0; i < count; ++i) {
+            if (!keep[i]) continue;
+            size_t size = pending.offsets[i + 1] - pending.offsets[i];
+            if (write != pending.offsets[i]) {
+                std::memmove(static_cast<void*>(pending.pixels.data() + write), pending.pixels.data() + pending.offsets[i],
+                             size * sizeof(Pixel));
+            }
+            write += size;
+            tiles.push_back(pending.tiles[i]);
+            offsets.push_back(write);
+        }
+
+        pending.tiles = std::move(tiles);
+        pending.offsets = std::move(offsets);
+        pending.pixels.resize(write);
+        pending.pixels.shrink_to_fit();
+    }
+
+    template <typename Find>
+    int step(Find& find, std::deque<Entry>& from, std::deque<Entry>& to) {
+        while (!from.empty()) {
+            Entry entry = std::move(from.back());
+            from.pop_back();
+            totalBytes -= entry.bytes();
+
+            // Skip entries whose layer was replaced or changed size outside the history
+            Layer* found = find(entry.layerId);
+            if (!found || found->uid != entry.layerUid) continue;
+            Layer& layer = *found;
+            if (layer.width() != entry.width || layer.height() != entry.height) continue;
+
+            const uint32_t before = layer.version;
+            if (!entry.buffer.empty()) {
+                std::swap(layer.pixels, entry.buffer);
+                layer.mark_all_dirty();
+                entry.width = layer.width();
+                entry.height = layer.height();
+            } else {
+                ThreadPool::shared().parallel_for(0, static_cast<int>(entry.tiles.size()), 16, [&](int i0, int i1) {
+                    for (int i = i0; i < i1; ++i) entry.swap_tile(layer, i);
+                });
+                layer.mark_tiles_dirty(entry.tiles);
+            }
+
+            // Planes derived from the pixels put back hold again (see plane_cache.h)
+            PlaneCache::shared().alias(layer.uid, entry.version, layer.version);
+            entry.version = before;
+
+            totalBytes += entry.bytes();
+            to.push_back(std::move(entry));
+            return layer.id;
+        }
+        return -1;
+    }
+
+    void clear_stack(std::deque<Entry>& stack) {
+        for (const Entry& entry : stack) totalBytes -= entry.bytes();
+        stack.clear();
+    }
+
+    // Forget the oldest entries until the history fits its budget
+    void trim() {
+        while (totalBytes > budget && !undoStack.empty()) {
+            totalBytes -= undoStack.front().bytes();
+            undoStack.pop_front();
+        }
+        while (totalBytes > budget && !redoStack.empty()) {
+            totalBytes -= redoStack.front().bytes();
+            redoStack.pop_front();
+        }
+    }
+};
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Image files for the native tools
+ *
+ * Dependency-free formats, read into and written from tightly packed RGBA:
+ *
+ *   ppm    binary PPM (P6). Read as opaque; alpha is dropped on write.
+ *   pam    PAM (P7) of depth 1 (GRAYSCALE), 2 (GRAYSCALE_ALPHA), 3 (RGB) or
+ *          4 (RGB_ALPHA). Written as RGB_ALPHA.
+ *   rgba   raw RGBA, no header. The size is not in the file, so it comes
+ *          from the file name (photo.1920x1080.rgba) or from the caller.
+ *
+ * Samples up to a maxval of 255 are scaled to 0 - 255; 16-bit files are
+ * rejected. Files are read in two steps, the header and then the pixels, so
+ * the caller knows how much memory an image needs before decoding it.
+ */
+
+enum class ImageFormat : int {
+    Unknown = 0,
+    Ppm = 1,
+    Pam = 2,
+    Raw = 3,
+};
+
+struct ImageHeader {
+    ImageFormat format = ImageFormat::Unknown;
+    int width = 0;
+    int height = 0;
+    int depth = 4;      // samples per pixel in the file
+    int maxval = 255;
+};
+
+inline const char* image_format_extension(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::Ppm: return "ppm";
+        case ImageFormat::Pam: return "pam";
+        case ImageFormat::Raw: return "rgba";
+        default: return "";
+    }
+}
+
+// Format named by an extension or format name ("ppm", "pam", "rgba" or "raw")
+inline ImageFormat image_format_named(std::string name) {
+    for (char& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (name == "ppm") return ImageFormat::Ppm;
+    if (name == "pam") return ImageFormat::Pam;
+    if (name == "rgba" || name == "raw") return ImageFormat::Raw;
+    return ImageFormat::Unknown;
+}
+
+// Format of a file, from its extension
+inline ImageFormat image_format_of(const std::string& path) {
+    const size_t dot = path.find_last_of('.');
+    const size_t slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return ImageFormat::Unknown;
+    return image_format_named(path.substr(dot + 1));
+}
+
+/**
+ * Size in a raw file name, "NAME.WIDTHxHEIGHT.rgba". Returns false if the
+ * name has none.
+ */
+inline bool raw_image_size(const std::string& path, int& width, int& height) {
+    const size_t ext = path.find_last_of('.');
+    if (ext == std::string::npos || ext == 0) return false;
+    const size_t dot = path.find_last_of('.', ext - 1);
+    if (dot == std::string::npos) return false;
+
+    const std::string size = path.substr(dot + 1, ext - dot - 1);
+    int w = 0, h = 0;
+    char tail = 0;
+    if (std::sscanf(size.c_str(), "%dx%d%c", &w, &h, &tail) != 2 || w <= 0 || h <= 0) return false;
+    width = w;
+    height = h;
+    return true;
+}
+
+/**
+ * Name of `path` written as a width x height image in `format`: raw files
+ * carry their size in the name, which resize and quad tree compression
+ * change, so it is only known once the image is filtered.
+ */
+inline std::string image_output_path(const std::string& path, ImageFormat format, int width, int height) {
+    std::string stem = path.substr(0, path.find_last_of('.'));
+    int w, h;
+    if (raw_image_size(path, w, h)) stem = stem.substr(0, stem.find_last_of('.'));
+    if (format == ImageFormat::Raw) stem += "." + std::to_string(width) + "x" + std::to_string(height);
+    return stem + "." + image_format_extension(format);
+}
+
+namespace image_file_detail {
+
+// Next whitespace-separated token of a PNM header, skipping # comments
+inline bool pnm_token(FILE* file, std::string& token) {
+    token.clear();
+    int c = std::fgetc(file);
+    for (;;) {
+        if (c == '#') {
+            while (c != EOF && c != '\n') c = std::fgetc(file);
+        } else if (c != EOF && std::isspace(c)) {
+            c = std::fgetc(file);
+        } else {
+            break;
+        }
+    }
+    while (c != EOF && !std::isspace(c) && c != '#') {
+        token += static_cast<char>(c);
+        c = std::fgetc(file);
+    }
+    // The single whitespace character after the last header token is consumed
+    // here, so the pixels start right after it; a comment straight after the
+    // token ends with that character, its newline
+    if (c == '#') {
+        while (c != EOF && c != '\n') c = std::fgetc(file);
+    }
+    return !token.empty();
+}
+
+inline bool positive(const std::string& token, int& value) {
+    char* end = nullptr;
+    const long parsed = std::strtol(token.c_str(), &end, 10);
+    if (*end != '\0' || parsed <= 0 || parsed > (1 << 30)) return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+inline bool read_ppm_header(FILE* file, ImageHeader& header, std::string& error) {
+    std::string w, h, maxval;
+    if (!pnm_token(file, w) || !pnm_token(file, h) || !pnm_token(file, maxval) || !positive(w, header.width) ||
+        !positive(h, header.height) || !positive(maxval, header.maxval)) {
+        error = "malformed PPM header";
+        return false;
+    }
+    header.depth = 3;
+    return true;
+}
+
+inline bool read_pam_header(FILE* file, ImageHeader& header, std::string& error) {
+    std::string key, value;
+    header.depth = 0;
+    for (;;) {
+        if (!pnm_token(file, key)) {
+            error = "PAM header without ENDHDR";
+            return false;
+        }
+        if (key == "ENDHDR") break;
+        if (!pnm_token(file, value)) {
+            error = "malformed PAM header";
+            return false;
+        }
+
+        // TUPLTYPE is implied by DEPTH
+        bool ok = true;
+        if (key == "WIDTH") ok = positive(value, header.width);
+        else if (key == "HEIGHT") ok = positive(value, header.height);
+        else if (key == "DEPTH") ok = positive(value, header.depth);
+        else if (key == "MAXVAL") ok = positive(value, header.maxval);
+        if (!ok) {
+            error = "malformed PAM " + key;
+            return false;
+        }
+    }
+
+    if (header.width == 0 || header.height == 0 || header.depth < 1 || header.depth > 4) {
+        error = "unsupported PAM (needs WIDTH, HEIGHT and a DEPTH of 1 to 4)";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace image_file_detail
+
+/**
+ * Read the header of an image in `format`. For raw images, `header` must
+ * already hold the size. Returns false and sets `error` if the file is not
+ * one this reads.
+ */
+inline bool read_image_header(FILE* file, ImageFormat format, ImageHeader& header, std::string& error) {
+    header.format = format;
+    if (format == ImageFormat::Raw) {
+        header.depth = 4;
+        header.maxval = 255;
+        if (header.width <= 0 || header.height <= 0) {
+            error = "raw image without a size";
+            return false;
+        }
+        return true;
+    }
+
+    char magic[2] = {0, 0};
+    if (std::fread(magic, 1, 2, file) != 2 || magic[0] != 'P') {
+        error = "not a PPM or PAM file";
+        return false;
+    }
+
+    bool ok;
+    if (magic[1] == '6') {
+        header.format = ImageFormat::Ppm;
+        ok = image_file_detail::read_ppm_header(file, header, error);
+    } else if (magic[1] == '7') {
+        header.format = ImageFormat::Pam;
+        ok = image_file_detail::read_pam_header(file, header, error);
+    } else {
+        error = "not a binary PPM (P6) or PAM (P7) file";
+        return false;
+    }
+    if (ok && header.maxval > 255) {
+        error = "16-bit samples are not supported";
+        return false;
+    }
+    return ok;
+}
+
+/**
+ * Read the pixels of an image whose header was just read into `rgba`
+ * (width * height * 4 bytes). Returns false if the file ends early.
+ */
+inline bool read_image_pixels(FILE* file, const ImageHeader& header, uint8_t* rgba) {
+    const size_t width = static_cast<size_t>(header.width);
+    const size_t rowBytes = width * 4;
+    if (header.depth == 4 && header.maxval == 255) {
+        return std::fread(rgba, 1, rowBytes * header.height, file) == rowBytes * header.height;
+    }
+
+    // Read each row into the end of its RGBA row and expand it forwards, so no
+    // second buffer is needed
+    const int depth = header.depth;
+    for (int y = 0; y < header.height; ++y) {
+        uint8_t* row = rgba + static_cast<size_t>(y) * rowBytes;
+        uint8_t* packed = row + rowBytes - width * depth;
+        if (std::fread(packed, 1, width * depth, file) != width * depth) return false;
+
+        for (size_t x = 0; x < width; ++x) {
+            const uint8_t* s = packed + x * depth;
+            uint8_t* d = row + x * 4;
+            uint8_t r, g, b, a;
+            if (depth <= 2) {
+                r = g = b = s[0];
+                a = depth == 2 ? s[1] : header.maxval;
+            } else {
+                r = s[0];
+                g = s[1];
+                b = s[2];
+                a = depth == 4 ? s[3] : header.maxval;
+            }
+            d[0] = r;
+            d[1] = g;
+            d[2] = b;
+            d[3] = a;
+        }
+
+        if (header.maxval != 255) {
+            for (size_t i = 0; i < rowBytes; ++i) {
+                row[i] = static_cast<uint8_t>(std::min(255, (row[i] * 255 + header.maxval / 2) / header.maxval));
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Write width x height tightly packed RGBA pixels as an image in `format`.
+ * Returns false on a write error.
+ */
+inline bool write_image(FILE* file, ImageFormat format, const uint8_t* rgba, int width, int height) {
+    const size_t rowBytes = static_cast<size_t>(width) * 4;
+    if (format == ImageFormat::Raw) {
+        return std::fwrite(rgba, 1, rowBytes * height, file) == rowBytes * height;
+    }
+    if (format == ImageFormat::Pam) {
+        return std::fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width,
+                            height) > 0 &&
+               std::fwrite(rgba, 1, rowBytes * height, file) == rowBytes * height;
+    }
+    if (format != ImageFormat::Ppm) return false;
+
+    if (std::fprintf(file, "P6\n%d %d\n255\n", width, height) <= 0) return false;
+    std::vector<uint8_t> row(static_cast<size_t>(width) * 3);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* src = rgba + static_cast<size_t>(y) * rowBytes;
+        for (int x = 0; x < width; ++x) {
+            row[x * 3] = src[x * 4];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        if (std::fwrite(row.data(), 1, row.size(), file) != row.size()) return false;
+    }
+    return true;
+}
@@ -1,8 +1,34 @@
 #include <cstdint>
+#include <cstring>
 #include <cmath>
+#include <chrono>
+#include <memory>
 #include <vector>
 #include <algorithm>
 #include "layer.h"
+#include "image_processor.h"
+#include "compositor.h"
+#include "thread_pool.h"
+#include "box_blur.h"
+#include "flood_fill.h"
+#include "quad_tree.h"
+#include "resample.h"
+#include "convolution.h"
+#include "filters.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "history.h"
+#include "layer_store.h"
+#include "command_buffer.h"
+#include "snapshot.h"
+#include "tile_digest.h"
+#include "integer_kernels.h"
+#include "engine_stats.h"
+#include "plane_cache.h"
+#include "scratch_arena.h"
+#if !defined(__EMSCRIPTEN__)
+#include "out_of_core.h"
+#endif
 #include <unordered_map>
 #include <unordered_set>
 #include <utility> 
@@ -10,355 +36,602 @@
 #include <array>
 #include <cmath>
 
-// Cache of layers 
-std::unordered_map<int, Layer> layers;
+// Every layer, compressed once cold (see layer_store.h)
+LayerStore layers;
+
+// Incremental compositor shared by every exported operation
+Compositor compositor;
+
+// Canvas region changed by the most recent operation (see get_dirty_rect)
+Rect last_dirty_rect;
+
+// Preview mode (see set_preview_size): the display size previews are rendered
+// for, their compositor, and the copy of a layer level previews filter
+int preview_display_width = 0;
+int preview_display_height = 0;
+Compositor preview_compositor;
+Layer preview_layer;
+
+// Undo / redo history of every layer (see edit_layer)
+History history;
+
+// Full-resolution pipeline run started by refine_pipeline, if any
+std::unique_ptr<PipelineJob> refine_job;
+int refine_layer_id = -1;
+
+// Snapshot being written by snapshot_next, its latest chunk, and the one
+// being restored by restore_feed (see snapshot.h)
+std::unique_ptr<SnapshotWriter> snapshot_writer;
+std::vector<uint8_t> snapshot_chunk;
+std::unique_ptr<SnapshotReader> snapshot_reader;
 
 /**
- * Monochrome functions
- * 
- * Various methods to convert RGB pixels to grayscale.
+ * Point operations
+ *
+ * Runs a compiled chain of colour adjustments (point_ops.h) over a layer in
+ * one parallel pass. The monochrome filters are single-operation chains.
  */
 
-uint8_t grayscale_average(uint8_t r, uint8_t g, uint8_t b) {
-    return static_cast<uint8_t>((r + g + b) / 3);
-}
+void apply_point_program(Layer& layer, const PointProgram& program) {
+    if (layer.empty() || program.empty()) return;
+    int layer_width = layer.width();
+    int layer_height = layer.height();
 
-uint8_t grayscale_luminosity(uint8_t r, uint8_t g, uint8_t b) {
-    return static_cast<uint8_t>(0.299 * r + 0.587 * g + 0.114 * b);
-}
+    ENGINE_STAT(stat, "point_ops.rows");
+    stat.add(static_cast<uint64_t>(layer_width) * layer_height);
+    ThreadPool::shared().parallel_for(0, layer_height, row_grain(layer_width), [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            program.run(layer.pixels.row(y), layer_width);
+        }
+    });
 
-uint8_t grayscale_lightness(uint8_t r, uint8_t g, uint8_t b) {
-    return static_cast<uint8_t>((std::max({r, g, b}) + std::min({r, g, b})) / 2);
+    layer.mark_dirty(0, 0, layer_width, layer_height);
 }
 
-uint8_t grayscale_itu(uint8_t r, uint8_t g, uint8_t b) {
-    return static_cast<uint8_t>(0.2126 * r + 0.7152 * g + 0.0722 * b);
+void apply_monochrome_filter(Layer& layer, GrayscaleFn grayscale_fn) {
+    apply_point_program(layer, grayscale_program(grayscale_fn));
 }
 
-void apply_monochrome_filter(int layer_id, uint8_t(*grayscale_fn)(uint8_t, uint8_t, uint8_t)) {
-    Layer& layer = layers[layer_id];
-    int layer_width = layer.pixels[0].size();
-    int layer_height = layer.pixels.size();
+// Run horizontal(in, out) on every row into a temporary buffer, then
+// vertical(rows, out), with rows[k] the temporary row at offset k - halfKernel
+template <typename Horizontal, typename Vertical>
+void separable_blur_passes(Layer& layer, int halfKernel, Horizontal&& horizontal, Vertical&& vertical) {
+    const int width = layer.width();
+    const int height = layer.height();
+    const uint64_t pixels = static_cast<uint64_t>(width) * height;
 
-    for (int y = 0; y < layer_height; ++y) {
-        auto& row = layer.pixels[y]; 
-        for (int x = 0; x < layer_width; ++x) {
-            Pixel& p = row[x];
-            uint8_t gray = grayscale_fn(p.r, p.g, p.b);
-            p.r = p.g = p.b = gray;
-            // p.a preserved
-        }
+    // Temp buffer for the horizontal pass
+    ScratchScope scratch;
+    const size_t tempPixels = static_cast<size_t>(width) * height;
+    Pixel* const temp = scratch.allocate<Pixel>(tempPixels);
+
+    ThreadPool& pool = ThreadPool::shared();
+    const int grain = row_grain(width);
+
+    // === HORIZONTAL PASS ===
+    {
+        ENGINE_STAT(stat, "gaussian.horizontal");
+        stat.add(pixels, tempPixels * sizeof(Pixel));
+        pool.parallel_for(0, height, grain, [&](int y0, int y1) {
+            for (int y = y0; y < y1; ++y) {
+                horizontal(layer.pixels.row(y), temp + static_cast<size_t>(y) * width);
+            }
+        });
     }
+
+    // === VERTICAL PASS ===
+    // Reads only from temp, so each band can read its halo rows (up to
+    // halfKernel rows above and below) while other bands write the layer
+    ENGINE_STAT(stat, "gaussian.vertical");
+    stat.add(pixels);
+    pool.parallel_for(0, height, grain, [&](int y0, int y1) {
+        ScratchScope bandScratch;
+        const Pixel** rows = bandScratch.allocate<const Pixel*>(2 * halfKernel + 1);
+        for (int y = y0; y < y1; ++y) {
+            for (int k = -halfKernel; k <= halfKernel; ++k) {
+                int sampleY = std::min(std::max(y + k, 0), height - 1);
+                rows[k + halfKernel] = temp + static_cast<size_t>(sampleY) * width;
+            }
+            vertical(rows, layer.pixels.row(y));
+        }
+    });
 }
 
 /**
  * Gaussian blur function 
  * 
  * This function applies a Gaussian blur to a specific layer in the image.
+ *
+ * The direct kernel costs kernelSize operations per pixel and pass. Large
+ * blurs (see use_box_blur in filters.h) use the stacked box blur in
+ * box_blur.h instead, whose cost does not depend on the kernel size. It is
+ * matched to the variance of the (truncated) kernel and stays within a few
+ * levels of the direct result. In the integer mode (integer_kernels.h) both
+ * use fixed-point weights and integer sums.
  */
 
- void gaussian_blur_layer(int layer_id, double sigma, int kernelSize) {
-    if (kernelSize % 2 == 0) kernelSize++;
-    int halfKernel = kernelSize / 2;
-
-    // Generate 1D Gaussian kernel
-    std::vector<float> kernel(kernelSize);
-    float denom = 2.0f * sigma * sigma;
-    float sum = 0.0f;
-
-    for (int i = 0; i < kernelSize; ++i) {
-        int x = i - halfKernel;
-        kernel[i] = std::exp(-(x * x) / denom);
-        sum += kernel[i];
+ void gaussian_blur_layer(Layer& layer, double sigma, int kernelSize) {
+    if (layer.empty()) return;
+
+    kernelSize = gaussian_kernel_size(kernelSize);
+    const int halfKernel = kernelSize / 2;
+    const int width = layer.width();
+
+    if (use_box_blur(sigma, kernelSize)) {
+        box_blur_layer(layer, gaussian_variance(sigma, kernelSize));
+    } else if (integer_kernels()) {
+        ScratchScope scratch;
+        int32_t* kernel = scratch.allocate<int32_t>(kernelSize);
+        gaussian_kernel_fixed(sigma, kernelSize, kernel);
+        separable_blur_passes(layer, halfKernel,
+            [&](const Pixel* in, Pixel* out) {
+                gaussian_fixed_row_horizontal(in, out, width, kernel, halfKernel);
+            },
+            [&](const Pixel* const* rows, Pixel* out) {
+                gaussian_fixed_row_vertical(rows, out, width, kernel, halfKernel);
+            });
+    } else {
+        // Generate 1D Gaussian kernel
+        ScratchScope scratch;
+        float* kernel = scratch.allocate<float>(kernelSize);
+        gaussian_kernel(sigma, kernelSize, kernel);
+
+        // Unrolled row passes for the common kernel sizes
+        const GaussianRowKernels blur = gaussian_row_kernels(halfKernel);
+        separable_blur_passes(layer, halfKernel,
+            [&](const Pixel* in, Pixel* out) { blur.horizontal(in, out, width, kernel, halfKernel); },
+            [&](const Pixel* const* rows, Pixel* out) { blur.vertical(rows, out, width, kernel, halfKernel); });
     }
-    for (float& k : kernel) k /= sum;
 
-    Layer& layer = layers[layer_id];
-    const int width = layer.pixels[0].size();
-    const int height = layer.pixels.size();
+    layer.mark_dirty(0, 0, width, layer.height());
+}
+
+/**
+ * Edge detection options 
+ *
+ * Both filters convolve the average grayscale of the layer with the engine in
+ * convolution.h, in row bands that each keep a window of 3 grayscale rows.
+ * Bands read the rows of their neighbours from copies taken before any band
+ * writes, so nothing larger than a few rows is allocated, except the Sobel
+ * magnitudes the derived-plane cache keeps (see edge_sobel_layer).
+ */
 
-    // Temp buffer: store RGBA per pixel as 4 * uint8_t
-    std::vector<uint8_t> temp(width * height * 4);
+/**
+ * Largest Sobel magnitude over rows [y0, y1) of the layer, inside its 1 pixel
+ * border (at least 1).
+ */
+int sobel_max_magnitude(const Layer& layer, int y0, int y1) {
+    const int width = layer.width();
+    y0 = std::max(1, y0);
+    y1 = std::min(layer.height() - 1, y1);
+    if (layer.empty() || y0 >= y1) return 1;
+
+    ENGINE_STAT(stat, "sobel.gradient");
+    stat.add(static_cast<uint64_t>(width) * (y1 - y0));
+    const int bands = convolution_band_count(width, y1 - y0);
+    ScratchScope scratch;
+    int* bandMax = scratch.allocate<int>(bands);
+    std::fill(bandMax, bandMax + bands, 1);
+    int16_t* rows = scratch.allocate<int16_t>(2 * static_cast<size_t>(width) * bands);
+    convolution_sweep(layer, 1, 1, y0, y1, bands, false, [&](int band, int, ConvolutionWindow& window) {
+        int16_t* magnitudes = rows + 2 * static_cast<size_t>(width) * band;
+        bandMax[band] = std::max(bandMax[band], sobel_magnitude_row(window, magnitudes, magnitudes + width, width));
+    });
+    return *std::max_element(bandMax, bandMax + bands);
+}
 
-    // === HORIZONTAL PASS ===
-    for (int y = 0; y < height; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        for (int x = 0; x < width; ++x) {
-            float r = 0, g = 0, b = 0, a = 0;
+/**
+ * Sobel magnitudes of a layer (at most 2040 each), rows 1 .. height - 2 of
+ * `width` values; the border rows are left unset. Only computed for the
+ * derived-plane cache (plane_cache.h), for whole layers it admits.
+ */
+struct GradientPlane {
+    int width = 0;
+    int height = 0;
+    std::unique_ptr<int16_t[]> magnitudes;
+    int maxMagnitude = 1;
 
-            for (int k = -halfKernel; k <= halfKernel; ++k) {
-                int sampleX = x + k;
-                if (sampleX < 0) sampleX = 0;
-                else if (sampleX >= width) sampleX = width - 1;
-
-                float coeff = kernel[k + halfKernel];
-                Pixel& p = row[sampleX];
-                r += p.r * coeff;
-                g += p.g * coeff;
-                b += p.b * coeff;
-                a += p.a * coeff;
-            }
+    const int16_t* row(int y) const { return magnitudes.get() + static_cast<size_t>(y) * width; }
+    size_t size_bytes() const { return static_cast<size_t>(width) * height * sizeof(int16_t); }
+};
 
-            int idx = (y * width + x) * 4;
-            temp[idx]     = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, r)));
-            temp[idx + 1] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, g)));
-            temp[idx + 2] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, b)));
-            temp[idx + 3] = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, a)));
-        }
+/**
+ * The Sobel magnitudes of the layer from the derived-plane cache, computed
+ * and stored if the cache would keep them. nullptr if it would not (the layer
+ * is not admitted or the plane is over the budget): the caller then runs
+ * Sobel in place instead.
+ */
+std::shared_ptr<const GradientPlane> cached_sobel_gradient(const Layer& layer) {
+    PlaneCache& cache = PlaneCache::shared();
+    if (std::shared_ptr<const GradientPlane> plane = cache.find<GradientPlane>(layer, PlaneKind::Gradient)) {
+        return plane;
     }
 
-    // === VERTICAL PASS ===
-    for (int y = 0; y < height; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        for (int x = 0; x < width; ++x) {
-            float r = 0, g = 0, b = 0, a = 0;
-
-            for (int k = -halfKernel; k <= halfKernel; ++k) {
-                int sampleY = y + k;
-                if (sampleY < 0) sampleY = 0;
-                else if (sampleY >= height) sampleY = height - 1;
+    const int width = layer.width();
+    const int height = layer.height();
+    const size_t bytes = static_cast<size_t>(width) * height * sizeof(int16_t);
+    if (!cache.admits(layer, bytes)) return nullptr;
+
+    auto plane = std::make_shared<GradientPlane>();
+    plane->width = width;
+    plane->height = height;
+    plane->magnitudes.reset(new int16_t[static_cast<size_t>(width) * height]);
+
+    ENGINE_STAT(stat, "sobel.gradient");
+    stat.add(static_cast<uint64_t>(width) * height);
+    const int bands = convolution_band_count(width, height - 2);
+    ScratchScope scratch;
+    int* bandMax = scratch.allocate<int>(bands);
+    std::fill(bandMax, bandMax + bands, 1);
+    int16_t* gy = scratch.allocate<int16_t>(static_cast<size_t>(width) * bands);
+    convolution_sweep(layer, 1, 1, 1, height - 1, bands, false, [&](int band, int y, ConvolutionWindow& window) {
+        int16_t* magnitudes = plane->magnitudes.get() + static_cast<size_t>(y) * width;
+        bandMax[band] = std::max(bandMax[band], sobel_magnitude_row(window, magnitudes,
+                                                                    gy + static_cast<size_t>(width) * band, width));
+    });
+    if (bands > 0) plane->maxMagnitude = *std::max_element(bandMax, bandMax + bands);
+
+    cache.store(layer, PlaneKind::Gradient, std::shared_ptr<const GradientPlane>(plane), bytes);
+    return plane;
+}
 
-                float coeff = kernel[k + halfKernel];
-                int idx = (sampleY * width + x) * 4;
+// Write the magnitudes of `gradient`, scaled so the largest is 255, to the interior of `layer`
+void sobel_normalize(Layer& layer, const GradientPlane& gradient) {
+    const int height = layer.height();
+    const int width = layer.width();
+    const int maxMag = gradient.maxMagnitude;
 
-                r += temp[idx]     * coeff;
-                g += temp[idx + 1] * coeff;
-                b += temp[idx + 2] * coeff;
-                a += temp[idx + 3] * coeff;
+    ENGINE_STAT(stat, "sobel.normalize");
+    stat.add(static_cast<uint64_t>(width) * height);
+    const float invMax = 255.0f / maxMag;
+    const bool integer = integer_kernels();
+    ThreadPool::shared().parallel_for(1, height - 1, row_grain(width), [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            const int16_t* magnitudes = gradient.row(y);
+            Pixel* row = layer.pixels.row(y);
+            for (int x = 1; x < width - 1; ++x) {
+                const int mag = magnitudes[x];
+                uint8_t edge = static_cast<uint8_t>(integer ? mag * 255 / maxMag : mag * invMax);
+                row[x].r = row[x].g = row[x].b = edge;
             }
-
-            row[x].r = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, r)));
-            row[x].g = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, g)));
-            row[x].b = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, b)));
-            row[x].a = static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, a)));
         }
-    }
+    });
+
+    layer.mark_dirty(1, 1, width - 2, height - 2);
 }
 
 /**
- * Edge detection options 
+ * Edge magnitudes, normalized so the largest in the layer is 255, or by
+ * `maxMag` if given (> 0), e.g. the largest over a whole image filtered in
+ * bands.
+ *
+ * The largest magnitude is only known once all of them are, so this takes
+ * two passes. Layers the derived-plane cache admits keep their magnitudes
+ * in a plane there, so filtering the same pixels again only rescales them.
+ * Otherwise (pipeline intermediates, bands, planes over the cache budget)
+ * the first pass parks each magnitude in the red and green bytes of its own
+ * pixel, which the window has already read, and the second scales them, so
+ * nothing larger than a few rows per band is allocated.
  */
+void edge_sobel_layer(Layer& layer, int maxMag = 0) {
+    if (layer.empty()) return;
 
-void edge_sobel_layer(int layer_id) {
-    Layer& layer = layers[layer_id];
-
-    const int height = layer.pixels.size();
-    if (height == 0) return;
-    const int width = layer.pixels[0].size();
-
-    // Precompute grayscale to a linear buffer for cache efficiency
-    std::vector<uint8_t> gray_buffer(width * height);
-    for (int y = 0; y < height; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        for (int x = 0; x < width; ++x) {
-            // Simple average grayscale
-            gray_buffer[y * width + x] = static_cast<uint8_t>((row[x].r + row[x].g + row[x].b) / 3);
+    if (maxMag <= 0) {
+        if (const std::shared_ptr<const GradientPlane> gradient = cached_sobel_gradient(layer)) {
+            sobel_normalize(layer, *gradient);
+            return;
         }
     }
 
-    // Sobel kernels as 1D arrays to avoid 2D indexing overhead
-    constexpr int Gx[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
-    constexpr int Gy[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+    const int height = layer.height();
+    const int width = layer.width();
+    const uint64_t pixels = static_cast<uint64_t>(width) * height;
+
+    int layerMax = 1;
+    {
+        ENGINE_STAT(stat, "sobel.gradient");
+        stat.add(pixels);
+        const int bands = convolution_band_count(width, height - 2);
+        ScratchScope scratch;
+        int* bandMax = scratch.allocate<int>(bands);
+        std::fill(bandMax, bandMax + bands, 1);
+        int16_t* rows = scratch.allocate<int16_t>(2 * static_cast<size_t>(width) * bands);
+        convolution_sweep(layer, 1, 1, 1, height - 1, bands, true, [&](int band, int y, ConvolutionWindow& window) {
+            int16_t* magnitudes = rows + 2 * static_cast<size_t>(width) * band;
+            bandMax[band] = std::max(bandMax[band], sobel_magnitude_row(window, magnitudes, magnitudes + width, width));
+            Pixel* row = layer.pixels.row(y);
+            for (int x = 1; x < width - 1; ++x) {
+                row[x].r = static_cast<uint8_t>(magnitudes[x] & 0xFF);
+                row[x].g = static_cast<uint8_t>(magnitudes[x] >> 8);
+            }
+        });
+        if (bands > 0) layerMax = *std::max_element(bandMax, bandMax + bands);
+    }
+    if (maxMag <= 0) maxMag = layerMax;
 
-    // Output buffer for edge magnitude
-    std::vector<int> magnitudes(width * height, 0);
+    // Normalize the parked magnitudes (skip borders)
+    ENGINE_STAT(stat, "sobel.normalize");
+    stat.add(pixels);
+    const float invMax = 255.0f / maxMag;
+    const bool integer = integer_kernels();
+    ThreadPool::shared().parallel_for(1, height - 1, row_grain(width), [&](int y0, int y1) {
+        for (int y = y0; y < y1; ++y) {
+            Pixel* row = layer.pixels.row(y);
+            for (int x = 1; x < width - 1; ++x) {
+                const int mag = row[x].r | (row[x].g << 8);
+                uint8_t edge = static_cast<uint8_t>(integer ? mag * 255 / maxMag : mag * invMax);
+                row[x].r = row[x].g = row[x].b = edge;
+            }
+        }
+    });
 
-    int maxMag = 1;
+    layer.mark_dirty(1, 1, width - 2, height - 2);
+}
 
-    // Apply Sobel - skip border pixels (1..height-2, 1..width-2)
-    // Unroll kernel loops for 3x3 fixed size (9 operations)
-    for (int y = 1; y < height - 1; ++y) {
-        int base_idx = y * width;
-        int prev_idx = (y - 1) * width;
-        int next_idx = (y + 1) * width;
+void laplacian_filter_layer(Layer& layer) {
+    if (layer.empty()) return;
 
-        for (int x = 1; x < width - 1; ++x) {
-            int gx = 0, gy = 0;
+    const int height = layer.height();
+    const int width = layer.width();
 
-            // Manually unrolled 3x3 kernel convolution
-            // Indices relative to center pixel (x,y)
-            gx += gray_buffer[prev_idx + (x - 1)] * Gx[0];
-            gx += gray_buffer[prev_idx + x] * Gx[1];
-            gx += gray_buffer[prev_idx + (x + 1)] * Gx[2];
-            gx += gray_buffer[base_idx + (x - 1)] * Gx[3];
-            gx += gray_buffer[base_idx + x] * Gx[4];
-            gx += gray_buffer[base_idx + (x + 1)] * Gx[5];
-            gx += gray_buffer[next_idx + (x - 1)] * Gx[6];
-            gx += gray_buffer[next_idx + x] * Gx[7];
-            gx += gray_buffer[next_idx + (x + 1)] * Gx[8];
+    ENGINE_STAT(stat, "laplacian.rows");
+    stat.add(static_cast<uint64_t>(width) * height);
+    const int bands = convolution_band_count(width, height - 2);
+    ScratchScope scratch;
+    int16_t* sums = scratch.allocate<int16_t>(static_cast<size_t>(width) * bands);
+    convolution_sweep(layer, 1, 1, 1, height - 1, bands, true, [&](int band, int y, ConvolutionWindow& window) {
+        laplacian_row(window, layer.pixels.row(y), sums + static_cast<size_t>(width) * band, width);
+    });
 
-            gy += gray_buffer[prev_idx + (x - 1)] * Gy[0];
-            gy += gray_buffer[prev_idx + x] * Gy[1];
-            gy += gray_buffer[prev_idx + (x + 1)] * Gy[2];
-            gy += gray_buffer[base_idx + (x - 1)] * Gy[3];
-            gy += gray_buffer[base_idx + x] * Gy[4];
-            gy += gray_buffer[base_idx + (x + 1)] * Gy[5];
-            gy += gray_buffer[next_idx + (x - 1)] * Gy[6];
-            gy += gray_buffer[next_idx + x] * Gy[7];
-            gy += gray_buffer[next_idx + (x + 1)] * Gy[8];
+    layer.mark_dirty(1, 1, width - 2, height - 2);
+}
 
-            // Approximate magnitude by sum of abs gx + abs gy (faster than sqrt)
-            int mag = std::abs(gx) + std::abs(gy);
+/**
+ * Colour kernels 
+ *
+ * Sharpen, emboss and user kernels filter the colour channels of every pixel
+ * with the same engine (see convolution.h); alpha is left unchanged. Pixels
+ * beyond the edges repeat the edge pixels.
+ */
 
-            magnitudes[base_idx + x] = mag;
-            if (mag > maxMag) maxMag = mag;
-        }
-    }
+void convolve_layer(Layer& layer, const ConvolutionKernel& kernel, int bias = 0) {
+    if (layer.empty() || !kernel.valid()) return;
 
-    // Normalize and write back to pixels (skip borders)
-    const float invMax = 255.0f / maxMag;
-    for (int y = 1; y < height - 1; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        int base_idx = y * width;
-        for (int x = 1; x < width - 1; ++x) {
-            int mag = magnitudes[base_idx + x];
-            uint8_t edge = static_cast<uint8_t>(mag * invMax);
-            row[x].r = row[x].g = row[x].b = edge;
-        }
-    }
-}
+    const int height = layer.height();
+    const int width = layer.width();
 
-void laplacian_filter_layer(int layer_id) {
-    Layer& layer = layers[layer_id];
+    ENGINE_STAT(stat, "convolution.rows");
+    stat.add(static_cast<uint64_t>(width) * height);
+    const int bands = convolution_band_count(width, height);
+    ScratchScope scratch;
+    int32_t* sums = scratch.allocate<int32_t>(4 * static_cast<size_t>(width) * bands);
+    convolution_sweep(layer, 4, kernel.radius(), 0, height, bands, true, [&](int band, int y, ConvolutionWindow& window) {
+        kernel_row(window, kernel, bias, layer.pixels.row(y), sums + 4 * static_cast<size_t>(width) * band, width);
+    });
 
-    const int height = layer.pixels.size();
-    if (height == 0) return;
-    const int width = layer.pixels[0].size();
+    layer.mark_dirty(0, 0, width, height);
+}
 
-    // Precompute grayscale buffer for cache efficiency
-    std::vector<uint8_t> gray_buffer(width * height);
-    for (int y = 0; y < height; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        for (int x = 0; x < width; ++x) {
-            gray_buffer[y * width + x] = static_cast<uint8_t>((row[x].r + row[x].g + row[x].b) / 3);
-        }
-    }
+/**
+ * Bucket fill tool 
+ *
+ * Finds the region with a scanline fill (flood_fill.h), or reuses it from
+ * FillCache when the click lands on a region that was just filled.
+ */
 
-    // Laplacian kernel 3x3 as 1D array (row-major)
-    constexpr int kernel[9] = {
-        -1, -1, -1,
-        -1,  8, -1,
-        -1, -1, -1
-    };
+void bucket_fill_layer(Layer& layer, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a, float error_threshold) {
+    if (layer.empty()) return;
+    int width = layer.width();
+    int height = layer.height();
 
-    // Buffer to store convolution results
-    std::vector<int> laplacian_values(width * height, 0);
+    if (x < 0 || x >= width || y < 0 || y >= height) return;
 
-    for (int y = 1; y < height - 1; ++y) {
-        int base_idx = y * width;
-        int prev_idx = (y - 1) * width;
-        int next_idx = (y + 1) * width;
+    const float threshold_sq = fill_threshold_sq(error_threshold);
+    const Pixel color(r, g, b, a);
 
-        for (int x = 1; x < width - 1; ++x) {
-            // Manually unrolled convolution sum
-            int sum = 0;
-            sum += gray_buffer[prev_idx + (x - 1)] * kernel[0];
-            sum += gray_buffer[prev_idx + x] * kernel[1];
-            sum += gray_buffer[prev_idx + (x + 1)] * kernel[2];
-            sum += gray_buffer[base_idx + (x - 1)] * kernel[3];
-            sum += gray_buffer[base_idx + x] * kernel[4];
-            sum += gray_buffer[base_idx + (x + 1)] * kernel[5];
-            sum += gray_buffer[next_idx + (x - 1)] * kernel[6];
-            sum += gray_buffer[next_idx + x] * kernel[7];
-            sum += gray_buffer[next_idx + (x + 1)] * kernel[8];
+    FillCache& cache = FillCache::shared();
+    FillRegion region;
+    if (!cache.take(layer, x, y, threshold_sq, region)) {
+        ENGINE_STAT(stat, "fill.region");
+        region = fill_region(layer, x, y, threshold_sq);
+        stat.add(region.pixel_count(), region.runs.size() * sizeof(FillRun));
+    }
+    if (region.empty()) return;
 
-            laplacian_values[base_idx + x] = sum;
-        }
+    history.capture(layer, region.minX, region.minY, region.maxX - region.minX + 1, region.maxY - region.minY + 1);
+    {
+        ENGINE_STAT(stat, "fill.blend");
+        stat.add(region.pixel_count());
+        fill_region_blend(layer, region, color);
     }
 
-    // Amplify by 3 and clamp, then write back
-    for (int y = 1; y < height - 1; ++y) {
-        Pixel* row = layer.pixels[y].data();
-        int base_idx = y * width;
-        for (int x = 1; x < width - 1; ++x) {
-            int amplified = laplacian_values[base_idx + x] * 3;
+    // Bounding box of the filled pixels, for dirty tracking
+    layer.mark_dirty(region.minX, region.minY, region.maxX - region.minX + 1, region.maxY - region.minY + 1);
 
-            // Clamp without std::min/max (faster)
-            if (amplified < 0) amplified = 0;
-            else if (amplified > 255) amplified = 255;
+    cache.store(layer, threshold_sq, color, std::move(region));
+}
 
-            uint8_t edge = static_cast<uint8_t>(amplified);
-            row[x].r = row[x].g = row[x].b = edge;
-        }
+/**
+ * Filter pipelines 
+ */
+
+// Run a step that cannot be fused into a sweep with the standalone layer kernel
+void run_pipeline_step(Layer& layer, const PipelineStep& step) {
+    switch (step.op) {
+        case PipelineOp::GaussianBlur:
+            if (pipeline_step_box_blur(step)) {
+                box_blur_layer(layer, pipeline_step_variance(step));
+                layer.mark_dirty(0, 0, layer.width(), layer.height());
+            } else {
+                gaussian_blur_layer(layer, step.param0, static_cast<int>(step.param1));
+            }
+            break;
+        case PipelineOp::EdgeSobel:
+            edge_sobel_layer(layer);
+            break;
+        case PipelineOp::LaplacianFilter:
+            laplacian_filter_layer(layer);
+            break;
+        default:
+            if (GrayscaleFn fn = pipeline_grayscale_fn(step.op)) apply_monochrome_filter(layer, fn);
+            break;
     }
 }
 
 /**
- * Bucket fill tool 
+ * Compositing helpers 
  */
 
-// Helper function - check if within error threshold 
-inline bool pixel_within_threshold_fast(const Pixel& p1, const Pixel& p2, float threshold_sq) {
-    int dr = p1.r - p2.r;
-    int dg = p1.g - p2.g;
-    int db = p1.b - p2.b;
-    int da = p1.a - p2.a;
+// Resolve a layer order (bottom to top) to the layers it refers to
+std::vector<Layer*> layer_stack(const int* order, int orderSize) {
+    std::vector<Layer*> stack;
+    stack.reserve(orderSize);
+    for (int i = 0; i < orderSize; ++i) {
+        stack.push_back(layers.find(order[i]));
+    }
+    return stack;
+}
 
-    int dist_sq = dr * dr + dg * dg + db * db + da * da;
-    return dist_sq <= threshold_sq;
+// Recomposite only the tiles dirtied since the last composite, and remember the
+// changed region for get_dirty_rect
+void merge_dirty_layers(uint8_t* output, int width, int height, const int* order, int orderSize) {
+    last_dirty_rect = compositor.composite(output, width, height, layer_stack(order, orderSize));
+    layers.trim();
 }
 
-void bucket_fill_layer(int layer_id, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a, float error_threshold) {
-    Layer& layer = layers[layer_id];
-    int width = layer.pixels[0].size();
-    int height = layer.pixels.size();
+/**
+ * Undo history
+ *
+ * Exported operations change layers through `edit_layer`, which records each
+ * one as a single undoable step (see history.h). The operation captures the
+ * region it is about to change, or hands over the buffer it replaced.
+ */
 
-    if (x < 0 || x >= width || y < 0 || y >= height) return;
+template <typename Edit>
+void edit_layer(Layer& layer, Edit&& edit) {
+    // Planes derived from the layer as it is now stay valid after an undo
+    PlaneCache::Admit admit(PlaneCache::shared(), layer);
+    history.begin(layer);
+    edit(layer);
+    history.commit(layer);
+}
 
-    const Pixel ref_pixel = layer.pixels[y][x];
+// Most filters change the whole layer
+template <typename Filter>
+void filter_layer(Layer& layer, Filter&& filter) {
+    edit_layer(layer, [&](Layer& target) {
+        history.capture(target);
+        filter(target);
+    });
+}
 
-    // Normalize threshold: scale [0,100] to [0, 255^2*4]
-    int max_channel_distance = 255;
-    float max_possible_sq = 4.0f * max_channel_distance * max_channel_distance;
-    float threshold_sq = (error_threshold / 100.0f) * max_possible_sq;
+/**
+ * Preview helpers
+ *
+ * In preview mode every layer is composited from the level of its pyramid
+ * (pyramid.h) that matches the display size, rather than at full resolution.
+ */
 
-    // Use 1D visited array for speed and memory
-    std::vector<bool> visited(width * height, false);
+// Pyramid level used for previews of a width x height canvas
+int preview_level(int width, int height) {
+    return pyramid_level_for(width, height, preview_display_width, preview_display_height);
+}
 
-    // Use vector as queue (faster than std::queue)
-    std::vector<std::pair<int, int>> queue;
-    queue.reserve(width * height);
-    queue.emplace_back(x, y);
-    visited[y * width + x] = true;
+// Composite the stack at `level` into the preview output, with layer
+// `replacedId` (if any) drawn from `replacement` instead
+void merge_preview_layers(uint8_t* output, int width, int height, const int* order, int orderSize,
+                          int level, int replacedId = -1, Layer* replacement = nullptr) {
+    std::vector<Layer*> stack = layer_stack(order, orderSize);
+    for (int i = 0; i < orderSize; ++i) {
+        if (!stack[i]) continue;
+        stack[i] = order[i] == replacedId ? replacement : &pyramid_level(*stack[i], level);
+    }
 
-    while (!queue.empty()) {
-        auto [cx, cy] = queue.back();
-        queue.pop_back();
+    last_dirty_rect = preview_compositor.composite(output, pyramid_extent(width, level),
+                                                   pyramid_extent(height, level), stack);
+    layers.trim();
+}
 
-        Pixel& cur_pixel = layer.pixels[cy][cx];
+// Steps packed as in run_pipeline, scaled for pyramid level `level`. Unknown
+// codes are skipped.
+std::vector<PipelineStep> unpack_pipeline_steps(const double* steps, int stepCount, int level = 0) {
+    std::vector<PipelineStep> unpacked;
+    for (int i = 0; i < stepCount; ++i) {
+        const double* step = steps + i * PIPELINE_STEP_SIZE;
+        int op = static_cast<int>(step[0]);
+        if (!pipeline_op_valid(op)) continue;
+        unpacked.push_back(scaled_pipeline_step(PipelineStep{static_cast<PipelineOp>(op), step[1], step[2]}, level));
+    }
+    return unpacked;
+}
 
-        if (!pixel_within_threshold_fast(cur_pixel, ref_pixel, threshold_sq)) continue;
+/**
+ * Command buffers
+ *
+ * run_commands executes commands in runs (see command_buffer.h): each run is
+ * one undoable step on one layer.
+ */
 
-        if (a == 255) {
-            cur_pixel.r = r;
-            cur_pixel.g = g;
-            cur_pixel.b = b;
-            cur_pixel.a = a;
-        } else {
-            float src_a = a / 255.0f;
-            float dst_a = cur_pixel.a / 255.0f;
-            float out_a = src_a + dst_a * (1.0f - src_a);
-
-            if (out_a > 0.0f) {
-                cur_pixel.r = static_cast<uint8_t>((r * src_a + cur_pixel.r * dst_a * (1.0f - src_a)) / out_a);
-                cur_pixel.g = static_cast<uint8_t>((g * src_a + cur_pixel.g * dst_a * (1.0f - src_a)) / out_a);
-                cur_pixel.b = static_cast<uint8_t>((b * src_a + cur_pixel.b * dst_a * (1.0f - src_a)) / out_a);
-                cur_pixel.a = static_cast<uint8_t>(out_a * 255.0f);
-            }
+// Run commands[first .. last): a single command, or a run of filters on one layer
+void run_command_run(const Command* first, const Command* last, int width, int height) {
+    switch (first->op) {
+        case CommandOp::Undo:
+            history.undo([](int layerId) { return layers.find(layerId); });
+            break;
+        case CommandOp::Redo:
+            history.redo([](int layerId) { return layers.find(layerId); });
+            break;
+        case CommandOp::BucketFill: {
+            const double* p = first->params;
+            edit_layer(layers[first->layerId], [&](Layer& layer) {
+                bucket_fill_layer(layer, static_cast<int>(p[0]), static_cast<int>(p[1]),
+                                  static_cast<uint8_t>(p[2]), static_cast<uint8_t>(p[3]), static_cast<uint8_t>(p[4]),
+                                  static_cast<uint8_t>(p[5]), static_cast<float>(p[6]));
+            });
+            break;
         }
-
-        // Check 4 neighbors
-        const int dx[4] = {1, -1, 0, 0};
-        const int dy[4] = {0, 0, 1, -1};
-        for (int d = 0; d < 4; ++d) {
-            int nx = cx + dx[d], ny = cy + dy[d];
-            if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-                int idx = ny * width + nx;
-                if (!visited[idx]) {
-                    visited[idx] = true;
-                    queue.emplace_back(nx, ny);
-                }
+        case CommandOp::Resize: {
+            const int newWidth = static_cast<int>(first->params[0]);
+            const int newHeight = static_cast<int>(first->params[1]);
+            const int filter = static_cast<int>(first->params[2]);
+            if (!resample_filter_valid(filter)) break;
+            edit_layer(layers[first->layerId], [&](Layer& layer) {
+                history.keep_previous(resample_layer(layer, newWidth, newHeight, static_cast<ResampleFilter>(filter)));
+            });
+            break;
+        }
+        case CommandOp::Sharpen: {
+            const ConvolutionKernel kernel = sharpen_kernel(static_cast<float>(first->params[0]));
+            filter_layer(layers[first->layerId], [&](Layer& layer) { convolve_layer(layer, kernel); });
+            break;
+        }
+        case CommandOp::Emboss:
+            filter_layer(layers[first->layerId], [](Layer& layer) { convolve_layer(layer, emboss_kernel()); });
+            break;
+        case CommandOp::Adjust: {
+            PointProgram program;
+            for (const Command* command = first; command != last; ++command) {
+                if (point_op_valid(static_cast<int>(command->params[0]))) program.add(command_point_op(*command));
             }
+            filter_layer(layers[first->layerId], [&](Layer& layer) { apply_point_program(layer, program); });
+            break;
+        }
+        case CommandOp::QuadCompression: {
+            const int givenWidth = static_cast<int>(first->params[0]);
+            const int givenHeight = static_cast<int>(first->params[1]);
+            if (givenWidth > width || givenHeight > height) break;
+            edit_layer(layers[first->layerId], [&](Layer& layer) {
+                history.keep_previous(quad_tree_compression(layer, givenWidth, givenHeight));
+            });
+            break;
+        }
+        default: {
+            std::vector<PipelineStep> steps;
+            for (const Command* command = first; command != last; ++command) add_command_steps(*command, steps);
+            Pipeline pipeline;
+            for (const PipelineStep& step : steps) pipeline.add(step);
+            filter_layer(layers[first->layerId], [&](Layer& layer) { pipeline.run(layer, run_pipeline_step); });
+            break;
         }
     }
 }
@@ -367,6 +640,27 @@ void bucket_fill_layer(int layer_id, int x, int y, uint8_t r, uint8_t g, uint8_t
  * Exported function APIs 
  */
 
+/**
+ * Tile digests of layer `id` (see tile_digest.h), or nullptr if there is no
+ * such layer. A compressed layer is only decompressed if some of its tiles
+ * changed since the digests were last computed.
+ */
+const std::vector<uint64_t>* layer_tile_digests(int id) {
+    const Layer* peeked = layers.peek(id);
+    if (!peeked) return nullptr;
+    if (peeked->digests && peeked->digests->current(*peeked)) return &peeked->digests->values();
+
+    Layer& layer = *layers.find(id);
+    if (!layer.digests) layer.digests = std::make_shared<TileDigests>();
+    return &layer.digests->update(layer);
+}
+
+// Write a 64-bit digest as two 32-bit halves, low first, for JS
+void put_digest(uint32_t* out, uint64_t digest) {
+    out[0] = static_cast<uint32_t>(digest);
+    out[1] = static_cast<uint32_t>(digest >> 32);
+}
+
 extern "C" {
 
     /**
@@ -379,33 +673,51 @@ extern "C" {
      */
 
     void data_to_layer(uint8_t* data, int width, int height, int id) {
-        Layer layer(id);
-        layer.pixels.resize(height, std::vector<Pixel>(width)); 
-
-        // Current x, y position in the image 
-        int x = 0, y = 0;
-
-        int size = width * height * 4;
+        ENGINE_STAT(stat, "data_to_layer");
+        if (width <= 0 || height <= 0) return;
+
+        // Single contiguous copy; rows are padded to the aligned stride
+        PixelBuffer buffer(width, height);
+        const size_t rowBytes = static_cast<size_t>(width) * sizeof(Pixel);
+        for (int y = 0; y < height; ++y) {
+            std::memcpy(buffer.row(y), data + y * rowBytes, rowBytes);
+        }
+        stat.add(static_cast<uint64_t>(width) * height, rowBytes * height);
 
-        for (int i = 0; i < size; i += 4) {
-            uint8_t r = data[i];
-            uint8_t g = data[i + 1];
-            uint8_t b = data[i + 2];
-            uint8_t a = data[i + 3];
+        // Store the layer in the cache (moved, not copied). The history of the
+        // layer it replaces no longer applies.
+        history.forget(id);
+        layers.insert(id, Layer(id, std::move(buffer)));
+        layers.trim();
+    }
 
-            // Create a new pixel and assign it to the layer 
-            layer.pixels[y][x] = Pixel(r, g, b, a);
+    /**
+     * Allocate a 64-byte aligned buffer of width * height * 4 bytes on the WASM
+     * heap. JS fills it with RGBA data and hands it to `adopt_layer`, which takes
+     * ownership without copying.
+     */
+    uint8_t* alloc_layer_buffer(int width, int height) {
+        if (width <= 0 || height <= 0) return nullptr;
+        return PixelBuffer::allocate_bytes(static_cast<size_t>(width) * height * sizeof(Pixel));
+    }
 
-            // Move to the next pixel 
-            x++;
-            if (x >= width) {
-                x = 0;
-                y++;
-            }
+    /**
+     * Zero-copy ingest. The layer takes ownership of `data`, which must come from
+     * `alloc_layer_buffer` (or `_malloc`) and must NOT be freed by the caller
+     * afterwards. Same layout as `data_to_layer`.
+     */
+    void adopt_layer(uint8_t* data, int width, int height, int id) {
+        ENGINE_STAT(stat, "adopt_layer");
+        if (!data) return;
+        if (width <= 0 || height <= 0) {
+            std::free(data);
+            return;
         }
 
-        // Store the layer in the cache
-        layers[id] = layer;
+        stat.add(static_cast<uint64_t>(width) * height);
+        history.forget(id);
+        layers.insert(id, Layer(id, PixelBuffer::adopt(data, width, height)));
+        layers.trim();
     }
 
     /**
@@ -415,90 +727,88 @@ extern "C" {
      * Order size is the number of layers in the order array.
      */
     void merge_layers(uint8_t* output, int width, int height, int* order, int orderSize) {
-        // Initialize output to transparent black
-        std::fill(output, output + (width * height * 4), 0);
-    
-        // Iterate from top layer down to bottom layer
-        for (int i = orderSize - 1; i >= 0; --i) {
-            int id = order[i];
-            Layer& layer = layers[id];
-    
-            int h = layer.pixels.size();
-            int w = layer.pixels[0].size();
-    
-            for (int y = 0; y < h; ++y) {
-                if (y >= height) continue;
-                auto& row = layer.pixels[y];
-    
-                for (int x = 0; x < w; ++x) {
-                    if (x >= width) continue;
-    
-                    Pixel& p = row[x];
-                    int idx = (y * width + x) * 4;
-    
-                    // Normalize alpha once
-                    float srcAlpha = p.a * (1.0f / 255.0f);
-                    float dstAlpha = output[idx + 3] * (1.0f / 255.0f);
-                    float outAlpha = dstAlpha + srcAlpha * (1 - dstAlpha);
-    
-                    if (outAlpha == 0.0f) continue;
-    
-                    float invOutAlpha = 1.0f / outAlpha;
-    
-                    // Precompute input colors as normalized float
-                    float srcRGB[3] = {
-                        p.r * (1.0f / 255.0f),
-                        p.g * (1.0f / 255.0f),
-                        p.b * (1.0f / 255.0f)
-                    };
-    
-                    for (int c = 0; c < 3; ++c) {
-                        float dstColor = output[idx + c] * (1.0f / 255.0f);
-                        float srcColor = srcRGB[c];
-    
-                        float outColor = (dstColor * dstAlpha + srcColor * srcAlpha * (1 - dstAlpha)) * invOutAlpha;
-                        output[idx + c] = static_cast<uint8_t>(outColor * 255.0f);
-                    }
-    
-                    output[idx + 3] = static_cast<uint8_t>(outAlpha * 255.0f);
-                }
-            }
-        }
-    }    
+        ENGINE_STAT(stat, "merge_layers");
+
+        // Full recomposite: clears the output and blends every layer, top to bottom
+        last_dirty_rect = compositor.composite(output, width, height, layer_stack(order, orderSize), true);
+        layers.trim();
+    }
+
+    /**
+     * Same as merge_layers, but only recomposites the tiles that changed since
+     * the previous composite into the same output buffer. The changed region is
+     * written to dirtyRect as [x, y, width, height] (width = height = 0 when
+     * nothing changed), so JS can redraw just that part of the canvas.
+     */
+    void merge_layers_incremental(uint8_t* output, int width, int height, int* order, int orderSize, int* dirtyRect) {
+        ENGINE_STAT(stat, "merge_layers_incremental");
+        merge_dirty_layers(output, width, height, order, orderSize);
+        get_dirty_rect(dirtyRect);
+    }
+
+    /**
+     * Region [x, y, width, height] of the canvas changed by the most recent
+     * operation. Every exported operation only recomposites the tiles it dirtied,
+     * so JS can `putImageData` just this region.
+     */
+    void get_dirty_rect(int* rect) {
+        rect[0] = last_dirty_rect.x;
+        rect[1] = last_dirty_rect.y;
+        rect[2] = last_dirty_rect.width;
+        rect[3] = last_dirty_rect.height;
+    }
+
+    /**
+     * Number of threads used by every kernel, including the calling thread.
+     * 0 uses one per hardware thread (the default) and 1 runs everything
+     * serially. Builds without thread support always use 1.
+     */
+    void set_thread_count(int count) {
+        ThreadPool::shared().resize(count);
+    }
+
+    int get_thread_count() {
+        return ThreadPool::shared().size();
+    }
 
     void monochrome_average(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        apply_monochrome_filter(layer_id, grayscale_average);
+        ENGINE_STAT(stat, "monochrome_average");
+        filter_layer(layers[layer_id], [](Layer& layer) { apply_monochrome_filter(layer, grayscale_average); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
 
     void monochrome_luminosity(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        apply_monochrome_filter(layer_id, grayscale_luminosity);
+        ENGINE_STAT(stat, "monochrome_luminosity");
+        filter_layer(layers[layer_id], [](Layer& layer) { apply_monochrome_filter(layer, grayscale_luminosity); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
     
     void monochrome_lightness(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        apply_monochrome_filter(layer_id, grayscale_lightness);
+        ENGINE_STAT(stat, "monochrome_lightness");
+        filter_layer(layers[layer_id], [](Layer& layer) { apply_monochrome_filter(layer, grayscale_lightness); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
     
     void monochrome_itu(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        apply_monochrome_filter(layer_id, grayscale_itu);
+        ENGINE_STAT(stat, "monochrome_itu");
+        filter_layer(layers[layer_id], [](Layer& layer) { apply_monochrome_filter(layer, grayscale_itu); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
 
     void gaussian_blur(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double sigma, int kernelSize) {
-        gaussian_blur_layer(layer_id, sigma, kernelSize);
+        ENGINE_STAT(stat, "gaussian_blur");
+        filter_layer(layers[layer_id], [&](Layer& layer) { gaussian_blur_layer(layer, sigma, kernelSize); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
 
     // Clamp utility 
@@ -507,47 +817,314 @@ extern "C" {
     }
 
     void edge_sobel(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        edge_sobel_layer(layer_id);
+        ENGINE_STAT(stat, "edge_sobel");
+        filter_layer(layers[layer_id], [](Layer& layer) { edge_sobel_layer(layer); });
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }     
 
     void laplacian_filter(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
-        laplacian_filter_layer(layer_id);
+        ENGINE_STAT(stat, "laplacian_filter");
+        filter_layer(layers[layer_id], laplacian_filter_layer);
     
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
 
     void edge_laplacian_of_gaussian(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double sigma, int kernelSize) {
+        ENGINE_STAT(stat, "edge_laplacian_of_gaussian");
+        Pipeline pipeline;
+
         // Step 1: convert to grayscale 
-        apply_monochrome_filter(layer_id, grayscale_itu);
+        pipeline.add(PipelineOp::MonochromeItu);
         
         // Step 2: apply Gaussian blur 
-        gaussian_blur_layer(layer_id, sigma, kernelSize);
+        pipeline.add(PipelineOp::GaussianBlur, sigma, kernelSize);
     
         // Step 3: apply Laplacian filter
-        laplacian_filter_layer(layer_id);
+        pipeline.add(PipelineOp::LaplacianFilter);
 
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize);
+        // All three steps run in a single sweep over the layer
+        filter_layer(layers[layer_id], [&](Layer& layer) { pipeline.run(layer, run_pipeline_step); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
     }
       
+    /**
+     * Sharpen the colour channels: each pixel plus `amount` times its
+     * difference from its 4 neighbours (0 leaves the layer as is, 1 is the
+     * usual sharpen kernel).
+     */
+    void sharpen(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double amount) {
+        ENGINE_STAT(stat, "sharpen");
+        const ConvolutionKernel kernel = sharpen_kernel(static_cast<float>(amount));
+        filter_layer(layers[layer_id], [&](Layer& layer) { convolve_layer(layer, kernel); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    void emboss(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id) {
+        ENGINE_STAT(stat, "emboss");
+        filter_layer(layers[layer_id], [](Layer& layer) { convolve_layer(layer, emboss_kernel()); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    /**
+     * Filter the colour channels with a user kernel: `weights` holds size x
+     * size weights, row-major (size odd, at most 9), and `bias` is added to
+     * every result. Returns 1, or 0 if the kernel is invalid, in which case
+     * the layer is left as is.
+     */
+    int apply_kernel(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id,
+                     float* weights, int size, double bias) {
+        ENGINE_STAT(stat, "apply_kernel");
+        const ConvolutionKernel kernel = weights ? ConvolutionKernel::from_float(size, weights) : ConvolutionKernel();
+        if (!kernel.valid()) return 0;
+        filter_layer(layers[layer_id], [&](Layer& layer) { convolve_layer(layer, kernel, static_cast<int>(std::lround(bias))); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+        return 1;
+    }
+
+    /**
+     * Apply a chain of colour adjustments to the layer with id `layer_id` as
+     * one undoable step, compiled into a single pass over the layer (see
+     * point_ops.h).
+     *
+     * `ops` holds opCount operations of POINT_OP_SIZE (13) doubles each:
+     * [PointOpKind code, 12 params]. Unused params are ignored, except that a
+     * curve's points end at the first x < 0. Unknown codes are skipped.
+     */
+    void adjust_colors(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double* ops, int opCount) {
+        ENGINE_STAT(stat, "adjust_colors");
+        PointProgram program;
+        for (int i = 0; i < opCount; ++i) {
+            const double* packed = ops + static_cast<size_t>(i) * POINT_OP_SIZE;
+            const int kind = static_cast<int>(packed[0]);
+            if (!point_op_valid(kind)) continue;
+
+            PointOp op{static_cast<PointOpKind>(kind)};
+            std::copy(packed + 1, packed + POINT_OP_SIZE, op.params);
+            program.add(op);
+        }
+        filter_layer(layers[layer_id], [&](Layer& layer) { apply_point_program(layer, program); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    /**
+     * Run a chain of filters on the layer with id `layer_id` in as few passes
+     * over the layer as possible (see pipeline.h).
+     *
+     * `steps` holds stepCount steps of PIPELINE_STEP_SIZE (3) doubles each:
+     * [op, param0, param1], where op is a PipelineOp code (0-3 monochrome
+     * average / luminosity / lightness / ITU, 4 Gaussian blur with param0 =
+     * sigma and param1 = kernel size, 5 Sobel, 6 Laplacian). Unknown codes are
+     * skipped.
+     */
+    void run_pipeline(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double* steps, int stepCount) {
+        ENGINE_STAT(stat, "run_pipeline");
+        Pipeline pipeline;
+        for (const PipelineStep& step : unpack_pipeline_steps(steps, stepCount)) pipeline.add(step);
+        filter_layer(layers[layer_id], [&](Layer& layer) { pipeline.run(layer, run_pipeline_step); });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    /**
+     * Run a batch of operations and recomposite once at the end, instead of
+     * once per operation (see command_buffer.h for the packing of `commands`,
+     * commandCount commands of COMMAND_SIZE (9) doubles each, and for the
+     * flags: 1 coalesces filters, 2 reorders by layer, 0 runs the commands
+     * exactly as separate calls would). Unknown codes are skipped. Returns the
+     * number of commands run.
+     */
+    int run_commands(uint8_t* data, int width, int height, int* order, int orderSize, double* commands, int commandCount, int flags) {
+        ENGINE_STAT(stat, "run_commands");
+        std::vector<Command> unpacked = unpack_commands(commands, commandCount);
+        if (flags & COMMANDS_REORDER) unpacked = reorder_commands(unpacked);
+
+        const std::vector<size_t> runs = command_runs(unpacked, (flags & COMMANDS_COALESCE) != 0);
+        int previousLayer = -1;
+        for (size_t i = 0; i + 1 < runs.size(); ++i) {
+            // Compress layers the batch is done with, if over the budget
+            const int layerId = unpacked[runs[i]].layerId;
+            if (i > 0 && layerId != previousLayer) layers.trim();
+            previousLayer = layerId;
+
+            run_command_run(unpacked.data() + runs[i], unpacked.data() + runs[i + 1], width, height);
+        }
+
+        // Recomposite the tiles the whole batch dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+        return static_cast<int>(unpacked.size());
+    }
+
+    /**
+     * Preview mode
+     *
+     * Dragging a slider should not re-filter a full resolution layer on every
+     * tick. Instead, the filter is previewed on a scaled-down copy of the
+     * layer that still covers the display (see pyramid.h), with its radii
+     * scaled to match, and the full resolution result is computed afterwards
+     * in chunks that each fit in a frame:
+     *
+     *   set_preview_size(displayWidth, displayHeight);
+     *   get_preview_size(width, height, size);      // [previewW, previewH, level]
+     *   preview_pipeline(preview, width, height, order, orderSize, id, steps, n);
+     *   ... on every tick, then once the value settles:
+     *   refine_pipeline(id, steps, n);
+     *   while (refine_step(data, width, height, order, orderSize, 8)) ... next frame
+     *
+     * The preview output holds previewW * previewH RGBA pixels; width and height
+     * are always the full canvas size.
+     */
+
+    // Display size previews are rendered for. 0 x 0 renders them at full size.
+    void set_preview_size(int displayWidth, int displayHeight) {
+        preview_display_width = std::max(0, displayWidth);
+        preview_display_height = std::max(0, displayHeight);
+    }
+
+    // Preview size of a width x height canvas, as [width, height, pyramid level]
+    void get_preview_size(int width, int height, int* size) {
+        int level = preview_level(width, height);
+        size[0] = pyramid_extent(width, level);
+        size[1] = pyramid_extent(height, level);
+        size[2] = level;
+    }
+
+    // merge_layers for previews: composites every layer at the preview level
+    void merge_layers_preview(uint8_t* output, int width, int height, int* order, int orderSize) {
+        ENGINE_STAT(stat, "merge_layers_preview");
+        merge_preview_layers(output, width, height, order, orderSize, preview_level(width, height));
+    }
+
+    /**
+     * Preview run_pipeline on layer `layer_id` without changing the layer. Only
+     * the tiles of the preview that changed are recomposited (see
+     * get_dirty_rect, in preview pixels).
+     */
+    void preview_pipeline(uint8_t* output, int width, int height, int* order, int orderSize, int layer_id, double* steps, int stepCount) {
+        ENGINE_STAT(stat, "preview_pipeline");
+        const int level = preview_level(width, height);
+        Layer* layer = layers.find(layer_id);
+        if (!layer) {
+            merge_preview_layers(output, width, height, order, orderSize, level);
+            return;
+        }
+
+        // Filter a copy of the layer's level, reusing the buffer between ticks
+        const Layer& source = pyramid_level(*layer, level);
+        if (preview_layer.width() != source.width() || preview_layer.height() != source.height()) {
+            preview_layer = Layer(layer_id, PixelBuffer(source.width(), source.height()));
+        }
+        preview_layer.id = layer_id;
+        for (int y = 0; y < source.height(); ++y) {
+            std::memcpy(static_cast<void*>(preview_layer.pixels.row(y)), source.pixels.row(y),
+                        static_cast<size_t>(source.width()) * sizeof(Pixel));
+        }
+        preview_layer.mark_dirty(0, 0, source.width(), source.height());
+
+        // A leading Sobel scales the source level's magnitudes, which stay
+        // cached from one tick to the next if the cache has room for them
+        std::vector<PipelineStep> unpacked = unpack_pipeline_steps(steps, stepCount, level);
+        size_t first = 0;
+        if (!unpacked.empty() && unpacked[0].op == PipelineOp::EdgeSobel) {
+            PlaneCache::Admit admit(PlaneCache::shared(), source);
+            if (const std::shared_ptr<const GradientPlane> gradient = cached_sobel_gradient(source)) {
+                sobel_normalize(preview_layer, *gradient);
+                first = 1;
+            }
+        }
+
+        Pipeline pipeline;
+        for (size_t i = first; i < unpacked.size(); ++i) pipeline.add(unpacked[i]);
+        pipeline.run(preview_layer, run_pipeline_step);
+
+        merge_preview_layers(output, width, height, order, orderSize, level, layer_id, &preview_layer);
+    }
+
+    /**
+     * Start running the steps on layer `layer_id` at full resolution, replacing
+     * any run already in progress. Nothing changes until refine_step finishes.
+     */
+    void refine_pipeline(int layer_id, double* steps, int stepCount) {
+        refine_job.reset();
+        Layer* layer = layers.find(layer_id);
+        if (!layer) return;
+
+        refine_job.reset(new PipelineJob(*layer, unpack_pipeline_steps(steps, stepCount)));
+        refine_layer_id = layer_id;
+    }
+
+    /**
+     * Run chunks of the refine_pipeline run for about budgetMs milliseconds
+     * (at least one chunk). Returns 1 while there is work left. Once done, the
+     * result replaces the layer, the dirtied tiles are recomposited into data
+     * and 0 is returned. A run whose layer was changed or removed in the
+     * meantime is dropped, also returning 0.
+     */
+    int refine_step(uint8_t* data, int width, int height, int* order, int orderSize, double budgetMs) {
+        ENGINE_STAT(stat, "refine_step");
+        if (!refine_job) return 0;
+
+        Layer* layer = layers.find(refine_layer_id);
+        if (!layer || !refine_job->matches(*layer)) {
+            refine_job.reset();
+            return 0;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        do {
+            refine_job->run_chunk(run_pipeline_step);
+        } while (!refine_job->done() &&
+                 std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() < budgetMs);
+
+        if (!refine_job->done()) return 1;
+
+        edit_layer(*layer, [](Layer& target) { history.keep_previous(refine_job->commit(target)); });
+        refine_job.reset();
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+        return 0;
+    }
+
+    // Fraction (0 to 1) of the refine_pipeline run done so far; 1 when idle
+    double get_refine_progress() {
+        return refine_job ? refine_job->progress() : 1.0;
+    }
+
+    // Abandon the refine_pipeline run, leaving the layer as it was
+    void cancel_refine() {
+        refine_job.reset();
+    }
+
     /**
      * Bucket fill algorithm to fill a region with a color.
      * 
-     * BFS algorithm, centered on the pixel at (x, y) in the layer with id `layer_id`. 
+     * Scanline fill, centered on the pixel at (x, y) in the layer with id `layer_id`. 
      * If the pixel in the connected region is within the error threshold of the reference pixel,
-     * it will be filled with the new color (r, g, b, a). 
+     * it will be filled with the new color (r, g, b, a). Clicking again inside a region that
+     * was just filled (e.g. to try another colour) reuses the region instead of searching again. 
      */
     void bucket_fill(uint8_t* data, int width, int height, int* order, int orderSize,
                      int layer_id, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a,
                      float error_threshold) {
-        bucket_fill_layer(layer_id, x, y, r, g, b, a, error_threshold);
+        ENGINE_STAT(stat, "bucket_fill");
+        edit_layer(layers[layer_id], [&](Layer& layer) { bucket_fill_layer(layer, x, y, r, g, b, a, error_threshold); });
 
-        // Call merge_layers to update the output data
-        merge_layers(data, width, height, order, orderSize); 
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize); 
     }
 
     /**
@@ -558,19 +1135,661 @@ extern "C" {
      * of the image. 
      */
     void quad_compression(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, int givenWidth, int givenHeight) {
+        ENGINE_STAT(stat, "quad_compression");
         // Check to make sure size is correct 
         if (givenWidth > width || givenHeight > height) {
-            merge_layers(data, width, height, order, orderSize); 
+            merge_dirty_layers(data, width, height, order, orderSize);
             return;  
         }
 
         // Select layer with given ID 
         Layer& layer = layers[layer_id]; 
 
-        // Layer compression 
-        layer.quad_tree_compression(givenWidth, givenHeight); 
+        // Layer compression, keeping the original pixels for undo
+        edit_layer(layer, [&](Layer& target) {
+            history.keep_previous(quad_tree_compression(target, givenWidth, givenHeight));
+        });
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    /**
+     * Resize and thumbnails
+     *
+     * Separable area / Lanczos-3 resampling (see resample.h); `filter` is 0
+     * for area averaging and 1 for Lanczos-3.
+     */
+
+    /**
+     * Resize the layer with id `layer_id` to newWidth x newHeight, up or down,
+     * as one undoable step. Unknown filters leave the layer as is.
+     */
+    void resize_layer(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id,
+                      int newWidth, int newHeight, int filter) {
+        ENGINE_STAT(stat, "resize_layer");
+        if (resample_filter_valid(filter)) {
+            edit_layer(layers[layer_id], [&](Layer& layer) {
+                history.keep_previous(resample_layer(layer, newWidth, newHeight, static_cast<ResampleFilter>(filter)));
+            });
+        }
+
+        // Recomposite the tiles this operation dirtied
+        merge_dirty_layers(data, width, height, order, orderSize);
+    }
+
+    /**
+     * Resize the RGBA image `src` (srcWidth x srcHeight, as in data_to_layer)
+     * into `dst` (dstWidth x dstHeight), e.g. for thumbnails or export,
+     * without touching any layer. Returns 1, or 0 if a size or the filter is
+     * invalid.
+     */
+    int resample_image(uint8_t* src, int srcWidth, int srcHeight, uint8_t* dst, int dstWidth, int dstHeight, int filter) {
+        ENGINE_STAT(stat, "resample_image");
+        if (!resample_filter_valid(filter) || srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0) return 0;
+
+        PixelBuffer input(srcWidth, srcHeight);
+        if (input.empty()) return 0;
+        const size_t srcRowBytes = static_cast<size_t>(srcWidth) * sizeof(Pixel);
+        for (int y = 0; y < srcHeight; ++y) std::memcpy(static_cast<void*>(input.row(y)), src + y * srcRowBytes, srcRowBytes);
+
+        const PixelBuffer output = resample(input, dstWidth, dstHeight, static_cast<ResampleFilter>(filter));
+        if (output.empty()) return 0;
+        const size_t dstRowBytes = static_cast<size_t>(dstWidth) * sizeof(Pixel);
+        for (int y = 0; y < dstHeight; ++y) std::memcpy(dst + y * dstRowBytes, output.row(y), dstRowBytes);
+
+        stat.add(static_cast<uint64_t>(dstWidth) * dstHeight, input.size_bytes() + output.size_bytes());
+        return 1;
+    }
+
+    /**
+     * Undo / redo
+     *
+     * Each exported operation that changes a layer is one step. Both return
+     * the id of the layer that changed, or -1 if there was nothing to undo or
+     * redo, and recomposite the tiles that changed. Loading a layer with
+     * data_to_layer or adopt_layer clears that layer's history.
+     */
+    int undo(uint8_t* data, int width, int height, int* order, int orderSize) {
+        ENGINE_STAT(stat, "undo");
+        int id = history.undo([](int layerId) { return layers.find(layerId); });
+        merge_dirty_layers(data, width, height, order, orderSize);
+        return id;
+    }
+
+    int redo(uint8_t* data, int width, int height, int* order, int orderSize) {
+        ENGINE_STAT(stat, "redo");
+        int id = history.redo([](int layerId) { return layers.find(layerId); });
+        merge_dirty_layers(data, width, height, order, orderSize);
+        return id;
+    }
+
+    // Memory the history may use; the oldest steps are forgotten beyond it
+    void set_history_budget(int megabytes) {
+        history.set_budget(static_cast<size_t>(std::max(0, megabytes)) << 20);
+    }
+
+    // [undo steps, redo steps, bytes used, byte budget]
+    void get_history_stats(double* stats) {
+        History::Stats s = history.stats();
+        stats[0] = static_cast<double>(s.undoEntries);
+        stats[1] = static_cast<double>(s.redoEntries);
+        stats[2] = static_cast<double>(s.bytes);
+        stats[3] = static_cast<double>(s.budget);
+    }
+
+    void clear_history() {
+        history.clear();
+    }
+
+    /**
+     * Byte budget of the derived-plane cache (see plane_cache.h): Sobel
+     * magnitudes and quad trees kept for reuse while a layer, or an undo,
+     * brings back the same pixels. 0 disables it.
+     */
+    void set_plane_cache_budget(int megabytes) {
+        PlaneCache::shared().set_budget(static_cast<size_t>(std::max(0, megabytes)) << 20);
+    }
+
+    // [planes, bytes used, byte budget, hits, misses]
+    void get_plane_cache_stats(double* stats) {
+        PlaneCache::Stats s = PlaneCache::shared().stats();
+        stats[0] = static_cast<double>(s.entries);
+        stats[1] = static_cast<double>(s.bytes);
+        stats[2] = static_cast<double>(s.budget);
+        stats[3] = static_cast<double>(s.hits);
+        stats[4] = static_cast<double>(s.misses);
+    }
+
+    /**
+     * Bytes each thread's scratch arena (see scratch_arena.h) keeps between
+     * operations, for the temporaries of the kernels. An operation needing
+     * more still runs, and frees the excess when it is done. A lower budget
+     * trims the calling thread's arena now and the workers' after their next
+     * operation.
+     */
+    void set_scratch_budget(int megabytes) {
+        ScratchArena::set_budget(static_cast<size_t>(std::max(0, megabytes)) << 20);
+    }
+
+    // [arenas, bytes reserved, high-water bytes, byte budget, blocks allocated]
+    void get_scratch_stats(double* stats) {
+        ScratchArena::Stats s = ScratchArena::stats();
+        stats[0] = static_cast<double>(s.arenas);
+        stats[1] = static_cast<double>(s.reserved);
+        stats[2] = static_cast<double>(s.highWater);
+        stats[3] = static_cast<double>(s.budget);
+        stats[4] = static_cast<double>(s.blocks);
+    }
+
+    /**
+     * Layer memory
+     *
+     * Layers not used recently are compressed once the uncompressed layers
+     * exceed the budget, and decompressed when an operation or merge needs
+     * them again (see layer_store.h).
+     */
+    void set_layer_memory_budget(int megabytes) {
+        layers.set_budget(static_cast<size_t>(std::max(0, megabytes)) << 20);
+    }
+
+    /**
+     * [layers, resident layers, resident bytes, compressed layers, compressed
+     * bytes, uncompressed size of the compressed layers, byte budget]
+     */
+    void get_layer_memory_stats(double* stats) {
+        LayerStore::Stats s = layers.stats();
+        stats[0] = static_cast<double>(s.layers);
+        stats[1] = static_cast<double>(s.residentLayers);
+        stats[2] = static_cast<double>(s.residentBytes);
+        stats[3] = static_cast<double>(s.compressedLayers);
+        stats[4] = static_cast<double>(s.compressedBytes);
+        stats[5] = static_cast<double>(s.compressedRawBytes);
+        stats[6] = static_cast<double>(s.budget);
+    }
+
+    /**
+     * Engine statistics
+     *
+     * Time, pixels and bytes of every operation and of its phases (see
+     * engine_stats.h), to find where a slow operation spends its time:
+     *
+     *   reset_engine_stats();
+     *   ... run the operation
+     *   n = get_engine_stats(stats, capacity);
+     *   get_engine_stat_name(i) ... for i < n
+     */
+
+    /**
+     * Counters of every probe used so far, EngineStats::FIELDS (5) values
+     * each: [calls, total ms, longest ms, pixels, bytes], for at most
+     * capacity / 5 probes. Returns the number of probes (0 if the build has
+     * them compiled out).
+     */
+    int get_engine_stats(double* stats, int capacity) {
+        EngineStats& engine = EngineStats::shared();
+        const int count = engine.size();
+        for (int i = 0; i < count && (i + 1) * EngineStats::FIELDS <= capacity; ++i) {
+            engine.snapshot(i, stats + i * EngineStats::FIELDS);
+        }
+        return count;
+    }
+
+    // Name of probe `index`, e.g. "gaussian_blur" or "gaussian.horizontal"; "" if none
+    const char* get_engine_stat_name(int index) {
+        return EngineStats::shared().name(index);
+    }
 
-        // Call merge_layers to update the output data 
-        merge_layers(data, width, height, order, orderSize); 
+    // Zero every counter
+    void reset_engine_stats() {
+        EngineStats::shared().reset();
+    }
+
+    /**
+     * Remove layer `id` and free its memory, along with its history and any
+     * refine_pipeline run on it. Returns 1 if there was such a layer.
+     */
+    int delete_layer(int id) {
+        history.forget(id);
+        if (const Layer* layer = layers.peek(id)) PlaneCache::shared().forget(layer->uid);
+        if (refine_job && refine_layer_id == id) refine_job.reset();
+        if (preview_layer.id == id) preview_layer = Layer();
+        return layers.erase(id) ? 1 : 0;
+    }
+
+    /**
+     * Snapshots
+     *
+     * Serialize layers to a compact stream in chunks, e.g. to send them to a
+     * peer, and restore them from one (see snapshot.h):
+     *
+     *   snapshot_begin(ids, count);
+     *   while ((chunk = snapshot_next(targetBytes, size)) && size[0] > 0) ... send chunk
+     *   snapshot_end();
+     *
+     *   restore_begin();
+     *   restore_feed(chunk, chunkSize) ... per chunk received, until it returns 1
+     */
+
+    // Start a snapshot of the layers with the given ids, in order
+    void snapshot_begin(int* ids, int count) {
+        snapshot_writer.reset(new SnapshotWriter(layers, std::vector<int>(ids, ids + std::max(0, count))));
+        snapshot_chunk.clear();
+    }
+
+    /**
+     * The next chunk of the snapshot, of about targetBytes bytes (whole
+     * records, so it may be larger). Its size is written to size[0]: 0 once
+     * the snapshot is complete, or -1 (returning null) if a layer changed
+     * since snapshot_begin, in which case the snapshot must be restarted. The
+     * chunk stays valid until the next call.
+     */
+    uint8_t* snapshot_next(int targetBytes, int* size) {
+        ENGINE_STAT(stat, "snapshot_next");
+        snapshot_chunk.clear();
+        if (!snapshot_writer) {
+            size[0] = 0;
+            return snapshot_chunk.data();
+        }
+        if (!snapshot_writer->next(snapshot_chunk, static_cast<size_t>(std::max(1, targetBytes)))) {
+            snapshot_writer.reset();
+            size[0] = -1;
+            return nullptr;
+        }
+        if (snapshot_writer->done() && snapshot_chunk.empty()) snapshot_writer.reset();
+        size[0] = static_cast<int>(snapshot_chunk.size());
+        stat.add(0, snapshot_chunk.size());
+        return snapshot_chunk.data();
+    }
+
+    void snapshot_end() {
+        snapshot_writer.reset();
+        std::vector<uint8_t>().swap(snapshot_chunk);
+    }
+
+    // Start restoring a snapshot, abandoning any restore in progress
+    void restore_begin() {
+        snapshot_reader.reset(new SnapshotReader(layers));
+    }
+
+    /**
+     * Apply the next size bytes of the snapshot. Layers replace those with the
+     * same id (and their history) as soon as they start, and fill in as their
+     * tiles arrive. A patch replaces the tiles it carries and forgets the
+     * layer's history. Returns 1 once the snapshot is complete, 0 while more is
+     * expected, and -1 if the data is malformed.
+     */
+    int restore_feed(uint8_t* data, int size) {
+        ENGINE_STAT(stat, "restore_feed");
+        if (!snapshot_reader) return -1;
+
+        stat.add(0, static_cast<uint64_t>(std::max(0, size)));
+        const size_t known = snapshot_reader->layers().size();
+        SnapshotReader::Status status = snapshot_reader->feed(data, static_cast<size_t>(std::max(0, size)));
+        const std::vector<SnapshotReader::LayerInfo>& restored = snapshot_reader->layers();
+        for (size_t i = known; i < restored.size(); ++i) history.forget(restored[i].id);
+        layers.trim();
+        return status;
+    }
+
+    /**
+     * Layers restored so far, as [id, width, height] triples, for at most
+     * capacity layers. Returns the number of layers.
+     */
+    int get_restored_layers(int* info, int capacity) {
+        if (!snapshot_reader) return 0;
+        const std::vector<SnapshotReader::LayerInfo>& restored = snapshot_reader->layers();
+        for (int i = 0; i < capacity && i < static_cast<int>(restored.size()); ++i) {
+            info[i * 3] = restored[i].id;
+            info[i * 3 + 1] = restored[i].width;
+            info[i * 3 + 2] = restored[i].height;
+        }
+        return static_cast<int>(restored.size());
+    }
+
+    /**
+     * Resync
+     *
+     * Peers check that their copies of a layer agree by exchanging digests
+     * (tile_digest.h) instead of pixels, and repair only the tiles that
+     * differ:
+     *
+     *   peer A: get_tile_digests(id, digests, capacity) ... send the digests
+     *   peer B: diff_tile_digests(id, remoteDigests, count, tiles, capacity)
+     *           ... send the mismatching tile indices to A
+     *   peer A: snapshot_tiles_begin(id, tiles, count), then snapshot_next /
+     *           snapshot_end as for a snapshot ... send the chunks
+     *   peer B: restore_begin(), restore_feed(chunk, chunkSize) per chunk
+     *
+     * Digests are written as [low, high] pairs of 32-bit halves. Peers only
+     * stay in sync if they all use the integer kernels (set_integer_kernels).
+     */
+
+    /**
+     * Use the integer-only mode of every kernel (enabled != 0), whose results
+     * are bit-identical on every engine, or the default float mode.
+     */
+    void set_integer_kernels(int enabled) {
+        use_integer_kernels(enabled != 0);
+    }
+
+    /**
+     * Write the digest of each tile of layer `id` (row-major, as the tiles
+     * of 64 x 64 pixels) to `digests`, for at most capacity tiles. Only the
+     * tiles changed since the last call are hashed. Returns the number of
+     * tiles, or -1 if there is no such layer.
+     */
+    int get_tile_digests(int id, uint32_t* digests, int capacity) {
+        ENGINE_STAT(stat, "get_tile_digests");
+        const std::vector<uint64_t>* tiles = layer_tile_digests(id);
+        if (!tiles) return -1;
+        for (int t = 0; t < capacity && t < static_cast<int>(tiles->size()); ++t) {
+            put_digest(digests + 2 * t, (*tiles)[t]);
+        }
+        return static_cast<int>(tiles->size());
+    }
+
+    /**
+     * Write a digest of the whole of layer `id`, including its size, to
+     * digest[0..1]. Returns 1, or 0 if there is no such layer.
+     */
+    int get_layer_digest(int id, uint32_t* digest) {
+        const std::vector<uint64_t>* tiles = layer_tile_digests(id);
+        if (!tiles) return 0;
+
+        const Layer* layer = layers.peek(id);
+        int width = layer->width(), height = layer->height();
+        if (const CompressedPixels* compressed = layers.compressed(id)) {
+            width = compressed->width;
+            height = compressed->height;
+        }
+        put_digest(digest, layer_digest(*tiles, width, height));
+        return 1;
+    }
+
+    /**
+     * Compare a peer's tile digests of layer `id` (count [low, high] pairs,
+     * from get_tile_digests) with ours, and write the indices of the tiles
+     * that differ to `tiles`, for at most capacity tiles. Returns the number
+     * of differing tiles, or -1 if there is no such layer or the peer's layer
+     * has a different number of tiles (the whole layer must be resent).
+     */
+    int diff_tile_digests(int id, uint32_t* digests, int count, int* tiles, int capacity) {
+        const std::vector<uint64_t>* local = layer_tile_digests(id);
+        if (!local || count != static_cast<int>(local->size())) return -1;
+
+        int differing = 0;
+        for (int t = 0; t < count; ++t) {
+            const uint64_t remote = static_cast<uint64_t>(digests[2 * t + 1]) << 32 | digests[2 * t];
+            if (remote == (*local)[t]) continue;
+            if (differing < capacity) tiles[differing] = t;
+            ++differing;
+        }
+        return differing;
+    }
+
+    /**
+     * Start a patch snapshot of the given tiles of layer `id`, read with
+     * snapshot_next and snapshot_end. Restoring it replaces just those tiles
+     * of the peer's layer, which must have the same size. Returns the number
+     * of tiles it carries, or -1 if there is no such layer.
+     */
+    int snapshot_tiles_begin(int id, int* tiles, int count) {
+        ENGINE_STAT(stat, "snapshot_tiles_begin");
+        snapshot_chunk.clear();
+        if (!layers.peek(id)) {
+            snapshot_writer.reset();
+            return -1;
+        }
+        snapshot_writer.reset(new SnapshotWriter(layers, id, std::vector<int>(tiles, tiles + std::max(0, count))));
+        return static_cast<int>(snapshot_writer->tile_count());
     }
 }
+
+#if !defined(__EMSCRIPTEN__)
+
+// Out-of-core images by id (see out_of_core.h)
+std::unordered_map<int, std::unique_ptr<TiledImage>> tiled_images;
+int next_tiled_image_id = 1;
+
+TiledImage* find_tiled_image(int id) {
+    auto it = tiled_images.find(id);
+    return it == tiled_images.end() ? nullptr : it->second.get();
+}
+
+/**
+ * Run filter steps on an out-of-core image. Consecutive point operations run
+ * as one compiled program, tile by tile; runs of steps with neighbours share one sweep of bands with
+ * the halo of all of them. Sobel normalizes by the largest magnitude in the
+ * whole image, so it first scans every band for it.
+ */
+void run_tiled_pipeline(TiledImage& image, const std::vector<PipelineStep>& steps) {
+    size_t i = 0;
+    while (i < steps.size()) {
+        if (steps[i].op == PipelineOp::EdgeSobel) {
+            int maxMag = 1;
+            scan_bands(image, 1, [&](const Layer& band, int first, int last) {
+                maxMag = std::max(maxMag, sobel_max_magnitude(band, first, last));
+            });
+            stream_bands(image, 1, [&](Layer& band) { edge_sobel_layer(band, maxMag); });
+            ++i;
+            continue;
+        }
+
+        size_t end = i;
+        int halo = 0;
+        while (end < steps.size() && steps[end].op != PipelineOp::EdgeSobel) halo += pipeline_step_reach(steps[end++]);
+
+        if (halo == 0) {
+            PointProgram program;
+            for (size_t j = i; j < end; ++j) {
+                program.add(PointOp{grayscale_point_op(pipeline_grayscale_fn(steps[j].op))});
+            }
+            stream_tiles(image, [&](Pixel* row, int count) { program.run(row, count); });
+        } else {
+            stream_bands(image, halo, [&](Layer& band) {
+                Pipeline pipeline;
+                for (size_t j = i; j < end; ++j) pipeline.add(steps[j]);
+                pipeline.run(band, run_pipeline_step);
+            });
+        }
+        i = end;
+    }
+}
+
+/**
+ * Out-of-core images (native builds only)
+ *
+ * Images too large for memory, kept in memory-mapped scratch files and
+ * processed in tiles and bands within a fixed budget of resident tiles (see
+ * out_of_core.h). They are separate from the layers: rows are copied in and
+ * out, e.g. while decoding or encoding a file.
+ */
+extern "C" {
+    // Create a transparent out-of-core image. Returns its id, or -1 on failure.
+    int tiled_image_create(int width, int height) {
+        if (width <= 0 || height <= 0) return -1;
+        std::unique_ptr<TiledImage> image(new TiledImage(width, height));
+        if (!image->valid()) return -1;
+        tiled_images[next_tiled_image_id] = std::move(image);
+        return next_tiled_image_id++;
+    }
+
+    // Free an out-of-core image and its scratch file
+    void tiled_image_destroy(int id) {
+        tiled_images.erase(id);
+    }
+
+    /**
+     * Copy `rows` rows of tightly packed RGBA, starting at row y, into (write)
+     * or out of (read) an out-of-core image. Returns 1, or 0 if there is no
+     * such image or the rows are out of range.
+     */
+    int tiled_image_write(int id, uint8_t* data, int y, int rows) {
+        ENGINE_STAT(stat, "tiled_image_write");
+        TiledImage* image = find_tiled_image(id);
+        if (!image || y < 0 || rows < 0 || y + rows > image->height) return 0;
+        image->write_rows(y, y + rows, reinterpret_cast<const Pixel*>(data), image->width);
+        stat.add(static_cast<uint64_t>(image->width) * rows, static_cast<uint64_t>(image->width) * rows * sizeof(Pixel));
+        return 1;
+    }
+
+    int tiled_image_read(int id, uint8_t* data, int y, int rows) {
+        ENGINE_STAT(stat, "tiled_image_read");
+        TiledImage* image = find_tiled_image(id);
+        if (!image || y < 0 || rows < 0 || y + rows > image->height) return 0;
+        image->read_rows(y, y + rows, reinterpret_cast<Pixel*>(data), image->width);
+        stat.add(static_cast<uint64_t>(image->width) * rows, static_cast<uint64_t>(image->width) * rows * sizeof(Pixel));
+        return 1;
+    }
+
+    /**
+     * Run filter steps (packed as for run_pipeline) on an out-of-core image.
+     * The results are identical to running them on a layer. Returns 1, or 0
+     * if there is no such image.
+     */
+    int tiled_run_pipeline(int id, double* steps, int stepCount) {
+        ENGINE_STAT(stat, "tiled_run_pipeline");
+        TiledImage* image = find_tiled_image(id);
+        if (!image) return 0;
+        run_tiled_pipeline(*image, unpack_pipeline_steps(steps, stepCount));
+        return 1;
+    }
+
+    /**
+     * Composite out-of-core images (bottom first, as merge_layers) into the
+     * one with id outputId. Returns 1, or 0 if an id is unknown.
+     */
+    int tiled_merge(int* ids, int count, int outputId) {
+        ENGINE_STAT(stat, "tiled_merge");
+        TiledImage* output = find_tiled_image(outputId);
+        if (!output) return 0;
+        std::vector<TiledImage*> stack;
+        for (int i = 0; i < count; ++i) {
+            TiledImage* image = find_tiled_image(ids[i]);
+            if (!image) return 0;
+            stack.push_back(image);
+        }
+        merge_tiled(stack, *output);
+        return 1;
+    }
+
+    // Resident tile budget shared by all out-of-core images, in megabytes
+    void set_tiled_cache_budget(int megabytes) {
+        TileCache::shared().set_budget(static_cast<size_t>(std::max(0, megabytes)) << 20);
+    }
+
+    /**
+     * Write [resident tiles, resident bytes, budget bytes, tile loads,
+     * evictions] to stats[0..4].
+     */
+    void get_tiled_cache_stats(double* stats) {
+        const TileCache::Stats s = TileCache::shared().stats();
+        stats[0] = static_cast<double>(s.residentTiles);
+        stats[1] = static_cast<double>(s.residentBytes);
+        stats[2] = static_cast<double>(s.budget);
+        stats[3] = static_cast<double>(s.loads);
+        stats[4] = static_cast<double>(s.evictions);
+    }
+}
+
+/**
+ * Batch images (native builds only)
+ *
+ * Command buffers run on standalone images instead of layers, for tools that
+ * filter many files (see batch.cpp): nothing is composited or recorded for
+ * undo, and the layer ids of the commands are ignored. Nothing shared is
+ * written either (fills skip the fill cache, and the plane cache never
+ * admits these images), so each thread of a tool can run its own image.
+ */
+
+// Run commands[first .. last) (one run of command_runs) on the image in `layer`
+void run_batch_command_run(Layer& layer, const Command* first, const Command* last) {
+    const double* p = first->params;
+    switch (first->op) {
+        case CommandOp::Undo:
+        case CommandOp::Redo:
+            break;
+        case CommandOp::BucketFill: {
+            const int x = static_cast<int>(p[0]);
+            const int y = static_cast<int>(p[1]);
+            if (x < 0 || x >= layer.width() || y < 0 || y >= layer.height()) break;
+            const FillRegion region = fill_region(layer, x, y, fill_threshold_sq(static_cast<float>(p[6])));
+            fill_region_blend(layer, region,
+                              Pixel(static_cast<uint8_t>(p[2]), static_cast<uint8_t>(p[3]),
+                                    static_cast<uint8_t>(p[4]), static_cast<uint8_t>(p[5])));
+            break;
+        }
+        case CommandOp::Resize: {
+            const int filter = static_cast<int>(p[2]);
+            if (resample_filter_valid(filter)) {
+                resample_layer(layer, static_cast<int>(p[0]), static_cast<int>(p[1]), static_cast<ResampleFilter>(filter));
+            }
+            break;
+        }
+        case CommandOp::Sharpen:
+            convolve_layer(layer, sharpen_kernel(static_cast<float>(p[0])));
+            break;
+        case CommandOp::Emboss:
+            convolve_layer(layer, emboss_kernel());
+            break;
+        case CommandOp::Adjust: {
+            PointProgram program;
+            for (const Command* command = first; command != last; ++command) {
+                if (point_op_valid(static_cast<int>(command->params[0]))) program.add(command_point_op(*command));
+            }
+            apply_point_program(layer, program);
+            break;
+        }
+        case CommandOp::QuadCompression:
+            quad_tree_compression(layer, static_cast<int>(p[0]), static_cast<int>(p[1]));
+            break;
+        default: {
+            std::vector<PipelineStep> steps;
+            for (const Command* command = first; command != last; ++command) add_command_steps(*command, steps);
+            Pipeline pipeline;
+            for (const PipelineStep& step : steps) pipeline.add(step);
+            pipeline.run(layer, run_pipeline_step);
+            break;
+        }
+    }
+}
+
+extern "C" {
+    /**
+     * Run commands (packed as for run_commands) on a standalone width x height
+     * image, taking ownership of `data` as adopt_layer does. Of the flags only
+     * COMMANDS_COALESCE (1) matters; undo and redo commands are skipped.
+     *
+     * Returns the result, tightly packed RGBA to release with free(), and
+     * writes its width and height to size[0..1] (resize and quad tree
+     * compression change them). Returns nullptr, having freed `data`, if the
+     * size is invalid. Several threads may call this at once, each with its
+     * own image.
+     */
+    uint8_t* batch_run_commands(uint8_t* data, int width, int height, double* commands, int commandCount, int flags,
+                                int* size) {
+        ENGINE_STAT(stat, "batch_run_commands");
+        if (!data) return nullptr;
+        if (width <= 0 || height <= 0) {
+            std::free(data);
+            return nullptr;
+        }
+        stat.add(static_cast<uint64_t>(width) * height);
+
+        std::vector<Command> unpacked = unpack_commands(commands, commandCount);
+        for (Command& command : unpacked) command.layerId = 0;
+
+        Layer layer(-1, PixelBuffer::adopt(data, width, height));
+        const std::vector<size_t> runs = command_runs(unpacked, (flags & COMMANDS_COALESCE) != 0);
+        for (size_t i = 0; i + 1 < runs.size(); ++i) {
+            run_batch_command_run(layer, unpacked.data() + runs[i], unpacked.data() + runs[i + 1]);
+        }
+
+        size[0] = layer.width();
+        size[1] = layer.height();
+        return layer.pixels.release_packed();
+    }
+}
+
+#endif
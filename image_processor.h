@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Exported function APIs
+ *
+ * Declarations of the extern "C" entry points defined in image_processor.cpp.
+ * These are the functions exported to JS through Emscripten, and are also used
+ * by the native tools (see benchmark.cpp and batch.cpp). See image_processor.cpp for details
+ * on each function and the RGBA data layout.
+ */
+
+extern "C" {
+
+    // Layer ingest
+    void data_to_layer(uint8_t* data, int width, int height, int id);
+    uint8_t* alloc_layer_buffer(int width, int height);
+    void adopt_layer(uint8_t* data, int width, int height, int id);
+
+    // Compositing
+    void merge_layers(uint8_t* output, int width, int height, int* order, int orderSize);
+    void merge_layers_incremental(uint8_t* output, int width, int height, int* order, int orderSize, int* dirtyRect);
+    void get_dirty_rect(int* rect);
+
+    // Threading
+    void set_thread_count(int count);
+    int get_thread_count();
+
+    // Monochrome filters
+    void monochrome_average(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    void monochrome_luminosity(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    void monochrome_lightness(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    void monochrome_itu(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+
+    // Blurring
+    void gaussian_blur(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double sigma, int kernelSize);
+
+    // Edge detection
+    void edge_sobel(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    void laplacian_filter(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    void edge_laplacian_of_gaussian(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double sigma, int kernelSize);
+    void sharpen(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double amount);
+    void emboss(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id);
+    int apply_kernel(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id,
+                     float* weights, int size, double bias);
+    void adjust_colors(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double* ops, int opCount);
+
+    // Filter pipelines
+    void run_pipeline(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, double* steps, int stepCount);
+    int run_commands(uint8_t* data, int width, int height, int* order, int orderSize, double* commands, int commandCount, int flags);
+
+    // Preview mode
+    void set_preview_size(int displayWidth, int displayHeight);
+    void get_preview_size(int width, int height, int* size);
+    void merge_layers_preview(uint8_t* output, int width, int height, int* order, int orderSize);
+    void preview_pipeline(uint8_t* output, int width, int height, int* order, int orderSize, int layer_id, double* steps, int stepCount);
+    void refine_pipeline(int layer_id, double* steps, int stepCount);
+    int refine_step(uint8_t* data, int width, int height, int* order, int orderSize, double budgetMs);
+    double get_refine_progress();
+    void cancel_refine();
+
+    // Bucket fill
+    void bucket_fill(uint8_t* data, int width, int height, int* order, int orderSize,
+                     int layer_id, int x, int y, uint8_t r, uint8_t g, uint8_t b, uint8_t a,
+                     float error_threshold);
+
+    // Quad tree compression
+    void quad_compression(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id, int givenWidth, int givenHeight);
+
+    // Resize and thumbnails
+    void resize_layer(uint8_t* data, int width, int height, int* order, int orderSize, int layer_id,
+                      int newWidth, int newHeight, int filter);
+    int resample_image(uint8_t* src, int srcWidth, int srcHeight, uint8_t* dst, int dstWidth, int dstHeight, int filter);
+
+    // Undo / redo
+    int undo(uint8_t* data, int width, int height, int* order, int orderSize);
+    int redo(uint8_t* data, int width, int height, int* order, int orderSize);
+    void set_history_budget(int megabytes);
+    void get_history_stats(double* stats);
+    void clear_history();
+
+    // Derived-plane cache
+    void set_plane_cache_budget(int megabytes);
+    void get_plane_cache_stats(double* stats);
+
+    // Scratch memory
+    void set_scratch_budget(int megabytes);
+    void get_scratch_stats(double* stats);
+
+    // Layer memory
+    void set_layer_memory_budget(int megabytes);
+    void get_layer_memory_stats(double* stats);
+    int delete_layer(int id);
+
+    // Engine statistics
+    int get_engine_stats(double* stats, int capacity);
+    const char* get_engine_stat_name(int index);
+    void reset_engine_stats();
+
+    // Snapshots
+    void snapshot_begin(int* ids, int count);
+    uint8_t* snapshot_next(int targetBytes, int* size);
+    void snapshot_end();
+    void restore_begin();
+    int restore_feed(uint8_t* data, int size);
+    int get_restored_layers(int* info, int capacity);
+
+    // Resync
+    void set_integer_kernels(int enabled);
+    int get_tile_digests(int id, uint32_t* digests, int capacity);
+    int get_layer_digest(int id, uint32_t* digest);
+    int diff_tile_digests(int id, uint32_t* digests, int count, int* tiles, int capacity);
+    int snapshot_tiles_begin(int id, int* tiles, int count);
+
+#if !defined(__EMSCRIPTEN__)
+    // Out-of-core images (native builds only)
+    int tiled_image_create(int width, int height);
+    void tiled_image_destroy(int id);
+    int tiled_image_write(int id, uint8_t* data, int y, int rows);
+    int tiled_image_read(int id, uint8_t* data, int y, int rows);
+    int tiled_run_pipeline(int id, double* steps, int stepCount);
+    int tiled_merge(int* ids, int count, int outputId);
+    void set_tiled_cache_budget(int megabytes);
+    void get_tiled_cache_stats(double* stats);
+
+    // Batch images (native builds only)
+    uint8_t* batch_run_commands(uint8_t* data, int width, int height, double* commands, int commandCount, int flags,
+                                int* size);
+#endif
+}
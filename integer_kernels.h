@@ -0,0 +1,35 @@
+#pragma once
+
+/**
+ * Integer kernels
+ *
+ * The float kernels give the same results on every run of one build, but not
+ * necessarily on another: compilers may fuse a multiply and an add, std::exp
+ * differs between C libraries, and native and WASM builds take different SIMD
+ * paths. Peers that must keep bit-identical layers (collaboration mode, checked
+ * with tile digests, see tile_digest.h) switch every kernel that writes a layer
+ * to an integer-only mode instead:
+ *
+ *   Gaussian blur   fixed-point weights from an exp made of + * / only, and
+ *                   integer sums (filters.h, box_blur.h)
+ *   Sobel           integer normalization (image_processor.cpp)
+ *   bucket fill     integer "over" blend (flood_fill.h)
+ *
+ * Compositing (blend.h), grayscale and the other point operations
+ * (point_ops.h), the Laplacian, the quad tree compression and resampling
+ * (fixed-point sums, with weights from a sin made of + * / only, resample.h)
+ * are integer already. Results are within
+ * a level or two of the float mode.
+ *
+ * Kernels running on worker threads read the mode, so it must only be changed
+ * between operations.
+ */
+
+inline bool& integer_kernels_flag() {
+    static bool enabled = false;
+    return enabled;
+}
+
+inline bool integer_kernels() { return integer_kernels_flag(); }
+
+inline void use_integer_kernels(bool enabled) { integer_kernels_flag() = enabled; }
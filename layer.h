@@ -1,11 +1,18 @@
-#include <vector> 
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 #include <cmath>
 #include <queue>
 #include <algorithm>
+#include <memory>
 
 class Pixel {
-public: 
-    uint8_t r; 
+public:
+    uint8_t r;
     uint8_t g;
     uint8_t b;
     uint8_t a;
@@ -14,120 +21,274 @@ public:
     Pixel() : r(0), g(0), b(0), a(0) {}
 
     // Parameterized constructor
-    Pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a) 
+    Pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
         : r(r), g(g), b(b), a(a) {}
-}; 
+};
 
-class Layer {
-public: 
-    int id; 
-    std::vector<std::vector<Pixel>> pixels; 
+// Pixels are reinterpreted directly from the RGBA byte arrays handed over by JS
+static_assert(sizeof(Pixel) == 4, "Pixel must be tightly packed RGBA");
 
-    // Default constructor
-    Layer() : id(-1) {}
+/**
+ * Contiguous RGBA pixel storage.
+ *
+ * All rows live in a single heap block, `stride` pixels apart. Buffers allocated
+ * here are 64-byte aligned and have their stride padded so every row starts on
+ * a 64-byte boundary. Buffers adopted from JS (see `adopt`) keep the tightly
+ * packed layout of ImageData, so stride == width. Kernels must always step rows
+ * with `row(y)` rather than assuming stride == width.
+ *
+ * width, height and stride are public for convenience, but must not be modified
+ * directly.
+ */
+class PixelBuffer {
+public:
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr int STRIDE_MULTIPLE = ALIGNMENT / sizeof(Pixel);
 
-    // Parameterized constructor
-    Layer(int id) : id(id) {} 
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+
+    // Default constructor — empty buffer
+    PixelBuffer() {}
+
+    // Allocate an aligned, padded buffer initialized to transparent black
+    PixelBuffer(int width, int height)
+        : width(width), height(height),
+          stride((width + STRIDE_MULTIPLE - 1) / STRIDE_MULTIPLE * STRIDE_MULTIPLE) {
+        data = static_cast<Pixel*>(allocate(size_bytes()));
+        if (data) std::memset(static_cast<void*>(data), 0, size_bytes());
+    }
 
     /**
-     * Quad tree image compression algorithm. 
-     * 
-     * Using the pixel information of the current layer, create and return a new 
-     * compressed layer of the current layer. The compression is done using a 
-     * quad tree, where each "block" in the tree has similar colour. The tree's 
-     * maximum depth is limited to 100. The compressed layer should have dimensions 
-     * width by height, where each represents the number of pixels. 
+     * Take ownership of a tightly packed RGBA buffer (width * height * 4 bytes)
+     * allocated with malloc / aligned_alloc, without copying it. The buffer is
+     * released with free() when this PixelBuffer is destroyed.
      */
-    void quad_tree_compression(int targetWidth, int targetHeight) {
-        int fullWidth = pixels[0].size();
-        int fullHeight = pixels.size();
+    static PixelBuffer adopt(uint8_t* bytes, int width, int height) {
+        PixelBuffer buffer;
+        buffer.width = width;
+        buffer.height = height;
+        buffer.stride = width;
+        buffer.data = reinterpret_cast<Pixel*>(bytes);
+        return buffer;
+    }
 
-        // Check given height and width are strictly smaller than current height and width 
-        if (targetWidth > fullWidth || targetHeight > fullHeight) return; 
+    /**
+     * Allocate an uninitialized, 64-byte aligned block suitable for `adopt`.
+     */
+    static uint8_t* allocate_bytes(size_t bytes) {
+        return reinterpret_cast<uint8_t*>(allocate(bytes));
+    }
 
-        const int MAX_DEPTH = 100;
-        const int COLOR_THRESHOLD = 10;
+    /**
+     * The reverse of `adopt`: give up the pixels as a tightly packed block
+     * (rows are moved together if the stride was padded) to be released with
+     * free(). The buffer is left empty.
+     */
+    uint8_t* release_packed() {
+        if (stride != width) {
+            for (int y = 1; y < height; ++y) {
+                std::memmove(static_cast<void*>(data + static_cast<size_t>(y) * width), row(y),
+                             static_cast<size_t>(width) * sizeof(Pixel));
+            }
+        }
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(data);
+        release();
+        return bytes;
+    }
 
-        // Modify pixels directly instead of using a separate compressedFull
-        compress_recursive(0, 0, fullWidth, fullHeight, 0, MAX_DEPTH, COLOR_THRESHOLD);
+    PixelBuffer(const PixelBuffer&) = delete;
+    PixelBuffer& operator=(const PixelBuffer&) = delete;
 
-        // Downscale and update pixels to new resolution
-        this->pixels = downscale(targetWidth, targetHeight);
+    PixelBuffer(PixelBuffer&& other) noexcept
+        : width(other.width), height(other.height), stride(other.stride), data(other.data) {
+        other.release();
     }
-    
-private:
-    void compress_recursive(int x0, int y0, int w, int h, int depth,
-                            int maxDepth,
-                            int threshold) {
-        if (w <= 1 || h <= 1 || depth >= maxDepth || is_uniform(x0, y0, w, h, threshold)) {
-            Pixel avg = average_color(x0, y0, w, h);
-            for (int y = y0; y < y0 + h; ++y) {
-                for (int x = x0; x < x0 + w; ++x) {
-                    pixels[y][x] = avg;
-                }
-            }
-            return;
+
+    PixelBuffer& operator=(PixelBuffer&& other) noexcept {
+        if (this != &other) {
+            std::free(data);
+            width = other.width;
+            height = other.height;
+            stride = other.stride;
+            data = other.data;
+            other.release();
         }
+        return *this;
+    }
+
+    ~PixelBuffer() { std::free(data); }
+
+    bool empty() const { return data == nullptr || width <= 0 || height <= 0; }
+
+    size_t size_bytes() const { return static_cast<size_t>(stride) * height * sizeof(Pixel); }
+
+    Pixel* row(int y) { return data + static_cast<size_t>(y) * stride; }
+    const Pixel* row(int y) const { return data + static_cast<size_t>(y) * stride; }
+
+    Pixel& at(int x, int y) { return row(y)[x]; }
+    const Pixel& at(int x, int y) const { return row(y)[x]; }
 
-        int hw = w / 2;
-        int hh = h / 2;
+    uint8_t* bytes() { return reinterpret_cast<uint8_t*>(data); }
 
-        compress_recursive(x0,        y0,        hw, hh, depth + 1, maxDepth, threshold); // top-left
-        compress_recursive(x0 + hw,   y0,        w - hw, hh, depth + 1, maxDepth, threshold); // top-right
-        compress_recursive(x0,        y0 + hh,   hw, h - hh, depth + 1, maxDepth, threshold); // bottom-left
-        compress_recursive(x0 + hw,   y0 + hh,   w - hw, h - hh, depth + 1, maxDepth, threshold); // bottom-right
+private:
+    Pixel* data = nullptr;
+
+    static void* allocate(size_t bytes) {
+        if (bytes == 0) return nullptr;
+        // aligned_alloc requires the size to be a multiple of the alignment
+        size_t rounded = (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        return std::aligned_alloc(ALIGNMENT, rounded);
     }
 
-    Pixel average_color(int x0, int y0, int w, int h) {
-        uint64_t sumR = 0, sumG = 0, sumB = 0, sumA = 0;
-        int count = 0;
+    void release() {
+        width = height = stride = 0;
+        data = nullptr;
+    }
+};
 
-        for (int y = y0; y < y0 + h; ++y) {
-            for (int x = x0; x < x0 + w; ++x) {
-                Pixel& p = pixels[y][x];
-                sumR += p.r;
-                sumG += p.g;
-                sumB += p.b;
-                sumA += p.a;
-                count++;
-            }
-        }
+class MipPyramid;
+class TileDigests;
+
+class Layer {
+public:
+    // Side length, in pixels, of the square tiles used for dirty tracking
+    static constexpr int TILE_SIZE = 64;
+
+    int id;
+    PixelBuffer pixels;
 
-        return Pixel(sumR / count, sumG / count, sumB / count, sumA / count);
+    // Unique per Layer instance, so a layer replaced under the same id is never
+    // mistaken for the one it replaced
+    uint64_t uid;
+
+    // Bumped by every mutation. tile_versions holds, for each TILE_SIZE tile
+    // (row-major, tiles_x per row), the version at which it last changed.
+    uint32_t version = 1;
+    int tiles_x = 0;
+    int tiles_y = 0;
+    std::vector<uint32_t> tile_versions;
+
+    // Scaled-down copies of the layer (see pyramid.h), built on first use
+    std::shared_ptr<MipPyramid> pyramid;
+
+    // Content digest of every tile (see tile_digest.h), updated on request
+    std::shared_ptr<TileDigests> digests;
+
+    // Alpha range of one tile, valid while `version` matches the tile's version
+    struct TileCoverage {
+        uint32_t version = 0;
+        uint8_t minAlpha = 0;
+        uint8_t maxAlpha = 0;
+    };
+
+    // Default constructor
+    Layer() : id(-1), uid(next_uid()) {}
+
+    // Parameterized constructor
+    Layer(int id) : id(id), uid(next_uid()) {}
+
+    // Construct a layer that owns the given pixel buffer
+    Layer(int id, PixelBuffer&& pixels) : id(id), pixels(std::move(pixels)), uid(next_uid()) {
+        reset_tiles();
     }
 
-    bool is_uniform(int x0, int y0, int w, int h, int threshold) {
-        Pixel mean = average_color(x0, y0, w, h);
+    Layer(const Layer&) = delete;
+    Layer& operator=(const Layer&) = delete;
+    Layer(Layer&&) = default;
+    Layer& operator=(Layer&&) = default;
 
-        for (int y = y0; y < y0 + h; ++y) {
-            for (int x = x0; x < x0 + w; ++x) {
-                Pixel& p = pixels[y][x];
-                int dr = std::abs(p.r - mean.r);
-                int dg = std::abs(p.g - mean.g);
-                int db = std::abs(p.b - mean.b);
-                int da = std::abs(p.a - mean.a);
+    int width() const { return pixels.width; }
+    int height() const { return pixels.height; }
+    bool empty() const { return pixels.empty(); }
 
-                if (dr > threshold || dg > threshold || db > threshold || da > threshold)
-                    return false;
+    /**
+     * Record that the pixels in the given rectangle have changed. Every kernel
+     * that mutates `pixels` must call this (or `mark_all_dirty`) so that the
+     * compositor only redraws the affected tiles.
+     */
+    void mark_dirty(int x, int y, int w, int h) {
+        int x0 = std::max(0, x), y0 = std::max(0, y);
+        int x1 = std::min(width(), x + w), y1 = std::min(height(), y + h);
+        if (x0 >= x1 || y0 >= y1) return;
+
+        ++version;
+        for (int ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ++ty) {
+            for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; ++tx) {
+                tile_versions[ty * tiles_x + tx] = version;
             }
         }
+    }
 
-        return true;
+    /**
+     * Record that the tiles with the given (row-major) indices have changed,
+     * as a single new version.
+     */
+    void mark_tiles_dirty(const std::vector<int>& tiles) {
+        if (tiles.empty()) return;
+
+        ++version;
+        for (int t : tiles) tile_versions[t] = version;
     }
 
-    std::vector<std::vector<Pixel>> downscale(int dstW, int dstH) {
-        int srcH = pixels.size();
-        int srcW = pixels[0].size();
-        std::vector<std::vector<Pixel>> output(dstH, std::vector<Pixel>(dstW));
-    
-        for (int y = 0; y < dstH; ++y) {
-            for (int x = 0; x < dstW; ++x) {
-                int srcX = x * srcW / dstW;
-                int srcY = y * srcH / dstH;
-                output[y][x] = pixels[srcY][srcX];
+    // Pixel rectangle [x, y, w, h] covered by tile `t`
+    void tile_rect(int t, int& x, int& y, int& w, int& h) const {
+        x = (t % tiles_x) * TILE_SIZE;
+        y = (t / tiles_x) * TILE_SIZE;
+        w = std::min(TILE_SIZE, width() - x);
+        h = std::min(TILE_SIZE, height() - y);
+    }
+
+    /**
+     * Alpha range of tile (tx, ty), computed lazily and cached until the tile
+     * is next marked dirty. minAlpha == 255 means the tile is fully opaque and
+     * maxAlpha == 0 means it is fully transparent.
+     */
+    const TileCoverage& tile_coverage(int tx, int ty) {
+        int t = ty * tiles_x + tx;
+        TileCoverage& coverage = tile_coverage_cache[t];
+        if (coverage.version == tile_versions[t]) return coverage;
+
+        uint8_t lo = 255, hi = 0;
+        int x0 = tx * TILE_SIZE, x1 = std::min(width(), x0 + TILE_SIZE);
+        int y0 = ty * TILE_SIZE, y1 = std::min(height(), y0 + TILE_SIZE);
+        for (int y = y0; y < y1; ++y) {
+            const Pixel* row = pixels.row(y);
+            for (int x = x0; x < x1; ++x) {
+                lo = std::min(lo, row[x].a);
+                hi = std::max(hi, row[x].a);
             }
         }
-    
-        return output;
-    }    
-}; 
+
+        coverage.version = tile_versions[t];
+        coverage.minAlpha = lo;
+        coverage.maxAlpha = hi;
+        return coverage;
+    }
+
+    /**
+     * Record that the whole layer has changed. Must be used when `pixels` is
+     * replaced, since it also resizes the tile grid to the new dimensions.
+     */
+    void mark_all_dirty() {
+        ++version;
+        reset_tiles();
+    }
+
+private:
+    // Layers are also created on batch worker threads (see batch_run_commands)
+    static uint64_t next_uid() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+
+    std::vector<TileCoverage> tile_coverage_cache;
+
+    void reset_tiles() {
+        tiles_x = (width() + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (height() + TILE_SIZE - 1) / TILE_SIZE;
+        tile_versions.assign(static_cast<size_t>(tiles_x) * tiles_y, version);
+        tile_coverage_cache.assign(tile_versions.size(), TileCoverage());
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+#include "layer.h"
+#include "pyramid.h"
+#include "tile_codec.h"
+#include "engine_stats.h"
+
+/**
+ * Layer store
+ *
+ * Owns every layer, by id, under a budget for the bytes of uncompressed pixels
+ * (including pyramids). Once over it, `trim` compresses the layers used least
+ * recently with the tile codec (tile_codec.h) and frees their pixels, until
+ * the rest fits. Looking a compressed layer up decompresses it again, so
+ * callers never see the difference.
+ *
+ * A compressed layer keeps its Layer object (id, uid, version and tile
+ * versions), so the compositor and history keep treating it as the same,
+ * unchanged layer once it is back. Its pyramid is dropped and rebuilt on
+ * demand; its tile digests (tile_digest.h) and derived planes
+ * (plane_cache.h) are kept.
+ *
+ * Layers used since the previous `trim` are never compressed by it, so the
+ * layers of the current composite and operation stay resident even when they
+ * alone exceed the budget. Layers that barely compress (noisy photos) are
+ * left resident until they change.
+ */
+class LayerStore {
+public:
+    static constexpr size_t DEFAULT_BUDGET_BYTES = size_t(1) << 30;
+
+    struct Stats {
+        size_t layers = 0;
+        size_t residentLayers = 0;
+        size_t residentBytes = 0;
+        size_t compressedLayers = 0;
+        size_t compressedBytes = 0;
+        // Uncompressed size of the compressed layers
+        size_t compressedRawBytes = 0;
+        size_t budget = 0;
+    };
+
+    /**
+     * The layer with the given id, decompressed if needed. Creates an empty
+     * layer if there is none.
+     */
+    Layer& operator[](int id) {
+        Entry& entry = entries[id];
+        entry.layer.id = id;
+        return use(entry);
+    }
+
+    // The layer with the given id, decompressed if needed, or nullptr
+    Layer* find(int id) {
+        auto it = entries.find(id);
+        return it == entries.end() ? nullptr : &use(it->second);
+    }
+
+    /**
+     * The layer with the given id as it is, without decompressing it or
+     * counting as a use, or nullptr. Its pixels are empty while it is
+     * compressed; see `compressed`.
+     */
+    const Layer* peek(int id) const {
+        auto it = entries.find(id);
+        return it == entries.end() ? nullptr : &it->second.layer;
+    }
+
+    // Compressed pixels of the layer with the given id, or nullptr if it is resident
+    const CompressedPixels* compressed(int id) const {
+        auto it = entries.find(id);
+        return it == entries.end() || it->second.compressed.empty() ? nullptr : &it->second.compressed;
+    }
+
+    // Store `layer` under `id`, replacing any layer there
+    Layer& insert(int id, Layer&& layer) {
+        Entry& entry = entries[id];
+        entry = Entry();
+        entry.layer = std::move(layer);
+        entry.layer.id = id;
+        return use(entry);
+    }
+
+    // Remove the layer with the given id. Returns whether there was one.
+    bool erase(int id) { return entries.erase(id) > 0; }
+
+    size_t size() const { return entries.size(); }
+
+    void set_budget(size_t bytes) {
+        budget = bytes;
+        trim();
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.layers = entries.size();
+        s.budget = budget;
+        for (const auto& item : entries) {
+            const Entry& entry = item.second;
+            if (entry.compressed.empty()) {
+                ++s.residentLayers;
+                s.residentBytes += entry.resident_bytes();
+            } else {
+                ++s.compressedLayers;
+                s.compressedBytes += entry.compressed.size_bytes();
+                s.compressedRawBytes += static_cast<size_t>(entry.compressed.width) * entry.compressed.height *
+                                        sizeof(Pixel);
+            }
+        }
+        return s;
+    }
+
+    /**
+     * Compress the least recently used layers, other than those used since
+     * the previous trim, until the resident bytes fit the budget.
+     */
+    void trim() {
+        size_t resident = 0;
+        std::vector<std::pair<uint64_t, Entry*>> candidates;
+        for (auto& item : entries) {
+            Entry& entry = item.second;
+            if (!entry.compressed.empty()) continue;
+            resident += entry.resident_bytes();
+            if (entry.lastUse > trimmedAt || entry.layer.empty() ||
+                entry.incompressibleVersion == entry.layer.version) {
+                continue;
+            }
+            candidates.emplace_back(entry.lastUse, &entry);
+        }
+        trimmedAt = clock;
+        if (resident <= budget) return;
+
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<uint64_t, Entry*>& a, const std::pair<uint64_t, Entry*>& b) {
+                      return a.first < b.first;
+                  });
+        for (const auto& candidate : candidates) {
+            if (resident <= budget) break;
+            Entry& entry = *candidate.second;
+            const size_t bytes = entry.resident_bytes();
+            if (compress(entry)) resident -= bytes;
+        }
+    }
+
+private:
+    // Keep a compressed copy only if it saves at least 1/8 of the pixels
+    static constexpr size_t MIN_SAVING_DIVISOR = 8;
+
+    struct Entry {
+        Layer layer;
+        // Pixels of the layer while it is compressed; empty while resident
+        CompressedPixels compressed;
+        uint64_t lastUse = 0;
+        // Version at which the layer last failed to compress well
+        uint32_t incompressibleVersion = 0;
+
+        size_t resident_bytes() const {
+            return layer.pixels.size_bytes() + (layer.pyramid ? layer.pyramid->size_bytes() : 0);
+        }
+    };
+
+    std::unordered_map<int, Entry> entries;
+    size_t budget = DEFAULT_BUDGET_BYTES;
+    uint64_t clock = 0;
+    uint64_t trimmedAt = 0;
+
+    Layer& use(Entry& entry) {
+        entry.lastUse = ++clock;
+        if (!entry.compressed.empty()) {
+            ENGINE_STAT(stat, "layer_store.decompress");
+            entry.layer.pixels = decompress_pixels(entry.compressed);
+            stat.add(static_cast<uint64_t>(entry.layer.width()) * entry.layer.height(), entry.layer.pixels.size_bytes());
+            entry.compressed = CompressedPixels();
+        }
+        return entry.layer;
+    }
+
+    bool compress(Entry& entry) {
+        ENGINE_STAT(stat, "layer_store.compress");
+        CompressedPixels compressed = compress_pixels(entry.layer.pixels);
+        const size_t raw = entry.layer.pixels.size_bytes();
+        stat.add(static_cast<uint64_t>(entry.layer.width()) * entry.layer.height(), compressed.size_bytes());
+        if (compressed.size_bytes() > raw - raw / MIN_SAVING_DIVISOR) {
+            entry.incompressibleVersion = entry.layer.version;
+            return false;
+        }
+
+        entry.compressed = std::move(compressed);
+        entry.layer.pixels = PixelBuffer();
+        entry.layer.pyramid.reset();
+        return true;
+    }
+};
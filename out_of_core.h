@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include "layer.h"
+#include "blend.h"
+#include "thread_pool.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Out-of-core tiled images (native builds only)
+ *
+ * Images too large for memory (panoramas, scans: 50k x 50k is 10 GB of RGBA)
+ * live in a scratch file, memory-mapped and split into TILE_SIZE x TILE_SIZE
+ * tiles stored one after the other, so a tile is one contiguous run of pages.
+ * The file is unlinked as soon as it is created and grows sparsely, so
+ * untouched tiles cost nothing and read as transparent black.
+ *
+ * Every tile access goes through the shared TileCache, which keeps the most
+ * recently used tiles up to a byte budget and releases the pages of the rest
+ * with madvise(MADV_DONTNEED). The data stays in the file (the kernel writes
+ * dirty pages back), and a released tile's pointer stays valid: touching it
+ * again simply faults it back in. So the budget bounds the resident set
+ * without any pinning.
+ *
+ * Kernels stream over the tiles: point operations one tile at a time, and
+ * neighbourhood filters one band of tile rows at a time, read with the halo
+ * rows they need into an ordinary Layer and run with the in-memory kernels,
+ * so the results match those of an in-memory layer exactly.
+ */
+
+class TileCache {
+public:
+    static constexpr size_t DEFAULT_BUDGET_BYTES = size_t(256) << 20;
+
+    struct Stats {
+        size_t residentTiles = 0;
+        size_t residentBytes = 0;
+        size_t budget = 0;
+        uint64_t loads = 0;        // accesses to a tile that was not resident
+        uint64_t evictions = 0;
+    };
+
+    // Never destroyed, since images in other static objects may outlive it
+    static TileCache& shared() {
+        static TileCache* cache = new TileCache();
+        return *cache;
+    }
+
+    void set_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        evict();
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s = counters;
+        s.residentTiles = lru.size();
+        s.residentBytes = residentBytes;
+        s.budget = budget;
+        return s;
+    }
+
+    // Record an access to the `bytes` bytes at `data`, releasing the least recently used tiles over budget
+    void touch(void* data, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(data);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+
+        ++counters.loads;
+        lru.push_front(Tile{data, bytes});
+        index[data] = lru.begin();
+        residentBytes += bytes;
+        evict();
+    }
+
+    // Forget the tiles in [data, data + bytes), which are being unmapped
+    void forget(void* data, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint8_t* begin = static_cast<uint8_t*>(data);
+        for (auto it = lru.begin(); it != lru.end();) {
+            uint8_t* tile = static_cast<uint8_t*>(it->data);
+            if (tile >= begin && tile < begin + bytes) {
+                residentBytes -= it->bytes;
+                index.erase(it->data);
+                it = lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    struct Tile {
+        void* data;
+        size_t bytes;
+    };
+
+    mutable std::mutex mutex;
+    std::list<Tile> lru;
+    std::unordered_map<void*, std::list<Tile>::iterator> index;
+    size_t residentBytes = 0;
+    size_t budget = DEFAULT_BUDGET_BYTES;
+    Stats counters;
+
+    // The most recently used tile always stays, even over budget
+    void evict() {
+        while (residentBytes > budget && lru.size() > 1) {
+            Tile& tile = lru.back();
+            madvise(tile.data, tile.bytes, MADV_DONTNEED);
+            residentBytes -= tile.bytes;
+            index.erase(tile.data);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+    }
+};
+
+class TiledImage {
+public:
+    static constexpr int TILE_SIZE = 256;
+    static constexpr size_t TILE_BYTES = size_t(TILE_SIZE) * TILE_SIZE * sizeof(Pixel);
+
+    int width = 0;
+    int height = 0;
+    int tiles_x = 0;
+    int tiles_y = 0;
+
+    /**
+     * A transparent image backed by a new scratch file in `directory`
+     * ($TMPDIR or /tmp if empty). Check `valid`: creating or mapping the
+     * file can fail.
+     */
+    TiledImage(int width, int height, const std::string& directory = std::string(),
+               TileCache& cache = TileCache::shared())
+        : width(width), height(height), cache(cache) {
+        if (width <= 0 || height <= 0) return;
+        tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+        bytes = static_cast<size_t>(tiles_x) * tiles_y * TILE_BYTES;
+
+        std::string path = directory;
+        if (path.empty()) {
+            const char* tmp = std::getenv("TMPDIR");
+            path = tmp && *tmp ? tmp : "/tmp";
+        }
+        path += "/image-tiles-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+
+        file = mkstemp(name.data());
+        if (file < 0) return;
+        unlink(name.data());
+        if (ftruncate(file, static_cast<off_t>(bytes)) != 0) return;
+
+        void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (mapped != MAP_FAILED) data = static_cast<Pixel*>(mapped);
+    }
+
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+
+    ~TiledImage() {
+        if (data) {
+            cache.forget(data, bytes);
+            munmap(data, bytes);
+        }
+        if (file >= 0) close(file);
+    }
+
+    bool valid() const { return data != nullptr; }
+
+    // Pixels of tile (tx, ty), TILE_SIZE per row, marked as used in the cache
+    Pixel* tile(int tx, int ty) {
+        Pixel* pixels = data + (static_cast<size_t>(ty) * tiles_x + tx) * (TILE_BYTES / sizeof(Pixel));
+        cache.touch(pixels, TILE_BYTES);
+        return pixels;
+    }
+
+    // Copy rows [y0, y1) into `out`, `stride` pixels apart
+    void read_rows(int y0, int y1, Pixel* out, size_t stride) {
+        copy_rows(y0, y1, out, stride, false);
+    }
+
+    // Copy rows [y0, y1) from `in`, `stride` pixels apart
+    void write_rows(int y0, int y1, const Pixel* in, size_t stride) {
+        copy_rows(y0, y1, const_cast<Pixel*>(in), stride, true);
+    }
+
+private:
+    TileCache& cache;
+    int file = -1;
+    size_t bytes = 0;
+    Pixel* data = nullptr;
+
+    // Row by row within each tile, so each tile is looked up once per call
+    void copy_rows(int y0, int y1, Pixel* rows, size_t stride, bool write) {
+        for (int ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ++ty) {
+            const int top = std::max(y0, ty * TILE_SIZE);
+            const int bottom = std::min(y1, (ty + 1) * TILE_SIZE);
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                Pixel* pixels = tile(tx, ty);
+                const int x0 = tx * TILE_SIZE;
+                const size_t count = static_cast<size_t>(std::min(TILE_SIZE, width - x0));
+                for (int y = top; y < bottom; ++y) {
+                    Pixel* tileRow = pixels + static_cast<size_t>(y - ty * TILE_SIZE) * TILE_SIZE;
+                    Pixel* row = rows + static_cast<size_t>(y - y0) * stride + x0;
+                    if (write) {
+                        std::memcpy(static_cast<void*>(tileRow), row, count * sizeof(Pixel));
+                    } else {
+                        std::memcpy(static_cast<void*>(row), tileRow, count * sizeof(Pixel));
+                    }
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Run `kernel(layer)` over `image` one band of TiledImage::TILE_SIZE rows (or
+ * `halo`, if more) at a time. Each band is read into `layer` with `halo` rows above and below (fewer
+ * at the image edges), and only its own rows are written back, so a kernel
+ * whose output rows depend on input rows at most `halo` away gives exactly
+ * the in-memory result. The input rows the next band needs as its upper halo
+ * are kept before the kernel overwrites them.
+ */
+template <typename Kernel>
+void stream_bands(TiledImage& image, int halo, Kernel&& kernel) {
+    halo = std::max(0, halo);
+    const int band = std::max(TiledImage::TILE_SIZE, halo);
+    const int width = image.width;
+    const size_t rowBytes = static_cast<size_t>(width) * sizeof(Pixel);
+
+    // Input rows [carryTop, y0) of the previous band, as they were before it ran
+    std::vector<Pixel> carry;
+    int carryTop = 0;
+
+    for (int y0 = 0; y0 < image.height; y0 += band) {
+        const int y1 = std::min(image.height, y0 + band);
+        const int top = std::max(0, y0 - halo);
+        const int bottom = std::min(image.height, y1 + halo);
+
+        Layer layer(-1, PixelBuffer(width, bottom - top));
+        if (layer.empty()) return;
+        for (int y = top; y < y0; ++y) {
+            std::memcpy(static_cast<void*>(layer.pixels.row(y - top)),
+                        carry.data() + static_cast<size_t>(y - carryTop) * width, rowBytes);
+        }
+        image.read_rows(y0, bottom, layer.pixels.row(y0 - top), layer.pixels.stride);
+
+        // Keep the rows the next band reads above itself
+        carryTop = std::max(y0, y1 - halo);
+        carry.resize(static_cast<size_t>(y1 - carryTop) * width);
+        for (int y = carryTop; y < y1; ++y) {
+            std::memcpy(static_cast<void*>(carry.data() + static_cast<size_t>(y - carryTop) * width),
+                        layer.pixels.row(y - top), rowBytes);
+        }
+
+        kernel(layer);
+
+        image.write_rows(y0, y1, layer.pixels.row(y0 - top), layer.pixels.stride);
+    }
+}
+
+/**
+ * Call `fn(band, first, last)` for each band of `image`, read as in
+ * stream_bands, without writing anything back. The band's own rows are
+ * band rows [first, last).
+ */
+template <typename Fn>
+void scan_bands(TiledImage& image, int halo, Fn&& fn) {
+    halo = std::max(0, halo);
+    const int band = std::max(TiledImage::TILE_SIZE, halo);
+    for (int y0 = 0; y0 < image.height; y0 += band) {
+        const int y1 = std::min(image.height, y0 + band);
+        const int top = std::max(0, y0 - halo);
+        const int bottom = std::min(image.height, y1 + halo);
+
+        Layer layer(-1, PixelBuffer(image.width, bottom - top));
+        if (layer.empty()) return;
+        image.read_rows(top, bottom, layer.pixels.row(0), layer.pixels.stride);
+        fn(static_cast<const Layer&>(layer), y0 - top, y1 - top);
+    }
+}
+
+/**
+ * Run `fn(pixels, count)` on every row segment of every tile, tiles in
+ * parallel. For point operations, which need no neighbours.
+ */
+template <typename Fn>
+void stream_tiles(TiledImage& image, Fn&& fn) {
+    const int tileCount = image.tiles_x * image.tiles_y;
+    ThreadPool::shared().parallel_for(0, tileCount, 1, [&](int t0, int t1) {
+        for (int t = t0; t < t1; ++t) {
+            const int tx = t % image.tiles_x, ty = t / image.tiles_x;
+            Pixel* pixels = image.tile(tx, ty);
+            const int w = std::min(TiledImage::TILE_SIZE, image.width - tx * TiledImage::TILE_SIZE);
+            const int h = std::min(TiledImage::TILE_SIZE, image.height - ty * TiledImage::TILE_SIZE);
+            for (int y = 0; y < h; ++y) fn(pixels + static_cast<size_t>(y) * TiledImage::TILE_SIZE, w);
+        }
+    });
+}
+
+/**
+ * Composite `stack` (bottom first, as merge_layers) into `output` tile by
+ * tile, with the "under" blend of the compositor (blend.h). Layers smaller
+ * than the output are clipped; the rest is transparent.
+ */
+inline void merge_tiled(const std::vector<TiledImage*>& stack, TiledImage& output) {
+    const int tileCount = output.tiles_x * output.tiles_y;
+    const BlendUnderFn blend = blend_kernel().fn;
+    const size_t outStride = static_cast<size_t>(TiledImage::TILE_SIZE) * 4;
+
+    ThreadPool::shared().parallel_for(0, tileCount, 1, [&](int t0, int t1) {
+        for (int t = t0; t < t1; ++t) {
+            const int tx = t % output.tiles_x, ty = t / output.tiles_x;
+            const int x0 = tx * TiledImage::TILE_SIZE, y0 = ty * TiledImage::TILE_SIZE;
+            const int w = std::min(TiledImage::TILE_SIZE, output.width - x0);
+            const int h = std::min(TiledImage::TILE_SIZE, output.height - y0);
+            uint8_t* out = reinterpret_cast<uint8_t*>(output.tile(tx, ty));
+            for (int y = 0; y < h; ++y) std::memset(out + y * outStride, 0, static_cast<size_t>(w) * 4);
+
+            // Top layer down, until the tile is opaque
+            for (int i = static_cast<int>(stack.size()) - 1; i >= 0; --i) {
+                TiledImage& layer = *stack[i];
+                if (tx >= layer.tiles_x || ty >= layer.tiles_y) continue;
+
+                const Pixel* pixels = layer.tile(tx, ty);
+                const int lw = std::min(w, layer.width - x0);
+                const int lh = std::min(h, layer.height - y0);
+                uint8_t coverage = lw == w && lh == h ? 255 : 0;
+                for (int y = 0; y < lh; ++y) {
+                    coverage = std::min(coverage, blend(out + y * outStride,
+                                                        pixels + static_cast<size_t>(y) * TiledImage::TILE_SIZE, lw));
+                }
+                if (coverage == 255) break;
+            }
+        }
+    });
+}
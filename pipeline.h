@@ -0,0 +1,692 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include "layer.h"
+#include "filters.h"
+#include "point_ops.h"
+#include "convolution.h"
+#include "thread_pool.h"
+#include "box_blur.h"
+#include "engine_stats.h"
+#include "scratch_arena.h"
+
+/**
+ * Fused operator pipeline
+ *
+ * Filters are queued on a Pipeline and only run when `run` is called. Runs of
+ * consecutive point operations (monochrome) and stencil operations (direct
+ * Gaussian blur, Laplacian) are then executed together in a single sweep over
+ * the layer, instead of one full pass per filter.
+ *
+ * During the sweep each filter is a stage that produces its output one row at
+ * a time, pulling the rows it needs from the stage before it. Every stage
+ * keeps only a rolling buffer of the rows its consumer still needs (the
+ * kernel height for a blur, 3 rows for the Laplacian, 1 row for point ops), so
+ * intermediate results never exist as full-size images and each input row is
+ * read from memory once. The last stage's rows are written back into the
+ * layer.
+ *
+ * Steps that need the whole image at once, like Sobel (which normalizes by the
+ * largest gradient in the image) and the stacked box blur used for large
+ * sigma, end the current sweep and run on their own.
+ *
+ * Results are bit-identical to running the same filters one by one, since
+ * both are built from the row primitives in filters.h.
+ */
+
+// Operation codes used by run_pipeline. The values are part of the JS API.
+enum class PipelineOp : int {
+    MonochromeAverage = 0,
+    MonochromeLuminosity = 1,
+    MonochromeLightness = 2,
+    MonochromeItu = 3,
+    GaussianBlur = 4,       // param0 = sigma, param1 = kernel size
+    EdgeSobel = 5,
+    LaplacianFilter = 6,
+};
+
+// Doubles per step in the packed array passed to run_pipeline: op, param0, param1
+constexpr int PIPELINE_STEP_SIZE = 3;
+
+struct PipelineStep {
+    PipelineOp op;
+    double param0 = 0.0;
+    double param1 = 0.0;
+
+    // Set on preview steps (see scaled_pipeline_step), which may trade some
+    // accuracy for speed
+    bool approximate = false;
+};
+
+// Longest blur an approximate step runs with the direct kernel: the largest
+// unrolled pass (see gaussian_row_kernels). Longer ones use the box blur.
+constexpr int APPROXIMATE_MAX_HALF_KERNEL = 7;
+
+inline bool pipeline_op_valid(int op) {
+    return op >= static_cast<int>(PipelineOp::MonochromeAverage) &&
+           op <= static_cast<int>(PipelineOp::LaplacianFilter);
+}
+
+// Grayscale function of a monochrome step, or null for other steps
+inline GrayscaleFn pipeline_grayscale_fn(PipelineOp op) {
+    switch (op) {
+        case PipelineOp::MonochromeAverage: return grayscale_average;
+        case PipelineOp::MonochromeLuminosity: return grayscale_luminosity;
+        case PipelineOp::MonochromeLightness: return grayscale_lightness;
+        case PipelineOp::MonochromeItu: return grayscale_itu;
+        default: return nullptr;
+    }
+}
+
+// Whether a step is a Gaussian blur run as the stacked box blur (box_blur.h)
+inline bool pipeline_step_box_blur(const PipelineStep& step) {
+    if (step.op != PipelineOp::GaussianBlur) return false;
+
+    const int kernelSize = static_cast<int>(step.param1);
+    if (use_box_blur(step.param0, kernelSize)) return true;
+    return step.approximate && gaussian_kernel_size(kernelSize) / 2 > APPROXIMATE_MAX_HALF_KERNEL;
+}
+
+// Variance of the Gaussian kernel of a blur step, matched by the box blur
+inline double pipeline_step_variance(const PipelineStep& step) {
+    return gaussian_variance(step.param0, static_cast<int>(step.param1));
+}
+
+// How many rows above and below each output row a step reads
+inline int pipeline_step_reach(const PipelineStep& step) {
+    switch (step.op) {
+        case PipelineOp::GaussianBlur:
+            if (pipeline_step_box_blur(step)) return box_blur_padding(box_blur_radii(pipeline_step_variance(step)));
+            return gaussian_kernel_size(static_cast<int>(step.param1)) / 2;
+        case PipelineOp::EdgeSobel:
+        case PipelineOp::LaplacianFilter:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Whether a step can be streamed row by row as part of a sweep
+inline bool pipeline_step_fusable(const PipelineStep& step) {
+    switch (step.op) {
+        case PipelineOp::EdgeSobel: return false;
+        // The fused stages blur in float, so integer kernels run on their own
+        case PipelineOp::GaussianBlur: return !pipeline_step_box_blur(step) && !integer_kernels();
+        default: return true;
+    }
+}
+
+/**
+ * One stage of a sweep. `row(y)` returns output row y, computing it on first
+ * use. Rows must be requested in (mostly) increasing order: the returned
+ * pointer stays valid while the requested rows span fewer than `reserve`d rows.
+ * Rows and buffers come from `memory`, which must outlive the stage.
+ */
+class RowStage {
+public:
+    RowStage(ScratchScope& memory, int width, int height) : width(width), height(height), memory(memory) {}
+    virtual ~RowStage() = default;
+
+    // Keep at least `rows` consecutive output rows available
+    void reserve(int rows) { capacity = std::max(capacity, rows); }
+
+    const Pixel* row(int y) {
+        if (!ring) {
+            ring = memory.allocate<Pixel>(static_cast<size_t>(capacity) * width);
+            tags = memory.allocate<int>(capacity);
+            std::fill(tags, tags + capacity, -1);
+        }
+
+        int slot = y % capacity;
+        Pixel* out = ring + static_cast<size_t>(slot) * width;
+        if (tags[slot] != y) {
+            produce(y, out);
+            tags[slot] = y;
+        }
+        return out;
+    }
+
+protected:
+    const int width;
+    const int height;
+    ScratchScope& memory;
+
+    virtual void produce(int y, Pixel* out) = 0;
+
+    int clamp_row(int y) const { return std::min(std::max(y, 0), height - 1); }
+
+private:
+    int capacity = 1;
+    Pixel* ring = nullptr;
+    int* tags = nullptr;
+};
+
+/**
+ * Rows of the layer. Rows inside the band [y0, y1) are read from the layer
+ * itself; rows outside it belong to other bands, which may already have
+ * overwritten them, so they come from a copy taken before the sweep started.
+ */
+class SourceStage : public RowStage {
+public:
+    // `above` holds rows top .. y0 - 1, `below` rows from y1 on
+    SourceStage(ScratchScope& memory, const Layer& layer, int y0, int y1, const Pixel* above, int top,
+                const Pixel* below)
+        : RowStage(memory, layer.width(), layer.height()), layer(layer), y0(y0), y1(y1),
+          above(above), top(top), below(below) {}
+
+protected:
+    void produce(int y, Pixel* out) override {
+        const Pixel* src;
+        if (y < y0) {
+            src = above + static_cast<size_t>(y - top) * width;
+        } else if (y >= y1) {
+            src = below + static_cast<size_t>(y - y1) * width;
+        } else {
+            src = layer.pixels.row(y);
+        }
+        std::memcpy(static_cast<void*>(out), src, static_cast<size_t>(width) * sizeof(Pixel));
+    }
+
+private:
+    const Layer& layer;
+    const int y0;
+    const int y1;
+    const Pixel* const above;
+    const int top;
+    const Pixel* const below;
+};
+
+// Consecutive monochrome steps, compiled into one table pass (point_ops.h)
+class PointStage : public RowStage {
+public:
+    PointStage(ScratchScope& memory, RowStage& input, int width, int height, PointProgram program)
+        : RowStage(memory, width, height), input(input), program(std::move(program)) {}
+
+protected:
+    void produce(int y, Pixel* out) override {
+        std::memcpy(static_cast<void*>(out), input.row(y), static_cast<size_t>(width) * sizeof(Pixel));
+        program.run(out, width);
+    }
+
+private:
+    RowStage& input;
+    const PointProgram program;
+};
+
+// Horizontal Gaussian pass, row by row
+class GaussianHorizontalStage : public RowStage {
+public:
+    GaussianHorizontalStage(ScratchScope& memory, RowStage& input, int width, int height, const float* kernel,
+                            int kernelSize)
+        : RowStage(memory, width, height), input(input), kernel(kernel), halfKernel(kernelSize / 2),
+          blur(gaussian_row_kernels(halfKernel).horizontal) {}
+
+protected:
+    void produce(int y, Pixel* out) override {
+        blur(input.row(y), out, width, kernel, halfKernel);
+    }
+
+private:
+    RowStage& input;
+    const float* const kernel;
+    const int halfKernel;
+    GaussianRowHorizontalFn blur;
+};
+
+// Vertical Gaussian pass over a rolling window of horizontally blurred rows
+class GaussianVerticalStage : public RowStage {
+public:
+    GaussianVerticalStage(ScratchScope& memory, RowStage& input, int width, int height, const float* kernel,
+                          int kernelSize)
+        : RowStage(memory, width, height), input(input), kernel(kernel), halfKernel(kernelSize / 2),
+          rows(memory.allocate<const Pixel*>(kernelSize)),
+          blur(gaussian_row_kernels(halfKernel).vertical) {
+        input.reserve(kernelSize);
+    }
+
+protected:
+    void produce(int y, Pixel* out) override {
+        for (int k = -halfKernel; k <= halfKernel; ++k) {
+            rows[k + halfKernel] = input.row(clamp_row(y + k));
+        }
+        blur(rows, out, width, kernel, halfKernel);
+    }
+
+private:
+    RowStage& input;
+    const float* const kernel;
+    const int halfKernel;
+    const Pixel** const rows;
+    GaussianRowVerticalFn blur;
+};
+
+// Laplacian filter over a rolling window of 3 grayscale rows (see convolution.h)
+class LaplacianStage : public RowStage {
+public:
+    LaplacianStage(ScratchScope& memory, RowStage& input, int width, int height)
+        : RowStage(memory, width, height), input(input), window(memory, width, height, 1, 1),
+          sums(memory.allocate<int16_t>(width)) {
+        input.reserve(3);
+    }
+
+protected:
+    void produce(int y, Pixel* out) override {
+        // The first and last rows are left unchanged
+        if (y > 0 && y < height - 1) window.center(y, [&](int row) { return input.row(row); });
+        std::memcpy(static_cast<void*>(out), input.row(y), static_cast<size_t>(width) * sizeof(Pixel));
+        if (y == 0 || y == height - 1) return;
+        laplacian_row(window, out, sums, width);
+    }
+
+private:
+    RowStage& input;
+    ConvolutionWindow window;
+    int16_t* const sums;
+};
+
+/**
+ * Blur kernels of the Gaussian steps among `count` fusable steps, back to back
+ * in order, from `memory`, and how many rows above and below its own rows a
+ * sweep of them reads.
+ */
+inline const float* fused_kernels(ScratchScope& memory, const PipelineStep* steps, int count, int& reach) {
+    int total = 0;
+    for (int i = 0; i < count; ++i) {
+        if (steps[i].op == PipelineOp::GaussianBlur) total += gaussian_kernel_size(static_cast<int>(steps[i].param1));
+    }
+    float* kernels = memory.allocate<float>(total);
+
+    reach = 0;
+    float* kernel = kernels;
+    for (int i = 0; i < count; ++i) {
+        if (steps[i].op == PipelineOp::GaussianBlur) {
+            int kernelSize = gaussian_kernel_size(static_cast<int>(steps[i].param1));
+            gaussian_kernel(steps[i].param0, kernelSize, kernel);
+            kernel += kernelSize;
+            reach += kernelSize / 2;
+        } else if (steps[i].op == PipelineOp::LaplacianFilter) {
+            reach += 1;
+        }
+    }
+    return kernels;
+}
+
+/**
+ * Append the stages of `count` fusable steps to `stages`, whose last stage
+ * (the source) feeds the first step. `kernels` comes from fused_kernels and
+ * `memory` gives the stages their rows; both must outlive the stages.
+ */
+inline void add_fused_stages(std::vector<std::unique_ptr<RowStage>>& stages, ScratchScope& memory,
+                             const PipelineStep* steps, int count, const float* kernels, int width, int height) {
+    const float* kernel = kernels;
+
+    for (int i = 0; i < count; ++i) {
+        RowStage& input = *stages.back();
+        const PipelineStep& step = steps[i];
+
+        if (GrayscaleFn fn = pipeline_grayscale_fn(step.op)) {
+            PointProgram program;
+            program.add(PointOp{grayscale_point_op(fn)});
+            while (i + 1 < count && pipeline_grayscale_fn(steps[i + 1].op)) {
+                program.add(PointOp{grayscale_point_op(pipeline_grayscale_fn(steps[++i].op))});
+            }
+            stages.emplace_back(new PointStage(memory, input, width, height, std::move(program)));
+        } else if (step.op == PipelineOp::GaussianBlur) {
+            const int kernelSize = gaussian_kernel_size(static_cast<int>(step.param1));
+            stages.emplace_back(new GaussianHorizontalStage(memory, input, width, height, kernel, kernelSize));
+            stages.emplace_back(new GaussianVerticalStage(memory, *stages.back(), width, height, kernel, kernelSize));
+            kernel += kernelSize;
+        } else if (step.op == PipelineOp::LaplacianFilter) {
+            stages.emplace_back(new LaplacianStage(memory, input, width, height));
+        }
+    }
+}
+
+/**
+ * Stream `count` fusable steps over `layer` in one band-parallel sweep.
+ */
+inline void run_fused_steps(Layer& layer, const PipelineStep* steps, int count) {
+    if (layer.empty() || count == 0) return;
+
+    const int width = layer.width();
+    const int height = layer.height();
+    ENGINE_STAT(stat, "pipeline.sweep");
+    stat.add(static_cast<uint64_t>(width) * height * count);
+
+    // Kernels stay alive for the whole sweep; stages refer to them
+    ScratchScope scratch;
+    int reach = 0;
+    const float* kernels = fused_kernels(scratch, steps, count, reach);
+
+    // Bands recompute `reach` rows of their neighbours, so keep them tall enough
+    // for that to stay a small fraction of the work
+    ThreadPool& pool = ThreadPool::shared();
+    const int grain = std::max(row_grain(width), 8 * reach);
+    const int bands = pool.band_count(height, grain);
+
+    // Copy every band's halo rows before any band starts writing
+    Pixel** above = scratch.allocate<Pixel*>(bands);
+    Pixel** below = scratch.allocate<Pixel*>(bands);
+    for (int band = 0; band < bands; ++band) {
+        std::pair<int, int> range = ThreadPool::band_range(0, height, bands, band);
+        int top = std::max(0, range.first - reach);
+        int bottom = std::min(height, range.second + reach);
+
+        above[band] = scratch.allocate<Pixel>(static_cast<size_t>(range.first - top) * width);
+        for (int y = top; y < range.first; ++y) {
+            std::memcpy(static_cast<void*>(above[band] + static_cast<size_t>(y - top) * width),
+                        layer.pixels.row(y), static_cast<size_t>(width) * sizeof(Pixel));
+        }
+
+        below[band] = scratch.allocate<Pixel>(static_cast<size_t>(bottom - range.second) * width);
+        for (int y = range.second; y < bottom; ++y) {
+            std::memcpy(static_cast<void*>(below[band] + static_cast<size_t>(y - range.second) * width),
+                        layer.pixels.row(y), static_cast<size_t>(width) * sizeof(Pixel));
+        }
+    }
+
+    pool.parallel_for(0, bands, 1, [&](int firstBand, int lastBand) {
+        for (int band = firstBand; band < lastBand; ++band) {
+            std::pair<int, int> range = ThreadPool::band_range(0, height, bands, band);
+            const int top = std::max(0, range.first - reach);
+
+            // Build the chain of stages for this band
+            ScratchScope bandScratch;
+            std::vector<std::unique_ptr<RowStage>> stages;
+            stages.emplace_back(new SourceStage(bandScratch, layer, range.first, range.second, above[band], top,
+                                                below[band]));
+            add_fused_stages(stages, bandScratch, steps, count, kernels, width, height);
+
+            // Pull the band's rows through the chain and write them back. The
+            // source row y can still be read (again, if a stage's ring evicted
+            // a row that depends on it) until output row y + reach is done, so
+            // each result is held back that long before it overwrites the layer
+            RowStage& output = *stages.back();
+            const int slots = reach + 1;
+            Pixel* pending = bandScratch.allocate<Pixel>(static_cast<size_t>(slots) * width);
+            auto slot = [&](int y) { return pending + static_cast<size_t>(y % slots) * width; };
+            auto write_back = [&](int y) {
+                std::memcpy(static_cast<void*>(layer.pixels.row(y)), slot(y), static_cast<size_t>(width) * sizeof(Pixel));
+            };
+
+            for (int y = range.first; y < range.second; ++y) {
+                std::memcpy(static_cast<void*>(slot(y)), output.row(y), static_cast<size_t>(width) * sizeof(Pixel));
+                if (y - reach >= range.first) write_back(y - reach);
+            }
+            for (int y = std::max(range.first, range.second - reach); y < range.second; ++y) write_back(y);
+        }
+    });
+}
+
+/**
+ * Stream `count` fusable steps over rows [y0, y1) of `source`, writing the
+ * results to the same rows of `dest` (which has the same size). `source` is
+ * left unchanged, so halo rows are read straight from it.
+ */
+inline void run_fused_rows(const Layer& source, PixelBuffer& dest, const PipelineStep* steps, int count,
+                           int y0, int y1) {
+    if (source.empty() || y0 >= y1) return;
+
+    const int width = source.width();
+    const int height = source.height();
+
+    ScratchScope scratch;
+    int reach = 0;
+    const float* kernels = fused_kernels(scratch, steps, count, reach);
+
+    ThreadPool& pool = ThreadPool::shared();
+    const int grain = std::max(row_grain(width), 8 * reach);
+    const int bands = pool.band_count(y1 - y0, grain);
+
+    pool.parallel_for(0, bands, 1, [&](int firstBand, int lastBand) {
+        for (int band = firstBand; band < lastBand; ++band) {
+            std::pair<int, int> range = ThreadPool::band_range(y0, y1, bands, band);
+
+            ScratchScope bandScratch;
+            std::vector<std::unique_ptr<RowStage>> stages;
+            stages.emplace_back(new SourceStage(bandScratch, source, 0, height, nullptr, 0, nullptr));
+            add_fused_stages(stages, bandScratch, steps, count, kernels, width, height);
+
+            RowStage& output = *stages.back();
+            for (int y = range.first; y < range.second; ++y) {
+                std::memcpy(static_cast<void*>(dest.row(y)), output.row(y),
+                            static_cast<size_t>(width) * sizeof(Pixel));
+            }
+        }
+    });
+}
+
+/**
+ * A queue of filter steps to run on a layer.
+ */
+class Pipeline {
+public:
+    void add(PipelineOp op, double param0 = 0.0, double param1 = 0.0) {
+        steps.push_back(PipelineStep{op, param0, param1});
+    }
+
+    void add(const PipelineStep& step) { steps.push_back(step); }
+
+    bool empty() const { return steps.empty(); }
+
+    /**
+     * Run the queued steps on `layer` and clear the queue. Consecutive fusable
+     * steps are streamed in one sweep; any other step is handed to
+     * barrier(layer, step) to run on its own. Marks the layer dirty.
+     */
+    template <typename Barrier>
+    void run(Layer& layer, Barrier&& barrier) {
+        if (layer.empty()) {
+            steps.clear();
+            return;
+        }
+
+        size_t i = 0;
+        while (i < steps.size()) {
+            if (!pipeline_step_fusable(steps[i])) {
+                barrier(layer, steps[i]);
+                ++i;
+                continue;
+            }
+
+            size_t end = i;
+            while (end < steps.size() && pipeline_step_fusable(steps[end])) ++end;
+            run_fused_steps(layer, steps.data() + i, static_cast<int>(end - i));
+            i = end;
+        }
+
+        if (!steps.empty()) layer.mark_dirty(0, 0, layer.width(), layer.height());
+        steps.clear();
+    }
+
+private:
+    std::vector<PipelineStep> steps;
+};
+
+/**
+ * `step` adjusted to preview on the layer scaled down by 2^level (see
+ * pyramid.h), so that it looks the same at that scale: blur radii shrink with
+ * the image. Preview steps are approximate (see PipelineStep).
+ */
+inline PipelineStep scaled_pipeline_step(const PipelineStep& step, int level) {
+    if (level <= 0) return step;
+
+    PipelineStep scaled = step;
+    scaled.approximate = true;
+    if (step.op == PipelineOp::GaussianBlur) {
+        const int scale = 1 << level;
+        const int halfKernel = gaussian_kernel_size(static_cast<int>(step.param1)) / 2;
+        const int scaledHalf = (halfKernel + scale / 2) / scale;
+        scaled.param0 = step.param0 / scale;
+        scaled.param1 = 2 * scaledHalf + 1;
+    }
+    return scaled;
+}
+
+/**
+ * A pipeline run split into chunks, so that running it on a large layer can
+ * be spread over many calls (e.g. one per animation frame) and abandoned
+ * between any two of them.
+ *
+ * The job works on its own copy of the layer, and the layer is left untouched
+ * until `commit` swaps the result in. Fused sweeps read one buffer and write
+ * the next a band of rows at a time. The stacked box blur runs its rows, then
+ * its column strips, a few at a time, in place. Sobel normalizes by the
+ * largest gradient in the whole image, so it runs in a single chunk.
+ *
+ * The result is identical to running the same steps with Pipeline::run.
+ */
+class PipelineJob {
+public:
+    // Pixels processed per thread in each chunk
+    static constexpr int CHUNK_PIXELS = 1 << 19;
+
+    PipelineJob(const Layer& layer, const std::vector<PipelineStep>& steps)
+        : steps(steps), uid(layer.uid), version(layer.version), work(layer.id, PixelBuffer(layer.width(), layer.height())) {
+        for (int y = 0; y < layer.height(); ++y) {
+            std::memcpy(static_cast<void*>(work.pixels.row(y)), layer.pixels.row(y),
+                        static_cast<size_t>(layer.width()) * sizeof(Pixel));
+        }
+        plan();
+    }
+
+    bool done() const { return phase >= phases.size(); }
+
+    // Whether `layer` is still the layer, at the version, the job started from
+    bool matches(const Layer& layer) const { return layer.uid == uid && layer.version == version; }
+
+    // Fraction of the work done so far, from 0 to 1
+    double progress() const {
+        if (phases.empty()) return 1.0;
+        double current = done() ? 0.0 : static_cast<double>(position) / phases[phase].units;
+        return (phase + current) / phases.size();
+    }
+
+    /**
+     * Run the next chunk. Steps that cannot be split are handed to
+     * barrier(layer, step), as in Pipeline::run.
+     */
+    template <typename Barrier>
+    void run_chunk(Barrier&& barrier) {
+        if (done()) return;
+
+        Phase& current = phases[phase];
+        const int width = work.width();
+        const int threads = ThreadPool::shared().size();
+        const int end = std::min(current.units, position + std::max(1, threads * current.chunk));
+
+        switch (current.kind) {
+            case Phase::Fused:
+                if (next.empty()) next = PixelBuffer(width, work.height());
+                run_fused_rows(work, next, steps.data() + current.step, current.count, position, end);
+                break;
+            case Phase::BoxRows:
+                ThreadPool::shared().parallel_for(position, end, row_grain(width), [&](int y0, int y1) {
+                    box_blur_rows(work.pixels, current.radii, y0, y1);
+                });
+                break;
+            case Phase::BoxStrips:
+                ThreadPool::shared().parallel_for(position, end, 1, [&](int s0, int s1) {
+                    box_blur_strips(work.pixels, current.radii, s0, s1);
+                });
+                break;
+            case Phase::Barrier:
+                barrier(work, steps[current.step]);
+                break;
+        }
+
+        position = end;
+        if (position < current.units) return;
+
+        // A finished sweep's output becomes the next phase's input
+        if (current.kind == Phase::Fused) std::swap(work.pixels, next);
+        ++phase;
+        position = 0;
+    }
+
+    /**
+     * Replace the pixels of `layer` with the result. The job must be done and
+     * must still match the layer. Marks the layer dirty and returns the pixels
+     * that were replaced (empty if none were).
+     */
+    PixelBuffer commit(Layer& layer) {
+        if (!done() || !matches(layer) || phases.empty()) return PixelBuffer();
+        std::swap(layer.pixels, work.pixels);
+        layer.mark_dirty(0, 0, layer.width(), layer.height());
+        return std::move(work.pixels);
+    }
+
+private:
+    struct Phase {
+        enum Kind { Fused, BoxRows, BoxStrips, Barrier } kind = Fused;
+        int step = 0;       // first step of the phase
+        int count = 1;      // steps in a fused sweep
+        int units = 1;      // rows, strips, or 1 for a barrier
+        int chunk = 1;      // units per thread in one chunk
+        std::array<int, BOX_BLUR_PASSES> radii{};
+    };
+
+    std::vector<PipelineStep> steps;
+    std::vector<Phase> phases;
+    size_t phase = 0;
+    int position = 0;
+
+    uint64_t uid;
+    uint32_t version;
+    Layer work;
+    PixelBuffer next;
+
+    void plan() {
+        if (work.empty()) return;
+
+        const int width = work.width();
+        const int height = work.height();
+        const int rowChunk = std::max(1, CHUNK_PIXELS / width);
+        const int count = static_cast<int>(steps.size());
+
+        int i = 0;
+        while (i < count) {
+            const PipelineStep& step = steps[i];
+            Phase entry;
+
+            if (pipeline_step_fusable(step)) {
+                int end = i;
+                while (end < count && pipeline_step_fusable(steps[end])) ++end;
+                entry.kind = Phase::Fused;
+                entry.step = i;
+                entry.count = end - i;
+                entry.units = height;
+                entry.chunk = rowChunk;
+                phases.push_back(entry);
+                i = end;
+                continue;
+            }
+
+            if (pipeline_step_box_blur(step)) {
+                entry.radii = box_blur_radii(pipeline_step_variance(step));
+                entry.step = i;
+
+                entry.kind = Phase::BoxRows;
+                entry.units = height;
+                entry.chunk = rowChunk;
+                phases.push_back(entry);
+
+                entry.kind = Phase::BoxStrips;
+                entry.units = box_blur_strip_count(width);
+                entry.chunk = std::max(1, CHUNK_PIXELS / (BOX_BLUR_STRIP_WIDTH * height));
+                phases.push_back(entry);
+            } else {
+                entry.kind = Phase::Barrier;
+                entry.step = i;
+                phases.push_back(entry);
+            }
+            ++i;
+        }
+    }
+};
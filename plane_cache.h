@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include "layer.h"
+
+/**
+ * Derived-plane cache
+ *
+ * Data derived from a layer's pixels that a later operation can reuse while
+ * the layer still holds those pixels: Sobel gradient magnitudes, quad trees.
+ * Entries are keyed by the layer's uid and version (see Layer), so any edit
+ * leaves them stale, and kept under a byte budget, the least recently used
+ * going first once over it.
+ *
+ * Only the states operations start from are worth keeping, not the
+ * intermediate results of a pipeline, bands of a tiled image or preview
+ * copies, so `store` only keeps planes of the layer an `Admit` scope names
+ * (edit_layer opens one for the layer it edits).
+ *
+ * Undo and redo put back pixels a layer held before, under a new version.
+ * History calls `alias` then, so the entries of the old version serve the new
+ * one: applying a filter, undoing it and applying another reuses the work.
+ *
+ * Every method takes a lock: batch workers (batch_run_commands) filtering
+ * their own images at once look planes up from several threads. Their
+ * images are never admitted, so they never store any.
+ */
+
+enum class PlaneKind : int {
+    Gradient = 0,   // Sobel magnitudes (image_processor.cpp)
+    QuadTree = 1,   // QuadTree (quad_tree.h)
+};
+
+class PlaneCache {
+public:
+    static constexpr size_t DEFAULT_BUDGET_BYTES = size_t(64) << 20;
+
+    struct Stats {
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t budget = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+
+    static PlaneCache& shared() {
+        static PlaneCache cache;
+        return cache;
+    }
+
+    // Lets `store` keep planes of `layer` at its current version
+    class Admit {
+    public:
+        Admit(PlaneCache& cache, const Layer& layer)
+            : cache(cache) {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            previous = cache.admitted;
+            cache.admitted = {layer.uid, layer.version};
+        }
+        ~Admit() {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            cache.admitted = previous;
+        }
+
+        Admit(const Admit&) = delete;
+        Admit& operator=(const Admit&) = delete;
+
+    private:
+        PlaneCache& cache;
+        std::pair<uint64_t, uint32_t> previous;
+    };
+
+    // The plane of `kind` for the layer's current pixels, or nullptr
+    template <typename T>
+    std::shared_ptr<const T> find(const Layer& layer, PlaneKind kind) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->uid != layer.uid || it->version != layer.version || it->kind != kind) continue;
+            entries.splice(entries.begin(), entries, it);
+            ++hits;
+            return std::static_pointer_cast<const T>(entries.front().plane);
+        }
+        ++misses;
+        return nullptr;
+    }
+
+    // Whether `store` would keep a plane of `bytes` for the layer's current pixels
+    bool admits(const Layer& layer, size_t bytes) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return admitted == std::make_pair(layer.uid, layer.version) && bytes <= budget;
+    }
+
+    /**
+     * Keep `plane` (taking `bytes`) for the layer's current pixels, if the
+     * layer is admitted and the plane fits the budget.
+     */
+    template <typename T>
+    void store(const Layer& layer, PlaneKind kind, std::shared_ptr<const T> plane, size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!plane || admitted != std::make_pair(layer.uid, layer.version) || bytes > budget) return;
+
+        erase_if([&](const Entry& e) { return e.uid == layer.uid && e.version == layer.version && e.kind == kind; });
+        entries.push_front({layer.uid, layer.version, kind, std::move(plane), bytes});
+        totalBytes += bytes;
+        trim();
+    }
+
+    // Layer `uid` holds again, at version `to`, the pixels it held at `from`
+    void alias(uint64_t uid, uint32_t from, uint32_t to) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Entry& e : entries) {
+            if (e.uid == uid && e.version == from) e.version = to;
+        }
+    }
+
+    // Drop every plane of layer `uid`, e.g. when it is deleted
+    void forget(uint64_t uid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        erase_if([&](const Entry& e) { return e.uid == uid; });
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+        totalBytes = 0;
+    }
+
+    void set_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        trim();
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats s;
+        s.entries = entries.size();
+        s.bytes = totalBytes;
+        s.budget = budget;
+        s.hits = hits;
+        s.misses = misses;
+        return s;
+    }
+
+private:
+    struct Entry {
+        uint64_t uid;
+        uint32_t version;
+        PlaneKind kind;
+        std::shared_ptr<const void> plane;
+        size_t bytes;
+    };
+
+    mutable std::mutex mutex;
+
+    // Most recently used first
+    std::list<Entry> entries;
+    size_t totalBytes = 0;
+    size_t budget = DEFAULT_BUDGET_BYTES;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    // Layer uid and version `store` keeps planes for (uids start at 1)
+    std::pair<uint64_t, uint32_t> admitted{0, 0};
+
+    template <typename Predicate>
+    void erase_if(Predicate&& predicate) {
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (predicate(*it)) {
+                totalBytes -= it->bytes;
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void trim() {
+        while (totalBytes > budget && !entries.empty()) {
+            totalBytes -= entries.back().bytes;
+            entries.pop_back();
+        }
+    }
+};
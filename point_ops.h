@@ -0,0 +1,395 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include "layer.h"
+#include "filters.h"
+
+/**
+ * Point operations
+ *
+ * Colour adjustments that map every pixel on its own: the four grayscale
+ * methods, levels, curves, gamma, invert, threshold and channel mixing. A
+ * chain of them is compiled into a PointProgram before it touches a pixel:
+ *
+ *   - per-channel adjustments (levels, curves, gamma, invert, threshold's
+ *     cut) compose into one 256-entry table per channel
+ *   - cross-channel ones (grayscale, channel mixing) become a stage of
+ *     fixed-point weight tables, one entry per input value, which absorb the
+ *     per-channel tables before them; the per-channel tables after them
+ *     become the stage's output tables
+ *
+ * So a chain of any length costs one table lookup per channel, plus one
+ * stage per cross-channel operation, in a single pass over each row without
+ * any per-pixel call. Alpha is never changed.
+ *
+ * Tables are built with integer arithmetic, or with + - * / and sqrt only
+ * (see reproducible_exp), so every build computes the same ones. Grayscale
+ * weights are exact: luminosity and ITU give floor(299 r + 587 g + 114 b) /
+ * 1000 and floor(2126 r + 7152 g + 722 b) / 10000.
+ */
+
+// Operation codes of adjust_colors. 0 - 3 match the monochrome PipelineOp codes.
+enum class PointOpKind : int {
+    GrayscaleAverage = 0,
+    GrayscaleLuminosity = 1,
+    GrayscaleLightness = 2,
+    GrayscaleItu = 3,
+    Levels = 4,         // input black, input white, gamma, output black, output white
+    Curves = 5,         // up to 6 points x0, y0, x1, y1, ... (0 - 255), ending at the first x < 0
+    Gamma = 6,          // gamma (> 1 brightens)
+    Invert = 7,
+    Threshold = 8,      // level: pixels whose luminosity reaches it become white, others black
+    ChannelMix = 9,     // r from r, g, b; g from r, g, b; b from r, g, b; r, g, b offsets
+};
+
+constexpr int POINT_OP_PARAM_COUNT = 12;
+
+// Doubles per operation in the packed array passed to adjust_colors: kind, params
+constexpr int POINT_OP_SIZE = 1 + POINT_OP_PARAM_COUNT;
+
+struct PointOp {
+    PointOpKind kind;
+    double params[POINT_OP_PARAM_COUNT] = {};
+};
+
+inline bool point_op_valid(int kind) {
+    return kind >= static_cast<int>(PointOpKind::GrayscaleAverage) &&
+           kind <= static_cast<int>(PointOpKind::ChannelMix);
+}
+
+/**
+ * ln x for 0 < x <= 1, from + * / only: x = m 2^e with m in [0.5, 1), and
+ * ln m = 2 atanh((m - 1) / (m + 1)) as a series.
+ */
+inline double reproducible_log(double x) {
+    int exponent = 0;
+    const double m = std::frexp(x, &exponent);
+    const double z = (m - 1.0) / (m + 1.0);
+    const double z2 = z * z;
+    double power = z;
+    double sum = 0.0;
+    for (int k = 0; k < 32; ++k) {
+        sum = sum + power / (2 * k + 1);
+        power = power * z2;
+    }
+    return 2.0 * sum + exponent * 0.6931471805599453;
+}
+
+// x^p for x in [0, 1] and p > 0
+inline double reproducible_pow(double x, double p) {
+    if (x <= 0.0) return 0.0;
+    if (x >= 1.0) return 1.0;
+    return reproducible_exp(p * reproducible_log(x));
+}
+
+inline uint8_t point_round(double value) {
+    if (!(value > 0.0)) return 0;
+    if (value >= 255.0) return 255;
+    return static_cast<uint8_t>(std::floor(value + 0.5));
+}
+
+class PointProgram {
+public:
+    using Table = std::array<uint8_t, 256>;
+
+    PointProgram() = default;
+
+    explicit PointProgram(const std::vector<PointOp>& ops) {
+        for (const PointOp& op : ops) add(op);
+    }
+
+    void add(const PointOp& op) {
+        const double* p = op.params;
+        switch (op.kind) {
+            case PointOpKind::GrayscaleAverage:
+                // s * 21846 >> 16 is s / 3 for every s up to 765
+                add_weighted(true, {{{21846, 21846, 21846}}}, 16, 0);
+                break;
+            case PointOpKind::GrayscaleLuminosity:
+                add_weighted(true, {{{299, 587, 114}}}, 0, 1000);
+                break;
+            case PointOpKind::GrayscaleItu:
+                add_weighted(true, {{{2126, 7152, 722}}}, 0, 10000);
+                break;
+            case PointOpKind::GrayscaleLightness:
+                add_lightness();
+                break;
+            case PointOpKind::ChannelMix:
+                add_mix(p);
+                break;
+            case PointOpKind::Threshold: {
+                add(PointOp{PointOpKind::GrayscaleLuminosity});
+                const double level = p[0];
+                add_table([&](int v) { return v >= level ? 255.0 : 0.0; });
+                break;
+            }
+            case PointOpKind::Levels: {
+                const double inBlack = p[0], inWhite = p[1], outBlack = p[3], outWhite = p[4];
+                const double exponent = p[2] > 0.0 ? 1.0 / p[2] : 1.0;
+                add_table([&](int v) {
+                    double t = inWhite > inBlack ? (v - inBlack) / (inWhite - inBlack) : (v >= inBlack ? 1.0 : 0.0);
+                    t = reproducible_pow(std::min(1.0, std::max(0.0, t)), exponent);
+                    return outBlack + t * (outWhite - outBlack);
+                });
+                break;
+            }
+            case PointOpKind::Gamma: {
+                const double exponent = p[0] > 0.0 ? 1.0 / p[0] : 1.0;
+                add_table([&](int v) { return 255.0 * reproducible_pow(v / 255.0, exponent); });
+                break;
+            }
+            case PointOpKind::Invert:
+                add_table([](int v) { return 255.0 - v; });
+                break;
+            case PointOpKind::Curves:
+                add_curve(p);
+                break;
+        }
+    }
+
+    bool empty() const { return stages.empty(); }
+
+    // Run the program on `width` pixels
+    void run(Pixel* row, int width) const {
+        for (const Stage& stage : stages) {
+            const uint8_t* outR = stage.output[0].data();
+            const uint8_t* outG = stage.output[1].data();
+            const uint8_t* outB = stage.output[2].data();
+            const int32_t* w = stage.weights.data();
+            const int shift = stage.shift;
+
+            switch (stage.kind) {
+                case Stage::Tables:
+                    for (int x = 0; x < width; ++x) {
+                        Pixel& px = row[x];
+                        px.r = outR[px.r];
+                        px.g = outG[px.g];
+                        px.b = outB[px.b];
+                    }
+                    break;
+                case Stage::Gray:
+                    for (int x = 0; x < width; ++x) {
+                        Pixel& px = row[x];
+                        const int gray = std::min(255, std::max(0, (w[px.r] + w[256 + px.g] + w[512 + px.b]) >> shift));
+                        px.r = outR[gray];
+                        px.g = outG[gray];
+                        px.b = outB[gray];
+                    }
+                    break;
+                case Stage::Mix:
+                    for (int x = 0; x < width; ++x) {
+                        Pixel& px = row[x];
+                        const int r = px.r, g = px.g, b = px.b;
+                        const int mr = (w[r] + w[256 + g] + w[512 + b]) >> shift;
+                        const int mg = (w[768 + r] + w[1024 + g] + w[1280 + b]) >> shift;
+                        const int mb = (w[1536 + r] + w[1792 + g] + w[2048 + b]) >> shift;
+                        px.r = outR[std::min(255, std::max(0, mr))];
+                        px.g = outG[std::min(255, std::max(0, mg))];
+                        px.b = outB[std::min(255, std::max(0, mb))];
+                    }
+                    break;
+                case Stage::Lightness: {
+                    const uint8_t* inR = stage.input[0].data();
+                    const uint8_t* inG = stage.input[1].data();
+                    const uint8_t* inB = stage.input[2].data();
+                    for (int x = 0; x < width; ++x) {
+                        Pixel& px = row[x];
+                        const uint8_t r = inR[px.r], g = inG[px.g], b = inB[px.b];
+                        const int gray = (std::max({r, g, b}) + std::min({r, g, b})) / 2;
+                        px.r = outR[gray];
+                        px.g = outG[gray];
+                        px.b = outB[gray];
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    /**
+     * One pass over the pixels. Tables: out[c][in]. Gray and Mix: weighted
+     * sums of weights[(3 * out + in) * 256 + value] (Gray only has out 0),
+     * shifted right by `shift`, clamped, then out[c][sum]. Lightness:
+     * (max + min) / 2 of input[c][in], then out[c][gray].
+     */
+    struct Stage {
+        enum Kind { Tables, Gray, Mix, Lightness } kind;
+        std::vector<int32_t> weights;
+        int shift = 0;
+        std::array<Table, 3> input;
+        std::array<Table, 3> output;
+    };
+
+    std::vector<Stage> stages;
+
+    static Table identity() {
+        Table table;
+        for (int v = 0; v < 256; ++v) table[v] = static_cast<uint8_t>(v);
+        return table;
+    }
+
+    // The per-channel tables a new cross-channel stage starts from: those of a
+    // trailing Tables stage, which it replaces, or the identity
+    std::array<Table, 3> take_input() {
+        if (!stages.empty() && stages.back().kind == Stage::Tables) {
+            std::array<Table, 3> input = stages.back().output;
+            stages.pop_back();
+            return input;
+        }
+        return {identity(), identity(), identity()};
+    }
+
+    Stage& push(Stage::Kind kind) {
+        Stage stage;
+        stage.kind = kind;
+        stage.output = {identity(), identity(), identity()};
+        stages.push_back(std::move(stage));
+        return stages.back();
+    }
+
+    // Compose f(v) (rounded to 0 - 255) after the output tables of the last stage
+    template <typename F>
+    void add_table(F&& f) {
+        Table mapped;
+        for (int v = 0; v < 256; ++v) mapped[v] = point_round(f(v));
+
+        if (stages.empty()) push(Stage::Tables);
+        for (Table& table : stages.back().output) {
+            for (uint8_t& value : table) value = mapped[value];
+        }
+    }
+
+    /**
+     * Stage of weighted sums: with `divisor`, output o is
+     * floor(sum of weights[o][c] * channel c / divisor), exactly; without,
+     * the weights are fixed point with `shift` fractional bits.
+     */
+    void add_weighted(bool gray, const std::array<std::array<int32_t, 3>, 3>& weights, int shift, int32_t divisor) {
+        const std::array<Table, 3> input = take_input();
+        Stage& stage = push(gray ? Stage::Gray : Stage::Mix);
+        const int outputs = gray ? 1 : 3;
+        stage.weights.assign(static_cast<size_t>(outputs) * 3 * 256, 0);
+
+        // Each exact weight w * v / divisor is floored with 20 fractional
+        // bits, so the sum of three is at most 2 units under the exact sum;
+        // adding 2 restores the floor, since the fractional part of the exact
+        // sum is a multiple of 1 / divisor, far larger than 2 units
+        constexpr int EXACT_BITS = 20;
+        stage.shift = divisor > 0 ? EXACT_BITS : shift;
+        for (int o = 0; o < outputs; ++o) {
+            for (int c = 0; c < 3; ++c) {
+                int32_t* table = stage.weights.data() + (3 * o + c) * 256;
+                for (int v = 0; v < 256; ++v) {
+                    const int64_t value = static_cast<int64_t>(weights[o][c]) * input[c][v];
+                    table[v] = static_cast<int32_t>(divisor > 0 ? (value << EXACT_BITS) / divisor : value);
+                }
+            }
+            if (divisor > 0) {
+                for (int v = 0; v < 256; ++v) stage.weights[3 * o * 256 + v] += 2;
+            }
+        }
+    }
+
+    void add_lightness() {
+        const std::array<Table, 3> input = take_input();
+        push(Stage::Lightness).input = input;
+    }
+
+    // Weights with 16 fractional bits, each clamped to +-8 so sums fit 32 bits
+    void add_mix(const double* p) {
+        constexpr int MIX_BITS = 16;
+        const std::array<Table, 3> input = take_input();
+        Stage& stage = push(Stage::Mix);
+        stage.shift = MIX_BITS;
+        stage.weights.assign(9 * 256, 0);
+        for (int o = 0; o < 3; ++o) {
+            const double offset = std::min(1024.0, std::max(-1024.0, p[9 + o]));
+            for (int c = 0; c < 3; ++c) {
+                const double weight = std::min(8.0, std::max(-8.0, p[3 * o + c]));
+                int32_t* table = stage.weights.data() + (3 * o + c) * 256;
+                for (int v = 0; v < 256; ++v) {
+                    // The offset and rounding go into the first table
+                    const double value = weight * input[c][v] + (c == 0 ? offset + 0.5 : 0.0);
+                    table[v] = static_cast<int32_t>(std::floor(value * (1 << MIX_BITS)));
+                }
+            }
+        }
+    }
+
+    // Monotone cubic (Fritsch-Carlson) through the points, flat beyond the ends
+    void add_curve(const double* p) {
+        std::vector<std::pair<double, double>> points;
+        for (int i = 0; i + 1 < POINT_OP_PARAM_COUNT && p[i] >= 0.0; i += 2) {
+            points.emplace_back(std::min(255.0, p[i]), std::min(255.0, std::max(0.0, p[i + 1])));
+        }
+        std::stable_sort(points.begin(), points.end(),
+                         [](const std::pair<double, double>& a, const std::pair<double, double>& b) { return a.first < b.first; });
+        points.erase(std::unique(points.begin(), points.end(),
+                                 [](const std::pair<double, double>& a, const std::pair<double, double>& b) {
+                                     return a.first == b.first;
+                                 }),
+                     points.end());
+        if (points.size() < 2) return;
+
+        const size_t n = points.size();
+        std::vector<double> slopes(n - 1), tangents(n);
+        for (size_t k = 0; k + 1 < n; ++k) {
+            slopes[k] = (points[k + 1].second - points[k].second) / (points[k + 1].first - points[k].first);
+        }
+        tangents[0] = slopes[0];
+        tangents[n - 1] = slopes[n - 2];
+        for (size_t k = 1; k + 1 < n; ++k) {
+            tangents[k] = slopes[k - 1] * slopes[k] <= 0.0 ? 0.0 : (slopes[k - 1] + slopes[k]) / 2;
+        }
+        for (size_t k = 0; k + 1 < n; ++k) {
+            if (slopes[k] == 0.0) {
+                tangents[k] = tangents[k + 1] = 0.0;
+                continue;
+            }
+            const double a = tangents[k] / slopes[k];
+            const double b = tangents[k + 1] / slopes[k];
+            const double length = a * a + b * b;
+            if (length > 9.0) {
+                const double t = 3.0 / std::sqrt(length);
+                tangents[k] = t * a * slopes[k];
+                tangents[k + 1] = t * b * slopes[k];
+            }
+        }
+
+        add_table([&](int v) {
+            if (v <= points.front().first) return points.front().second;
+            if (v >= points.back().first) return points.back().second;
+            size_t k = 0;
+            while (points[k + 1].first < v) ++k;
+            const double h = points[k + 1].first - points[k].first;
+            const double t = (v - points[k].first) / h;
+            const double t2 = t * t, t3 = t2 * t;
+            return (2 * t3 - 3 * t2 + 1) * points[k].second + (t3 - 2 * t2 + t) * h * tangents[k] +
+                   (-2 * t3 + 3 * t2) * points[k + 1].second + (t3 - t2) * h * tangents[k + 1];
+        });
+    }
+};
+
+// The point operation of a monochrome filter
+inline PointOpKind grayscale_point_op(GrayscaleFn grayscale_fn) {
+    if (grayscale_fn == grayscale_luminosity) return PointOpKind::GrayscaleLuminosity;
+    if (grayscale_fn == grayscale_lightness) return PointOpKind::GrayscaleLightness;
+    if (grayscale_fn == grayscale_itu) return PointOpKind::GrayscaleItu;
+    return PointOpKind::GrayscaleAverage;
+}
+
+// Compiled program of each monochrome filter, built once
+inline const PointProgram& grayscale_program(GrayscaleFn grayscale_fn) {
+    static const PointProgram programs[] = {
+        PointProgram({PointOp{PointOpKind::GrayscaleAverage}}),
+        PointProgram({PointOp{PointOpKind::GrayscaleLuminosity}}),
+        PointProgram({PointOp{PointOpKind::GrayscaleLightness}}),
+        PointProgram({PointOp{PointOpKind::GrayscaleItu}}),
+    };
+    return programs[static_cast<int>(grayscale_point_op(grayscale_fn))];
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <climits>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+
+/**
+ * Multi-resolution pyramid
+ *
+ * Level n of a layer is the layer scaled down by 2^n in each direction
+ * (rounded up), every pixel being the average of a 2x2 block of level n - 1.
+ * Level 0 is the layer itself. Levels are built the first time they are asked
+ * for and kept on the layer (Layer::pyramid), so previews at a fixed display
+ * size only ever read a fraction of the layer's pixels.
+ *
+ * Each level is a Layer of its own, with its own version and tile versions.
+ * When the layer above it changes, a level only recomputes the block covered
+ * by the tiles marked dirty since it was last updated, and marks that block
+ * dirty in turn, so an incremental Compositor over levels keeps working.
+ *
+ * Averages are weighted by alpha, so transparent pixels do not darken the
+ * edges of what they surround.
+ */
+
+// Levels past this are never useful: 2^12 source pixels per level pixel
+constexpr int PYRAMID_MAX_LEVEL = 12;
+
+// Size of a `size` pixel side at `level`, i.e. ceil(size / 2^level)
+inline int pyramid_extent(int size, int level) {
+    return size <= 0 ? 0 : ((size - 1) >> level) + 1;
+}
+
+/**
+ * Deepest level at which a width x height canvas still has at least
+ * displayWidth x displayHeight pixels. 0 (full resolution) when the display
+ * size is not set.
+ */
+inline int pyramid_level_for(int width, int height, int displayWidth, int displayHeight) {
+    if (displayWidth <= 0 || displayHeight <= 0) return 0;
+
+    int level = 0;
+    while (level < PYRAMID_MAX_LEVEL &&
+           pyramid_extent(width, level + 1) >= displayWidth &&
+           pyramid_extent(height, level + 1) >= displayHeight) {
+        ++level;
+    }
+    return level;
+}
+
+// Alpha-weighted average of a 2x2 block
+inline Pixel pyramid_average(const Pixel& p0, const Pixel& p1, const Pixel& p2, const Pixel& p3) {
+    // Equal alphas (opaque or fully transparent blocks) need no weighting
+    if (p0.a == p1.a && p1.a == p2.a && p2.a == p3.a) {
+        return Pixel(static_cast<uint8_t>((p0.r + p1.r + p2.r + p3.r + 2) >> 2),
+                     static_cast<uint8_t>((p0.g + p1.g + p2.g + p3.g + 2) >> 2),
+                     static_cast<uint8_t>((p0.b + p1.b + p2.b + p3.b + 2) >> 2),
+                     p0.a);
+    }
+
+    const int alpha = p0.a + p1.a + p2.a + p3.a;
+    const int half = alpha / 2;
+    return Pixel(static_cast<uint8_t>((p0.r * p0.a + p1.r * p1.a + p2.r * p2.a + p3.r * p3.a + half) / alpha),
+                 static_cast<uint8_t>((p0.g * p0.a + p1.g * p1.a + p2.g * p2.a + p3.g * p3.a + half) / alpha),
+                 static_cast<uint8_t>((p0.b * p0.a + p1.b * p1.a + p2.b * p2.a + p3.b * p3.a + half) / alpha),
+                 static_cast<uint8_t>((alpha + 2) >> 2));
+}
+
+/**
+ * Compute the block [x0, x1) x [y0, y1) of `out` from `in`, which is twice its
+ * size (rounded up). An odd last row or column of `in` is averaged with itself.
+ */
+inline void pyramid_downsample(const PixelBuffer& in, PixelBuffer& out, int x0, int y0, int x1, int y1) {
+    const int lastX = in.width - 1;
+    const int lastY = in.height - 1;
+
+    ThreadPool::shared().parallel_for(y0, y1, row_grain(2 * (x1 - x0)), [&](int rowBegin, int rowEnd) {
+        for (int y = rowBegin; y < rowEnd; ++y) {
+            const Pixel* a = in.row(std::min(2 * y, lastY));
+            const Pixel* b = in.row(std::min(2 * y + 1, lastY));
+            Pixel* dst = out.row(y);
+
+            for (int x = x0; x < x1; ++x) {
+                const int left = 2 * x;
+                const int right = std::min(left + 1, lastX);
+                dst[x] = pyramid_average(a[left], a[right], b[left], b[right]);
+            }
+        }
+    });
+}
+
+class MipPyramid {
+public:
+    /**
+     * Level `n` of `source` (the layer this pyramid belongs to), brought up
+     * to date with it first. Builds or updates every level in between. The
+     * reference stays valid until the pyramid is destroyed.
+     */
+    Layer& level(const Layer& source, int n) {
+        n = std::min(n, PYRAMID_MAX_LEVEL);
+        while (static_cast<int>(levels.size()) < n) levels.emplace_back();
+
+        const Layer* above = &source;
+        for (int i = 0; i < n; ++i) {
+            update(*above, levels[i]);
+            above = &levels[i].layer;
+        }
+        return levels[n - 1].layer;
+    }
+
+    // Memory held by all levels built so far
+    size_t size_bytes() const {
+        size_t bytes = 0;
+        for (const Level& level : levels) bytes += level.layer.pixels.size_bytes();
+        return bytes;
+    }
+
+private:
+    struct Level {
+        Layer layer;
+
+        // Version of the level above this one when it was last updated
+        uint32_t synced = 0;
+    };
+
+    // A deque, so references to levels survive adding deeper ones
+    std::deque<Level> levels;
+
+    static void update(const Layer& above, Level& level) {
+        const int width = pyramid_extent(above.width(), 1);
+        const int height = pyramid_extent(above.height(), 1);
+
+        // First use, or the layer above was resized: build the whole level
+        if (level.synced == 0 || level.layer.width() != width || level.layer.height() != height) {
+            level.layer = Layer(above.id, PixelBuffer(width, height));
+            if (!above.empty()) pyramid_downsample(above.pixels, level.layer.pixels, 0, 0, width, height);
+            level.synced = above.version;
+            return;
+        }
+
+        if (level.synced == above.version) return;
+
+        // Bounding box of the tiles changed since the last update
+        int tx0 = INT_MAX, ty0 = INT_MAX, tx1 = -1, ty1 = -1;
+        for (int ty = 0; ty < above.tiles_y; ++ty) {
+            for (int tx = 0; tx < above.tiles_x; ++tx) {
+                if (above.tile_versions[ty * above.tiles_x + tx] > level.synced) {
+                    tx0 = std::min(tx0, tx);
+                    ty0 = std::min(ty0, ty);
+                    tx1 = std::max(tx1, tx);
+                    ty1 = std::max(ty1, ty);
+                }
+            }
+        }
+        level.synced = above.version;
+        if (tx1 < 0) return;
+
+        // A tile of the level above covers half a tile here
+        constexpr int HALF_TILE = Layer::TILE_SIZE / 2;
+        const int x0 = tx0 * HALF_TILE, x1 = std::min(width, (tx1 + 1) * HALF_TILE);
+        const int y0 = ty0 * HALF_TILE, y1 = std::min(height, (ty1 + 1) * HALF_TILE);
+        pyramid_downsample(above.pixels, level.layer.pixels, x0, y0, x1, y1);
+        level.layer.mark_dirty(x0, y0, x1 - x0, y1 - y0);
+    }
+};
+
+/**
+ * Level `n` of `layer`'s pyramid (the layer itself for n = 0).
+ */
+inline Layer& pyramid_level(Layer& layer, int n) {
+    if (n <= 0) return layer;
+    if (!layer.pyramid) layer.pyramid = std::make_shared<MipPyramid>();
+    return layer.pyramid->level(layer, n);
+}
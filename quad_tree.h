@@ -0,0 +1,409 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+#include "resample.h"
+#include "plane_cache.h"
+
+/**
+ * Summed-area table
+ *
+ * Entry (i, j) holds the per-channel sums of all pixels above row ys[j] and
+ * left of column xs[i], and the sum of their squared channel values, so the
+ * sums over a rectangle whose corners are on the grid take four lookups.
+ *
+ * The table is only sampled at the grid `xs` x `ys` rather than at every
+ * pixel: at 40 bytes per entry, a full-resolution table would be ten times the
+ * size of the image, and filling it would cost more than the scans it saves.
+ * Passing every coordinate (0, 1, ..., width) gives the full table.
+ */
+class SummedAreaTable {
+public:
+    struct Sums {
+        uint64_t channel[4] = {0, 0, 0, 0};
+        // Squared values, summed over all four channels
+        uint64_t squares = 0;
+
+        void add(const Pixel& p) {
+            channel[0] += p.r;
+            channel[1] += p.g;
+            channel[2] += p.b;
+            channel[3] += p.a;
+            squares += p.r * p.r + p.g * p.g + p.b * p.b + p.a * p.a;
+        }
+
+        void add(const Sums& other) {
+            for (int c = 0; c < 4; ++c) channel[c] += other.channel[c];
+            squares += other.squares;
+        }
+
+        void subtract(const Sums& other) {
+            for (int c = 0; c < 4; ++c) channel[c] -= other.channel[c];
+            squares -= other.squares;
+        }
+    };
+
+    // xs and ys are increasing, and span the whole image (0 .. width, 0 .. height)
+    SummedAreaTable(const PixelBuffer& pixels, const std::vector<int>& xs, const std::vector<int>& ys)
+        : columns(static_cast<int>(xs.size())), rows(static_cast<int>(ys.size())),
+          xIndex(pixels.width + 1, -1), yIndex(pixels.height + 1, -1),
+          entries(static_cast<size_t>(columns) * rows) {
+        for (int i = 0; i < columns; ++i) xIndex[xs[i]] = i;
+        for (int j = 0; j < rows; ++j) yIndex[ys[j]] = j;
+
+        // Sums of each grid cell, rows of cells in parallel
+        ThreadPool::shared().parallel_for(1, rows, std::max(1, row_grain(pixels.width) / 4), [&](int j0, int j1) {
+            for (int j = j0; j < j1; ++j) {
+                Sums* cells = &entries[static_cast<size_t>(j) * columns];
+                for (int y = ys[j - 1]; y < ys[j]; ++y) {
+                    const Pixel* row = pixels.row(y);
+                    for (int i = 1; i < columns; ++i) {
+                        for (int x = xs[i - 1]; x < xs[i]; ++x) cells[i].add(row[x]);
+                    }
+                }
+            }
+        });
+
+        // Then accumulate them along the rows and down the columns
+        for (int j = 1; j < rows; ++j) {
+            Sums* cells = &entries[static_cast<size_t>(j) * columns];
+            const Sums* above = cells - columns;
+            Sums running;
+            for (int i = 1; i < columns; ++i) {
+                running.add(cells[i]);
+                cells[i] = running;
+                cells[i].add(above[i]);
+            }
+        }
+    }
+
+    /**
+     * Sums over the w x h rectangle at (x0, y0). Returns false if its corners
+     * are not on the grid.
+     */
+    bool block(int x0, int y0, int w, int h, Sums& result) const {
+        int i0 = xIndex[x0], i1 = xIndex[x0 + w];
+        int j0 = yIndex[y0], j1 = yIndex[y0 + h];
+        if (i0 < 0 || i1 < 0 || j0 < 0 || j1 < 0) return false;
+
+        result = entry(i1, j1);
+        result.subtract(entry(i1, j0));
+        result.subtract(entry(i0, j1));
+        result.add(entry(i0, j0));
+        return true;
+    }
+
+private:
+    int columns;
+    int rows;
+    // Grid index of each pixel coordinate, or -1 if it is not on the grid
+    std::vector<int> xIndex;
+    std::vector<int> yIndex;
+    std::vector<Sums> entries;
+
+    const Sums& entry(int i, int j) const { return entries[static_cast<size_t>(j) * columns + i]; }
+};
+
+/**
+ * Quad tree
+ *
+ * The layer is split recursively into four rectangles (the right and bottom
+ * halves get the odd pixel) until a rectangle is uniform: every channel of
+ * every pixel is within `threshold` of the rectangle's average colour.
+ *
+ * Block sums come from a summed-area table, so averages cost O(1) per node.
+ * Block corners always fall on the coordinates produced by halving the image
+ * size, so the table is only sampled there, down to blocks LATTICE_MIN_SIZE
+ * pixels wide; smaller blocks are summed directly. The squared sums give the
+ * block's variance, which rules out most non-uniform blocks without looking at
+ * their pixels (a block whose pixels are all within `threshold` of the mean
+ * has a variance of at most threshold^2 per channel); only blocks that pass
+ * are checked pixel by pixel.
+ *
+ * The tree does not depend on any output size: `render` draws it at any
+ * resolution. It is kept in the derived-plane cache (plane_cache.h), so it is
+ * reused whenever the layer holds the same pixels again, e.g. to compress
+ * to another size after an undo. Detailed images can have nearly one leaf per
+ * pixel, so the nodes are only kept up to a budget; the construction can draw
+ * the leaves as it finds them, which works with or without the nodes.
+ */
+class QuadTree {
+public:
+    static constexpr int MAX_DEPTH = 100;
+    static constexpr int COLOR_THRESHOLD = 10;
+
+    // Blocks up to this size are not split further in the summed-area table's grid
+    static constexpr int LATTICE_MIN_SIZE = 8;
+
+    // Blocks of at most this many pixels are summed directly
+    static constexpr int SMALL_BLOCK = 64;
+
+    struct Node {
+        // Index of the first of four consecutive children, or -1 for a leaf.
+        // Children are in the order top-left, top-right, bottom-left, bottom-right.
+        int32_t firstChild;
+        // Average colour of the block
+        Pixel mean;
+    };
+
+    /**
+     * Build the tree of `pixels`, keeping at most `maxNodes` nodes (if it needs
+     * more, `complete()` is false and the tree cannot be rendered). If `output`
+     * is given, the tree is drawn into it as with `render`.
+     */
+    QuadTree(const PixelBuffer& pixels, size_t maxNodes, PixelBuffer* output = nullptr,
+             int threshold = COLOR_THRESHOLD, int maxDepth = MAX_DEPTH)
+        : width(pixels.width), height(pixels.height), threshold(threshold) {
+        SummedAreaTable sat(pixels, split_points(width), split_points(height));
+
+        Canvas canvas;
+        if (output && !output->empty()) canvas = Canvas(*output, width, height);
+
+        Builder builder{pixels, sat, output && !output->empty() ? &canvas : nullptr, maxNodes, maxDepth};
+        nodes.push_back({-1, Pixel()});
+        build(builder, 0, 0, 0, width, height, 0);
+        nodes.shrink_to_fit();
+    }
+
+    int source_width() const { return width; }
+    int source_height() const { return height; }
+
+    // False if the tree went over its node budget, and only drew its output
+    bool complete() const { return !nodes.empty(); }
+
+    size_t node_count() const { return nodes.size(); }
+    size_t size_bytes() const { return nodes.size() * sizeof(Node); }
+
+    /**
+     * Draw the leaves at dstW x dstH. Each output pixel takes the colour of the
+     * leaf under its nearest-neighbour source pixel (x * width / dstW,
+     * y * height / dstH).
+     */
+    PixelBuffer render(int dstW, int dstH) const {
+        PixelBuffer output(dstW, dstH);
+        if (output.empty() || !complete()) return output;
+
+        Canvas canvas(output, width, height);
+        draw(canvas, 0, 0, 0, width, height);
+        return output;
+    }
+
+private:
+    int width;
+    int height;
+    int threshold;
+    std::vector<Node> nodes;
+
+    // An output buffer, and the first output column (row) at or after each
+    // source column (row)
+    struct Canvas {
+        PixelBuffer* output = nullptr;
+        std::vector<int> xMap;
+        std::vector<int> yMap;
+
+        Canvas() {}
+
+        Canvas(PixelBuffer& output, int srcW, int srcH)
+            : output(&output), xMap(srcW + 1), yMap(srcH + 1) {
+            for (int x = 0; x <= srcW; ++x) xMap[x] = first_output(x, srcW, output.width);
+            for (int y = 0; y <= srcH; ++y) yMap[y] = first_output(y, srcH, output.height);
+        }
+
+        // True if no output pixel samples the block
+        bool misses(int x0, int y0, int w, int h) const {
+            return xMap[x0] >= xMap[x0 + w] || yMap[y0] >= yMap[y0 + h];
+        }
+
+        void fill(int x0, int y0, int w, int h, const Pixel& color) {
+            for (int y = yMap[y0]; y < yMap[y0 + h]; ++y) {
+                std::fill(output->row(y) + xMap[x0], output->row(y) + xMap[x0 + w], color);
+            }
+        }
+
+        // First output coordinate whose source coordinate (out * src / dst) is >= `source`
+        static int first_output(int64_t source, int src, int dst) {
+            return static_cast<int>((source * dst + src - 1) / src);
+        }
+    };
+
+    struct Builder {
+        const PixelBuffer& pixels;
+        const SummedAreaTable& sat;
+        Canvas* canvas;
+        size_t maxNodes;
+        int maxDepth;
+    };
+
+    // Nodes are only recorded until the budget is exceeded, which empties `nodes`
+    void build(Builder& b, int node, int x0, int y0, int w, int h, int depth) {
+        const int64_t count = static_cast<int64_t>(w) * h;
+        bool leaf = w <= 1 || h <= 1 || depth >= b.maxDepth;
+
+        SummedAreaTable::Sums sums;
+        Pixel mean;
+        if (count > SMALL_BLOCK && b.sat.block(x0, y0, w, h, sums)) {
+            mean = Pixel(sums.channel[0] / count, sums.channel[1] / count,
+                         sums.channel[2] / count, sums.channel[3] / count);
+            leaf = leaf || (low_variance(sums, count) && is_uniform(b.pixels, mean, x0, y0, w, h));
+        } else {
+            // Small blocks are cheaper to sum directly (and need not be on the grid)
+            uint32_t sum[4] = {0, 0, 0, 0};
+            for (int y = y0; y < y0 + h; ++y) {
+                const Pixel* row = b.pixels.row(y);
+                for (int x = x0; x < x0 + w; ++x) {
+                    sum[0] += row[x].r;
+                    sum[1] += row[x].g;
+                    sum[2] += row[x].b;
+                    sum[3] += row[x].a;
+                }
+            }
+            uint32_t n = static_cast<uint32_t>(count);
+            mean = Pixel(sum[0] / n, sum[1] / n, sum[2] / n, sum[3] / n);
+            leaf = leaf || is_uniform(b.pixels, mean, x0, y0, w, h);
+        }
+
+        const bool keep = !nodes.empty();
+        if (keep) nodes[node].mean = mean;
+        if (leaf) {
+            if (b.canvas) b.canvas->fill(x0, y0, w, h, mean);
+            return;
+        }
+
+        // The children are recursed into after all four are allocated, so they stay consecutive
+        int32_t first = -1;
+        if (keep && nodes.size() + 4 <= b.maxNodes) {
+            first = static_cast<int32_t>(nodes.size());
+            nodes[node].firstChild = first;
+            nodes.resize(nodes.size() + 4, {-1, Pixel()});
+        } else if (keep) {
+            // Over budget: drop the nodes, and only carry on drawing
+            nodes.clear();
+        }
+        if (nodes.empty() && !b.canvas) return;
+
+        auto child = [first](int i) { return first < 0 ? -1 : first + i; };
+        int hw = w / 2;
+        int hh = h / 2;
+        build(b, child(0), x0,      y0,      hw,     hh,     depth + 1); // top-left
+        build(b, child(1), x0 + hw, y0,      w - hw, hh,     depth + 1); // top-right
+        build(b, child(2), x0,      y0 + hh, hw,     h - hh, depth + 1); // bottom-left
+        build(b, child(3), x0 + hw, y0 + hh, w - hw, h - hh, depth + 1); // bottom-right
+    }
+
+    // Block edges along an axis of `length` pixels, down to LATTICE_MIN_SIZE
+    static std::vector<int> split_points(int length) {
+        std::vector<int> points = {0, length};
+        add_split_points(points, 0, length);
+        std::sort(points.begin(), points.end());
+        points.erase(std::unique(points.begin(), points.end()), points.end());
+        return points;
+    }
+
+    static void add_split_points(std::vector<int>& points, int start, int length) {
+        if (length <= LATTICE_MIN_SIZE) return;
+        int half = length / 2;
+        points.push_back(start + half);
+        add_split_points(points, start, half);
+        add_split_points(points, start + half, length - half);
+    }
+
+    /**
+     * False if the block's variance rules out it being uniform. The sum of
+     * squared deviations from the exact mean, over all channels, is at most
+     * the sum of squared deviations from the rounded mean, which is at most
+     * count * threshold^2 per channel if the block is uniform. The slack
+     * covers rounding in the double arithmetic.
+     */
+    bool low_variance(const SummedAreaTable::Sums& sums, int64_t count) const {
+        const double n = static_cast<double>(count);
+        double deviation = static_cast<double>(sums.squares);
+        for (int c = 0; c < 4; ++c) {
+            double sum = static_cast<double>(sums.channel[c]);
+            deviation -= sum * sum / n;
+        }
+        double limit = 4.0 * n * threshold * threshold;
+        return deviation <= limit + 1e-9 * static_cast<double>(sums.squares) + 1.0;
+    }
+
+    // Every channel of every pixel in the block is within `threshold` of `mean`
+    bool is_uniform(const PixelBuffer& pixels, const Pixel& mean, int x0, int y0, int w, int h) const {
+        for (int y = y0; y < y0 + h; ++y) {
+            const Pixel* row = pixels.row(y);
+            for (int x = x0; x < x0 + w; ++x) {
+                const Pixel& p = row[x];
+                int dr = std::abs(p.r - mean.r);
+                int dg = std::abs(p.g - mean.g);
+                int db = std::abs(p.b - mean.b);
+                int da = std::abs(p.a - mean.a);
+
+                if (dr > threshold || dg > threshold || db > threshold || da > threshold)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    void draw(Canvas& canvas, int node, int x0, int y0, int w, int h) const {
+        if (canvas.misses(x0, y0, w, h)) return;
+
+        const Node& n = nodes[node];
+        if (n.firstChild < 0) {
+            canvas.fill(x0, y0, w, h, n.mean);
+            return;
+        }
+
+        int hw = w / 2;
+        int hh = h / 2;
+        draw(canvas, n.firstChild,     x0,      y0,      hw,     hh);
+        draw(canvas, n.firstChild + 1, x0 + hw, y0,      w - hw, hh);
+        draw(canvas, n.firstChild + 2, x0,      y0 + hh, hw,     h - hh);
+        draw(canvas, n.firstChild + 3, x0 + hw, y0 + hh, w - hw, h - hh);
+    }
+};
+
+/**
+ * Quad tree image compression algorithm.
+ *
+ * Replaces the layer's pixels with its quad tree (see QuadTree) scaled to
+ * targetWidth x targetHeight, which must not be larger than the layer. The
+ * leaves are drawn at the layer's size and scaled down with the area filter
+ * (resample.h), so leaves smaller than an output pixel are averaged into it
+ * rather than point-sampled, and leaf edges are antialiased. The tree is
+ * reused if it is cached for the layer's pixels. Otherwise it is built and
+ * drawn in one go, and cached if its nodes take at most a quarter of the
+ * memory of the pixels.
+ *
+ * Returns the pixels that were replaced (empty if the layer was left as is),
+ * e.g. for the undo history.
+ */
+inline PixelBuffer quad_tree_compression(Layer& layer, int targetWidth, int targetHeight) {
+    if (layer.empty() || targetWidth <= 0 || targetHeight <= 0) return PixelBuffer();
+
+    // Check given height and width are strictly smaller than current height and width
+    if (targetWidth > layer.width() || targetHeight > layer.height()) return PixelBuffer();
+
+    PixelBuffer previous = std::move(layer.pixels);
+
+    PlaneCache& cache = PlaneCache::shared();
+    const std::shared_ptr<const QuadTree> cached = cache.find<QuadTree>(layer, PlaneKind::QuadTree);
+    PixelBuffer leaves;
+    if (cached && cached->source_width() == previous.width && cached->source_height() == previous.height) {
+        leaves = cached->render(previous.width, previous.height);
+    } else {
+        leaves = PixelBuffer(previous.width, previous.height);
+        size_t maxNodes = previous.size_bytes() / 4 / sizeof(QuadTree::Node);
+        auto tree = std::make_shared<const QuadTree>(previous, maxNodes, &leaves);
+        if (tree->complete()) cache.store(layer, PlaneKind::QuadTree, tree, tree->size_bytes());
+    }
+    layer.pixels = targetWidth == leaves.width && targetHeight == leaves.height
+                       ? std::move(leaves)
+                       : resample(leaves, targetWidth, targetHeight, ResampleFilter::Area);
+    layer.mark_all_dirty();
+    return previous;
+}
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "layer.h"
+#include "thread_pool.h"
+#include "engine_stats.h"
+#include "scratch_arena.h"
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Separable resampling
+ *
+ * Resizes an image up or down in two passes, rows then columns, each output
+ * pixel being a weighted sum of a run of input pixels. The weights only depend
+ * on the two sizes, so each pass computes them once per output column (row)
+ * into a table (ResampleWeights) instead of once per pixel.
+ *
+ *   Area      every output pixel is the average of the input area it covers.
+ *             Upscaling, pixels are only blended where an output pixel
+ *             straddles two input pixels. Fast and free of ringing: for
+ *             thumbnails and the quad tree (quad_tree.h).
+ *   Lanczos3  windowed sinc over 3 lobes, stretched by the scale factor when
+ *             downscaling. Sharper, with slight ringing at hard edges.
+ *
+ * Sums are in fixed point. Pixels are premultiplied by alpha into 16-bit
+ * values with RESAMPLE_VALUE_BITS fractional bits, so transparent pixels do
+ * not bleed their colour into their neighbours, and weights have
+ * RESAMPLE_WEIGHT_BITS and add up to exactly 1, so opaque stays opaque. Taps
+ * are taken in pairs, multiplied and added in one instruction (pmaddwd on
+ * SSE2, i32x4.dot_i16x8 on WASM). Between the passes values keep their sign
+ * and twice their range as headroom, so the negative lobes of Lanczos are
+ * only clamped at the end. The weights are computed without the C library,
+ * so every build resamples to the same pixels.
+ */
+
+// Filter codes; the values are part of the JS API
+enum class ResampleFilter : int {
+    Area = 0,
+    Lanczos3 = 1,
+};
+
+inline bool resample_filter_valid(int filter) {
+    return filter == static_cast<int>(ResampleFilter::Area) || filter == static_cast<int>(ResampleFilter::Lanczos3);
+}
+
+constexpr int RESAMPLE_WEIGHT_BITS = 14;
+constexpr int RESAMPLE_VALUE_BITS = 6;
+
+// Premultiplied value of a fully opaque channel
+constexpr int RESAMPLE_OPAQUE = 255 << RESAMPLE_VALUE_BITS;
+
+constexpr double RESAMPLE_PI = 3.14159265358979323846;
+
+/**
+ * sin(pi * x) from + * / only, like reproducible_exp (filters.h): std::sin
+ * differs between C libraries and between native and WASM builds, and the
+ * weights must not. x is reduced to [0, 1/2], where 12 terms of the Taylor
+ * series are within an ulp or two.
+ */
+inline double reproducible_sin_pi(double x) {
+    double sign = 1.0;
+    if (x < 0.0) {
+        x = -x;
+        sign = -1.0;
+    }
+    x -= 2.0 * std::floor(x / 2.0);
+    if (x >= 1.0) {
+        x -= 1.0;
+        sign = -sign;
+    }
+    if (x > 0.5) x = 1.0 - x;
+
+    const double y = RESAMPLE_PI * x;
+    const double y2 = y * y;
+    double term = y;
+    double sum = y;
+    for (int n = 1; n < 12; ++n) {
+        term = -term * y2 / ((2 * n) * (2 * n + 1));
+        sum = sum + term;
+    }
+    return sign * sum;
+}
+
+inline double lanczos3(double x) {
+    x = std::fabs(x);
+    if (x < 1e-9) return 1.0;
+    if (x >= 3.0) return 0.0;
+    return 3.0 * reproducible_sin_pi(x) * reproducible_sin_pi(x / 3.0) / (RESAMPLE_PI * RESAMPLE_PI * x * x);
+}
+
+/**
+ * Weights of one pass from `src` to `dst` samples. Output i is the sum over the
+ * taps k of weight k times input first[i] + k. Every output has the same
+ * number of taps, padded with zero weights, so inputs are read in pairs:
+ * pairs[i * pairCount + j] packs the weights of taps 2j and 2j + 1 as the low
+ * and high 16 bits. The tables, and the temporaries that build them, are in
+ * memory from `scratch`.
+ */
+struct ResampleWeights {
+    int taps = 0;
+    int pairCount = 0;
+    int* first;
+    int32_t* pairs = nullptr;
+
+    ResampleWeights(ScratchScope& scratch, int src, int dst, ResampleFilter filter)
+        : first(scratch.allocate<int>(dst)) {
+        const double scale = static_cast<double>(src) / dst;
+        const double stretch = std::max(1.0, scale);
+
+        // Inputs [left, right) each output reads
+        int* left = scratch.allocate<int>(dst);
+        int* right = scratch.allocate<int>(dst);
+        int reach = 0;
+        for (int i = 0; i < dst; ++i) {
+            if (filter == ResampleFilter::Area) {
+                left[i] = static_cast<int>(std::floor(i * scale));
+                right[i] = std::min(src, static_cast<int>(std::ceil((i + 1) * scale)));
+            } else {
+                const double center = (i + 0.5) * scale;
+                left[i] = std::max(0, static_cast<int>(std::floor(center - 3.0 * stretch)));
+                right[i] = std::min(src, static_cast<int>(std::ceil(center + 3.0 * stretch)));
+            }
+            reach = std::max(reach, right[i] - left[i]);
+        }
+
+        // Quantized weights of every output, `reach` apart, and how many each has
+        double* raw = scratch.allocate<double>(reach);
+        int32_t* quantized = scratch.allocate<int32_t>(static_cast<size_t>(dst) * reach);
+        int* counts = scratch.allocate<int>(dst);
+        for (int i = 0; i < dst; ++i) {
+            const int k0 = left[i], k1 = right[i];
+            if (filter == ResampleFilter::Area) {
+                const double begin = i * scale, end = (i + 1) * scale;
+                for (int k = k0; k < k1; ++k) raw[k - k0] = std::min<double>(end, k + 1) - std::max<double>(begin, k);
+            } else {
+                const double center = (i + 0.5) * scale;
+                for (int k = k0; k < k1; ++k) raw[k - k0] = lanczos3((k + 0.5 - center) / stretch);
+            }
+            int32_t* w = quantized + static_cast<size_t>(i) * reach;
+            quantize(raw, k1 - k0, w);
+
+            // Taps whose weight rounded to 0 are not read
+            int lead = 0, count = k1 - k0;
+            while (lead + 1 < count && w[lead] == 0) ++lead;
+            while (count > lead + 1 && w[count - 1] == 0) --count;
+            std::memmove(w, w + lead, (count - lead) * sizeof(int32_t));
+            counts[i] = count - lead;
+            left[i] += lead;
+            taps = std::max(taps, counts[i]);
+        }
+
+        // An even number of taps, unless that reads past the input
+        if (taps % 2 && taps < src) ++taps;
+        pairCount = (taps + 1) / 2;
+        pairs = scratch.allocate<int32_t>(static_cast<size_t>(dst) * pairCount);
+
+        int16_t* padded = scratch.allocate<int16_t>(2 * pairCount);
+        for (int i = 0; i < dst; ++i) {
+            first[i] = std::max(0, std::min(left[i], src - taps));
+            std::fill(padded, padded + 2 * pairCount, 0);
+            const int32_t* w = quantized + static_cast<size_t>(i) * reach;
+            for (int k = 0; k < counts[i]; ++k) padded[left[i] - first[i] + k] = static_cast<int16_t>(w[k]);
+            for (int j = 0; j < pairCount; ++j) {
+                pairs[static_cast<size_t>(i) * pairCount + j] =
+                    static_cast<int32_t>(static_cast<uint16_t>(padded[2 * j]) |
+                                         static_cast<uint32_t>(static_cast<uint16_t>(padded[2 * j + 1])) << 16);
+            }
+        }
+    }
+
+private:
+    // The `count` weights of `raw` normalized and rounded to
+    // RESAMPLE_WEIGHT_BITS into `weights`, the rounding error going to the
+    // largest so they add up to exactly 1
+    static void quantize(const double* raw, int count, int32_t* weights) {
+        double total = 0;
+        for (int k = 0; k < count; ++k) total += raw[k];
+
+        int32_t sum = 0;
+        int largest = 0;
+        for (int k = 0; k < count; ++k) {
+            weights[k] = static_cast<int32_t>(std::lround(raw[k] / total * (1 << RESAMPLE_WEIGHT_BITS)));
+            sum += weights[k];
+            if (std::abs(weights[k]) > std::abs(weights[largest])) largest = k;
+        }
+        weights[largest] += (1 << RESAMPLE_WEIGHT_BITS) - sum;
+    }
+};
+
+/**
+ * Weighted sum of premultiplied pixels (4 int16 channels), two taps at a time.
+ * `weights` packs the weights of p0 and p1 as in ResampleWeights::pairs. The
+ * SIMD versions do exactly the integer arithmetic of the scalar one.
+ */
+#if defined(__wasm_simd128__)
+
+struct ResampleSum {
+    v128_t sum = wasm_i32x4_splat(0);
+
+    void add(const int16_t* p0, const int16_t* p1, int32_t weights) {
+        v128_t interleaved = wasm_i16x8_shuffle(wasm_v128_load64_zero(p0), wasm_v128_load64_zero(p1),
+                                                0, 8, 1, 9, 2, 10, 3, 11);
+        sum = wasm_i32x4_add(sum, wasm_i32x4_dot_i16x8(interleaved, wasm_i32x4_splat(weights)));
+    }
+
+    // Rounded back to RESAMPLE_VALUE_BITS, saturated to int16
+    void store(int16_t* out) const {
+        v128_t v = wasm_i32x4_shr(wasm_i32x4_add(sum, wasm_i32x4_splat(1 << (RESAMPLE_WEIGHT_BITS - 1))),
+                                  RESAMPLE_WEIGHT_BITS);
+        wasm_v128_store64_lane(out, wasm_i16x8_narrow_i32x4(v, v), 0);
+    }
+};
+
+#elif defined(__SSE2__)
+
+struct ResampleSum {
+    __m128i sum = _mm_setzero_si128();
+
+    void add(const int16_t* p0, const int16_t* p1, int32_t weights) {
+        __m128i interleaved = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p0)),
+                                                 _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p1)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(interleaved, _mm_set1_epi32(weights)));
+    }
+
+    // Rounded back to RESAMPLE_VALUE_BITS, saturated to int16
+    void store(int16_t* out) const {
+        __m128i v = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1))),
+                                   RESAMPLE_WEIGHT_BITS);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packs_epi32(v, v));
+    }
+};
+
+#else
+
+struct ResampleSum {
+    int32_t sum[4] = {0, 0, 0, 0};
+
+    void add(const int16_t* p0, const int16_t* p1, int32_t weights) {
+        const int32_t w0 = static_cast<int16_t>(weights & 0xFFFF);
+        const int32_t w1 = static_cast<int16_t>(static_cast<uint32_t>(weights) >> 16);
+        for (int c = 0; c < 4; ++c) sum[c] += p0[c] * w0 + p1[c] * w1;
+    }
+
+    // Rounded back to RESAMPLE_VALUE_BITS, saturated to int16
+    void store(int16_t* out) const {
+        for (int c = 0; c < 4; ++c) {
+            const int32_t v = (sum[c] + (1 << (RESAMPLE_WEIGHT_BITS - 1))) >> RESAMPLE_WEIGHT_BITS;
+            out[c] = static_cast<int16_t>(std::min(32767, std::max(-32768, v)));
+        }
+    }
+};
+
+#endif
+
+/**
+ * Premultiply `width` pixels into 4 int16 values each: c * a / 255 with
+ * RESAMPLE_VALUE_BITS fractional bits, computed as (p + (p >> 8) + 2) >> 2
+ * with p = c * a, which only needs 16-bit lanes and is exact for opaque
+ * pixels. Four pixels at a time with SIMD.
+ */
+inline void resample_premultiply_row(const Pixel* in, int16_t* out, int width) {
+    int x = 0;
+#if defined(__wasm_simd128__)
+    const v128_t alphaLanes = wasm_i16x8_make(0, 0, 0, -1, 0, 0, 0, -1);
+    auto premultiply = [&](v128_t v) {
+        v128_t p = wasm_i16x8_mul(v, wasm_i16x8_shuffle(v, v, 3, 3, 3, 3, 7, 7, 7, 7));
+        p = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(p, wasm_u16x8_shr(p, 8)), wasm_i16x8_splat(2)), 2);
+        return wasm_v128_bitselect(wasm_i16x8_shl(v, RESAMPLE_VALUE_BITS), p, alphaLanes);
+    };
+    for (; x + 4 <= width; x += 4) {
+        const v128_t v = wasm_v128_load(in + x);
+        wasm_v128_store(out + 4 * x, premultiply(wasm_u16x8_extend_low_u8x16(v)));
+        wasm_v128_store(out + 4 * x + 8, premultiply(wasm_u16x8_extend_high_u8x16(v)));
+    }
+#elif defined(__SSE2__)
+    const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    auto premultiply = [&](__m128i v) {
+        __m128i p = _mm_mullo_epi16(v, _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xFF), 0xFF));
+        p = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(p, _mm_srli_epi16(p, 8)), _mm_set1_epi16(2)), 2);
+        return _mm_or_si128(_mm_andnot_si128(alphaLanes, p),
+                            _mm_and_si128(alphaLanes, _mm_slli_epi16(v, RESAMPLE_VALUE_BITS)));
+    };
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * x), premultiply(_mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * x + 8), premultiply(_mm_unpackhi_epi8(v, zero)));
+    }
+#endif
+    for (; x < width; ++x) {
+        const int a = in[x].a;
+        const int channels[3] = {in[x].r * a, in[x].g * a, in[x].b * a};
+        for (int c = 0; c < 3; ++c) out[4 * x + c] = static_cast<int16_t>((channels[c] + (channels[c] >> 8) + 2) >> 2);
+        out[4 * x + 3] = static_cast<int16_t>(a << RESAMPLE_VALUE_BITS);
+    }
+}
+
+// Back to straight alpha, clamping what the negative lobes over- or undershot
+inline Pixel resample_unpremultiply(const int16_t* v) {
+    const int alpha = std::min<int>(std::max<int>(v[3], 0), RESAMPLE_OPAQUE);
+    const int a = (alpha + (1 << (RESAMPLE_VALUE_BITS - 1))) >> RESAMPLE_VALUE_BITS;
+    if (a == 0) return Pixel(0, 0, 0, 0);
+
+    uint8_t c[3];
+    for (int i = 0; i < 3; ++i) {
+        const int value = std::min<int>(std::max<int>(v[i], 0), alpha);
+        c[i] = static_cast<uint8_t>(alpha == RESAMPLE_OPAQUE ? (value + (1 << (RESAMPLE_VALUE_BITS - 1))) >> RESAMPLE_VALUE_BITS
+                                                             : (value * 255 + alpha / 2) / alpha);
+    }
+    return Pixel(c[0], c[1], c[2], static_cast<uint8_t>(a));
+}
+
+/**
+ * One output row of the second pass: pixel x is the weighted sum of pixel x of
+ * the rows `inputs`, converted back to straight alpha. Two pixels at a time
+ * with SIMD, opaque ones without leaving the vector registers; the results
+ * are the same as the scalar version's.
+ */
+inline void resample_rows(const int16_t* const* inputs, const int32_t* pairs, int pairCount, int taps,
+                          Pixel* out, int width) {
+    int x = 0;
+#if defined(__wasm_simd128__)
+    const v128_t round = wasm_i32x4_splat(1 << (RESAMPLE_WEIGHT_BITS - 1));
+    for (; x + 2 <= width; x += 2) {
+        v128_t lo = wasm_i32x4_splat(0), hi = lo;
+        for (int j = 0; j < pairCount; ++j) {
+            const v128_t a = wasm_v128_load(inputs[2 * j] + 4 * x);
+            const v128_t b = 2 * j + 1 < taps ? wasm_v128_load(inputs[2 * j + 1] + 4 * x) : a;
+            const v128_t w = wasm_i32x4_splat(pairs[j]);
+            lo = wasm_i32x4_add(lo, wasm_i32x4_dot_i16x8(wasm_i16x8_shuffle(a, b, 0, 8, 1, 9, 2, 10, 3, 11), w));
+            hi = wasm_i32x4_add(hi, wasm_i32x4_dot_i16x8(wasm_i16x8_shuffle(a, b, 4, 12, 5, 13, 6, 14, 7, 15), w));
+        }
+        v128_t v = wasm_i16x8_narrow_i32x4(wasm_i32x4_shr(wasm_i32x4_add(lo, round), RESAMPLE_WEIGHT_BITS),
+                                           wasm_i32x4_shr(wasm_i32x4_add(hi, round), RESAMPLE_WEIGHT_BITS));
+        if (wasm_i16x8_extract_lane(v, 3) >= RESAMPLE_OPAQUE && wasm_i16x8_extract_lane(v, 7) >= RESAMPLE_OPAQUE) {
+            v = wasm_i16x8_min(wasm_i16x8_max(v, wasm_i16x8_splat(0)), wasm_i16x8_splat(RESAMPLE_OPAQUE));
+            v = wasm_u16x8_shr(wasm_i16x8_add(v, wasm_i16x8_splat(1 << (RESAMPLE_VALUE_BITS - 1))), RESAMPLE_VALUE_BITS);
+            wasm_v128_store64_lane(out + x, wasm_u8x16_narrow_i16x8(v, v), 0);
+        } else {
+            int16_t values[8];
+            wasm_v128_store(values, v);
+            out[x] = resample_unpremultiply(values);
+            out[x + 1] = resample_unpremultiply(values + 4);
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i round = _mm_set1_epi32(1 << (RESAMPLE_WEIGHT_BITS - 1));
+    const __m128i opaque = _mm_set1_epi16(RESAMPLE_OPAQUE);
+    for (; x + 2 <= width; x += 2) {
+        __m128i lo = _mm_setzero_si128(), hi = lo;
+        for (int j = 0; j < pairCount; ++j) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[2 * j] + 4 * x));
+            const __m128i b = 2 * j + 1 < taps ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(inputs[2 * j + 1] + 4 * x))
+                                               : a;
+            const __m128i w = _mm_set1_epi32(pairs[j]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), RESAMPLE_WEIGHT_BITS),
+                                    _mm_srai_epi32(_mm_add_epi32(hi, round), RESAMPLE_WEIGHT_BITS));
+        // Both alpha lanes (3 and 7) at least opaque
+        if ((_mm_movemask_epi8(_mm_cmplt_epi16(v, opaque)) & 0xC0C0) == 0) {
+            v = _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), opaque);
+            v = _mm_srli_epi16(_mm_add_epi16(v, _mm_set1_epi16(1 << (RESAMPLE_VALUE_BITS - 1))), RESAMPLE_VALUE_BITS);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(v, v));
+        } else {
+            alignas(16) int16_t values[8];
+            _mm_store_si128(reinterpret_cast<__m128i*>(values), v);
+            out[x] = resample_unpremultiply(values);
+            out[x + 1] = resample_unpremultiply(values + 4);
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        ResampleSum sum;
+        for (int j = 0; j < pairCount; ++j) {
+            const int16_t* p0 = inputs[2 * j] + 4 * static_cast<size_t>(x);
+            sum.add(p0, 2 * j + 1 < taps ? inputs[2 * j + 1] + 4 * static_cast<size_t>(x) : p0, pairs[j]);
+        }
+        int16_t values[4];
+        sum.store(values);
+        out[x] = resample_unpremultiply(values);
+    }
+}
+
+// Weighted sums of runs of consecutive pixels of `in`, one per output pixel
+inline void resample_row(const int16_t* in, int16_t* out, const ResampleWeights& weights, int count) {
+    const bool odd = weights.taps % 2 != 0;
+    for (int x = 0; x < count; ++x) {
+        const int16_t* taps = in + 4 * static_cast<size_t>(weights.first[x]);
+        const int32_t* pairs = weights.pairs + static_cast<size_t>(x) * weights.pairCount;
+        ResampleSum sum;
+        int j = 0;
+        for (; j < weights.taps / 2; ++j) sum.add(taps + 8 * j, taps + 8 * j + 4, pairs[j]);
+        if (odd) sum.add(taps + 8 * j, taps + 8 * j, pairs[j]);
+        sum.store(out + 4 * static_cast<size_t>(x));
+    }
+}
+
+/**
+ * `src` resized to dstW x dstH with `filter`. Empty if either size is not
+ * positive or the output cannot be allocated.
+ */
+inline PixelBuffer resample(const PixelBuffer& src, int dstW, int dstH, ResampleFilter filter) {
+    PixelBuffer out(dstW, dstH);
+    if (src.empty() || out.empty()) return out;
+
+    if (dstW == src.width && dstH == src.height) {
+        for (int y = 0; y < dstH; ++y) {
+            std::memcpy(static_cast<void*>(out.row(y)), src.row(y), static_cast<size_t>(dstW) * sizeof(Pixel));
+        }
+        return out;
+    }
+
+    ScratchScope scratch;
+    const ResampleWeights columns(scratch, src.width, dstW, filter);
+    const ResampleWeights rows(scratch, src.height, dstH, filter);
+
+    // Only the input rows some output row reads go through the first pass
+    const int rowBegin = rows.first[0];
+    const int rowEnd = rows.first[dstH - 1] + rows.taps;
+    const size_t tempStride = static_cast<size_t>(dstW) * 4;
+    const size_t tempSize = tempStride * (rowEnd - rowBegin);
+    int16_t* const temp = scratch.allocate<int16_t>(tempSize);
+
+    ThreadPool& pool = ThreadPool::shared();
+
+    // === HORIZONTAL PASS ===
+    {
+        ENGINE_STAT(stat, "resample.horizontal");
+        stat.add(static_cast<uint64_t>(dstW) * (rowEnd - rowBegin), tempSize * sizeof(int16_t));
+        pool.parallel_for(rowBegin, rowEnd, row_grain(src.width), [&](int y0, int y1) {
+            ScratchScope bandScratch;
+            int16_t* premultiplied = bandScratch.allocate<int16_t>(static_cast<size_t>(src.width) * 4);
+            for (int y = y0; y < y1; ++y) {
+                resample_premultiply_row(src.row(y), premultiplied, src.width);
+                resample_row(premultiplied, temp + (y - rowBegin) * tempStride, columns, dstW);
+            }
+        });
+    }
+
+    // === VERTICAL PASS ===
+    ENGINE_STAT(stat, "resample.vertical");
+    stat.add(static_cast<uint64_t>(dstW) * dstH, out.size_bytes());
+    pool.parallel_for(0, dstH, row_grain(dstW * rows.taps), [&](int y0, int y1) {
+        ScratchScope bandScratch;
+        const int16_t** inputs = bandScratch.allocate<const int16_t*>(rows.taps);
+        for (int y = y0; y < y1; ++y) {
+            for (int k = 0; k < rows.taps; ++k) inputs[k] = temp + (rows.first[y] + k - rowBegin) * tempStride;
+            resample_rows(inputs, rows.pairs + static_cast<size_t>(y) * rows.pairCount, rows.pairCount,
+                          rows.taps, out.row(y), dstW);
+        }
+    });
+
+    return out;
+}
+
+/**
+ * Resize `layer` to width x height with `filter`. Returns the pixels that were
+ * replaced (empty if the layer was left as is), e.g. for the undo history.
+ */
+inline PixelBuffer resample_layer(Layer& layer, int width, int height, ResampleFilter filter) {
+    if (layer.empty() || (width == layer.width() && height == layer.height())) return PixelBuffer();
+
+    PixelBuffer resized = resample(layer.pixels, width, height, filter);
+    if (resized.empty()) return PixelBuffer();
+
+    PixelBuffer previous = std::move(layer.pixels);
+    layer.pixels = std::move(resized);
+    layer.mark_all_dirty();
+    return previous;
+}
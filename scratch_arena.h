@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+#include "engine_stats.h"
+
+/**
+ * Scratch arenas
+ *
+ * Temporaries that only live for part of an operation (the intermediate image
+ * of a blur, the halo rows and row windows of each band) come from a bump
+ * allocator per thread instead of the heap. A ScratchScope marks the thread's
+ * arena when it opens and gives back everything allocated since when it
+ * closes, so scopes nest and an allocation is a pointer bump.
+ *
+ * An arena grows by whole blocks when a scope needs more than it has. Once
+ * the outermost scope closes, the blocks are merged into one as large as the
+ * most the arena held at once (its high-water mark), so an operation that ran
+ * before runs again without touching the heap. Arenas keep up to the scratch
+ * budget each (set_budget); one that needed more frees its blocks instead,
+ * as a call allocating its own temporaries would. An arena is only ever
+ * changed by its own thread, so a lower budget trims the calling thread's
+ * arena at once and every other one when its thread next closes a scope.
+ *
+ * Memory from a scope may be handed to other threads, e.g. to the bands of a
+ * parallel_for, as long as the scope outlives them. Memory is uninitialized,
+ * and only for trivially destructible types.
+ */
+class ScratchArena {
+public:
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t MIN_BLOCK_BYTES = size_t(64) << 10;
+    static constexpr size_t DEFAULT_BUDGET_BYTES = size_t(128) << 20;
+
+    struct Stats {
+        size_t arenas = 0;
+        size_t reserved = 0;     // bytes in blocks, over all arenas
+        size_t highWater = 0;    // largest high-water mark of an arena
+        size_t budget = 0;
+        uint64_t blocks = 0;     // blocks allocated from the heap so far
+    };
+
+    // The calling thread's arena
+    static ScratchArena& local() {
+        thread_local ScratchArena arena;
+        return arena;
+    }
+
+    ScratchArena() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.arenas.push_back(this);
+    }
+
+    ~ScratchArena() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.arenas.erase(std::find(r.arenas.begin(), r.arenas.end(), this));
+        r.reserved -= reserved;
+    }
+
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    // `bytes` of uninitialized memory, ALIGNMENT aligned, until the innermost open scope closes
+    void* allocate(size_t bytes) {
+        bytes = (std::max<size_t>(bytes, 1) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (blocks.empty() || offset + bytes > blocks[current].size) next_block(bytes);
+
+        void* memory = blocks[current].data + offset;
+        offset += bytes;
+        peak = std::max(peak, base + offset);
+        return memory;
+    }
+
+    // Keep at most `bytes` in each arena between operations
+    static void set_budget(size_t bytes) {
+        registry().budget = bytes;
+        ScratchArena& arena = local();
+        if (arena.depth == 0 && arena.reserved > bytes) {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            arena.release(r);
+        }
+    }
+
+    static Stats stats() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        Stats s;
+        s.arenas = r.arenas.size();
+        s.reserved = r.reserved;
+        s.budget = r.budget;
+        s.blocks = r.blocks;
+        for (const ScratchArena* arena : r.arenas) s.highWater = std::max(s.highWater, arena->highWater.load());
+        return s;
+    }
+
+private:
+    friend class ScratchScope;
+
+    struct Block {
+        std::unique_ptr<uint8_t[]> memory;
+        uint8_t* data;
+        size_t size;
+    };
+
+    // Every arena, for stats and budget changes
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ScratchArena*> arenas;
+        size_t reserved = 0;
+        std::atomic<size_t> budget{DEFAULT_BUDGET_BYTES};    // read without the lock
+        uint64_t blocks = 0;
+    };
+
+    // Never destroyed: pool threads may exit, and drop their arenas, after static destructors ran
+    static Registry& registry() {
+        static Registry* r = new Registry();
+        return *r;
+    }
+
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    std::vector<Block> blocks;
+    size_t current = 0;    // block allocations come from
+    size_t offset = 0;     // bytes used in it
+    size_t base = 0;       // bytes in the blocks before it
+    size_t reserved = 0;
+    size_t peak = 0;                      // most bytes in use since the outermost scope opened
+    std::atomic<size_t> highWater{0};     // largest peak so far, read by stats()
+    int depth = 0;
+
+    Mark open() {
+        ++depth;
+        return {current, offset};
+    }
+
+    void close(const Mark& mark) {
+        current = mark.block;
+        offset = mark.offset;
+        base = 0;
+        for (size_t i = 0; i < current; ++i) base += blocks[i].size;
+        if (--depth > 0) return;
+        if (blocks.size() > 1 || reserved > registry().budget) settle();
+        if (peak > highWater.load(std::memory_order_relaxed)) highWater.store(peak, std::memory_order_relaxed);
+        peak = 0;
+    }
+
+    // Move on to a block after the current one with room for `bytes`
+    void next_block(size_t bytes) {
+        if (!blocks.empty()) {
+            if (current + 1 < blocks.size() && blocks[current + 1].size >= bytes) {
+                base += blocks[current].size;
+                ++current;
+                offset = 0;
+                return;
+            }
+            base += blocks[current].size;
+            ++current;
+        }
+
+        // Blocks past the current one are unused; replace them with one large enough
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        while (blocks.size() > current) drop_last(r);
+        add_block(r, std::max({bytes, MIN_BLOCK_BYTES, reserved}));
+        offset = 0;
+    }
+
+    // After the outermost scope: one block of the high-water size, or none over the budget
+    void settle() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        const size_t size = peak;
+        release(r);
+        if (size <= r.budget) add_block(r, size);
+    }
+
+    void release(Registry& r) {
+        while (!blocks.empty()) drop_last(r);
+        current = offset = base = 0;
+    }
+
+    void add_block(Registry& r, size_t size) {
+        ENGINE_STAT(stat, "scratch.grow");
+        stat.add(0, size);
+        Block block;
+        block.memory.reset(new uint8_t[size + ALIGNMENT]);
+        const uintptr_t address = reinterpret_cast<uintptr_t>(block.memory.get());
+        block.data = block.memory.get() + ((ALIGNMENT - address % ALIGNMENT) % ALIGNMENT);
+        block.size = size;
+        blocks.push_back(std::move(block));
+        reserved += size;
+        r.reserved += size;
+        ++r.blocks;
+    }
+
+    void drop_last(Registry& r) {
+        reserved -= blocks.back().size;
+        r.reserved -= blocks.back().size;
+        blocks.pop_back();
+    }
+};
+
+/**
+ * Allocations from the calling thread's arena that last until the scope
+ * closes.
+ */
+class ScratchScope {
+public:
+    ScratchScope() : arena(ScratchArena::local()), mark(arena.open()) {}
+    ~ScratchScope() { arena.close(mark); }
+
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+    // `count` uninitialized values
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "scratch memory is never destroyed");
+        static_assert(alignof(T) <= ScratchArena::ALIGNMENT, "scratch memory is ALIGNMENT aligned");
+        return static_cast<T*>(arena.allocate(count * sizeof(T)));
+    }
+
+private:
+    ScratchArena& arena;
+    ScratchArena::Mark mark;
+};
+
+/**
+ * A stack in memory from `scratch`, for temporaries whose size is not known
+ * up front. When full it moves to a block twice as large, leaving the old one
+ * to the scope, so it takes at most twice its largest size. It must only grow
+ * while no scope opened after `scratch` is open.
+ */
+template <typename T>
+class ScratchStack {
+public:
+    explicit ScratchStack(ScratchScope& scratch, size_t capacity = 64)
+        : scratch(scratch), values(scratch.allocate<T>(capacity)), capacity(capacity) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    const T* begin() const { return values; }
+    const T* end() const { return values + count; }
+
+    void push(const T& value) {
+        if (count == capacity) {
+            T* larger = scratch.allocate<T>(capacity * 2);
+            std::memcpy(static_cast<void*>(larger), values, count * sizeof(T));
+            values = larger;
+            capacity *= 2;
+        }
+        values[count++] = value;
+    }
+
+    T pop() { return values[--count]; }
+
+private:
+    ScratchScope& scratch;
+    T* values;
+    size_t capacity;
+    size_t count = 0;
+};
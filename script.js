@@ -26,6 +26,9 @@ let processedImageData = null;
 // Flag to indicate if the image and WASM buffers are ready for operations
 let isImageReady = false;
 
+// Set while the canvas shows a scaled-up preview instead of the merged image
+let isPreviewShown = false;
+
 // PeerJS setup
 let peer;
 let connections = []; // To store multiple connections
@@ -50,6 +53,10 @@ const REQUEST_TIMEOUT_MS = 100000;
 let processImageFile;
 let handleReceivedImage;
 let applyOperationLocally;
+let flushRemoteOperations;
+
+// Operations received from peers, waiting to run as one batch
+let remoteOperations = [];
 
 /**
  * Function to handle peer disconnection and cleanup.
@@ -461,19 +468,89 @@ Module().then((mod) => {
   wasmModule = mod;
 
   /**
-   * Time the duration in milliseconds taken by an operation.
+   * Whether the loaded build exports a C++ function. image_processor.js and
+   * image_processor.wasm are only as new as the last `make wasm`, so functions
+   * added to the engine since are checked for before they are called, and the
+   * older calls are used without them.
+   */
+  function hasExport(name) {
+    return typeof wasmModule["_" + name] === "function";
+  }
+
+  /**
+   * Disable the buttons of an operation that the loaded build does not export.
+   */
+  function requireExport(name, ...buttonIds) {
+    if (hasExport(name)) return;
+    for (const id of buttonIds) {
+      const button = document.getElementById(id);
+      button.disabled = true;
+      button.title = `Needs a WASM build with ${name} (make wasm)`;
+    }
+  }
+
+  /**
+   * Engine statistics (see get_engine_stats) of every probe that ran since the
+   * last reset_engine_stats, as { name, calls, ms, longestMs, pixels, bytes }.
+   */
+  function readEngineStats() {
+    if (!hasExport("get_engine_stats")) return [];
+    const fields = 5;
+    const count = wasmModule.ccall("get_engine_stats", "number", ["number", "number"], [0, 0]);
+    if (count === 0) return [];
+
+    const statsPtr = wasmModule._malloc(count * fields * 8);
+    wasmModule.ccall("get_engine_stats", "number", ["number", "number"], [statsPtr, count * fields]);
+    const values = new Float64Array(wasmModule.HEAPF64.buffer, statsPtr, count * fields).slice();
+    wasmModule._free(statsPtr);
+
+    const stats = [];
+    for (let i = 0; i < count; i++) {
+      const [calls, ms, longestMs, pixels, bytes] = values.subarray(i * fields, (i + 1) * fields);
+      if (calls === 0) continue;
+      const name = wasmModule.ccall("get_engine_stat_name", "string", ["number"], [i]);
+      stats.push({ name, calls, ms, longestMs, pixels, bytes });
+    }
+    return stats;
+  }
+
+  /**
+   * Time an operation, split into the engine's kernels, its compositing and
+   * the rest (JS, heap copies, drawing). Operations are the probes without a
+   * dot in their name; phases (e.g. "gaussian.horizontal") are logged too.
+   * Builds without the statistics only show the total.
    */
   function timeOperation(operationName, callback) {
+    if (hasExport("reset_engine_stats")) wasmModule.ccall("reset_engine_stats", null, [], []);
     const start = performance.now();
     callback();
     const end = performance.now();
     const duration = Math.round(end - start);
-    document.getElementById("timing-display").textContent = `${operationName}: ${duration} ms`;
+
+    const stats = readEngineStats();
+    let breakdown = "";
+    if (stats.length > 0) {
+      const engineMs = stats.filter(s => !s.name.includes(".")).reduce((sum, s) => sum + s.ms, 0);
+      const compositeMs = stats.filter(s => s.name === "compositor.composite").reduce((sum, s) => sum + s.ms, 0);
+      breakdown = ` (kernels ${Math.round(engineMs - compositeMs)} ms, composite ${Math.round(compositeMs)} ms, ` +
+                  `other ${Math.max(0, Math.round(end - start - engineMs))} ms)`;
+      console.table(stats);
+    }
+    document.getElementById("timing-display").textContent = `${operationName}: ${duration} ms${breakdown}`;
   }
 
   console.log("WASM loaded:", Object.keys(wasmModule));
   console.log("HEAPU8?", wasmModule.HEAPU8);
 
+  // Functions the page falls back without. A build missing any of them predates
+  // the engine sources and runs the old kernels, so say so once, loudly.
+  const newerExports = ["adjust_colors", "adopt_layer", "alloc_layer_buffer", "emboss", "get_dirty_rect",
+    "get_engine_stats", "preview_pipeline", "reset_engine_stats", "resize_layer", "run_commands", "sharpen", "undo"];
+  const missingExports = newerExports.filter((name) => !hasExport(name));
+  if (missingExports.length > 0) {
+    console.warn(`Stale WASM build (missing ${missingExports.join(", ")}): run make wasm and reload`);
+  }
+
   /**
    * Takes raw image data (either from local file upload or from peer) and
    * prepares it for processing by WASM module. Handles P2P sharing of raw image
@@ -484,6 +561,9 @@ Module().then((mod) => {
    * @param {number} [predefinedImageId] - Optional image ID to use for the new layer, useful for syncing follower images.
    */
   processImageFile = (sourceData, isLeaderProcessingFollowerRequest = false, predefinedImageId = null) => {
+    // Operations received before this image must run first
+    flushRemoteOperations();
+
     let originalWidth, originalHeight, pixelData;
 
     // When image is uploaded locally via the "ADD IMAGE" button
@@ -546,21 +626,30 @@ Module().then((mod) => {
 
     /**
      * Copy raw pixel data for current image (which will become a new layer) into
-     * a temporary WASM memory location. Purpose: call the C++ function to cache
-     * the pixel data information.
+     * a WASM buffer allocated by C++. The layer then adopts that buffer as its
+     * pixel storage, so the data is copied exactly once (JS -> WASM heap).
+     * Builds without adopt_layer copy it from a temporary buffer instead.
      */
 
     // Copy pixel data to WASM heap (for the layer)
     const len = pixelData.length;
-    const dataPtr = wasmModule._malloc(len);
+    const canAdopt = hasExport("alloc_layer_buffer") && hasExport("adopt_layer");
+    const dataPtr = canAdopt
+      ? wasmModule.ccall("alloc_layer_buffer", "number", ["number", "number"], [originalWidth, originalHeight])
+      : wasmModule._malloc(len);
     const heap = new Uint8Array(wasmModule.HEAPU8.buffer, dataPtr, len);
     heap.set(pixelData);
 
-    // Call WASM to store the layer
-    wasmModule.ccall("data_to_layer", null, ["number", "number", "number", "number"],
-      [dataPtr, originalWidth, originalHeight, currentImageId]);
-    // Cleanup after data has been copied and cached in C++
-    wasmModule._free(dataPtr);
+    if (canAdopt) {
+      // Call WASM to store the layer. The layer takes ownership of dataPtr, so
+      // it must NOT be freed here.
+      wasmModule.ccall("adopt_layer", null, ["number", "number", "number", "number"],
+        [dataPtr, originalWidth, originalHeight, currentImageId]);
+    } else {
+      wasmModule.ccall("data_to_layer", null, ["number", "number", "number", "number"],
+        [dataPtr, originalWidth, originalHeight, currentImageId]);
+      wasmModule._free(dataPtr);
+    }
 
     // Add layer to UI
     // Create thumbnail for loaded image
@@ -676,6 +765,7 @@ Module().then((mod) => {
       [wasmOutputPtr, canvas.width, canvas.height, orderPtr, layerOrder.length]);
 
     ctx.putImageData(processedImageData, 0, 0);
+    isPreviewShown = false;
 
     wasmModule._free(orderPtr);
   }
@@ -711,31 +801,129 @@ Module().then((mod) => {
   }
 
   /**
-   * Executes image manipulation operations on current canvas and synchronize
-   * these operations across all connected peers.
-   *
-   * operationType is a string that identifies tha name of the operation to perform
-   * payload is an object containing any parameters required for the specific operationType
-   * isRemote = false is a flag that indicates if the operation was initiated by the local user
-   *
-   * If isRemote = false (the default), then the operation was initiated by the local user,
-   * and the operation needs to be sent to other connected peers.
-   * If isRemote = true, then the operation was received from another peer. In this case,
-   * the operation is executed locally but NOT re-sent back to the network, preventing infinite loops.
+   * Redraw the region of the canvas recomposited by the last WASM operation
+   * (the whole canvas if a preview was shown, or the build has no
+   * get_dirty_rect).
    */
-  applyOperationLocally = (operationType, payload, isRemote = false) => {
-    // If the image processing isn't ready yet, defer the operation.
+  function renderDirtyRect() {
+    if (isPreviewShown || !hasExport("get_dirty_rect")) {
+      ctx.putImageData(processedImageData, 0, 0);
+      isPreviewShown = false;
+      return;
+    }
+
+    const rectPtr = wasmModule._malloc(4 * 4);
+    wasmModule.ccall("get_dirty_rect", null, ["number"], [rectPtr]);
+    const [dirtyX, dirtyY, dirtyWidth, dirtyHeight] = new Int32Array(wasmModule.HEAPU8.buffer, rectPtr, 4);
+    wasmModule._free(rectPtr);
+
+    if (dirtyWidth > 0 && dirtyHeight > 0) {
+      ctx.putImageData(processedImageData, 0, 0, dirtyX, dirtyY, dirtyWidth, dirtyHeight);
+    }
+  }
+
+  /**
+   * Operation codes and parameters of run_commands (see command_buffer.h).
+   * Each command is COMMAND_SIZE doubles: [op, layer id, params...].
+   */
+  const COMMAND_SIZE = 9;
+  const commandCodes = {
+    monochrome_average: 0,
+    monochrome_luminosity: 1,
+    monochrome_lightness: 2,
+    monochrome_itu: 3,
+    gaussian_blur: 4,
+    edge_sobel: 5,
+    edge_laplacian_of_gaussian: 7,
+    bucket_fill: 8,
+    quad_compression: 9,
+    undo: 10,
+    redo: 11,
+    resize_layer: 12,
+    sharpen: 13,
+    emboss: 14,
+    adjust_colors: 15,
+  };
+  const commandParams = {
+    gaussian_blur: (p) => [p.sigma, p.kernelSize],
+    edge_laplacian_of_gaussian: (p) => [p.sigma, p.kernelSize],
+    bucket_fill: (p) => [p.x, p.y, p.r, p.g, p.b, p.a, p.threshold],
+    quad_compression: (p) => [p.newWidth, p.newHeight],
+    resize_layer: (p) => [p.newWidth, p.newHeight, p.filter],
+    sharpen: (p) => [p.amount],
+    adjust_colors: (p) => [p.kind, ...p.params],
+  };
+
+  /**
+   * Run every queued peer operation with a single run_commands call, so a
+   * burst of them (e.g. a new peer catching up on the operation log) costs
+   * one WASM call, one composite and one redraw. No flags are passed, so each
+   * operation stays its own undo step, as it is on every other peer.
+   */
+  flushRemoteOperations = () => {
+    if (remoteOperations.length === 0) return;
     if (!isImageReady || !wasmOutputPtr) {
-        console.warn("Image not ready, deferring operation:", operationType);
-        // Retry after a short delay. For production, consider a more robust queuing mechanism.
-        setTimeout(() => applyOperationLocally(operationType, payload, isRemote), 100);
-        return;
+      console.warn("Image not ready, deferring operations:", remoteOperations.length);
+      setTimeout(flushRemoteOperations, 100);
+      return;
+    }
+
+    const operations = remoteOperations;
+    remoteOperations = [];
+
+    // Builds without run_commands run the operations one by one
+    if (!hasExport("run_commands")) {
+      for (const { operationType, payload } of operations) runOperation(operationType, payload);
+      return;
+    }
+
+    const commands = [];
+    for (const { operationType, payload } of operations) {
+      if (!(operationType in commandCodes)) {
+        console.warn(`Unknown operation type received: ${operationType}`);
+        continue;
+      }
+      const layerId = payload.layerId !== undefined ? payload.layerId : selectedLayerId;
+      const params = commandParams[operationType] ? commandParams[operationType](payload) : [];
+      const command = new Array(COMMAND_SIZE).fill(0);
+      command[0] = commandCodes[operationType];
+      command[1] = layerId;
+      params.forEach((value, i) => { command[2 + i] = Number(value); });
+      commands.push(...command);
     }
+    if (commands.length === 0) return;
+
+    const commandsPtr = wasmModule._malloc(commands.length * 8);
+    wasmModule.HEAPF64.set(commands, commandsPtr / 8);
+    const orderPtr = wasmModule._malloc(uploadedLayerOrder.length * 4);
+    new Int32Array(wasmModule.HEAPU8.buffer, orderPtr, uploadedLayerOrder.length).set(uploadedLayerOrder);
+
+    wasmModule.ccall("run_commands", "number",
+      ["number", "number", "number", "number", "number", "number", "number", "number"],
+      [wasmOutputPtr, canvas.width, canvas.height, orderPtr, uploadedLayerOrder.length,
+       commandsPtr, commands.length / COMMAND_SIZE, 0]);
+    renderDirtyRect();
 
+    wasmModule._free(commandsPtr);
+    wasmModule._free(orderPtr);
+  };
+
+  /**
+   * Run one operation on the layers and redraw what it changed. Nothing is
+   * sent to peers; see applyOperationLocally.
+   */
+  const runOperation = (operationType, payload) => {
     // Get selected layer for operation (either current local layer, or remotely defined layer)
     const targetLayerId = payload.layerId !== undefined ? payload.layerId : selectedLayerId;
 
     const executeAndRender = (cppFunctionName, ...args) => {
+      // Operations added since the WASM build was made (e.g. undo from a peer
+      // with a newer build) are skipped rather than thrown on
+      if (!hasExport(cppFunctionName)) {
+        console.warn(`${cppFunctionName} is not in this WASM build (run make wasm)`);
+        return;
+      }
+
       // Prepare layer order for WASM
       const orderPtr = wasmModule._malloc(uploadedLayerOrder.length * 4);
       const orderHeap = new Int32Array(wasmModule.HEAPU8.buffer, orderPtr, uploadedLayerOrder.length);
@@ -743,15 +931,18 @@ Module().then((mod) => {
         orderHeap[i] = uploadedLayerOrder[i];
       }
 
-      // Construct arguments for WASM call
-      const allArgs = [wasmOutputPtr, canvas.width, canvas.height, orderPtr, uploadedLayerOrder.length, targetLayerId, ...args];
-      const argTypes = ["number", "number", "number", "number", "number", "number", ...args.map(arg => typeof arg === 'number' ? 'number' : 'float')];
+      // Construct arguments for WASM call. Undo and redo apply to the whole
+      // document rather than one layer.
+      const layerArgs = (cppFunctionName === 'undo' || cppFunctionName === 'redo') ? [] : [targetLayerId];
+      const allArgs = [wasmOutputPtr, canvas.width, canvas.height, orderPtr, uploadedLayerOrder.length, ...layerArgs, ...args];
+      const argTypes = ["number", "number", "number", "number", "number", ...layerArgs.map(() => "number"), ...args.map(arg => typeof arg === 'number' ? 'number' : 'float')];
 
       // Call WASM function
       wasmModule.ccall(cppFunctionName, null, argTypes, allArgs);
 
-      // Update canvas with processed image
-      ctx.putImageData(processedImageData, 0, 0);
+      // Only the tiles dirtied by the operation were recomposited, so only
+      // redraw that region of the canvas
+      renderDirtyRect();
 
       // Free temporary WASM memory
       wasmModule._free(orderPtr);
@@ -774,15 +965,75 @@ Module().then((mod) => {
       case 'edge_laplacian_of_gaussian':
         executeAndRender('edge_laplacian_of_gaussian', payload.sigma, payload.kernelSize);
         break;
+      case 'sharpen':
+        executeAndRender('sharpen', payload.amount);
+        break;
+      case 'emboss':
+        executeAndRender('emboss');
+        break;
+      case 'adjust_colors': {
+        // One PointOpKind operation (point_ops.h); params it does not give
+        // are -1, as in command op 15
+        const op = new Float64Array(13).fill(-1);
+        op[0] = payload.kind;
+        payload.params.forEach((value, i) => { op[1 + i] = Number(value); });
+        const opsPtr = wasmModule._malloc(op.byteLength);
+        wasmModule.HEAPF64.set(op, opsPtr / 8);
+        executeAndRender('adjust_colors', opsPtr, 1);
+        wasmModule._free(opsPtr);
+        break;
+      }
       case 'bucket_fill':
         executeAndRender('bucket_fill', payload.x, payload.y, payload.r, payload.g, payload.b, payload.a, payload.threshold);
         break;
       case 'quad_compression':
         executeAndRender('quad_compression', payload.newWidth, payload.newHeight);
         break;
+      case 'resize_layer':
+        executeAndRender('resize_layer', payload.newWidth, payload.newHeight, payload.filter);
+        break;
+      case 'undo':
+      case 'redo':
+        executeAndRender(operationType);
+        break;
       default:
         console.warn(`Unknown operation type received: ${operationType}`);
     }
+  };
+
+  /**
+   * Executes image manipulation operations on current canvas and synchronize
+   * these operations across all connected peers.
+   *
+   * operationType is a string that identifies tha name of the operation to perform
+   * payload is an object containing any parameters required for the specific operationType
+   * isRemote = false is a flag that indicates if the operation was initiated by the local user
+   *
+   * If isRemote = false (the default), then the operation was initiated by the local user,
+   * and the operation needs to be sent to other connected peers.
+   * If isRemote = true, then the operation was received from another peer. In this case,
+   * the operation is executed locally but NOT re-sent back to the network, preventing infinite loops.
+   */
+  applyOperationLocally = (operationType, payload, isRemote = false) => {
+    // Operations from peers are queued and run together (see
+    // flushRemoteOperations). Local ones run after anything still queued.
+    if (isRemote) {
+      if (remoteOperations.push({ operationType, payload }) === 1) {
+        setTimeout(flushRemoteOperations, 0);
+      }
+      return;
+    }
+    flushRemoteOperations();
+
+    // If the image processing isn't ready yet, defer the operation.
+    if (!isImageReady || !wasmOutputPtr) {
+        console.warn("Image not ready, deferring operation:", operationType);
+        // Retry after a short delay. For production, consider a more robust queuing mechanism.
+        setTimeout(() => applyOperationLocally(operationType, payload, isRemote), 100);
+        return;
+    }
+
+    runOperation(operationType, payload);
 
     // Only send operation to peers if operation was initiated by the local user and this peer is the leader
     // For remote operations (isRemote is true), it means the leader has already processed and broadcasted it.
@@ -829,17 +1080,131 @@ Module().then((mod) => {
       alert("Sigma must be between 0 and 50");
       return;
     }
-    if (isNaN(kernelSize) || kernelSize < 1 || kernelSize > 50 || kernelSize % 2 === 0) {
-      alert("Kernel size must an odd number be between 1 and 50");
+    if (isNaN(kernelSize) || kernelSize < 1 || kernelSize > 201 || kernelSize % 2 === 0) {
+      alert("Kernel size must an odd number be between 1 and 201");
       return;
     }
     handleOperationClick("gaussian_blur", () => ({ layerId: selectedLayerId, sigma, kernelSize }));
   });
 
+  /**
+   * Preview the Gaussian blur on the selected layer while its parameters are
+   * edited. The preview is computed at roughly the size the canvas is displayed
+   * at (see "Previews" in the README) and drawn scaled up over the canvas; the
+   * layer itself is only changed by the blur button. Builds without
+   * preview_pipeline show no preview.
+   */
+  const previewCanvas = document.createElement("canvas");
+
+  function previewGaussianBlur() {
+    const sigma = parseFloat(document.getElementById("sigma").value);
+    const kernelSize = parseInt(document.getElementById("kernel").value);
+    if (!isImageReady || !wasmOutputPtr || !hasExport("preview_pipeline")) return;
+    if (isNaN(sigma) || sigma <= 0 || sigma > 50) return;
+    if (isNaN(kernelSize) || kernelSize < 1 || kernelSize > 201 || kernelSize % 2 === 0) return;
+
+    const scale = window.devicePixelRatio || 1;
+    wasmModule.ccall("set_preview_size", null, ["number", "number"],
+      [Math.round(canvas.clientWidth * scale), Math.round(canvas.clientHeight * scale)]);
+
+    const sizePtr = wasmModule._malloc(3 * 4);
+    wasmModule.ccall("get_preview_size", null, ["number", "number", "number"], [canvas.width, canvas.height, sizePtr]);
+    const [previewWidth, previewHeight, level] = new Int32Array(wasmModule.HEAPU8.buffer, sizePtr, 3);
+    wasmModule._free(sizePtr);
+
+    const previewBytes = previewWidth * previewHeight * 4;
+    const previewPtr = wasmModule._malloc(previewBytes);
+    const stepsPtr = wasmModule._malloc(3 * 8);
+    wasmModule.HEAPF64.set([4, sigma, kernelSize], stepsPtr / 8);
+    const orderPtr = wasmModule._malloc(uploadedLayerOrder.length * 4);
+    new Int32Array(wasmModule.HEAPU8.buffer, orderPtr, uploadedLayerOrder.length).set(uploadedLayerOrder);
+
+    wasmModule.ccall("preview_pipeline", null,
+      ["number", "number", "number", "number", "number", "number", "number", "number"],
+      [previewPtr, canvas.width, canvas.height, orderPtr, uploadedLayerOrder.length, selectedLayerId, stepsPtr, 1]);
+
+    previewCanvas.width = previewWidth;
+    previewCanvas.height = previewHeight;
+    const pixels = new Uint8ClampedArray(wasmModule.HEAPU8.buffer, previewPtr, previewBytes);
+    previewCanvas.getContext("2d").putImageData(new ImageData(pixels, previewWidth, previewHeight), 0, 0);
+    ctx.clearRect(0, 0, canvas.width, canvas.height);
+    // Level n pixels cover 2^n canvas pixels; the last row and column may overhang
+    const levelScale = 1 << level;
+    ctx.drawImage(previewCanvas, 0, 0, canvas.width / levelScale, canvas.height / levelScale,
+      0, 0, canvas.width, canvas.height);
+    isPreviewShown = true;
+
+    wasmModule._free(orderPtr);
+    wasmModule._free(stepsPtr);
+    wasmModule._free(previewPtr);
+  }
+
+  document.getElementById("sigma").addEventListener("input", previewGaussianBlur);
+  document.getElementById("kernel").addEventListener("input", previewGaussianBlur);
+
+  // Ctrl+Z undoes the last operation, Ctrl+Shift+Z or Ctrl+Y redoes it. Like
+  // any other operation, they are applied on every peer.
+  document.addEventListener("keydown", (e) => {
+    if (!(e.ctrlKey || e.metaKey) || e.target.tagName === "INPUT") return;
+    const key = e.key.toLowerCase();
+    if ((key === "z" || key === "y") && hasExport("undo")) {
+      e.preventDefault();
+      const operationType = (key === "y" || e.shiftKey) ? "redo" : "undo";
+      handleOperationClick(operationType, () => ({}));
+    }
+  });
+
   document.getElementById("edge_sobel").addEventListener("click", () => {
     handleOperationClick("edge_sobel", () => ({ layerId: selectedLayerId }));
   });
 
+  document.getElementById("sharpen").addEventListener("click", () => {
+    const amount = parseFloat(document.getElementById("sharpen_amount").value);
+
+    if (isNaN(amount) || amount < 0 || amount > 5) {
+      alert("Amount must be between 0 and 5");
+      return;
+    }
+    handleOperationClick("sharpen", () => ({ layerId: selectedLayerId, amount }));
+  });
+
+  document.getElementById("emboss").addEventListener("click", () => {
+    handleOperationClick("emboss", () => ({ layerId: selectedLayerId }));
+  });
+  requireExport("sharpen", "sharpen");
+  requireExport("emboss", "emboss");
+
+  document.getElementById("levels").addEventListener("click", () => {
+    const black = parseFloat(document.getElementById("levels_black").value);
+    const white = parseFloat(document.getElementById("levels_white").value);
+    const gamma = parseFloat(document.getElementById("levels_gamma").value);
+
+    if (isNaN(black) || isNaN(white) || black < 0 || white > 255 || black >= white) {
+      alert("Levels need 0 <= black < white <= 255");
+      return;
+    }
+    if (isNaN(gamma) || gamma < 0.1 || gamma > 10) {
+      alert("Gamma must be between 0.1 and 10");
+      return;
+    }
+    handleOperationClick("adjust_colors", () => ({ layerId: selectedLayerId, kind: 4, params: [black, white, gamma, 0, 255] }));
+  });
+
+  document.getElementById("invert").addEventListener("click", () => {
+    handleOperationClick("adjust_colors", () => ({ layerId: selectedLayerId, kind: 7, params: [] }));
+  });
+
+  document.getElementById("threshold").addEventListener("click", () => {
+    const level = parseFloat(document.getElementById("threshold_level").value);
+
+    if (isNaN(level) || level < 0 || level > 255) {
+      alert("Threshold must be between 0 and 255");
+      return;
+    }
+    handleOperationClick("adjust_colors", () => ({ layerId: selectedLayerId, kind: 8, params: [level] }));
+  });
+  requireExport("adjust_colors", "levels", "invert", "threshold");
+
   document.getElementById("edge_laplacian_of_gaussian").addEventListener("click", () => {
     const sigma = parseFloat(document.getElementById('log_sigma').value);
     let kernelSize = parseInt(document.getElementById('log_kernel').value);
@@ -916,4 +1281,18 @@ Module().then((mod) => {
     }
     handleOperationClick("quad_compression", () => ({ layerId: selectedLayerId, newWidth, newHeight }));
   });
+
+  // Plain resize, up or down, without the quad tree: 0 = area, 1 = Lanczos-3
+  document.getElementById("resample_button").addEventListener("click", () => {
+    const newWidth = parseInt(document.getElementById("new_width").value);
+    const newHeight = parseInt(document.getElementById("new_height").value);
+    const filter = parseInt(document.getElementById("resize_filter").value);
+
+    if (isNaN(newWidth) || isNaN(newHeight) || newWidth <= 0 || newHeight <= 0) {
+      alert("Please enter valid width and height values.");
+      return;
+    }
+    handleOperationClick("resize_layer", () => ({ layerId: selectedLayerId, newWidth, newHeight, filter }));
+  });
+  requireExport("resize_layer", "resample_button");
 });
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <unordered_map>
+#include "layer.h"
+#include "layer_store.h"
+#include "thread_pool.h"
+#include "tile_codec.h"
+
+/**
+ * Layer snapshots
+ *
+ * A compact binary stream of a set of layers, for sending a document to a
+ * peer or saving and restoring a session. Pixels are stored as Layer::TILE_SIZE
+ * tiles coded with the tile codec (tile_codec.h), and tiles of layers the
+ * store already holds compressed are copied as they are.
+ *
+ * The stream is a header followed by self-delimiting records, all integers
+ * little-endian:
+ *
+ *   header    "IESN", u32 format version (1)
+ *   record    u8 type, u32 payload size, payload
+ *     LAYER   i32 id, u32 width, u32 height: starts a layer
+ *     TILES   i32 id, u32 first tile, u32 tile count, then per tile u32 size
+ *             and the coded tile (tiles row-major, as Layer::tile_versions)
+ *     END     no payload
+ *     PATCH   i32 id, u32 width, u32 height: like LAYER, but the reader
+ *             keeps its own layer, which must have that size, and only the
+ *             tiles that follow replace its tiles
+ *
+ * Both ends work in chunks of any size: SnapshotWriter produces a few records
+ * at a time, without ever holding the whole stream, and SnapshotReader
+ * applies every complete record it is fed. A layer exists (transparent) as
+ * soon as its LAYER record is read and its tiles fill in as they arrive, each
+ * record marking its tiles dirty, so it can be composited right away.
+ *
+ * A patch stream carries only some tiles of one layer: the ones a peer found
+ * to differ by comparing tile digests (tile_digest.h).
+ */
+
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+constexpr size_t SNAPSHOT_HEADER_SIZE = 8;
+constexpr size_t SNAPSHOT_RECORD_HEADER_SIZE = 5;
+
+// Largest record a reader accepts, and largest layer, in pixels
+constexpr size_t SNAPSHOT_MAX_RECORD_SIZE = size_t(256) << 20;
+constexpr size_t SNAPSHOT_MAX_PIXELS = size_t(1) << 28;
+
+enum class SnapshotRecord : uint8_t {
+    Layer = 1,
+    Tiles = 2,
+    End = 3,
+    Patch = 4,
+};
+
+inline void snapshot_put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+inline uint32_t snapshot_get_u32(const uint8_t* in) {
+    return static_cast<uint32_t>(in[0]) | static_cast<uint32_t>(in[1]) << 8 |
+           static_cast<uint32_t>(in[2]) << 16 | static_cast<uint32_t>(in[3]) << 24;
+}
+
+// Overwrite the u32 at out[at], e.g. a record size known once it is written
+inline void snapshot_patch_u32(std::vector<uint8_t>& out, size_t at, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out[at + i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+/**
+ * Serializes the layers with the given ids, in order, or some tiles of one
+ * layer as a patch. Layers the store does not have, and empty ones (looking
+ * an unknown id up creates one), are skipped.
+ */
+class SnapshotWriter {
+public:
+    SnapshotWriter(LayerStore& store, const std::vector<int>& ids) : store(store) {
+        for (int id : ids) {
+            Source source;
+            if (!make_source(id, source)) continue;
+
+            // One row of tiles per record
+            const int tilesX = (source.width + Layer::TILE_SIZE - 1) / Layer::TILE_SIZE;
+            const int tilesY = (source.height + Layer::TILE_SIZE - 1) / Layer::TILE_SIZE;
+            for (int ty = 0; ty < tilesY; ++ty) source.runs.emplace_back(ty * tilesX, tilesX);
+            sources.push_back(std::move(source));
+        }
+    }
+
+    /**
+     * A patch of the layer with the given id: the given tiles (row-major
+     * indices, as Layer::tile_versions). Indices out of range are ignored.
+     */
+    SnapshotWriter(LayerStore& store, int id, std::vector<int> tiles) : store(store) {
+        Source source;
+        if (!make_source(id, source)) return;
+        source.patch = true;
+
+        // Consecutive tiles share a record, up to a row of tiles per record
+        const int tilesX = (source.width + Layer::TILE_SIZE - 1) / Layer::TILE_SIZE;
+        const int tileCount = tilesX * ((source.height + Layer::TILE_SIZE - 1) / Layer::TILE_SIZE);
+        std::sort(tiles.begin(), tiles.end());
+        tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+        for (int t : tiles) {
+            if (t < 0 || t >= tileCount) continue;
+            if (!source.runs.empty() && source.runs.back().first + source.runs.back().second == t &&
+                source.runs.back().second < tilesX) {
+                ++source.runs.back().second;
+            } else {
+                source.runs.emplace_back(t, 1);
+            }
+        }
+        sources.push_back(std::move(source));
+    }
+
+    // Tiles the stream will carry
+    size_t tile_count() const {
+        size_t count = 0;
+        for (const Source& source : sources) {
+            for (const auto& run : source.runs) count += run.second;
+        }
+        return count;
+    }
+
+    bool done() const { return ended; }
+
+    /**
+     * Append records to `out` until it holds at least `target` bytes or the
+     * stream is complete. Returns false if a layer changed since the writer
+     * was created, since the snapshot would mix versions.
+     */
+    bool next(std::vector<uint8_t>& out, size_t target) {
+        if (!headerWritten) {
+            out.insert(out.end(), {'I', 'E', 'S', 'N'});
+            snapshot_put_u32(out, SNAPSHOT_VERSION);
+            headerWritten = true;
+        }
+
+        while (!ended && out.size() < target) {
+            if (current == sources.size()) {
+                begin_record(out, SnapshotRecord::End);
+                end_record(out);
+                ended = true;
+                break;
+            }
+
+            const Source& source = sources[current];
+            const Layer* layer = store.peek(source.id);
+            if (!layer || layer->uid != source.uid || layer->version != source.version) return false;
+
+            if (nextRun < 0) {
+                begin_record(out, source.patch ? SnapshotRecord::Patch : SnapshotRecord::Layer);
+                snapshot_put_u32(out, static_cast<uint32_t>(source.id));
+                snapshot_put_u32(out, static_cast<uint32_t>(source.width));
+                snapshot_put_u32(out, static_cast<uint32_t>(source.height));
+                end_record(out);
+                nextRun = 0;
+                continue;
+            }
+
+            if (nextRun >= static_cast<int>(source.runs.size())) {
+                ++current;
+                nextRun = -1;
+                continue;
+            }
+            write_tiles(out, source, *layer, source.runs[nextRun].first, source.runs[nextRun].second);
+            ++nextRun;
+        }
+        return true;
+    }
+
+private:
+    struct Source {
+        int id = -1;
+        uint64_t uid = 0;
+        uint32_t version = 0;
+        int width = 0;
+        int height = 0;
+        bool patch = false;
+        // Tiles to write, as (first, count), one record each
+        std::vector<std::pair<int, int>> runs;
+    };
+
+    LayerStore& store;
+    std::vector<Source> sources;
+    size_t current = 0;
+    int nextRun = -1;           // -1 until the layer's LAYER / PATCH record is written
+    bool headerWritten = false;
+    bool ended = false;
+    size_t recordStart = 0;
+
+    bool make_source(int id, Source& source) const {
+        const Layer* layer = store.peek(id);
+        if (!layer) return false;
+
+        source.id = id;
+        source.uid = layer->uid;
+        source.version = layer->version;
+        if (const CompressedPixels* compressed = store.compressed(id)) {
+            source.width = compressed->width;
+            source.height = compressed->height;
+        } else {
+            source.width = layer->width();
+            source.height = layer->height();
+        }
+        return source.width > 0 && source.height > 0;
+    }
+
+    void begin_record(std::vector<uint8_t>& out, SnapshotRecord type) {
+        out.push_back(static_cast<uint8_t>(type));
+        recordStart = out.size();
+        snapshot_put_u32(out, 0);
+    }
+
+    void end_record(std::vector<uint8_t>& out) {
+        snapshot_patch_u32(out, recordStart, static_cast<uint32_t>(out.size() - recordStart - 4));
+    }
+
+    void write_tiles(std::vector<uint8_t>& out, const Source& source, const Layer& layer, int first, int count) {
+        begin_record(out, SnapshotRecord::Tiles);
+        snapshot_put_u32(out, static_cast<uint32_t>(source.id));
+        snapshot_put_u32(out, static_cast<uint32_t>(first));
+        snapshot_put_u32(out, static_cast<uint32_t>(count));
+
+        if (const CompressedPixels* compressed = store.compressed(source.id)) {
+            // Already coded: copy the tiles as they are
+            for (int t = first; t < first + count; ++t) {
+                const uint32_t begin = compressed->offsets[t], end = compressed->offsets[t + 1];
+                snapshot_put_u32(out, end - begin);
+                out.insert(out.end(), compressed->data.begin() + begin, compressed->data.begin() + end);
+            }
+        } else {
+            std::vector<std::vector<uint8_t>> coded(count);
+            ThreadPool::shared().parallel_for(0, count, 1, [&](int i0, int i1) {
+                std::vector<Pixel> scratch;
+                for (int i = i0; i < i1; ++i) {
+                    int x, y, w, h;
+                    layer.tile_rect(first + i, x, y, w, h);
+                    tile_encode(layer.pixels, x, y, w, h, scratch, coded[i]);
+                }
+            });
+            for (const std::vector<uint8_t>& tile : coded) {
+                snapshot_put_u32(out, static_cast<uint32_t>(tile.size()));
+                out.insert(out.end(), tile.begin(), tile.end());
+            }
+        }
+        end_record(out);
+    }
+};
+
+/**
+ * Restores layers from a snapshot stream fed in chunks, replacing the layers
+ * with the same ids, or patching them.
+ */
+class SnapshotReader {
+public:
+    enum Status { Error = -1, Reading = 0, Done = 1 };
+
+    struct LayerInfo {
+        int id;
+        int width;
+        int height;
+    };
+
+    explicit SnapshotReader(LayerStore& store) : store(store) {}
+
+    Status status() const { return state; }
+
+    // Layers read or patched so far, in stream order
+    const std::vector<LayerInfo>& layers() const { return info; }
+
+    // Apply every record completed by `data`; the rest is kept for later
+    Status feed(const uint8_t* data, size_t size) {
+        if (state != Reading) return state;
+        pending.insert(pending.end(), data, data + size);
+
+        size_t at = 0;
+        if (!headerRead) {
+            if (pending.size() < SNAPSHOT_HEADER_SIZE) return state;
+            if (std::memcmp(pending.data(), "IESN", 4) != 0 || snapshot_get_u32(pending.data() + 4) != SNAPSHOT_VERSION) {
+                return fail();
+            }
+            headerRead = true;
+            at = SNAPSHOT_HEADER_SIZE;
+        }
+
+        while (state == Reading && pending.size() - at >= SNAPSHOT_RECORD_HEADER_SIZE) {
+            const uint8_t type = pending[at];
+            const uint32_t recordSize = snapshot_get_u32(pending.data() + at + 1);
+            if (recordSize > SNAPSHOT_MAX_RECORD_SIZE) return fail();
+            if (pending.size() - at - SNAPSHOT_RECORD_HEADER_SIZE < recordSize) break;
+
+            const uint8_t* payload = pending.data() + at + SNAPSHOT_RECORD_HEADER_SIZE;
+            if (!read_record(type, payload, recordSize)) return fail();
+            at += SNAPSHOT_RECORD_HEADER_SIZE + recordSize;
+        }
+
+        if (state == Done) {
+            std::vector<uint8_t>().swap(pending);
+        } else {
+            pending.erase(pending.begin(), pending.begin() + at);
+        }
+        return state;
+    }
+
+private:
+    LayerStore& store;
+    std::vector<uint8_t> pending;
+    bool headerRead = false;
+    Status state = Reading;
+    std::vector<LayerInfo> info;
+
+    // Uid of each layer this reader created or patches, so tiles never land
+    // in a layer that replaced it in the meantime
+    std::unordered_map<int, uint64_t> targets;
+
+    Status fail() {
+        state = Error;
+        std::vector<uint8_t>().swap(pending);
+        return state;
+    }
+
+    bool read_record(uint8_t type, const uint8_t* payload, uint32_t size) {
+        switch (static_cast<SnapshotRecord>(type)) {
+            case SnapshotRecord::Layer: {
+                if (size != 12) return false;
+                const int id = static_cast<int>(snapshot_get_u32(payload));
+                const uint32_t width = snapshot_get_u32(payload + 4);
+                const uint32_t height = snapshot_get_u32(payload + 8);
+                if (width == 0 || height == 0 || static_cast<uint64_t>(width) * height > SNAPSHOT_MAX_PIXELS) {
+                    return false;
+                }
+
+                Layer& layer = store.insert(id, Layer(id, PixelBuffer(static_cast<int>(width), static_cast<int>(height))));
+                if (layer.empty()) return false;
+                targets[id] = layer.uid;
+                info.push_back(LayerInfo{id, layer.width(), layer.height()});
+                return true;
+            }
+            case SnapshotRecord::Patch: {
+                if (size != 12) return false;
+                const int id = static_cast<int>(snapshot_get_u32(payload));
+                const uint32_t width = snapshot_get_u32(payload + 4);
+                const uint32_t height = snapshot_get_u32(payload + 8);
+
+                // A patch only makes sense on the same layer, at the same size
+                Layer* layer = store.find(id);
+                if (!layer || layer->empty() || static_cast<uint32_t>(layer->width()) != width ||
+                    static_cast<uint32_t>(layer->height()) != height) {
+                    return false;
+                }
+                targets[id] = layer->uid;
+                info.push_back(LayerInfo{id, layer->width(), layer->height()});
+                return true;
+            }
+            case SnapshotRecord::Tiles:
+                return read_tiles(payload, size);
+            case SnapshotRecord::End:
+                state = Done;
+                return true;
+        }
+        return false;
+    }
+
+    bool read_tiles(const uint8_t* payload, uint32_t size) {
+        if (size < 12) return false;
+        const int id = static_cast<int>(snapshot_get_u32(payload));
+        const uint32_t first = snapshot_get_u32(payload + 4);
+        const uint32_t count = snapshot_get_u32(payload + 8);
+
+        auto it = targets.find(id);
+        if (it == targets.end()) return false;
+        Layer* layer = store.find(id);
+        // The layer was replaced or deleted while streaming: skip its tiles
+        if (!layer || layer->uid != it->second) return true;
+
+        const size_t tileCount = layer->tile_versions.size();
+        if (first > tileCount || count > tileCount - first) return false;
+
+        // Locate every tile before decoding them in parallel
+        std::vector<uint32_t> offsets(count + 1);
+        std::vector<uint32_t> sizes(count);
+        uint32_t at = 12;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (size - at < 4) return false;
+            sizes[i] = snapshot_get_u32(payload + at);
+            at += 4;
+            if (size - at < sizes[i]) return false;
+            offsets[i] = at;
+            at += sizes[i];
+        }
+        if (at != size) return false;
+
+        const bool valid = ThreadPool::shared().parallel_reduce(0, static_cast<int>(count), 1, true, [&](int i0, int i1) {
+            std::vector<Pixel> scratch;
+            for (int i = i0; i < i1; ++i) {
+                int x, y, w, h;
+                layer->tile_rect(static_cast<int>(first) + i, x, y, w, h);
+                if (!tile_decode(payload + offsets[i], sizes[i], layer->pixels, x, y, w, h, scratch)) return false;
+            }
+            return true;
+        }, [](bool a, bool b) { return a && b; });
+        if (!valid) return false;
+
+        std::vector<int> tiles(count);
+        for (uint32_t i = 0; i < count; ++i) tiles[i] = static_cast<int>(first + i);
+        layer->mark_tiles_dirty(tiles);
+        return true;
+    }
+};
@@ -0,0 +1,1949 @@
+/**
+ * Native tests for the engine.
+ *
+ * Each test builds its input in memory, runs it through the engine and checks
+ * the result: round trips that must be exact, and kernels whose output is
+ * documented to be exact or within a bound. Unlike benchmark.cpp nothing is
+ * timed, so the tests run in a few seconds.
+ *
+ * Build and run with `make check`; `./tests NAME...` runs the tests whose name
+ * starts with one of the given prefixes.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "blend.h"
+#include "command_buffer.h"
+#include "filters.h"
+#include "flood_fill.h"
+#include "history.h"
+#include "image_file.h"
+#include "image_processor.h"
+#include "layer.h"
+#include "layer_store.h"
+#include "out_of_core.h"
+#include "point_ops.h"
+#include "resample.h"
+#include "snapshot.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what, const char* file, int line) {
+    if (ok) return;
+    ++failures;
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+/**
+ * Deterministic test pattern: gradients with noise on top, and an alpha
+ * channel that fades out towards the right, so both flat and busy tiles, and
+ * opaque and transparent ones, come up. `noise` 0 keeps it smooth (and so
+ * compressible).
+ */
+void fill_pattern(PixelBuffer& pixels, int seed, int noise) {
+    uint32_t state = 0x9e3779b9u * (seed + 1);
+    for (int y = 0; y < pixels.height; ++y) {
+        Pixel* row = pixels.row(y);
+        for (int x = 0; x < pixels.width; ++x) {
+            state = state * 1664525u + 1013904223u;
+            const int n = noise > 0 ? static_cast<int>(state >> 24) % (2 * noise + 1) - noise : 0;
+            row[x].r = static_cast<uint8_t>(std::clamp(x * 255 / std::max(1, pixels.width - 1) + n, 0, 255));
+            row[x].g = static_cast<uint8_t>(std::clamp(y * 255 / std::max(1, pixels.height - 1) + n, 0, 255));
+            row[x].b = static_cast<uint8_t>(std::clamp((x + y + seed * 40) % 256 + n, 0, 255));
+            row[x].a = static_cast<uint8_t>(std::clamp(255 - x * 200 / std::max(1, pixels.width), 0, 255));
+        }
+    }
+}
+
+// The same pattern as tightly packed RGBA, as JS hands it over
+std::vector<uint8_t> pattern_rgba(int width, int height, int seed, int noise) {
+    PixelBuffer pixels(width, height);
+    fill_pattern(pixels, seed, noise);
+    std::vector<uint8_t> data(static_cast<size_t>(width) * height * 4);
+    for (int y = 0; y < height; ++y) {
+        std::memcpy(&data[static_cast<size_t>(y) * width * 4], pixels.row(y), static_cast<size_t>(width) * 4);
+    }
+    return data;
+}
+
+bool same_pixels(const PixelBuffer& a, const PixelBuffer& b) {
+    if (a.width != b.width || a.height != b.height) return false;
+    for (int y = 0; y < a.height; ++y) {
+        if (std::memcmp(a.row(y), b.row(y), static_cast<size_t>(a.width) * sizeof(Pixel)) != 0) return false;
+    }
+    return true;
+}
+
+PixelBuffer copy_of(const PixelBuffer& pixels) {
+    PixelBuffer copy(pixels.width, pixels.height);
+    for (int y = 0; y < pixels.height; ++y) {
+        std::memcpy(copy.row(y), pixels.row(y), static_cast<size_t>(pixels.width) * sizeof(Pixel));
+    }
+    return copy;
+}
+
+Layer& add_layer(LayerStore& store, int id, int width, int height, int seed, int noise) {
+    Layer& layer = store.insert(id, Layer(id, PixelBuffer(width, height)));
+    fill_pattern(layer.pixels, seed, noise);
+    return layer;
+}
+
+// The whole stream of `writer`, asked for in chunks of about `target` bytes
+std::vector<uint8_t> write_stream(SnapshotWriter& writer, size_t target) {
+    std::vector<uint8_t> stream, chunk;
+    while (!writer.done()) {
+        chunk.clear();
+        CHECK(writer.next(chunk, target));
+        stream.insert(stream.end(), chunk.begin(), chunk.end());
+    }
+    return stream;
+}
+
+// Feed `stream` to `reader` in chunks of the given sizes, cycled
+SnapshotReader::Status feed_stream(SnapshotReader& reader, const std::vector<uint8_t>& stream,
+                                   const std::vector<size_t>& chunkSizes) {
+    size_t at = 0, next = 0;
+    SnapshotReader::Status status = reader.status();
+    while (at < stream.size()) {
+        const size_t size = std::min(chunkSizes[next++ % chunkSizes.size()], stream.size() - at);
+        status = reader.feed(stream.data() + at, size);
+        at += size;
+        // Only the last chunk completes the stream
+        if (at < stream.size() && status != SnapshotReader::Reading) return status;
+    }
+    return status;
+}
+
+std::vector<uint8_t> snapshot_header() {
+    std::vector<uint8_t> out = {'I', 'E', 'S', 'N'};
+    snapshot_put_u32(out, SNAPSHOT_VERSION);
+    return out;
+}
+
+void put_record(std::vector<uint8_t>& out, SnapshotRecord type, const std::vector<uint32_t>& fields) {
+    out.push_back(static_cast<uint8_t>(type));
+    snapshot_put_u32(out, static_cast<uint32_t>(fields.size() * 4));
+    for (uint32_t field : fields) snapshot_put_u32(out, field);
+}
+
+SnapshotReader::Status restore(const std::vector<uint8_t>& stream) {
+    LayerStore store;
+    SnapshotReader reader(store);
+    return reader.feed(stream.data(), stream.size());
+}
+
+/*
+ * Snapshots
+ */
+
+void test_snapshot_round_trip() {
+    LayerStore source;
+    add_layer(source, 1, 203, 157, 1, 20);
+    add_layer(source, 3, 64, 64, 3, 0);
+    add_layer(source, 4, 1, 1, 4, 0);
+    add_layer(source, 5, 130, 65, 5, 3);
+    source[2];  // looking an id up creates an empty layer
+
+    // Empty layers are left out, wherever they are in the list
+    for (const std::vector<int>& ids : {std::vector<int>{1, 2, 3, 4, 5}, std::vector<int>{2, 5, 1}}) {
+        SnapshotWriter writer(source, ids);
+        const std::vector<uint8_t> stream = write_stream(writer, size_t(1) << 20);
+
+        LayerStore restored;
+        SnapshotReader reader(restored);
+        CHECK(reader.feed(stream.data(), stream.size()) == SnapshotReader::Done);
+        CHECK(restored.peek(2) == nullptr);
+
+        size_t expected = 0;
+        for (int id : ids) {
+            if (source[id].empty()) continue;
+            ++expected;
+            const Layer* layer = restored.find(id);
+            CHECK(layer && same_pixels(layer->pixels, source[id].pixels));
+        }
+        CHECK(reader.layers().size() == expected);
+    }
+
+    // Only unknown and empty layers: a stream with nothing but an END record
+    SnapshotWriter writer(source, {2, 7});
+    const std::vector<uint8_t> stream = write_stream(writer, 64);
+    CHECK(stream.size() == SNAPSHOT_HEADER_SIZE + SNAPSHOT_RECORD_HEADER_SIZE);
+    CHECK(restore(stream) == SnapshotReader::Done);
+}
+
+void test_snapshot_compressed_layers() {
+    LayerStore source;
+    add_layer(source, 1, 300, 200, 1, 0);
+    add_layer(source, 2, 90, 70, 2, 0);
+    const PixelBuffer original1 = copy_of(source[1].pixels);
+    const PixelBuffer original2 = copy_of(source[2].pixels);
+
+    // Nothing used since the trim: every layer is compressed
+    source.set_budget(0);
+    source.trim();
+    CHECK(source.compressed(1) != nullptr);
+    CHECK(source.compressed(2) != nullptr);
+
+    SnapshotWriter writer(source, {1, 2});
+    const std::vector<uint8_t> stream = write_stream(writer, 1000);
+    LayerStore restored;
+    SnapshotReader reader(restored);
+    CHECK(reader.feed(stream.data(), stream.size()) == SnapshotReader::Done);
+    CHECK(restored.find(1) && same_pixels(restored.find(1)->pixels, original1));
+    CHECK(restored.find(2) && same_pixels(restored.find(2)->pixels, original2));
+}
+
+void test_snapshot_chunked() {
+    LayerStore source;
+    add_layer(source, 1, 203, 157, 1, 20);
+    add_layer(source, 2, 65, 129, 2, 0);
+
+    // Small chunks from the writer, and odd ones (splitting record headers
+    // and tiles anywhere) into the reader
+    SnapshotWriter writer(source, {1, 2});
+    const std::vector<uint8_t> stream = write_stream(writer, 37);
+    for (const std::vector<size_t>& chunks : {std::vector<size_t>{1}, std::vector<size_t>{2, 3, 5, 7, 11, 13},
+                                             std::vector<size_t>{4999}}) {
+        LayerStore restored;
+        SnapshotReader reader(restored);
+        CHECK(feed_stream(reader, stream, chunks) == SnapshotReader::Done);
+        CHECK(restored.find(1) && same_pixels(restored.find(1)->pixels, source[1].pixels));
+        CHECK(restored.find(2) && same_pixels(restored.find(2)->pixels, source[2].pixels));
+    }
+
+    // A layer exists, transparent, as soon as its LAYER record is in
+    LayerStore partial;
+    SnapshotReader reader(partial);
+    const size_t layerRecordEnd = SNAPSHOT_HEADER_SIZE + SNAPSHOT_RECORD_HEADER_SIZE + 12;
+    CHECK(reader.feed(stream.data(), layerRecordEnd) == SnapshotReader::Reading);
+    const Layer* layer = partial.find(1);
+    CHECK(layer && layer->width() == 203 && layer->height() == 157 && layer->pixels.at(0, 0).a == 0);
+}
+
+void test_snapshot_patch() {
+    LayerStore source;
+    Layer& layer = add_layer(source, 1, 203, 157, 1, 20);
+    SnapshotWriter full(source, {1});
+    const std::vector<uint8_t> fullStream = write_stream(full, size_t(1) << 20);
+
+    LayerStore peer;
+    SnapshotReader fullReader(peer);
+    CHECK(fullReader.feed(fullStream.data(), fullStream.size()) == SnapshotReader::Done);
+
+    // Change the first and last tiles on the source only
+    const int lastTile = static_cast<int>(layer.tile_versions.size()) - 1;
+    for (int y = 0; y < 10; ++y) {
+        for (int x = 0; x < 10; ++x) layer.pixels.at(x, y) = Pixel{1, 2, 3, 4};
+    }
+    layer.pixels.at(202, 156) = Pixel{9, 9, 9, 9};
+    layer.mark_tiles_dirty({0, lastTile});
+
+    // Out of range and repeated indices are ignored
+    SnapshotWriter patch(source, 1, {lastTile, 0, -5, 0, 9999});
+    CHECK(patch.tile_count() == 2);
+    const std::vector<uint8_t> patchStream = write_stream(patch, 100);
+    CHECK(patchStream.size() < fullStream.size());
+
+    const uint64_t uid = peer.find(1)->uid;
+    SnapshotReader patchReader(peer);
+    CHECK(feed_stream(patchReader, patchStream, {3, 8}) == SnapshotReader::Done);
+    CHECK(peer.find(1)->uid == uid);
+    CHECK(same_pixels(peer.find(1)->pixels, layer.pixels));
+
+    // A patch needs the same layer, at the same size
+    LayerStore other;
+    add_layer(other, 1, 200, 157, 1, 0);
+    CHECK(restore(patchStream) == SnapshotReader::Error);
+    SnapshotReader mismatch(other);
+    CHECK(mismatch.feed(patchStream.data(), patchStream.size()) == SnapshotReader::Error);
+}
+
+void test_snapshot_malformed() {
+    LayerStore source;
+    add_layer(source, 1, 100, 70, 1, 20);
+    SnapshotWriter writer(source, {1});
+    const std::vector<uint8_t> valid = write_stream(writer, size_t(1) << 20);
+
+    std::vector<uint8_t> badMagic = valid;
+    badMagic[3] = 'X';
+    CHECK(restore(badMagic) == SnapshotReader::Error);
+
+    std::vector<uint8_t> badVersion = valid;
+    snapshot_patch_u32(badVersion, 4, SNAPSHOT_VERSION + 1);
+    CHECK(restore(badVersion) == SnapshotReader::Error);
+
+    // A truncated stream is still waiting for the rest
+    std::vector<uint8_t> truncated(valid.begin(), valid.end() - 1);
+    CHECK(restore(truncated) == SnapshotReader::Reading);
+
+    std::vector<uint8_t> unknownRecord = snapshot_header();
+    put_record(unknownRecord, static_cast<SnapshotRecord>(9), {});
+    CHECK(restore(unknownRecord) == SnapshotReader::Error);
+
+    std::vector<uint8_t> hugeRecord = snapshot_header();
+    hugeRecord.push_back(static_cast<uint8_t>(SnapshotRecord::Tiles));
+    snapshot_put_u32(hugeRecord, static_cast<uint32_t>(SNAPSHOT_MAX_RECORD_SIZE + 1));
+    CHECK(restore(hugeRecord) == SnapshotReader::Error);
+
+    std::vector<uint8_t> shortLayer = snapshot_header();
+    put_record(shortLayer, SnapshotRecord::Layer, {1, 10});
+    CHECK(restore(shortLayer) == SnapshotReader::Error);
+
+    std::vector<uint8_t> emptyLayer = snapshot_header();
+    put_record(emptyLayer, SnapshotRecord::Layer, {1, 0, 0});
+    CHECK(restore(emptyLayer) == SnapshotReader::Error);
+
+    std::vector<uint8_t> hugeLayer = snapshot_header();
+    put_record(hugeLayer, SnapshotRecord::Layer, {1, 1u << 16, 1u << 16});
+    CHECK(restore(hugeLayer) == SnapshotReader::Error);
+
+    std::vector<uint8_t> tilesFirst = snapshot_header();
+    put_record(tilesFirst, SnapshotRecord::Tiles, {1, 0, 0});
+    CHECK(restore(tilesFirst) == SnapshotReader::Error);
+
+    // 100x70 has 2x2 tiles
+    std::vector<uint8_t> tilesOutOfRange = snapshot_header();
+    put_record(tilesOutOfRange, SnapshotRecord::Layer, {1, 100, 70});
+    put_record(tilesOutOfRange, SnapshotRecord::Tiles, {1, 3, 2, 0, 0});
+    CHECK(restore(tilesOutOfRange) == SnapshotReader::Error);
+
+    // First tile's size, past the end of its record
+    std::vector<uint8_t> badTileSize = valid;
+    const size_t firstTileSize = SNAPSHOT_HEADER_SIZE + SNAPSHOT_RECORD_HEADER_SIZE + 12 +
+                                 SNAPSHOT_RECORD_HEADER_SIZE + 12;
+    snapshot_patch_u32(badTileSize, firstTileSize, 0xffffff);
+    CHECK(restore(badTileSize) == SnapshotReader::Error);
+
+    // Tile data that does not decode
+    std::vector<uint8_t> badTile = valid;
+    const uint32_t tileBytes = snapshot_get_u32(&badTile[firstTileSize]);
+    std::fill(badTile.begin() + firstTileSize + 4, badTile.begin() + firstTileSize + 4 + tileBytes, 0xff);
+    CHECK(restore(badTile) == SnapshotReader::Error);
+
+    // Once failed, a reader stays failed
+    LayerStore store;
+    SnapshotReader reader(store);
+    CHECK(reader.feed(badMagic.data(), badMagic.size()) == SnapshotReader::Error);
+    CHECK(reader.feed(valid.data(), valid.size()) == SnapshotReader::Error);
+}
+
+/*
+ * Snapshots through the exported API, as script.js drives them
+ */
+
+void test_snapshot_exports() {
+    const std::vector<uint8_t> a = pattern_rgba(150, 90, 1, 10);
+    const std::vector<uint8_t> b = pattern_rgba(40, 300, 2, 0);
+    data_to_layer(const_cast<uint8_t*>(a.data()), 150, 90, 101);
+    data_to_layer(const_cast<uint8_t*>(b.data()), 40, 300, 102);
+
+    // An operation on an unknown id leaves an empty layer 103 behind
+    std::vector<uint8_t> canvas(16 * 16 * 4);
+    int emptyOrder[] = {103};
+    monochrome_average(canvas.data(), 16, 16, emptyOrder, 1, 103);
+
+    // Each layer merged on its own, to compare the restored layers against
+    std::vector<uint8_t> before[2];
+    for (int i = 0; i < 2; ++i) {
+        int order[] = {101 + i};
+        before[i].resize((i == 0 ? a : b).size());
+        merge_layers(before[i].data(), i == 0 ? 150 : 40, i == 0 ? 90 : 300, order, 1);
+    }
+
+    int ids[] = {101, 103, 102};
+    snapshot_begin(ids, 3);
+    std::vector<uint8_t> stream;
+    int size[1] = {0};
+    for (;;) {
+        uint8_t* chunk = snapshot_next(1000, size);
+        CHECK(size[0] >= 0);
+        if (size[0] <= 0) break;
+        stream.insert(stream.end(), chunk, chunk + size[0]);
+    }
+    snapshot_end();
+
+    CHECK(delete_layer(101) == 1);
+    CHECK(delete_layer(102) == 1);
+    restore_begin();
+    int status = 0;
+    for (size_t at = 0; at < stream.size(); at += 333) {
+        std::vector<uint8_t> chunk(stream.begin() + at, stream.begin() + std::min(stream.size(), at + 333));
+        status = restore_feed(chunk.data(), static_cast<int>(chunk.size()));
+    }
+    CHECK(status == 1);
+
+    int info[9] = {0};
+    CHECK(get_restored_layers(info, 3) == 2);
+    CHECK(info[0] == 101 && info[1] == 150 && info[2] == 90);
+    CHECK(info[3] == 102 && info[4] == 40 && info[5] == 300);
+
+    // The restored layers merge exactly as the originals did
+    for (int i = 0; i < 2; ++i) {
+        std::vector<uint8_t> merged(before[i].size());
+        int order[] = {101 + i};
+        merge_layers(merged.data(), i == 0 ? 150 : 40, i == 0 ? 90 : 300, order, 1);
+        CHECK(merged == before[i]);
+    }
+    delete_layer(101);
+    delete_layer(102);
+    delete_layer(103);
+}
+
+/*
+ * Compositing (blend.h): merge_layers must evaluate the blend formula exactly,
+ * and stay within a level per layer of what it first shipped with
+ */
+
+// A layer of random pixels, with whole 64 x 64 tiles transparent or opaque
+std::vector<uint8_t> blend_layer(int width, int height, int seed) {
+    std::vector<uint8_t> data(static_cast<size_t>(width) * height * 4);
+    uint32_t state = 0x2545f491u * (seed + 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t* p = &data[(static_cast<size_t>(y) * width + x) * 4];
+            for (int c = 0; c < 4; ++c) {
+                state = state * 1664525u + 1013904223u;
+                p[c] = static_cast<uint8_t>(state >> 24);
+            }
+            const int tile = (x / 64 + y / 64 * 7 + seed) % 5;
+            if (tile == 0) p[3] = 0;
+            if (tile == 1) p[3] = 255;
+        }
+    }
+    return data;
+}
+
+// The blend merge_layers first shipped with, in floats
+void float_blend(uint8_t* o, const uint8_t* p) {
+    float srcAlpha = p[3] * (1.0f / 255.0f);
+    float dstAlpha = o[3] * (1.0f / 255.0f);
+    float outAlpha = dstAlpha + srcAlpha * (1 - dstAlpha);
+    if (outAlpha == 0.0f) return;
+    float invOutAlpha = 1.0f / outAlpha;
+    float srcRGB[3] = {p[0] * (1.0f / 255.0f), p[1] * (1.0f / 255.0f), p[2] * (1.0f / 255.0f)};
+    for (int c = 0; c < 3; ++c) {
+        float dstColor = o[c] * (1.0f / 255.0f);
+        float outColor = (dstColor * dstAlpha + srcRGB[c] * srcAlpha * (1 - dstAlpha)) * invOutAlpha;
+        o[c] = static_cast<uint8_t>(outColor * 255.0f);
+    }
+    o[3] = static_cast<uint8_t>(outAlpha * 255.0f);
+}
+
+// The blend formula of blend.h, with plain divisions
+void exact_blend(uint8_t* o, const uint8_t* p) {
+    const int coverage = 255 * o[3] + p[3] * (255 - o[3]);
+    if (coverage == 0) return;
+    for (int c = 0; c < 3; ++c) o[c] = static_cast<uint8_t>((o[c] * o[3] * 255 + p[c] * p[3] * (255 - o[3])) / coverage);
+    o[3] = static_cast<uint8_t>(coverage / 255);
+}
+
+// merge_layers, with `blend` for each pixel
+void reference_merge(uint8_t* output, int width, int height, const std::vector<std::vector<uint8_t>>& layers,
+                     const std::vector<int>& widths, const std::vector<int>& heights,
+                     void (*blend)(uint8_t*, const uint8_t*)) {
+    std::fill(output, output + (width * height * 4), 0);
+    for (int i = static_cast<int>(layers.size()) - 1; i >= 0; --i) {
+        for (int y = 0; y < heights[i] && y < height; ++y) {
+            for (int x = 0; x < widths[i] && x < width; ++x) {
+                blend(&output[(y * width + x) * 4], &layers[i][(static_cast<size_t>(y) * widths[i] + x) * 4]);
+            }
+        }
+    }
+}
+
+int max_difference(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+    int worst = 0;
+    for (size_t i = 0; i < a.size(); ++i) worst = std::max(worst, std::abs(a[i] - b[i]));
+    return worst;
+}
+
+void test_blend_merge() {
+    const int width = 300, height = 200;
+    for (int count = 1; count <= 8; ++count) {
+        std::vector<std::vector<uint8_t>> layers;
+        std::vector<int> widths, heights, order;
+        for (int i = 0; i < count; ++i) {
+            // Some layers smaller and some larger than the canvas
+            widths.push_back(i % 3 == 1 ? 170 : i % 3 == 2 ? 333 : width);
+            heights.push_back(i % 2 == 1 ? 90 : height);
+            layers.push_back(blend_layer(widths[i], heights[i], count * 10 + i));
+            data_to_layer(layers[i].data(), widths[i], heights[i], 200 + i);
+            order.push_back(200 + i);
+        }
+
+        std::vector<uint8_t> expected(static_cast<size_t>(width) * height * 4), merged(expected.size());
+        std::vector<uint8_t> original(expected.size());
+        reference_merge(expected.data(), width, height, layers, widths, heights, exact_blend);
+        reference_merge(original.data(), width, height, layers, widths, heights, float_blend);
+        merge_layers(merged.data(), width, height, order.data(), count);
+        CHECK(merged == expected);
+        CHECK(max_difference(merged, original) <= count);
+
+        // Recomposited after a change to one layer
+        layers[0] = blend_layer(widths[0], heights[0], count * 10 + 9);
+        data_to_layer(layers[0].data(), widths[0], heights[0], 200);
+        reference_merge(expected.data(), width, height, layers, widths, heights, exact_blend);
+        int dirty[4] = {0};
+        merge_layers_incremental(merged.data(), width, height, order.data(), count, dirty);
+        CHECK(merged == expected);
+
+        for (int id : order) delete_layer(id);
+    }
+}
+
+void test_blend_kernels() {
+    const int count = 1000;
+    std::vector<uint8_t> src = blend_layer(count, 1, 1);
+    std::vector<uint8_t> under = blend_layer(count, 1, 2);
+    // All 65536 (alpha, alpha) pairs, for the division and truncation edges
+    for (int i = 0; i < count; ++i) under[i * 4 + 3] = static_cast<uint8_t>(i % 256);
+
+    std::vector<std::vector<uint8_t>> srcs, dsts;
+    for (int srcAlpha = 0; srcAlpha < 256; ++srcAlpha) {
+        std::vector<uint8_t> s = src, d = under;
+        for (int i = 0; i < count; ++i) s[i * 4 + 3] = static_cast<uint8_t>((srcAlpha + i / 256) % 256);
+        srcs.push_back(s);
+        dsts.push_back(d);
+    }
+
+    std::vector<std::pair<BlendUnderFn, const char*>> kernels = {{blend_kernel().fn, blend_kernel().name}};
+#if defined(BLEND_X86_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) kernels.push_back({blend_under_sse41, "sse4.1"});
+    if (__builtin_cpu_supports("avx2")) kernels.push_back({blend_under_avx2, "avx2"});
+#endif
+
+    int floatWorst = 0;
+    for (size_t k = 0; k < srcs.size(); ++k) {
+        std::vector<uint8_t> expected = dsts[k], original = dsts[k];
+        for (int i = 0; i < count; ++i) {
+            exact_blend(&expected[i * 4], &srcs[k][i * 4]);
+            float_blend(&original[i * 4], &srcs[k][i * 4]);
+        }
+        floatWorst = std::max(floatWorst, max_difference(expected, original));
+        uint8_t minAlpha = 255;
+        for (int i = 0; i < count; ++i) minAlpha = std::min(minAlpha, expected[i * 4 + 3]);
+
+        const Pixel* pixels = reinterpret_cast<const Pixel*>(srcs[k].data());
+        std::vector<uint8_t> out = dsts[k];
+        CHECK(blend_under_integer(out.data(), pixels, count) == minAlpha);
+        CHECK(out == expected);
+
+        for (const auto& kernel : kernels) {
+            // Odd lengths, for the tails
+            out = dsts[k];
+            const uint8_t head = kernel.first(out.data(), pixels, 7);
+            const uint8_t rest = kernel.first(out.data() + 7 * 4, pixels + 7, count - 7);
+            CHECK(out == expected);
+            CHECK(std::min(head, rest) == minAlpha);
+        }
+    }
+    // One blend is within a level of the original float one
+    CHECK(floatWorst <= 1);
+}
+
+void test_blend_integer() {
+    // The kernel mode does not change compositing
+    const int width = 200, height = 130;
+    for (int count = 1; count <= 4; ++count) {
+        std::vector<int> order;
+        for (int i = 0; i < count; ++i) {
+            std::vector<uint8_t> layer = blend_layer(width, height, 50 + count * 4 + i);
+            data_to_layer(layer.data(), width, height, 300 + i);
+            order.push_back(300 + i);
+        }
+        std::vector<uint8_t> floats(static_cast<size_t>(width) * height * 4), integers(floats.size());
+        merge_layers(floats.data(), width, height, order.data(), count);
+        set_integer_kernels(1);
+        merge_layers(integers.data(), width, height, order.data(), count);
+        set_integer_kernels(0);
+        CHECK(floats == integers);
+        for (int id : order) delete_layer(id);
+    }
+}
+
+void test_blend_tiled() {
+    // Out-of-core compositing blends exactly as merge_layers
+    const int width = 300, height = 280;
+    std::vector<std::vector<uint8_t>> layers;
+    std::vector<int> widths = {300, 260, 300}, heights = {280, 280, 100};
+    TiledImage output(width, height);
+    std::vector<std::unique_ptr<TiledImage>> images;
+    std::vector<TiledImage*> stack;
+    for (int i = 0; i < 3; ++i) {
+        layers.push_back(blend_layer(widths[i], heights[i], 70 + i));
+        images.push_back(std::make_unique<TiledImage>(widths[i], heights[i]));
+        CHECK(images[i]->valid());
+        images[i]->write_rows(0, heights[i], reinterpret_cast<const Pixel*>(layers[i].data()), widths[i]);
+        stack.push_back(images[i].get());
+    }
+    CHECK(output.valid());
+    merge_tiled(stack, output);
+
+    std::vector<uint8_t> expected(static_cast<size_t>(width) * height * 4), merged(expected.size());
+    reference_merge(expected.data(), width, height, layers, widths, heights, exact_blend);
+    output.read_rows(0, height, reinterpret_cast<Pixel*>(merged.data()), width);
+    CHECK(merged == expected);
+}
+
+/*
+ * Resampling (resample.h): the weights must not depend on the build
+ */
+
+void test_resample_weights() {
+    double worst = 0;
+    for (int i = -4000; i <= 4000; ++i) {
+        const double x = i / 1000.0 + 0.0001234;
+        worst = std::max(worst, std::fabs(reproducible_sin_pi(x) - std::sin(RESAMPLE_PI * x)));
+    }
+    CHECK(worst < 1e-14);
+
+    // Digests of the Lanczos weight tables, as every build must compute them
+    struct Case {
+        int src, dst;
+        uint64_t digest;
+    };
+    const Case cases[] = {
+        {1000, 333, 0x0ad96fdcea2aa6dfull},
+        {333, 1000, 0x23504caec857e4b8ull},
+        {730, 97, 0xc2db686837ca3176ull},
+        {64, 65, 0xf14504e0bab9d94aull},
+    };
+    for (const Case& c : cases) {
+        ScratchScope scratch;
+        const ResampleWeights weights(scratch, c.src, c.dst, ResampleFilter::Lanczos3);
+        uint64_t digest = 1469598103934665603ull;
+        auto mix = [&](uint32_t value) { digest = (digest ^ value) * 1099511628211ull; };
+        for (int i = 0; i < c.dst; ++i) mix(static_cast<uint32_t>(weights.first[i]));
+        for (int i = 0; i < c.dst * weights.pairCount; ++i) mix(static_cast<uint32_t>(weights.pairs[i]));
+        mix(static_cast<uint32_t>(weights.taps));
+        CHECK(digest == c.digest);
+
+        // Every output's weights add up to exactly 1
+        for (int i = 0; i < c.dst; ++i) {
+            int sum = 0;
+            for (int j = 0; j < weights.pairCount; ++j) {
+                const uint32_t pair = static_cast<uint32_t>(weights.pairs[static_cast<size_t>(i) * weights.pairCount + j]);
+                sum += static_cast<int16_t>(pair & 0xffff) + static_cast<int16_t>(pair >> 16);
+            }
+            CHECK(sum == 1 << RESAMPLE_WEIGHT_BITS);
+        }
+    }
+}
+
+/*
+ * Sobel (image_processor.cpp): the magnitudes go through a cached plane or,
+ * when the derived-plane cache would not keep one, through the pixels
+ */
+
+// An opaque noisy test image, which merge_layers copies as it is
+std::vector<uint8_t> opaque_rgba(int width, int height, int seed) {
+    std::vector<uint8_t> data = pattern_rgba(width, height, seed, 40);
+    for (size_t i = 3; i < data.size(); i += 4) data[i] = 255;
+    return data;
+}
+
+// Layer `id` as merge_layers shows it, alone on a canvas of its size
+std::vector<uint8_t> merged_layer(int id, int width, int height) {
+    std::vector<uint8_t> out(static_cast<size_t>(width) * height * 4);
+    int order[] = {id};
+    merge_layers(out.data(), width, height, order, 1);
+    return out;
+}
+
+void test_sobel_plane() {
+    const int width = 173, height = 141;
+    const std::vector<uint8_t> input = opaque_rgba(width, height, 4);
+    std::vector<uint8_t> canvas(input.size());
+    int order[] = {400};
+    double stats[5];
+
+    set_plane_cache_budget(64);
+    data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 400);
+    get_plane_cache_stats(stats);
+    const double entries = stats[0];
+    edge_sobel(canvas.data(), width, height, order, 1, 400);
+    const std::vector<uint8_t> cached = merged_layer(400, width, height);
+    get_plane_cache_stats(stats);
+    CHECK(stats[0] == entries + 1);
+
+    // Under a budget too small for the plane, Sobel runs in place
+    set_plane_cache_budget(0);
+    data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 400);
+    edge_sobel(canvas.data(), width, height, order, 1, 400);
+    get_plane_cache_stats(stats);
+    CHECK(stats[0] == 0);
+    CHECK(merged_layer(400, width, height) == cached);
+
+    set_plane_cache_budget(64);
+    delete_layer(400);
+}
+
+/*
+ * Convolution engine (convolution.h) against the hand-written 3x3 kernels it
+ * replaced, and the exactness of the fused pipeline and unrolled blurs
+ */
+
+// Sobel as the engine first shipped it, on tightly packed RGBA
+void reference_sobel(std::vector<uint8_t>& rgba, int width, int height) {
+    std::vector<uint8_t> gray(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < gray.size(); ++i) gray[i] = static_cast<uint8_t>((rgba[4 * i] + rgba[4 * i + 1] + rgba[4 * i + 2]) / 3);
+
+    const int gxWeights[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    const int gyWeights[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+    std::vector<int> magnitudes(gray.size(), 0);
+    int maxMag = 1;
+    for (int y = 1; y < height - 1; ++y) {
+        for (int x = 1; x < width - 1; ++x) {
+            int gx = 0, gy = 0;
+            for (int k = 0; k < 9; ++k) {
+                const int value = gray[(y + k / 3 - 1) * width + x + k % 3 - 1];
+                gx += value * gxWeights[k];
+                gy += value * gyWeights[k];
+            }
+            magnitudes[y * width + x] = std::abs(gx) + std::abs(gy);
+            maxMag = std::max(maxMag, magnitudes[y * width + x]);
+        }
+    }
+
+    const float invMax = 255.0f / maxMag;
+    for (int y = 1; y < height - 1; ++y) {
+        for (int x = 1; x < width - 1; ++x) {
+            uint8_t* p = &rgba[(static_cast<size_t>(y) * width + x) * 4];
+            p[0] = p[1] = p[2] = static_cast<uint8_t>(magnitudes[y * width + x] * invMax);
+        }
+    }
+}
+
+// The Laplacian as the engine first shipped it
+void reference_laplacian(std::vector<uint8_t>& rgba, int width, int height) {
+    std::vector<uint8_t> gray(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < gray.size(); ++i) gray[i] = static_cast<uint8_t>((rgba[4 * i] + rgba[4 * i + 1] + rgba[4 * i + 2]) / 3);
+
+    for (int y = 1; y < height - 1; ++y) {
+        for (int x = 1; x < width - 1; ++x) {
+            int sum = 0;
+            for (int k = 0; k < 9; ++k) sum += gray[(y + k / 3 - 1) * width + x + k % 3 - 1] * (k == 4 ? 8 : -1);
+            uint8_t* p = &rgba[(static_cast<size_t>(y) * width + x) * 4];
+            p[0] = p[1] = p[2] = static_cast<uint8_t>(std::min(255, std::max(0, sum * 3)));
+        }
+    }
+}
+
+// The Gaussian blur and ITU grayscale as the engine first shipped them
+void reference_gaussian(std::vector<uint8_t>& rgba, int width, int height, double sigma, int kernelSize) {
+    if (kernelSize % 2 == 0) kernelSize++;
+    const int halfKernel = kernelSize / 2;
+    std::vector<float> kernel(kernelSize);
+    float denom = 2.0f * sigma * sigma;
+    float sum = 0.0f;
+    for (int i = 0; i < kernelSize; ++i) {
+        int x = i - halfKernel;
+        kernel[i] = std::exp(-(x * x) / denom);
+        sum += kernel[i];
+    }
+    for (float& k : kernel) k /= sum;
+
+    auto clamp = [](float v) { return static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, v))); };
+    std::vector<uint8_t> temp(rgba.size());
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float acc[4] = {0, 0, 0, 0};
+            for (int k = -halfKernel; k <= halfKernel; ++k) {
+                const int sx = std::min(width - 1, std::max(0, x + k));
+                for (int c = 0; c < 4; ++c) acc[c] += rgba[(static_cast<size_t>(y) * width + sx) * 4 + c] * kernel[k + halfKernel];
+            }
+            for (int c = 0; c < 4; ++c) temp[(static_cast<size_t>(y) * width + x) * 4 + c] = clamp(acc[c]);
+        }
+    }
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float acc[4] = {0, 0, 0, 0};
+            for (int k = -halfKernel; k <= halfKernel; ++k) {
+                const int sy = std::min(height - 1, std::max(0, y + k));
+                for (int c = 0; c < 4; ++c) acc[c] += temp[(static_cast<size_t>(sy) * width + x) * 4 + c] * kernel[k + halfKernel];
+            }
+            for (int c = 0; c < 4; ++c) rgba[(static_cast<size_t>(y) * width + x) * 4 + c] = clamp(acc[c]);
+        }
+    }
+}
+
+void reference_itu(std::vector<uint8_t>& rgba) {
+    for (size_t i = 0; i < rgba.size(); i += 4) {
+        const uint8_t gray = static_cast<uint8_t>(0.2126 * rgba[i] + 0.7152 * rgba[i + 1] + 0.0722 * rgba[i + 2]);
+        rgba[i] = rgba[i + 1] = rgba[i + 2] = gray;
+    }
+}
+
+// Sizes from degenerate to several bands wide and tall
+const int CONVOLUTION_SIZES[][2] = {{1, 1}, {2, 5}, {3, 3}, {7, 2}, {64, 64}, {173, 141}, {517, 389}};
+
+void test_convolution_sobel() {
+    for (const auto& size : CONVOLUTION_SIZES) {
+        const int width = size[0], height = size[1];
+        std::vector<uint8_t> expected = opaque_rgba(width, height, 5);
+        std::vector<uint8_t> canvas(expected.size());
+        data_to_layer(expected.data(), width, height, 500);
+        int order[] = {500};
+        edge_sobel(canvas.data(), width, height, order, 1, 500);
+        reference_sobel(expected, width, height);
+        CHECK(canvas == expected);
+        delete_layer(500);
+    }
+}
+
+void test_convolution_laplacian() {
+    for (const auto& size : CONVOLUTION_SIZES) {
+        const int width = size[0], height = size[1];
+        std::vector<uint8_t> expected = opaque_rgba(width, height, 6);
+        std::vector<uint8_t> canvas(expected.size());
+        data_to_layer(expected.data(), width, height, 500);
+        int order[] = {500};
+        laplacian_filter(canvas.data(), width, height, order, 1, 500);
+        reference_laplacian(expected, width, height);
+        CHECK(canvas == expected);
+        delete_layer(500);
+    }
+}
+
+void test_convolution_log() {
+    // The grayscale step is the exact floor of the ITU weights (point_ops.h),
+    // where the old double code truncated one level low on a few colours; the
+    // Laplacian amplifies that by 24. So the old blur and Laplacian run on the
+    // engine's grayscale, and the grayscale is checked on its own.
+    struct Case {
+        double sigma;
+        int kernelSize;
+    };
+    const Case cases[] = {{0.8, 3}, {1.4, 5}, {2.0, 9}};
+    for (const auto& size : CONVOLUTION_SIZES) {
+        const int width = size[0], height = size[1];
+        const std::vector<uint8_t> input = opaque_rgba(width, height, 7);
+        int order[] = {500};
+
+        std::vector<uint8_t> gray(input.size()), old = input;
+        data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 500);
+        monochrome_itu(gray.data(), width, height, order, 1, 500);
+        reference_itu(old);
+        CHECK(max_difference(gray, old) <= 1);
+
+        for (const Case& c : cases) {
+            std::vector<uint8_t> expected = gray, canvas(input.size());
+            data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 500);
+            edge_laplacian_of_gaussian(canvas.data(), width, height, order, 1, 500, c.sigma, c.kernelSize);
+            reference_gaussian(expected, width, height, c.sigma, c.kernelSize);
+            reference_laplacian(expected, width, height);
+            CHECK(max_difference(canvas, expected) <= 3);
+        }
+        delete_layer(500);
+    }
+}
+
+// The fused pipeline gives exactly what running its steps one at a time does
+void test_pipeline_fused() {
+    const int width = 301, height = 233;
+    const std::vector<std::vector<double>> pipelines = {
+        {3, 0, 0, 4, 1.4, 5, 6, 0, 0},
+        {0, 0, 0, 4, 0.9, 3, 4, 2.5, 7, 2, 0, 0},
+        {4, 1.0, 5, 5, 0, 0, 4, 1.2, 3},
+        {1, 0, 0, 6, 0, 0, 6, 0, 0, 4, 3.0, 15},
+    };
+    for (const std::vector<double>& steps : pipelines) {
+        const std::vector<uint8_t> input = pattern_rgba(width, height, 8, 30);
+        std::vector<uint8_t> fused(input.size()), single(input.size());
+        int order[] = {500};
+
+        data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 500);
+        run_pipeline(fused.data(), width, height, order, 1, 500, const_cast<double*>(steps.data()),
+                     static_cast<int>(steps.size() / 3));
+
+        data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 500);
+        for (size_t i = 0; i < steps.size(); i += 3) {
+            switch (static_cast<int>(steps[i])) {
+                case 0: monochrome_average(single.data(), width, height, order, 1, 500); break;
+                case 1: monochrome_luminosity(single.data(), width, height, order, 1, 500); break;
+                case 2: monochrome_lightness(single.data(), width, height, order, 1, 500); break;
+                case 3: monochrome_itu(single.data(), width, height, order, 1, 500); break;
+                case 4:
+                    gaussian_blur(single.data(), width, height, order, 1, 500, steps[i + 1],
+                                  static_cast<int>(steps[i + 2]));
+                    break;
+                case 5: edge_sobel(single.data(), width, height, order, 1, 500); break;
+                case 6: laplacian_filter(single.data(), width, height, order, 1, 500); break;
+            }
+        }
+        CHECK(fused == single);
+        delete_layer(500);
+    }
+}
+
+// The unrolled blur passes give exactly what the generic loops do
+void test_gaussian_unrolled() {
+    for (int halfKernel : {1, 2, 3, 4, 5, 7}) {
+        const int kernelSize = 2 * halfKernel + 1;
+        std::vector<float> kernel(kernelSize);
+        gaussian_kernel(0.4 * kernelSize, kernelSize, kernel.data());
+        const GaussianRowKernels unrolled = gaussian_row_kernels(halfKernel);
+        CHECK(unrolled.horizontal != gaussian_blur_row_horizontal);
+
+        for (int width = 1; width < 60; ++width) {
+            PixelBuffer rows(width, kernelSize);
+            fill_pattern(rows, width, 100);
+            PixelBuffer expected(width, 2), actual(width, 2);
+
+            gaussian_blur_row_horizontal(rows.row(0), expected.row(0), width, kernel.data(), halfKernel);
+            unrolled.horizontal(rows.row(0), actual.row(0), width, kernel.data(), halfKernel);
+
+            std::vector<const Pixel*> window(kernelSize);
+            for (int k = 0; k < kernelSize; ++k) window[k] = rows.row(k);
+            gaussian_blur_row_vertical(window.data(), expected.row(1), width, kernel.data(), halfKernel);
+            unrolled.vertical(window.data(), actual.row(1), width, kernel.data(), halfKernel);
+            CHECK(same_pixels(actual, expected));
+        }
+    }
+}
+
+/*
+ * Point operations (point_ops.h): a compiled chain must map every pixel as
+ * its operations would one at a time, with exact grayscale weights and
+ * tables every build computes alike
+ */
+
+// 256 x 256 pixels in which each channel takes every value, in differing
+// combinations, over alphas that the program must leave alone
+PixelBuffer point_input() {
+    PixelBuffer pixels(256, 256);
+    for (int y = 0; y < 256; ++y) {
+        Pixel* row = pixels.row(y);
+        for (int x = 0; x < 256; ++x) {
+            row[x] = Pixel{static_cast<uint8_t>(x), static_cast<uint8_t>(y), static_cast<uint8_t>((5 * x + 3 * y) & 255),
+                           static_cast<uint8_t>((x ^ y) & 255)};
+        }
+    }
+    return pixels;
+}
+
+uint8_t reference_levels(int v, const double* p) {
+    const double t = p[1] > p[0] ? std::clamp((v - p[0]) / (p[1] - p[0]), 0.0, 1.0) : (v >= p[0] ? 1.0 : 0.0);
+    return point_round(p[3] + reproducible_pow(t, 1.0 / p[2]) * (p[4] - p[3]));
+}
+
+// One operation on its own: channel mixing and curves through a program of
+// just that operation, the rest from their definitions
+void reference_point_op(PixelBuffer& pixels, const PointOp& op) {
+    if (op.kind == PointOpKind::ChannelMix || op.kind == PointOpKind::Curves) {
+        const PointProgram program({op});
+        for (int y = 0; y < pixels.height; ++y) program.run(pixels.row(y), pixels.width);
+        return;
+    }
+    const double* p = op.params;
+    for (int y = 0; y < pixels.height; ++y) {
+        Pixel* row = pixels.row(y);
+        for (int x = 0; x < pixels.width; ++x) {
+            Pixel& px = row[x];
+            const int r = px.r, g = px.g, b = px.b;
+            int gray = -1;
+            switch (op.kind) {
+                case PointOpKind::GrayscaleAverage: gray = (r + g + b) / 3; break;
+                case PointOpKind::GrayscaleLuminosity: gray = (299 * r + 587 * g + 114 * b) / 1000; break;
+                case PointOpKind::GrayscaleLightness: gray = (std::max({r, g, b}) + std::min({r, g, b})) / 2; break;
+                case PointOpKind::GrayscaleItu: gray = (2126 * r + 7152 * g + 722 * b) / 10000; break;
+                case PointOpKind::Threshold: gray = (299 * r + 587 * g + 114 * b) / 1000 >= p[0] ? 255 : 0; break;
+                case PointOpKind::Levels:
+                    px.r = reference_levels(r, p), px.g = reference_levels(g, p), px.b = reference_levels(b, p);
+                    break;
+                case PointOpKind::Gamma:
+                    px.r = point_round(255.0 * reproducible_pow(r / 255.0, 1.0 / p[0]));
+                    px.g = point_round(255.0 * reproducible_pow(g / 255.0, 1.0 / p[0]));
+                    px.b = point_round(255.0 * reproducible_pow(b / 255.0, 1.0 / p[0]));
+                    break;
+                case PointOpKind::Invert:
+                    px.r = 255 - r, px.g = 255 - g, px.b = 255 - b;
+                    break;
+                default: break;
+            }
+            if (gray >= 0) px.r = px.g = px.b = static_cast<uint8_t>(gray);
+        }
+    }
+}
+
+void test_point_chain() {
+    const PointOp levels{PointOpKind::Levels, {20, 230, 1.3, 10, 245}};
+    const PointOp curves{PointOpKind::Curves, {0, 0, 64, 90, 192, 170, 255, 255, -1}};
+    const PointOp gamma{PointOpKind::Gamma, {1.8}};
+    const PointOp invert{PointOpKind::Invert};
+    const PointOp average{PointOpKind::GrayscaleAverage};
+    const PointOp luminosity{PointOpKind::GrayscaleLuminosity};
+    const PointOp lightness{PointOpKind::GrayscaleLightness};
+    const PointOp itu{PointOpKind::GrayscaleItu};
+    const PointOp mix{PointOpKind::ChannelMix, {0.5, 0.3, 0.2, 0.1, 0.8, 0.1, -0.2, 0.4, 0.9, 10, -5, 0}};
+    const PointOp threshold{PointOpKind::Threshold, {128}};
+    const std::vector<std::vector<PointOp>> chains = {
+        {levels, curves, gamma, invert, luminosity},
+        {gamma, itu, curves, invert},
+        {invert, lightness, levels},
+        {levels, mix, gamma, average, invert},
+        {curves, threshold, invert},
+        {luminosity, gamma, itu, levels},
+    };
+
+    const PixelBuffer input = point_input();
+    for (const std::vector<PointOp>& chain : chains) {
+        PixelBuffer compiled = copy_of(input), single = copy_of(input);
+        const PointProgram program(chain);
+        for (int y = 0; y < compiled.height; ++y) program.run(compiled.row(y), compiled.width);
+        for (const PointOp& op : chain) reference_point_op(single, op);
+        CHECK(same_pixels(compiled, single));
+
+        // Alpha is never changed
+        bool alphaKept = true;
+        for (int y = 0; y < input.height; ++y) {
+            for (int x = 0; x < input.width; ++x) alphaKept &= compiled.row(y)[x].a == input.row(y)[x].a;
+        }
+        CHECK(alphaKept);
+    }
+
+    // adjust_colors runs the same program on a layer, from the packed operations
+    PixelBuffer opaque = copy_of(input);
+    std::vector<uint8_t> rgba(static_cast<size_t>(256) * 256 * 4);
+    for (int y = 0; y < 256; ++y) {
+        for (int x = 0; x < 256; ++x) opaque.row(y)[x].a = 255;
+        std::memcpy(&rgba[static_cast<size_t>(y) * 256 * 4], opaque.row(y), 256 * 4);
+    }
+    std::vector<double> packed;
+    for (const PointOp& op : chains[0]) {
+        packed.push_back(static_cast<int>(op.kind));
+        packed.insert(packed.end(), op.params, op.params + POINT_OP_PARAM_COUNT);
+    }
+    std::vector<uint8_t> canvas(rgba.size());
+    int order[] = {800};
+    data_to_layer(rgba.data(), 256, 256, 800);
+    adjust_colors(canvas.data(), 256, 256, order, 1, 800, packed.data(), static_cast<int>(chains[0].size()));
+    for (const PointOp& op : chains[0]) reference_point_op(opaque, op);
+    bool same = true;
+    for (int y = 0; y < 256; ++y) same &= std::memcmp(&canvas[static_cast<size_t>(y) * 256 * 4], opaque.row(y), 256 * 4) == 0;
+    CHECK(same);
+    delete_layer(800);
+}
+
+// The grayscale programs give their documented values for every colour
+void test_point_grayscale() {
+    const PointProgram average({PointOp{PointOpKind::GrayscaleAverage}});
+    const PointProgram luminosity({PointOp{PointOpKind::GrayscaleLuminosity}});
+    const PointProgram lightness({PointOp{PointOpKind::GrayscaleLightness}});
+    const PointProgram itu({PointOp{PointOpKind::GrayscaleItu}});
+    int wrong[4] = {};
+    std::vector<Pixel> row(256), gray(256);
+    for (int r = 0; r < 256; ++r) {
+        for (int g = 0; g < 256; ++g) {
+            for (int b = 0; b < 256; ++b) row[b] = Pixel{static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b), 255};
+            const PointProgram* programs[] = {&average, &luminosity, &lightness, &itu};
+            for (int m = 0; m < 4; ++m) {
+                gray = row;
+                programs[m]->run(gray.data(), 256);
+                for (int b = 0; b < 256; ++b) {
+                    const int expected = m == 0   ? (r + g + b) / 3
+                                         : m == 1 ? (299 * r + 587 * g + 114 * b) / 1000
+                                         : m == 2 ? (std::max({r, g, b}) + std::min({r, g, b})) / 2
+                                                  : (2126 * r + 7152 * g + 722 * b) / 10000;
+                    wrong[m] += gray[b].r != expected || gray[b].g != expected || gray[b].b != expected;
+                }
+            }
+        }
+    }
+    CHECK(wrong[0] == 0);
+    CHECK(wrong[1] == 0);
+    CHECK(wrong[2] == 0);
+    CHECK(wrong[3] == 0);
+}
+
+// Digests of reproducible_log / reproducible_pow and the tables built from
+// them, as every build must compute them
+void test_point_tables() {
+    uint64_t digest = 1469598103934665603ull;
+    auto mix = [&](uint32_t value) { digest = (digest ^ value) * 1099511628211ull; };
+    auto mix_double = [&](double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        mix(static_cast<uint32_t>(bits));
+        mix(static_cast<uint32_t>(bits >> 32));
+    };
+
+    double worst = 0;
+    for (int i = 1; i <= 4096; ++i) {
+        const double x = i / 4096.0;
+        mix_double(reproducible_log(x));
+        worst = std::max(worst, std::fabs(reproducible_log(x) - std::log(x)));
+    }
+    CHECK(worst < 1e-12);
+    CHECK(digest == 0x28480c3dec6f8919ull);
+
+    digest = 1469598103934665603ull;
+    worst = 0;
+    for (double p : {0.25, 1.0 / 1.8, 1.0 / 1.3, 1.7, 2.2, 3.0}) {
+        for (int v = 0; v < 256; ++v) {
+            mix_double(reproducible_pow(v / 255.0, p));
+            worst = std::max(worst, std::fabs(reproducible_pow(v / 255.0, p) - std::pow(v / 255.0, p)));
+        }
+    }
+    CHECK(worst < 1e-12);
+    CHECK(digest == 0xd663d20b52752451ull);
+
+    digest = 1469598103934665603ull;
+    std::vector<Pixel> ramp(256);
+    const PointOp ops[] = {
+        {PointOpKind::Levels, {20, 230, 1.3, 10, 245}},
+        {PointOpKind::Levels, {0, 255, 0.45, 0, 255}},
+        {PointOpKind::Gamma, {1.8}},
+        {PointOpKind::Gamma, {0.6}},
+        {PointOpKind::Curves, {0, 0, 64, 90, 192, 170, 255, 255, -1}},
+        {PointOpKind::Curves, {0, 255, 100, 40, 160, 220, 255, 0, -1}},
+    };
+    for (const PointOp& op : ops) {
+        for (int v = 0; v < 256; ++v) ramp[v] = Pixel{static_cast<uint8_t>(v), static_cast<uint8_t>(v), static_cast<uint8_t>(v), 255};
+        PointProgram({op}).run(ramp.data(), 256);
+        for (int v = 0; v < 256; ++v) mix(ramp[v].r);
+    }
+    CHECK(digest == 0x9e4b98e774fe294dull);
+}
+
+/*
+ * Bucket fill (flood_fill.h): the scanline search and the span blend must
+ * fill what a pixel-by-pixel search and blend would
+ */
+
+// Blocks of four well separated colours with a little noise, so a fill at a
+// low threshold takes irregular, holed regions of one colour; the first
+// colour is most of the blocks, so its regions are large. `alpha` 0 keeps
+// every pixel opaque; otherwise alphas vary by up to that much.
+std::vector<uint8_t> fill_rgba(int width, int height, int seed, int alpha) {
+    static const uint8_t palette[4][3] = {{200, 40, 40}, {40, 200, 40}, {40, 40, 200}, {200, 200, 40}};
+    std::vector<uint8_t> data(static_cast<size_t>(width) * height * 4);
+    uint32_t state = 0x51ed270bu * (seed + 1);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const uint32_t cell = static_cast<uint32_t>((x / 5) * 7919 + (y / 4) * 104729 + seed * 31);
+            const uint8_t* colour = palette[std::max(0, static_cast<int>(cell * 2654435761u >> 29) - 4)];
+            uint8_t* p = &data[(static_cast<size_t>(y) * width + x) * 4];
+            for (int c = 0; c < 4; ++c) {
+                state = state * 1664525u + 1013904223u;
+                const int noise = static_cast<int>(state >> 24) % 13 - 6;
+                p[c] = static_cast<uint8_t>(c < 3 ? colour[c] + noise : 255 - (alpha ? (state >> 16) % alpha : 0));
+            }
+        }
+    }
+    return data;
+}
+
+// The pixels a click at (x, y) fills, found one pixel at a time
+std::vector<bool> reference_fill_region(const std::vector<uint8_t>& rgba, int width, int height, int x, int y,
+                                        float threshold) {
+    const float thresholdSq = (threshold / 100.0f) * (4.0f * 255 * 255);
+    auto within = [&](size_t a, size_t b) {
+        int sum = 0;
+        for (int c = 0; c < 4; ++c) sum += (rgba[a * 4 + c] - rgba[b * 4 + c]) * (rgba[a * 4 + c] - rgba[b * 4 + c]);
+        return sum <= thresholdSq;
+    };
+
+    const size_t seed = static_cast<size_t>(y) * width + x;
+    std::vector<bool> filled(static_cast<size_t>(width) * height);
+    std::vector<size_t> queue = {seed};
+    filled[seed] = true;
+    for (size_t head = 0; head < queue.size(); ++head) {
+        const int px = static_cast<int>(queue[head] % width), py = static_cast<int>(queue[head] / width);
+        const int neighbours[4][2] = {{px - 1, py}, {px + 1, py}, {px, py - 1}, {px, py + 1}};
+        for (const auto& n : neighbours) {
+            if (n[0] < 0 || n[0] >= width || n[1] < 0 || n[1] >= height) continue;
+            const size_t i = static_cast<size_t>(n[1]) * width + n[0];
+            if (filled[i] || !within(i, seed)) continue;
+            filled[i] = true;
+            queue.push_back(i);
+        }
+    }
+    return filled;
+}
+
+// The bucket fill as it first shipped: the "over" blend per pixel, in floats
+void reference_fill(std::vector<uint8_t>& rgba, int width, int height, int x, int y, const Pixel& colour,
+                    float threshold) {
+    const std::vector<bool> filled = reference_fill_region(rgba, width, height, x, y, threshold);
+    const float src_a = colour.a / 255.0f;
+    for (size_t i = 0; i < filled.size(); ++i) {
+        if (!filled[i]) continue;
+        uint8_t* p = &rgba[i * 4];
+        const float dst_a = p[3] / 255.0f;
+        const float out_a = src_a + dst_a * (1.0f - src_a);
+        if (out_a <= 0.0f) continue;
+        p[0] = static_cast<uint8_t>((colour.r * src_a + p[0] * dst_a * (1.0f - src_a)) / out_a);
+        p[1] = static_cast<uint8_t>((colour.g * src_a + p[1] * dst_a * (1.0f - src_a)) / out_a);
+        p[2] = static_cast<uint8_t>((colour.b * src_a + p[2] * dst_a * (1.0f - src_a)) / out_a);
+        p[3] = static_cast<uint8_t>(out_a * 255.0f);
+    }
+}
+
+void test_fill_region() {
+    const int width = 203, height = 151;
+    struct Case {
+        int x, y;
+        float threshold;
+        Pixel colour;
+    };
+    const Case cases[] = {
+        {17, 23, 10, {10, 20, 30, 255}},
+        {100, 75, 10, {250, 120, 0, 128}},
+        {202, 150, 25, {0, 0, 0, 40}},
+        {60, 9, 0, {90, 90, 90, 255}},
+    };
+    for (const Case& c : cases) {
+        for (int alpha : {0, 60}) {
+            std::vector<uint8_t> expected = fill_rgba(width, height, c.x, alpha);
+            PixelBuffer pixels(width, height);
+            for (int y = 0; y < height; ++y) {
+                std::memcpy(pixels.row(y), &expected[static_cast<size_t>(y) * width * 4], static_cast<size_t>(width) * 4);
+            }
+            Layer layer(1, std::move(pixels));
+
+            const FillRegion region = fill_region(layer, c.x, c.y, fill_threshold_sq(c.threshold));
+            const std::vector<bool> filled = reference_fill_region(expected, width, height, c.x, c.y, c.threshold);
+            bool same = region.pixel_count() == static_cast<size_t>(std::count(filled.begin(), filled.end(), true));
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) same = same && region.contains(x, y) == filled[static_cast<size_t>(y) * width + x];
+            }
+            CHECK(same);
+
+            fill_region_blend(layer, region, c.colour);
+            reference_fill(expected, width, height, c.x, c.y, c.colour, c.threshold);
+            bool blended = true;
+            for (int y = 0; y < height; ++y) {
+                blended = blended && std::memcmp(layer.pixels.row(y), &expected[static_cast<size_t>(y) * width * 4],
+                                                 static_cast<size_t>(width) * 4) == 0;
+            }
+            CHECK(blended);
+        }
+    }
+}
+
+// Fills through the export, clicking again inside a region just filled
+void test_fill_exports() {
+    const int width = 190, height = 140;
+    std::vector<uint8_t> expected = fill_rgba(width, height, 3, 0);
+    std::vector<uint8_t> canvas(expected.size());
+    int order[] = {600};
+    data_to_layer(expected.data(), width, height, 600);
+
+    struct Click {
+        int x, y;
+        Pixel colour;
+    };
+    const Click clicks[] = {
+        {30, 41, {10, 20, 30, 255}},
+        // Inside the region just filled, none of whose border is close to its
+        // colour: the cached region is filled again
+        {31, 41, {120, 0, 120, 255}},
+        // That colour is close to the red blocks around it: the region grows
+        {30, 41, {40, 200, 40, 255}},
+        // A translucent fill, which is not cached
+        {30, 41, {200, 0, 0, 100}},
+        {30, 41, {0, 0, 200, 255}},
+    };
+    for (const Click& click : clicks) {
+        bucket_fill(canvas.data(), width, height, order, 1, 600, click.x, click.y, click.colour.r, click.colour.g,
+                    click.colour.b, click.colour.a, 10);
+        reference_fill(expected, width, height, click.x, click.y, click.colour, 10);
+        CHECK(merged_layer(600, width, height) == expected);
+        CHECK(canvas == expected);
+    }
+
+    // A region filled with a colour close to the other half of the image,
+    // which borders it on one side only: the region grows into that half on
+    // the next click, whichever side it is on
+    for (int side = 0; side < 3; ++side) {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                uint8_t* p = &expected[(static_cast<size_t>(y) * width + x) * 4];
+                const bool region = side == 0 ? x < width / 2 : side == 1 ? x >= width / 2 : y >= height / 2;
+                p[0] = region ? 200 : 40;
+                p[1] = region ? 40 : 200;
+                p[2] = 40;
+                p[3] = 255;
+            }
+        }
+        data_to_layer(expected.data(), width, height, 600);
+        const int x = side == 1 ? width - 10 : 10, y = side == 2 ? height - 10 : 10;
+        for (const Pixel& colour : {Pixel(40, 190, 40, 255), Pixel(10, 20, 30, 255)}) {
+            bucket_fill(canvas.data(), width, height, order, 1, 600, x, y, colour.r, colour.g, colour.b, colour.a, 10);
+            reference_fill(expected, width, height, x, y, colour, 10);
+            CHECK(merged_layer(600, width, height) == expected);
+        }
+    }
+    delete_layer(600);
+}
+
+/*
+ * Undo / redo (history.h): stepping back and forth must bring back every
+ * layer and composite exactly
+ */
+
+uint64_t layer_digest_of(int id) {
+    uint32_t digest[2] = {0, 0};
+    CHECK(get_layer_digest(id, digest) == 1);
+    return static_cast<uint64_t>(digest[1]) << 32 | digest[0];
+}
+
+std::vector<double> history_stats() {
+    std::vector<double> stats(4);
+    get_history_stats(stats.data());
+    return stats;
+}
+
+void test_history_steps() {
+    const int width = 300, height = 220;
+    clear_history();
+
+    // Layer 700 is opaque, with its first two tile columns gray, which
+    // grayscale leaves as they are; layer 701 fades out to the right
+    std::vector<uint8_t> bottom = opaque_rgba(width, height, 11);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < 128; ++x) {
+            uint8_t* p = &bottom[(static_cast<size_t>(y) * width + x) * 4];
+            p[1] = p[2] = p[0];
+        }
+    }
+    const std::vector<uint8_t> top = pattern_rgba(260, 200, 12, 30);
+    data_to_layer(bottom.data(), width, height, 700);
+    data_to_layer(const_cast<uint8_t*>(top.data()), 260, 200, 701);
+
+    int order[] = {700, 701};
+    std::vector<uint8_t> canvas(static_cast<size_t>(width) * height * 4);
+    merge_layers(canvas.data(), width, height, order, 2);
+
+    // The composite and both layers after every step
+    struct State {
+        std::vector<uint8_t> canvas;
+        uint64_t digests[2];
+    };
+    std::vector<State> states = {{canvas, {layer_digest_of(700), layer_digest_of(701)}}};
+    auto record = [&]() { states.push_back({canvas, {layer_digest_of(700), layer_digest_of(701)}}); };
+    auto matches = [&](const State& state) {
+        return canvas == state.canvas && layer_digest_of(700) == state.digests[0] &&
+               layer_digest_of(701) == state.digests[1];
+    };
+
+    std::vector<int> changed;
+    bucket_fill(canvas.data(), width, height, order, 2, 700, 250, 150, 20, 200, 90, 255, 3);
+    changed.push_back(700);
+    record();
+    gaussian_blur(canvas.data(), width, height, order, 2, 701, 1.5, 5);
+    changed.push_back(701);
+    record();
+
+    // Only the tiles grayscale changed are kept
+    const double before = history_stats()[2];
+    monochrome_luminosity(canvas.data(), width, height, order, 2, 700);
+    changed.push_back(700);
+    record();
+    CHECK(history_stats()[2] - before == static_cast<double>((width - 128) * height * 4));
+
+    edge_sobel(canvas.data(), width, height, order, 2, 701);
+    changed.push_back(701);
+    record();
+    quad_compression(canvas.data(), width, height, order, 2, 700, 150, 110);
+    changed.push_back(700);
+    record();
+    resize_layer(canvas.data(), width, height, order, 2, 701, 180, 250, 1);
+    changed.push_back(701);
+    record();
+    CHECK(history_stats()[0] == 6);
+
+    // Back to the start, then forward to the end
+    for (int i = static_cast<int>(changed.size()) - 1; i >= 0; --i) {
+        CHECK(undo(canvas.data(), width, height, order, 2) == changed[i]);
+        CHECK(matches(states[i]));
+    }
+    CHECK(undo(canvas.data(), width, height, order, 2) == -1);
+    CHECK(matches(states[0]));
+    for (size_t i = 0; i < changed.size(); ++i) {
+        CHECK(redo(canvas.data(), width, height, order, 2) == changed[i]);
+        CHECK(matches(states[i + 1]));
+    }
+    CHECK(redo(canvas.data(), width, height, order, 2) == -1);
+
+    std::vector<uint8_t> full(canvas.size());
+    merge_layers(full.data(), width, height, order, 2);
+    CHECK(full == canvas);
+
+    // A new step after undoing drops what could have been redone
+    CHECK(undo(canvas.data(), width, height, order, 2) == 701);
+    CHECK(undo(canvas.data(), width, height, order, 2) == 700);
+    gaussian_blur(canvas.data(), width, height, order, 2, 700, 1.0, 3);
+    CHECK(history_stats()[1] == 0);
+    CHECK(redo(canvas.data(), width, height, order, 2) == -1);
+    CHECK(undo(canvas.data(), width, height, order, 2) == 700);
+    CHECK(matches(states[4]));
+
+    delete_layer(700);
+    delete_layer(701);
+    clear_history();
+}
+
+// Planes derived from a layer serve it again once undo brings its pixels back
+void test_history_planes() {
+    const int width = 200, height = 150;
+    clear_history();
+    // Smooth, so that its quad tree is small enough to keep
+    std::vector<uint8_t> input = pattern_rgba(width, height, 13, 0);
+    for (size_t i = 3; i < input.size(); i += 4) input[i] = 255;
+    data_to_layer(input.data(), width, height, 702);
+    int order[] = {702};
+    std::vector<uint8_t> canvas(input.size());
+
+    for (int pass = 0; pass < 2; ++pass) {
+        double stats[5];
+        get_plane_cache_stats(stats);
+        const double hits = stats[3];
+
+        if (pass == 0) {
+            edge_sobel(canvas.data(), width, height, order, 1, 702);
+        } else {
+            quad_compression(canvas.data(), width, height, order, 1, 702, 90, 70);
+        }
+        const uint64_t first = layer_digest_of(702);
+        const std::vector<uint8_t> composite = canvas;
+
+        // A fill in between, undone with the step itself
+        bucket_fill(canvas.data(), width, height, order, 1, 702, 5, 5, 0, 0, 0, 255, 50);
+        CHECK(undo(canvas.data(), width, height, order, 1) == 702);
+        CHECK(undo(canvas.data(), width, height, order, 1) == 702);
+        CHECK(layer_digest_of(702) != first);
+
+        if (pass == 0) {
+            edge_sobel(canvas.data(), width, height, order, 1, 702);
+        } else {
+            quad_compression(canvas.data(), width, height, order, 1, 702, 90, 70);
+        }
+        get_plane_cache_stats(stats);
+        CHECK(stats[3] == hits + 1);
+        CHECK(layer_digest_of(702) == first);
+        CHECK(canvas == composite);
+        CHECK(undo(canvas.data(), width, height, order, 1) == 702);
+    }
+    delete_layer(702);
+    clear_history();
+}
+
+// Over its budget, the history forgets the oldest steps
+void test_history_budget() {
+    const int width = 400, height = 400;
+    clear_history();
+    set_history_budget(1);
+    const std::vector<uint8_t> input = opaque_rgba(width, height, 14);
+    data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 703);
+    int order[] = {703};
+    std::vector<uint8_t> canvas(input.size());
+
+    // Each step changes the whole layer, 640 KB
+    monochrome_average(canvas.data(), width, height, order, 1, 703);
+    const std::vector<uint8_t> gray = canvas;
+    CHECK(history_stats()[0] == 1);
+    gaussian_blur(canvas.data(), width, height, order, 1, 703, 2.0, 7);
+    CHECK(history_stats()[0] == 1);
+    CHECK(history_stats()[2] <= 1 << 20);
+
+    CHECK(undo(canvas.data(), width, height, order, 1) == 703);
+    CHECK(canvas == gray);
+    CHECK(undo(canvas.data(), width, height, order, 1) == -1);
+    CHECK(canvas == gray);
+    CHECK(redo(canvas.data(), width, height, order, 1) == 703);
+
+    set_history_budget(static_cast<int>(History::DEFAULT_BUDGET_BYTES >> 20));
+    delete_layer(703);
+    clear_history();
+}
+
+/*
+ * Command buffers (command_buffer.h): run_commands must do what calling the
+ * same operations one by one does, grouped and ordered as its flags say
+ */
+
+// Interleaved commands on layers 710 - 712, with an undo between them. Packed
+// as for run_commands: op, layer id, params.
+const std::vector<std::vector<double>> BUFFER_COMMANDS = {
+    {4, 710, 1.2, 5},                        //  0 blur
+    {5, 711},                                //  1 Sobel
+    {15, 712, 4, 20, 230, 1.3, 10, 245},     //  2 levels
+    {1, 710},                                //  3 luminosity
+    {15, 712, 6, 1.5},                       //  4 gamma
+    {8, 711, 20, 30, 255, 0, 0, 255, 40},    //  5 bucket fill
+    {6, 710},                                //  6 Laplacian
+    {10, 0},                                 //  7 undo
+    {15, 712, 7},                            //  8 invert
+    {4, 711, 1.0, 3},                        //  9 blur
+    {3, 711},                                // 10 ITU
+    {9, 710, 100, 75},                       // 11 quad compression
+    {7, 712, 1.4, 7},                        // 12 Laplacian of Gaussian
+    {15, 712, 5, 0, 0, 128, 180, 255, 255},  // 13 curves
+    {13, 710, 0.8},                          // 14 sharpen
+    {12, 711, 150, 120, 1},                  // 15 resize
+    {14, 712},                               // 16 emboss
+    {15, 710, 7},                            // 17 invert
+    {15, 710, 6, 0.7},                       // 18 gamma
+};
+
+// The commands above as run_commands groups them with each flag value, one
+// undoable step per group, in the order the groups run
+const std::vector<std::vector<int>> BUFFER_PLANS[] = {
+    // 0: one command at a time
+    {{0}, {1}, {2}, {3}, {4}, {5}, {6}, {7}, {8}, {9}, {10}, {11}, {12}, {13}, {14}, {15}, {16}, {17}, {18}},
+    // COMMANDS_COALESCE: consecutive filters, or adjustments, of one layer
+    {{0}, {1}, {2}, {3}, {4}, {5}, {6}, {7}, {8}, {9, 10}, {11}, {12}, {13}, {14}, {15}, {16}, {17, 18}},
+    // COMMANDS_REORDER: each layer's commands together, in order of first appearance, up to the undo
+    {{0}, {3}, {6}, {1}, {5}, {2}, {4}, {7}, {8}, {12}, {13}, {16}, {9}, {10}, {15}, {11}, {14}, {17}, {18}},
+    // both
+    {{0, 3, 6}, {1}, {5}, {2, 4}, {7}, {8}, {12}, {13}, {16}, {9, 10}, {15}, {11}, {14}, {17, 18}},
+};
+
+// Run one group of BUFFER_COMMANDS through the exports that do its job on their own
+void run_command_group(std::vector<uint8_t>& canvas, int width, int height, int* order, int orderSize,
+                       const std::vector<int>& group) {
+    std::vector<double> c = BUFFER_COMMANDS[group[0]];
+    c.resize(COMMAND_SIZE, 0.0);
+    const int op = static_cast<int>(c[0]), layer = static_cast<int>(c[1]);
+    uint8_t* data = canvas.data();
+
+    if (group.size() > 1 || op <= 7 || op == 15) {
+        if (op == 15) {
+            std::vector<double> ops;
+            for (int index : group) {
+                std::vector<double> packed(POINT_OP_SIZE, -1.0);
+                const std::vector<double>& command = BUFFER_COMMANDS[index];
+                for (size_t i = 2; i < command.size(); ++i) packed[i - 2] = command[i];
+                ops.insert(ops.end(), packed.begin(), packed.end());
+            }
+            adjust_colors(data, width, height, order, orderSize, layer, ops.data(), static_cast<int>(group.size()));
+        } else {
+            std::vector<double> steps;
+            for (int index : group) {
+                std::vector<double> command = BUFFER_COMMANDS[index];
+                command.resize(COMMAND_SIZE, 0.0);
+                if (command[0] == 7) {
+                    steps.insert(steps.end(), {3, 0, 0, 4, command[2], command[3], 6, 0, 0});
+                } else {
+                    steps.insert(steps.end(), {command[0], command[2], command[3]});
+                }
+            }
+            run_pipeline(data, width, height, order, orderSize, layer, steps.data(), static_cast<int>(steps.size() / 3));
+        }
+        return;
+    }
+
+    switch (op) {
+        case 8:
+            bucket_fill(data, width, height, order, orderSize, layer, static_cast<int>(c[2]), static_cast<int>(c[3]),
+                        static_cast<uint8_t>(c[4]), static_cast<uint8_t>(c[5]), static_cast<uint8_t>(c[6]),
+                        static_cast<uint8_t>(c[7]), static_cast<float>(c[8]));
+            break;
+        case 9:
+            quad_compression(data, width, height, order, orderSize, layer, static_cast<int>(c[2]), static_cast<int>(c[3]));
+            break;
+        case 10: undo(data, width, height, order, orderSize); break;
+        case 11: redo(data, width, height, order, orderSize); break;
+        case 12:
+            resize_layer(data, width, height, order, orderSize, layer, static_cast<int>(c[2]), static_cast<int>(c[3]),
+                         static_cast<int>(c[4]));
+            break;
+        case 13: sharpen(data, width, height, order, orderSize, layer, c[2]); break;
+        case 14: emboss(data, width, height, order, orderSize, layer); break;
+    }
+}
+
+// The plans above are what reorder_commands and command_runs make of the buffer
+void test_commands_plan() {
+    std::vector<double> packed;
+    for (std::vector<double> command : BUFFER_COMMANDS) {
+        command.resize(COMMAND_SIZE, 0.0);
+        packed.insert(packed.end(), command.begin(), command.end());
+    }
+    const std::vector<Command> commands = unpack_commands(packed.data(), static_cast<int>(BUFFER_COMMANDS.size()));
+    CHECK(commands.size() == BUFFER_COMMANDS.size());
+
+    for (int flags = 0; flags < 4; ++flags) {
+        const std::vector<Command> ordered = flags & COMMANDS_REORDER ? reorder_commands(commands) : commands;
+        const std::vector<size_t> runs = command_runs(ordered, (flags & COMMANDS_COALESCE) != 0);
+        const std::vector<std::vector<int>>& plan = BUFFER_PLANS[flags];
+        CHECK(runs.size() == plan.size() + 1);
+        if (runs.size() != plan.size() + 1) continue;
+
+        bool same = true;
+        for (size_t i = 0; i < plan.size(); ++i) {
+            same &= runs[i + 1] - runs[i] == plan[i].size();
+            for (size_t j = 0; j < plan[i].size() && runs[i] + j < ordered.size(); ++j) {
+                const Command& expected = commands[plan[i][j]];
+                const Command& actual = ordered[runs[i] + j];
+                same &= actual.op == expected.op && actual.layerId == expected.layerId &&
+                        std::equal(actual.params, actual.params + COMMAND_PARAM_COUNT, expected.params);
+            }
+        }
+        CHECK(same);
+    }
+}
+
+// Each flag value gives the layers, composite and history of its plan run through the exports
+void test_commands_flags() {
+    const int width = 200, height = 150;
+    int order[] = {710, 711, 712};
+    std::vector<double> packed;
+    for (std::vector<double> command : BUFFER_COMMANDS) {
+        command.resize(COMMAND_SIZE, 0.0);
+        packed.insert(packed.end(), command.begin(), command.end());
+    }
+    auto load = [&](std::vector<uint8_t>& canvas) {
+        for (int i = 0; i < 3; ++i) {
+            std::vector<uint8_t> rgba = pattern_rgba(width, height, 20 + i, 25);
+            data_to_layer(rgba.data(), width, height, order[i]);
+        }
+        clear_history();
+        merge_layers(canvas.data(), width, height, order, 3);
+    };
+
+    std::vector<uint64_t> digests[4];
+    for (int flags = 0; flags < 4; ++flags) {
+        std::vector<uint8_t> canvas(static_cast<size_t>(width) * height * 4), expected(canvas.size());
+        load(expected);
+        for (const std::vector<int>& group : BUFFER_PLANS[flags]) run_command_group(expected, width, height, order, 3, group);
+        const std::vector<double> expectedHistory = history_stats();
+        for (int id : order) digests[flags].push_back(layer_digest_of(id));
+
+        load(canvas);
+        CHECK(run_commands(canvas.data(), width, height, order, 3, packed.data(),
+                           static_cast<int>(BUFFER_COMMANDS.size()), flags) == static_cast<int>(BUFFER_COMMANDS.size()));
+        for (size_t i = 0; i < 3; ++i) CHECK(layer_digest_of(order[i]) == digests[flags][i]);
+        CHECK(canvas == expected);
+        std::vector<uint8_t> merged(canvas.size());
+        merge_layers(merged.data(), width, height, order, 3);
+        CHECK(canvas == merged);
+        CHECK(history_stats()[0] == expectedHistory[0]);
+        CHECK(history_stats()[1] == expectedHistory[1]);
+    }
+
+    // Coalescing only merges steps; reordering moves which step the undo takes back
+    CHECK(digests[1] == digests[0]);
+    CHECK(digests[2] != digests[0]);
+    for (int id : order) delete_layer(id);
+    clear_history();
+}
+
+/*
+ * Image files (image_file.h) and batch images (batch_run_commands): files
+ * must read back what was written, and a batch image must come out as the
+ * same commands leave a stored layer
+ */
+
+// Read an image from the start of `file`, as batch does; empty if it is not one
+std::vector<uint8_t> read_back(FILE* file, ImageFormat format, ImageHeader& header) {
+    std::rewind(file);
+    std::string error;
+    if (!read_image_header(file, format, header, error)) return {};
+    std::vector<uint8_t> rgba(static_cast<size_t>(header.width) * header.height * 4);
+    if (!read_image_pixels(file, header, rgba.data())) return {};
+    return rgba;
+}
+
+// A file holding `bytes`, to read from the start
+FILE* file_of(const std::string& bytes) {
+    FILE* file = std::tmpfile();
+    std::fwrite(bytes.data(), 1, bytes.size(), file);
+    return file;
+}
+
+void test_image_file_round_trip() {
+    const int width = 37, height = 23;
+    const std::vector<uint8_t> rgba = pattern_rgba(width, height, 30, 60);
+    for (ImageFormat format : {ImageFormat::Ppm, ImageFormat::Pam, ImageFormat::Raw}) {
+        FILE* file = std::tmpfile();
+        CHECK(write_image(file, format, rgba.data(), width, height));
+
+        ImageHeader header;
+        header.width = format == ImageFormat::Raw ? width : 0;
+        header.height = format == ImageFormat::Raw ? height : 0;
+        std::vector<uint8_t> expected = rgba;
+        if (format == ImageFormat::Ppm) {
+            for (size_t i = 3; i < expected.size(); i += 4) expected[i] = 255;
+        }
+        CHECK(read_back(file, format, header) == expected);
+        CHECK(header.format == format && header.width == width && header.height == height);
+        std::fclose(file);
+    }
+}
+
+// PAM of every depth, and PAM and PPM with a maxval under 255, expand to RGBA
+// with their samples scaled to 0 - 255
+void test_image_file_depths() {
+    const int width = 5, height = 3;
+    for (int maxval : {255, 100, 1}) {
+        for (int depth = 1; depth <= 5; ++depth) {
+            const bool ppm = depth == 5;
+            const int samples = ppm ? 3 : depth;
+            std::string bytes = ppm ? "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n" +
+                                          std::to_string(maxval) + "\n"
+                                    : "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " + std::to_string(height) +
+                                          "\nDEPTH " + std::to_string(depth) + "\nMAXVAL " + std::to_string(maxval) +
+                                          "\nENDHDR\n";
+            std::vector<uint8_t> expected;
+            auto scaled = [&](int v) { return static_cast<uint8_t>((v * 255 + maxval / 2) / maxval); };
+            for (int i = 0; i < width * height; ++i) {
+                int s[4];
+                for (int c = 0; c < samples; ++c) {
+                    s[c] = (i * 7 + c * 3) % (maxval + 1);
+                    bytes += static_cast<char>(s[c]);
+                }
+                const bool gray = samples <= 2, alpha = samples == 2 || samples == 4;
+                const uint8_t r = scaled(s[0]), g = gray ? r : scaled(s[1]), b = gray ? r : scaled(s[2]);
+                expected.insert(expected.end(), {r, g, b, alpha ? scaled(s[samples - 1]) : uint8_t{255}});
+            }
+
+            FILE* file = file_of(bytes);
+            ImageHeader header;
+            CHECK(read_back(file, ImageFormat::Unknown, header) == expected);
+            CHECK(header.depth == samples && header.maxval == maxval);
+            std::fclose(file);
+        }
+    }
+
+    // 16-bit samples, depths beyond 4 and files that end early are refused
+    ImageHeader header;
+    for (const char* bytes : {"P6\n2 2\n65535\n", "P7\nWIDTH 2\nHEIGHT 2\nDEPTH 5\nMAXVAL 255\nENDHDR\n",
+                              "P6\n2 2\n255\nabcdefghi", "P5\n2 2\n255\nabcd"}) {
+        FILE* file = file_of(bytes);
+        CHECK(read_back(file, ImageFormat::Unknown, header).empty());
+        std::fclose(file);
+    }
+}
+
+// Comments may come between any header tokens, also right after the last
+// one, and the pixels start after the single whitespace that ends the header
+// even when they look like a comment
+void test_image_file_comments() {
+    const std::string pixels = "# \n\x01\x02\x03" "abcxyz";
+    const std::vector<uint8_t> expected = {'#', ' ', '\n', 255, 1, 2, 3, 255, 'a', 'b', 'c', 255, 'x', 'y', 'z', 255};
+    const std::string headers[] = {
+        "P6\n# made by hand\n2 # width\n# height next\n2\n255\n",
+        "P6 2 2 255#comment ending the header\n",
+        "P6\t2\r2 #\n255 ",
+        "P7\n# a PAM\nWIDTH 2 # pixels\nHEIGHT 2\n#\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\n",
+        "P7\nWIDTH 2\nHEIGHT 2\nDEPTH 3\nMAXVAL 255\nENDHDR# and a comment\n",
+    };
+    for (const std::string& header : headers) {
+        FILE* file = file_of(header + pixels);
+        ImageHeader read;
+        CHECK(read_back(file, ImageFormat::Unknown, read) == expected);
+        std::fclose(file);
+    }
+}
+
+// Output names: raw names carry the size of the image as written
+void test_image_file_names() {
+    int width = 0, height = 0;
+    CHECK(raw_image_size("in/photo.640x480.rgba", width, height) && width == 640 && height == 480);
+    CHECK(!raw_image_size("in/photo.rgba", width, height));
+    CHECK(!raw_image_size("in/photo.640x480x2.rgba", width, height));
+
+    CHECK(image_output_path("out/photo.640x480.rgba", ImageFormat::Raw, 320, 200) == "out/photo.320x200.rgba");
+    CHECK(image_output_path("out/photo.640x480.rgba", ImageFormat::Ppm, 320, 200) == "out/photo.ppm");
+    CHECK(image_output_path("out/photo.ppm", ImageFormat::Raw, 320, 200) == "out/photo.320x200.rgba");
+    CHECK(image_output_path("out/photo.ppm", ImageFormat::Pam, 320, 200) == "out/photo.pam");
+    CHECK(image_output_path("out/photo.v2.pam", ImageFormat::Raw, 64, 48) == "out/photo.v2.64x48.rgba");
+}
+
+// batch_run_commands leaves an image as run_commands leaves a stored layer
+// with the same pixels, and its new size names a raw output
+void test_batch_commands() {
+    const int width = 160, height = 120;
+    const std::vector<std::vector<double>> commands = {
+        {4, 0, 1.3, 5},                         // blur
+        {15, 0, 4, 10, 240, 1.2, 0, 255},       // levels
+        {15, 0, 6, 1.4},                        // gamma
+        {8, 0, 40, 50, 10, 200, 30, 255, 30},   // bucket fill
+        {13, 0, 0.7},                           // sharpen
+        {5, 0},                                 // Sobel
+        {6, 0},                                 // Laplacian
+        {9, 0, 80, 60},                         // quad compression
+        {12, 0, 203, 97, 1},                    // resize
+        {14, 0},                                // emboss
+        {7, 0, 1.1, 5},                         // Laplacian of Gaussian
+    };
+    const std::vector<uint8_t> input = opaque_rgba(width, height, 31);
+
+    for (int flags : {0, COMMANDS_COALESCE}) {
+        for (size_t count = 1; count <= commands.size(); ++count) {
+            std::vector<double> packed;
+            for (size_t i = 0; i < count; ++i) {
+                std::vector<double> command = commands[i];
+                command.resize(COMMAND_SIZE, 0.0);
+                command[1] = 720;
+                packed.insert(packed.end(), command.begin(), command.end());
+            }
+
+            std::vector<uint8_t> canvas(input.size());
+            int order[] = {720};
+            data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 720);
+            merge_layers(canvas.data(), width, height, order, 1);
+            run_commands(canvas.data(), width, height, order, 1, packed.data(), static_cast<int>(count), flags);
+
+            uint8_t* data = alloc_layer_buffer(width, height);
+            std::memcpy(data, input.data(), input.size());
+            int size[2] = {0, 0};
+            uint8_t* result = batch_run_commands(data, width, height, packed.data(), static_cast<int>(count), flags, size);
+            CHECK(result != nullptr);
+            if (!result) continue;
+
+            // Quad tree compression and resize change the size
+            const int expectedWidth = count > 8 ? 203 : count > 7 ? 80 : width;
+            const int expectedHeight = count > 8 ? 97 : count > 7 ? 60 : height;
+            CHECK(size[0] == expectedWidth && size[1] == expectedHeight);
+            const std::vector<uint8_t> output(result, result + static_cast<size_t>(size[0]) * size[1] * 4);
+            CHECK(output == merged_layer(720, size[0], size[1]));
+            std::free(result);
+
+            if (count == commands.size()) {
+                CHECK(image_output_path("out/scan.160x120.rgba", ImageFormat::Raw, size[0], size[1]) ==
+                      "out/scan.203x97.rgba");
+            }
+        }
+    }
+    delete_layer(720);
+    clear_history();
+}
+
+/*
+ * Out-of-core images (out_of_core.h): filters streamed through bands of tiles
+ * under a budget of a few resident tiles must give the in-memory results
+ */
+
+void test_tiled_pipeline() {
+    // Three tiles across and bands of 256, 256 and 88 rows
+    const int width = 700, height = 600;
+    const std::vector<uint8_t> input = opaque_rgba(width, height, 40);
+    const std::vector<std::vector<double>> pipelines = {
+        {4, 1.5, 7},
+        {5, 0, 0},
+        {6, 0, 0},
+        {0, 0, 0},
+        {1, 0, 0, 2, 0, 0, 3, 0, 0},
+        {3, 0, 0, 4, 2.0, 9, 6, 0, 0},
+        {4, 1.0, 5, 5, 0, 0, 4, 2.5, 11, 1, 0, 0},
+        // Box blurs whose halos together reach past a band
+        {4, 60.0, 241, 4, 80.0, 321},
+    };
+
+    // A budget of four tiles, under the nine of each image
+    set_tiled_cache_budget(1);
+    double before[5], after[5];
+    get_tiled_cache_stats(before);
+    for (const std::vector<double>& steps : pipelines) {
+        const int stepCount = static_cast<int>(steps.size() / 3);
+        std::vector<uint8_t> expected(input.size()), tiled(input.size());
+        int order[] = {730};
+        data_to_layer(const_cast<uint8_t*>(input.data()), width, height, 730);
+        run_pipeline(expected.data(), width, height, order, 1, 730, const_cast<double*>(steps.data()), stepCount);
+
+        // Written and read in row counts that straddle tile boundaries
+        const int id = tiled_image_create(width, height);
+        CHECK(id > 0);
+        for (int y = 0; y < height; y += 37) {
+            CHECK(tiled_image_write(id, const_cast<uint8_t*>(&input[static_cast<size_t>(y) * width * 4]), y,
+                                    std::min(37, height - y)) == 1);
+        }
+        CHECK(tiled_run_pipeline(id, const_cast<double*>(steps.data()), stepCount) == 1);
+        for (int y = 0; y < height; y += 53) {
+            CHECK(tiled_image_read(id, &tiled[static_cast<size_t>(y) * width * 4], y, std::min(53, height - y)) == 1);
+        }
+        CHECK(tiled == expected);
+        CHECK(tiled_image_read(id, tiled.data(), height - 10, 11) == 0);
+        tiled_image_destroy(id);
+        CHECK(tiled_image_read(id, tiled.data(), 0, 1) == 0);
+        delete_layer(730);
+    }
+
+    // The resident tiles stayed within the budget, so tiles were released and loaded again
+    get_tiled_cache_stats(after);
+    CHECK(after[1] <= after[2] && after[2] == 1 << 20);
+    CHECK(after[4] > before[4]);
+    CHECK(after[3] - before[3] > 9.0 * pipelines.size());
+    set_tiled_cache_budget(static_cast<int>(TileCache::DEFAULT_BUDGET_BYTES >> 20));
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+const Test TESTS[] = {
+    {"snapshot.round_trip", test_snapshot_round_trip},
+    {"snapshot.compressed_layers", test_snapshot_compressed_layers},
+    {"snapshot.chunked", test_snapshot_chunked},
+    {"snapshot.patch", test_snapshot_patch},
+    {"snapshot.malformed", test_snapshot_malformed},
+    {"snapshot.exports", test_snapshot_exports},
+    {"blend.merge", test_blend_merge},
+    {"blend.kernels", test_blend_kernels},
+    {"blend.integer", test_blend_integer},
+    {"blend.tiled", test_blend_tiled},
+    {"resample.weights", test_resample_weights},
+    {"sobel.plane", test_sobel_plane},
+    {"convolution.sobel", test_convolution_sobel},
+    {"convolution.laplacian", test_convolution_laplacian},
+    {"convolution.log", test_convolution_log},
+    {"pipeline.fused", test_pipeline_fused},
+    {"gaussian.unrolled", test_gaussian_unrolled},
+    {"point.chain", test_point_chain},
+    {"point.grayscale", test_point_grayscale},
+    {"point.tables", test_point_tables},
+    {"fill.region", test_fill_region},
+    {"fill.exports", test_fill_exports},
+    {"history.steps", test_history_steps},
+    {"history.planes", test_history_planes},
+    {"history.budget", test_history_budget},
+    {"commands.plan", test_commands_plan},
+    {"commands.flags", test_commands_flags},
+    {"image_file.round_trip", test_image_file_round_trip},
+    {"image_file.depths", test_image_file_depths},
+    {"image_file.comments", test_image_file_comments},
+    {"image_file.names", test_image_file_names},
+    {"batch.commands", test_batch_commands},
+    {"tiled.pipeline", test_tiled_pipeline},
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int run = 0, failed = 0;
+    for (const Test& test : TESTS) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            if (std::strncmp(test.name, argv[i], std::strlen(argv[i])) == 0) selected = true;
+        }
+        if (!selected) continue;
+
+        const int before = failures;
+        test.run();
+        ++run;
+        const bool ok = failures == before;
+        if (!ok) ++failed;
+        std::printf("%-40s %s\n", test.name, ok ? "ok" : "FAILED");
+    }
+
+    std::printf("%d of %d tests passed\n", run - failed, run);
+    return failed == 0 && run > 0 ? 0 : 1;
+}
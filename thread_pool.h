@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+// Threads are available natively, and in WASM builds compiled with -pthread.
+// A plain WASM build runs everything serially on the calling thread.
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define IMAGE_PROCESSOR_THREADS 0
+#else
+#define IMAGE_PROCESSOR_THREADS 1
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+/**
+ * Shared worker pool for band-parallel kernels.
+ *
+ * Work is expressed as a range of indices (usually image rows, or tiles for
+ * the compositor) that is split into contiguous bands. The calling thread
+ * works on bands alongside the workers, and returns once every band is done.
+ * There are a few bands per thread so that uneven bands still balance out.
+ *
+ * Ranges smaller than `grain` indices per band run serially on the caller, as
+ * do calls made from inside a band or while another thread is using the pool,
+ * so kernels can call parallel_for unconditionally.
+ */
+class ThreadPool {
+public:
+    static constexpr int BANDS_PER_THREAD = 4;
+
+    // The pool shared by every kernel
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ThreadPool() { resize(0); }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() { stop(); }
+
+    // Number of threads that work on a job, including the caller
+    int size() const { return threads; }
+
+    /**
+     * Use `count` threads in total, including the caller. 0 means one per
+     * hardware thread; 1 makes every job serial.
+     */
+    void resize(int count) {
+#if IMAGE_PROCESSOR_THREADS
+        if (count <= 0) count = static_cast<int>(std::thread::hardware_concurrency());
+        count = std::max(1, count);
+        if (count == threads) return;
+
+        std::lock_guard<std::mutex> job(jobMutex);
+        stop();
+        threads = count;
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+#else
+        (void)count;
+        threads = 1;
+#endif
+    }
+
+    /**
+     * Call fn(bandBegin, bandEnd) for contiguous bands covering [begin, end),
+     * each at least `grain` long.
+     */
+    template <typename Fn>
+    void parallel_for(int begin, int end, int grain, Fn&& fn) {
+        int bands = band_count(end - begin, grain);
+        if (bands == 0) return;
+        if (bands == 1) {
+            fn(begin, end);
+            return;
+        }
+
+        run(bands, [&](int band) {
+            std::pair<int, int> range = band_range(begin, end, bands, band);
+            fn(range.first, range.second);
+        });
+    }
+
+    /**
+     * Like parallel_for, but each band returns a value; the values are folded
+     * with combine(accumulated, bandValue) in band order, starting from init.
+     */
+    template <typename T, typename Fn, typename Combine>
+    T parallel_reduce(int begin, int end, int grain, T init, Fn&& fn, Combine&& combine) {
+        int bands = band_count(end - begin, grain);
+        if (bands == 0) return init;
+        if (bands == 1) return combine(init, fn(begin, end));
+
+        std::vector<T> partial(bands, init);
+        run(bands, [&](int band) {
+            std::pair<int, int> range = band_range(begin, end, bands, band);
+            partial[band] = fn(range.first, range.second);
+        });
+
+        T result = init;
+        for (const T& value : partial) result = combine(result, value);
+        return result;
+    }
+
+    // Number of bands parallel_for splits `count` indices into
+    int band_count(int count, int grain) const {
+        if (count <= 0) return 0;
+        int maxBands = count / std::max(1, grain);
+        return std::max(1, std::min(maxBands, threads * BANDS_PER_THREAD));
+    }
+
+    // Index range [first, second) of band `band` out of `bands` over [begin, end)
+    static std::pair<int, int> band_range(int begin, int end, int bands, int band) {
+        int64_t count = end - begin;
+        return {begin + static_cast<int>(count * band / bands),
+                begin + static_cast<int>(count * (band + 1) / bands)};
+    }
+
+private:
+    int threads = 0;
+
+    static bool& inside_band() {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+#if IMAGE_PROCESSOR_THREADS
+    std::vector<std::thread> workers;
+
+    // Held by the thread submitting a job, for the whole job
+    std::mutex jobMutex;
+
+    // Guards the job description and worker wake-ups
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stopping = false;
+    uint64_t generation = 0;
+    const std::function<void(int)>* job = nullptr;
+    int jobBands = 0;
+    int active = 0;
+    std::atomic<int> next{0};
+    std::atomic<int> remaining{0};
+
+    void run(int bands, const std::function<void(int)>& task) {
+        std::unique_lock<std::mutex> submit(jobMutex, std::try_to_lock);
+        if (threads == 1 || inside_band() || !submit.owns_lock()) {
+            for (int band = 0; band < bands; ++band) task(band);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobBands = bands;
+            next = 0;
+            remaining = bands;
+            ++generation;
+        }
+        wake.notify_all();
+
+        work(task, bands);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return remaining == 0 && active == 0; });
+        job = nullptr;
+    }
+
+    // Take bands of the current job until none are left
+    void work(const std::function<void(int)>& task, int bands) {
+        inside_band() = true;
+        for (int band = next++; band < bands; band = next++) {
+            task(band);
+            if (--remaining == 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+        inside_band() = false;
+    }
+
+    void worker_loop() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            // The job may already be finished by the time this worker wakes up
+            if (!job) continue;
+
+            const std::function<void(int)>* task = job;
+            int bands = jobBands;
+            ++active;
+            lock.unlock();
+
+            work(*task, bands);
+
+            lock.lock();
+            --active;
+            done.notify_all();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+        workers.clear();
+        stopping = false;
+    }
+#else
+    void run(int bands, const std::function<void(int)>& task) {
+        for (int band = 0; band < bands; ++band) task(band);
+    }
+
+    void stop() {}
+#endif
+};
+
+/**
+ * Rows per band for a row-parallel pass over an image `width` pixels wide,
+ * so that each band has enough work to be worth handing to another thread.
+ */
+inline int row_grain(int width) {
+    constexpr int MIN_PIXELS_PER_BAND = 16384;
+    return std::max(1, MIN_PIXELS_PER_BAND / std::max(1, width));
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "layer.h"
+#include "thread_pool.h"
+
+/**
+ * Tile digests
+ *
+ * A 64-bit digest of every Layer::TILE_SIZE tile of a layer, for peers to find
+ * where their copies of a layer differ without sending pixels: they compare
+ * digest vectors (8 bytes per tile) and resend only the tiles that differ (see
+ * snapshot_tiles_begin). Layers only stay identical if every peer runs the
+ * integer kernels (integer_kernels.h).
+ *
+ * The hash is a multiply-rotate mix in the style of xxHash, not cryptographic:
+ * rows are read 8 bytes at a time into four independent lanes. It reads the
+ * pixels as little-endian words, as on every target we build for.
+ *
+ * A layer's digests are kept with it (Layer::digests) and updated on request,
+ * hashing only the tiles whose version changed since the last one, so a layer
+ * compressed by the store is only decompressed if it changed.
+ */
+
+constexpr uint64_t DIGEST_PRIME_1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t DIGEST_PRIME_2 = 0xC2B2AE3D27D4EB4Full;
+constexpr uint64_t DIGEST_PRIME_3 = 0x165667B19E3779F9ull;
+
+inline uint64_t digest_rotl(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+
+inline uint64_t digest_round(uint64_t acc, uint64_t input) {
+    acc += input * DIGEST_PRIME_2;
+    return digest_rotl(acc, 31) * DIGEST_PRIME_1;
+}
+
+inline uint64_t digest_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= DIGEST_PRIME_2;
+    h ^= h >> 29;
+    h *= DIGEST_PRIME_3;
+    return h ^ (h >> 32);
+}
+
+inline uint64_t digest_load(const uint8_t* bytes) {
+    uint64_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Digest of the w x h block of `pixels` at (x, y)
+inline uint64_t tile_digest(const PixelBuffer& pixels, int x, int y, int w, int h) {
+    uint64_t lanes[4] = {DIGEST_PRIME_1 + DIGEST_PRIME_2, DIGEST_PRIME_2, 0, 0 - DIGEST_PRIME_1};
+    const size_t rowBytes = static_cast<size_t>(w) * sizeof(Pixel);
+
+    for (int row = y; row < y + h; ++row) {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels.row(row) + x);
+        size_t i = 0;
+        for (; i + 32 <= rowBytes; i += 32) {
+            lanes[0] = digest_round(lanes[0], digest_load(bytes + i));
+            lanes[1] = digest_round(lanes[1], digest_load(bytes + i + 8));
+            lanes[2] = digest_round(lanes[2], digest_load(bytes + i + 16));
+            lanes[3] = digest_round(lanes[3], digest_load(bytes + i + 24));
+        }
+        for (; i + 8 <= rowBytes; i += 8) lanes[0] = digest_round(lanes[0], digest_load(bytes + i));
+        if (i < rowBytes) {
+            uint32_t last;
+            std::memcpy(&last, bytes + i, sizeof(last));
+            lanes[1] = digest_round(lanes[1], last);
+        }
+    }
+
+    uint64_t digest = digest_rotl(lanes[0], 1) + digest_rotl(lanes[1], 7) + digest_rotl(lanes[2], 12) +
+                      digest_rotl(lanes[3], 18);
+    digest = digest_round(digest, static_cast<uint64_t>(w) << 32 | static_cast<uint32_t>(h));
+    return digest_avalanche(digest);
+}
+
+// One digest for a whole layer of the given size, from its tile digests
+inline uint64_t layer_digest(const std::vector<uint64_t>& tiles, int width, int height) {
+    uint64_t h = digest_round(DIGEST_PRIME_3, static_cast<uint64_t>(width) << 32 | static_cast<uint32_t>(height));
+    for (uint64_t tile : tiles) h = digest_round(h, tile);
+    return digest_avalanche(h);
+}
+
+/**
+ * The tile digests of one layer, with the tile version each was computed at.
+ */
+class TileDigests {
+public:
+    // Whether `values` is up to date with `layer`, so `update` needs no pixels
+    bool current(const Layer& layer) const { return versions == layer.tile_versions; }
+
+    const std::vector<uint64_t>& values() const { return digests; }
+
+    // Digests of every tile of `layer`, hashing the tiles changed since the last call
+    const std::vector<uint64_t>& update(const Layer& layer) {
+        if (versions.size() != layer.tile_versions.size()) {
+            versions.assign(layer.tile_versions.size(), 0);
+            digests.assign(layer.tile_versions.size(), 0);
+        }
+
+        std::vector<int> stale;
+        for (size_t t = 0; t < versions.size(); ++t) {
+            if (versions[t] != layer.tile_versions[t]) stale.push_back(static_cast<int>(t));
+        }
+
+        ThreadPool::shared().parallel_for(0, static_cast<int>(stale.size()), 16, [&](int i0, int i1) {
+            for (int i = i0; i < i1; ++i) {
+                int x, y, w, h;
+                layer.tile_rect(stale[i], x, y, w, h);
+                digests[stale[i]] = tile_digest(layer.pixels, x, y, w, h);
+            }
+        });
+        for (int t : stale) versions[t] = layer.tile_versions[t];
+        return digests;
+    }
+
+private:
+    std::vector<uint32_t> versions;
+    std::vector<uint64_t> digests;
+};